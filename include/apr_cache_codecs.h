@@ -0,0 +1,203 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief
+ */
+/*
+ * apr_cache_codecs.h
+ *
+ *  The compression codecs that an APRGlobalStorage can use
+ *  for the values that it stores.
+ */
+
+#ifndef APR_CACHE_CODECS_H_
+#define APR_CACHE_CODECS_H_
+
+#include "apr_pools.h"
+
+#include "typedefs.h"
+
+
+/**
+ * The identifiers for the available codecs. These are stored
+ * with each entry so they must not be changed or reused.
+ *
+ * @ingroup httpd_server
+ */
+typedef enum APRCacheCodecId
+{
+	/** The values are stored as they are. */
+	ACC_NONE = 0,
+
+	/** The values are compressed with LZ4. */
+	ACC_LZ4 = 1,
+
+	/** The values are compressed with Zstandard. */
+	ACC_ZSTD = 2,
+
+	/** The values are compressed with bzip2. */
+	ACC_BZIP2 = 3,
+
+	/** The number of codec identifiers. */
+	ACC_NUM_CODECS
+} APRCacheCodecId;
+
+
+/**
+ * A codec used to compress the values stored in
+ * an APRGlobalStorage.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRCacheCodec
+{
+	/** The identifier stored with each entry compressed by this codec. */
+	APRCacheCodecId acc_id;
+
+	/** The name used to select this codec with the GrassrootsCacheCompression directive. */
+	const char *acc_name_s;
+
+	/**
+	 * Compress a value straight into the caller's buffer. The compression
+	 * stops as soon as the buffer is full, so passing the largest length
+	 * that is worth storing saves compressing all of a value that won't
+	 * shrink enough.
+	 *
+	 * @param src_p The value to compress.
+	 * @param src_length The length of the value in bytes.
+	 * @param dest_p The buffer to compress the value into.
+	 * @param dest_capacity The size of dest_p in bytes.
+	 * @param dest_length_p Upon success, the length of the compressed data will be
+	 * stored here. This will be 0 if the compressed data did not fit into dest_p.
+	 * @param key_s The key for the value, used for any log messages.
+	 * @return <code>true</code> if the value was compressed or did not fit,
+	 * <code>false</code> upon error.
+	 */
+	bool (*acc_compress_fn) (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_capacity, unsigned int *dest_length_p, const char * const key_s);
+
+	/**
+	 * Decompress a value.
+	 *
+	 * @param src_p The compressed data.
+	 * @param src_length The length of the compressed data in bytes.
+	 * @param dest_p The buffer to decompress the value into.
+	 * @param dest_length The length of the original value in bytes.
+	 * @param key_s The key for the value, used for any log messages.
+	 * @return <code>true</code> if the value was decompressed to exactly dest_length
+	 * bytes, <code>false</code> otherwise.
+	 */
+	bool (*acc_decompress_fn) (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_length, const char * const key_s);
+} APRCacheCodec;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Set up the per-thread compression contexts. Each worker thread
+ * allocates its contexts the first time that it compresses or
+ * decompresses a value and then reuses them until it exits, rather than
+ * allocating them again for every value.
+ *
+ * This needs to be called once in each child process before any of
+ * the codecs are used. If it fails, the codecs still work but allocate
+ * their state on every call.
+ *
+ * @param pool_p The pool whose cleanup will release the contexts' key.
+ * @return <code>true</code> if the contexts were set up successfully,
+ * <code>false</code> otherwise.
+ * @ingroup httpd_server
+ */
+bool InitAPRCacheCodecs (apr_pool_t *pool_p);
+
+
+/**
+ * Get the number of times that the codecs have had to allocate their
+ * compression state and the number of times that they have been able to
+ * reuse a thread's existing state instead.
+ *
+ * @param allocations_p The number of allocations will be stored here.
+ * @param reuses_p The number of reuses, i.e. the allocations avoided,
+ * will be stored here.
+ * @ingroup httpd_server
+ */
+void GetAPRCacheCodecContextCounts (uint32 *allocations_p, uint32 *reuses_p);
+
+
+/**
+ * Load a zstd dictionary, such as one made by grassroots_dictionary_trainer,
+ * for the zstd codec to compress with.
+ *
+ * Each compressed value records the id of the dictionary it was compressed
+ * with, so values stored before the dictionary was loaded can still be read.
+ * Values compressed with a different dictionary cannot be and are treated
+ * as missing.
+ *
+ * This needs to be called in each child process before any threads use
+ * the codecs.
+ *
+ * @param path_s The path to the dictionary.
+ * @param pool_p The pool whose cleanup will free the dictionary.
+ * @return <code>true</code> if the dictionary was loaded successfully,
+ * <code>false</code> otherwise.
+ * @ingroup httpd_server
+ */
+bool LoadAPRCacheCodecDictionary (const char *path_s, apr_pool_t *pool_p);
+
+
+/**
+ * Get a codec by the name used for it in the GrassrootsCacheCompression directive.
+ *
+ * @param name_s The name of the codec: "none", "lz4", "zstd" or "bzip2".
+ * @return The codec or <code>NULL</code> if there is no codec with the given
+ * name or it was not available when the module was built.
+ * @ingroup httpd_server
+ */
+const APRCacheCodec *GetAPRCacheCodecByName (const char *name_s);
+
+
+/**
+ * Get a codec by the identifier that is stored with each entry.
+ *
+ * @param id The identifier of the codec.
+ * @return The codec or <code>NULL</code> if there is no codec with the given
+ * identifier or it was not available when the module was built.
+ * @ingroup httpd_server
+ */
+const APRCacheCodec *GetAPRCacheCodecById (const uint32 id);
+
+
+/**
+ * Get the names of the codecs that are available, for use in
+ * error messages.
+ *
+ * @return The names of the codecs separated by commas.
+ * @ingroup httpd_server
+ */
+const char *GetAvailableAPRCacheCodecNames (void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* APR_CACHE_CODECS_H_ */
@@ -31,10 +31,233 @@
 #include "apr_hash.h"
 #include "httpd.h"
 #include "apr_global_mutex.h"
+#include "apr_atomic.h"
+#include "apr_shm.h"
 #include "ap_provider.h"
 #include "ap_socache.h"
 
 #include "typedefs.h"
+#include "apr_cache_codecs.h"
+
+
+/**
+ * The maximum number of stripes that an APRGlobalStorage can
+ * split its locks and shared object cache partitions into.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_GLOBAL_STORAGE_MAX_NUM_STRIPES (64)
+
+
+/**
+ * The different ways that an APRGlobalStorage can lock
+ * its stripes.
+ *
+ * @ingroup httpd_server
+ */
+typedef enum APRGlobalStorageLockMode
+{
+	/**
+	 * Every operation takes the stripe's cross-process
+	 * mutex exclusively.
+	 */
+	AGS_LM_EXCLUSIVE,
+
+	/**
+	 * Retrieving a value takes a shared lock so that
+	 * concurrent lookups do not wait for each other.
+	 * Adding and removing values take the lock exclusively.
+	 */
+	AGS_LM_SHARED_READS
+} APRGlobalStorageLockMode;
+
+
+/**
+ * What an APRGlobalStorage does when adding an object would take it
+ * over its capacity.
+ *
+ * @ingroup httpd_server
+ */
+typedef enum APRGlobalStorageFullPolicy
+{
+	/** Refuse to add the object. */
+	AGS_FP_REJECT,
+
+	/**
+	 * Evict the objects that have a time to live, soonest to
+	 * expire first. Objects that never expire are kept.
+	 */
+	AGS_FP_EVICT_EXPIRING,
+
+	/**
+	 * Evict the least recently used objects that have a time to live
+	 * first. As with AGS_FP_EVICT_EXPIRING, objects that never expire
+	 * are kept.
+	 */
+	AGS_FP_EVICT_LRU
+} APRGlobalStorageFullPolicy;
+
+
+/**
+ * The results of AcquireAPRGlobalStorageCounter.
+ *
+ * @ingroup httpd_server
+ */
+typedef enum APRGlobalStorageCounterResult
+{
+	/** The counter was incremented. */
+	AGS_CR_ACQUIRED,
+
+	/** The counter had already reached its limit. */
+	AGS_CR_AT_LIMIT,
+
+	/** The counter wasn't in use and there was no room to add it. */
+	AGS_CR_NO_ROOM,
+
+	/** The counter's name was invalid or the counters couldn't be locked. */
+	AGS_CR_ERROR
+} APRGlobalStorageCounterResult;
+
+
+/**
+ * The amount of space used by an APRGlobalStorage.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRGlobalStorageUsage
+{
+	/** The number of objects that are stored. */
+	apr_uint32_t agsu_num_entries;
+
+	/** The number of bytes stored, including the entry headers. */
+	apr_uint64_t agsu_stored_bytes;
+
+	/** The number of bytes that the stored values take before compression. */
+	apr_uint64_t agsu_value_bytes;
+
+	/** The maximum number of bytes that can be stored, or 0 for no limit. */
+	apr_uint64_t agsu_capacity;
+
+	/** The number of objects that have been evicted to make room for others. */
+	apr_uint32_t agsu_num_evictions;
+
+	/** The number of objects that the shared object cache provider dropped by itself. */
+	apr_uint32_t agsu_num_lost;
+
+	/** The number of objects that were not added because there was no room. */
+	apr_uint32_t agsu_num_rejections;
+} APRGlobalStorageUsage;
+
+
+/**
+ * Pass this as the time to live when adding an object to use
+ * the APRGlobalStorage's default time to live.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_GLOBAL_STORAGE_DEFAULT_TTL (-1)
+
+
+/**
+ * Pass this as the time to live when adding an object for
+ * it to never expire.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_GLOBAL_STORAGE_NO_EXPIRY (0)
+
+
+/**
+ * On the platforms without futexes, this is how often in milliseconds
+ * that a thread waiting for an object to change checks it.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_GLOBAL_STORAGE_WAIT_POLL_INTERVAL (50)
+
+
+/**
+ * A callback function used by ReadObjectFromAPRGlobalStorage to read
+ * a copy of a stored value.
+ *
+ * The value is only valid for the duration of the call and must not be
+ * altered. A reader of a value in the local cache runs whilst that
+ * cache's mutex is held so it should be quick. Otherwise it runs on the
+ * copy that the provider made, after the stripe has been unlocked.
+ *
+ * @param value_p The stored value.
+ * @param value_length The length of the value in bytes.
+ * @param reader_data_p The custom data passed to ReadObjectFromAPRGlobalStorage.
+ * @return <code>true</code> if the reader succeeded, <code>false</code> otherwise.
+ * @ingroup httpd_server
+ */
+typedef bool (*APRGlobalStorageReader) (const unsigned char *value_p, const unsigned int value_length, void *reader_data_p);
+
+
+/**
+ * A callback function used by UpdateObjectInAPRGlobalStorage to change
+ * a stored value in place.
+ *
+ * It runs whilst the object's stripe is locked exclusively, so it
+ * should be quick and must not call back into the APRGlobalStorage.
+ *
+ * @param value_p A copy of the stored value that can be altered.
+ * @param value_length The length of the value in bytes.
+ * @param expiry The time that the object expires or 0 if it never does.
+ * @param updater_data_p The custom data passed to UpdateObjectInAPRGlobalStorage.
+ * @return <code>true</code> if the altered value should be stored, <code>false</code>
+ * to leave the object as it is.
+ * @ingroup httpd_server
+ */
+typedef bool (*APRGlobalStorageUpdater) (unsigned char *value_p, const unsigned int value_length, const apr_time_t expiry, void *updater_data_p);
+
+
+/**
+ * A function that chooses which entries IterateOverFilteredAPRGlobalStorage
+ * passes to its iterator. It is called before the entry's value is
+ * decompressed, so entries can be skipped cheaply by their keys.
+ *
+ * @param raw_key_p The key of the entry.
+ * @param raw_key_length The length of the key in bytes.
+ * @param data_p The custom data passed to IterateOverFilteredAPRGlobalStorage.
+ * @return <code>true</code> if the entry should be passed to the iterator,
+ * <code>false</code> if it should be skipped.
+ * @ingroup httpd_server
+ */
+typedef bool (*APRGlobalStorageKeyFilter) (const unsigned char *raw_key_p, const unsigned int raw_key_length, void *data_p);
+
+
+/**
+ * A function that is run after the sweeper has removed the expired
+ * objects from an APRGlobalStorage. Only one process sweeps each time,
+ * so this is where any other data that expires along with the objects
+ * can be tidied up without every child process doing it.
+ *
+ * @param pool_p A pool for any temporary allocations. It is cleared
+ * after the function returns.
+ * @param data_p The custom data passed to SetAPRGlobalStorageSweepCallback.
+ * @ingroup httpd_server
+ */
+typedef void (*APRGlobalStorageSweepCallback) (apr_pool_t *pool_p, void *data_p);
+
+
+/**
+ * A function that is run for each object that an APRGlobalStorage
+ * removes by itself, either because the object has expired or to make
+ * room for others, so that anything kept about the object elsewhere
+ * can be tidied up. It is run after the object has been removed and
+ * without any of the storage's locks being held, in whichever process
+ * did the removing.
+ *
+ * @param key_p The key of the removed object.
+ * @param key_length The length of the key in bytes.
+ * @param value_p The value of the removed object.
+ * @param value_length The length of the value in bytes.
+ * @param data_p The custom data passed to SetAPRGlobalStorageRemovalCallback.
+ * @ingroup httpd_server
+ */
+typedef void (*APRGlobalStorageRemovalCallback) (const unsigned char *key_p, const unsigned int key_length, const unsigned char *value_p, const unsigned int value_length, void *data_p);
+
 
 /**
  * @brief A datatype to manage all of the ServiceJobs on a Grassroots system running on Apache httpd.
@@ -51,8 +274,30 @@ typedef struct APRGlobalStorage
 	/** @privatesection */
 	apr_hash_t *ags_entries_p;
 
-	/** Our cross-thread/cross-process mutex */
-	apr_global_mutex_t *ags_mutex_p;
+	/**
+	 * The function used to hash the keys to choose their stripes.
+	 * If this is <code>NULL</code>, apr_hashfunc_default is used.
+	 */
+	apr_hashfunc_t ags_hash_fn;
+
+	/**
+	 * The number of stripes that this APRGlobalStorage is split into.
+	 * Each stripe has its own cross-process mutex and its own shared
+	 * object cache partition and the stripe that a given key uses is
+	 * chosen by the hash of that key, so that operations on unrelated
+	 * keys do not contend with each other.
+	 */
+	uint32 ags_num_stripes;
+
+	/** Our cross-thread/cross-process mutexes, one per stripe */
+	apr_global_mutex_t **ags_mutexes_pp;
+
+	/**
+	 * How the stripes are locked. If this is AGS_LM_SHARED_READS,
+	 * process-shared reader/writer locks in ags_shared_data_p are used
+	 * instead of ags_mutexes_pp.
+	 */
+	APRGlobalStorageLockMode ags_lock_mode;
 
 	/** The pool to use for any temporary memory allocations */
 	apr_pool_t *ags_pool_p;
@@ -63,18 +308,46 @@ typedef struct APRGlobalStorage
 	 */
 	const char *ags_mutex_lock_filename_s;
 
+	/**
+	 * The filenames for each of the stripe mutexes. If there
+	 * is only a single stripe, this will just contain
+	 * ags_mutex_lock_filename_s.
+	 */
+	const char **ags_mutex_lock_filenames_ss;
+
+	/**
+	 * The mutex that guards the shared counters used by
+	 * AcquireAPRGlobalStorageCounter () and friends.
+	 */
+	apr_global_mutex_t *ags_counters_mutex_p;
+
+	/** The filename for ags_counters_mutex_p. */
+	const char *ags_counters_mutex_filename_s;
+
 	/**
 	 * A user-friendly identifier to denote this APRGlobalStorage.
 	 */
 	const char *ags_cache_id_s;
 
 	/**
-	 * This points to the size of the largest entry that
-	 * has been added to the storage. Since we are in a
-	 * multi-process environment, this will be in shared
-	 * memory
+	 * The shared memory segment holding the data that
+	 * all of the httpd processes need to see, such as
+	 * the per-bucket entry size hints. Each APRGlobalStorage
+	 * has its own segment which is created and zeroed by
+	 * PostConfigureGlobalStorage() and removed when the
+	 * configuration pool is cleared.
+	 */
+	apr_shm_t *ags_shm_p;
+
+	/** The pool that ags_shm_p was created from. */
+	apr_pool_t *ags_shm_pool_p;
+
+	/**
+	 * The address of the shared data within ags_shm_p.
+	 * This is <code>NULL</code> until PostConfigureGlobalStorage()
+	 * has been called.
 	 */
-	struct MappedMemory *ags_mapped_mem_p;
+	struct APRGlobalStorageSharedData *ags_shared_data_p;
 
 	/** The httpd server. */
 	server_rec *ags_server_p;
@@ -85,9 +358,144 @@ typedef struct APRGlobalStorage
 	ap_socache_provider_t *ags_socache_provider_p;
 
 	/**
-	 * The shared object cache instance.
+	 * The shared object cache instances, one partition per stripe.
 	 */
-	ap_socache_instance_t *ags_socache_instance_p;
+	ap_socache_instance_t **ags_socache_instances_pp;
+
+	/**
+	 * If the provider can safely be read from whilst it is being
+	 * changed, as the native cache can, lookups that do not remove
+	 * the value do not need to take the stripe locks.
+	 */
+	bool ags_lock_free_reads_flag;
+
+	/**
+	 * The number of times that a stripe mutex has been locked by
+	 * this process.
+	 */
+	volatile apr_uint32_t ags_num_lock_acquisitions;
+
+	/**
+	 * The number of times that this process has had to wait
+	 * for a stripe mutex that was already held by someone else.
+	 * Comparing this against ags_num_lock_acquisitions gives
+	 * the amount of lock contention for a given number of
+	 * stripes.
+	 */
+	volatile apr_uint32_t ags_num_lock_contentions;
+
+	/**
+	 * The number of lookups that this process has made.
+	 */
+	volatile apr_uint32_t ags_num_lookups;
+
+	/**
+	 * The total number of bytes that this process has allocated
+	 * for retrieving and decompressing values during its lookups.
+	 */
+	volatile apr_uint64_t ags_lookup_bytes_allocated;
+
+	/**
+	 * The optional cache, local to this process, of recently
+	 * retrieved values. This is <code>NULL</code> unless
+	 * EnableAPRGlobalStorageLocalCache has been called.
+	 */
+	struct APRGlobalStorageLocalCache *ags_local_cache_p;
+
+	/**
+	 * The number of lookups that were answered by the local cache.
+	 */
+	volatile apr_uint32_t ags_local_cache_hits;
+
+	/**
+	 * The number of lookups that were not in the local cache.
+	 */
+	volatile apr_uint32_t ags_local_cache_misses;
+
+	/**
+	 * The number of local cache entries that were found to be out of
+	 * date because the value had been changed or removed by another
+	 * process.
+	 */
+	volatile apr_uint32_t ags_local_cache_invalidations;
+
+	/** The number of times that an APRGlobalStorageReader has been run. */
+	volatile apr_uint32_t ags_num_reads;
+
+	/** The longest time in microseconds that an APRGlobalStorageReader has taken. */
+	volatile apr_uint32_t ags_max_read_time;
+
+	/** The total time in microseconds spent in APRGlobalStorageReaders. */
+	volatile apr_uint64_t ags_total_read_time;
+
+	/**
+	 * The number of times that this process has held a stripe's lock
+	 * to get, read, add or remove a single entry.
+	 */
+	volatile apr_uint32_t ags_num_lock_holds;
+
+	/** The longest time in microseconds that one of those locks was held. */
+	volatile apr_uint32_t ags_max_lock_hold_time;
+
+	/** The total time in microseconds that those locks were held. */
+	volatile apr_uint64_t ags_total_lock_hold_time;
+
+	/**
+	 * The time to live in microseconds for objects added without
+	 * their own one. If this is 0, they never expire.
+	 */
+	apr_interval_time_t ags_default_ttl;
+
+	/**
+	 * How long the shared object cache keeps expired objects
+	 * so that the sweeper can remove them itself.
+	 */
+	apr_interval_time_t ags_expiry_grace_period;
+
+	/** How often the sweeper removes the expired objects. */
+	apr_interval_time_t ags_sweep_interval;
+
+	/** The thread that sweeps the expired objects, if it is running. */
+	struct apr_thread_t *ags_sweeper_thread_p;
+
+	/** The pool that the sweeper thread was created in. */
+	apr_pool_t *ags_sweeper_pool_p;
+
+	/** The pool that is cleared after each sweep. */
+	apr_pool_t *ags_sweep_scratch_pool_p;
+
+	/** Set to 1 to ask the sweeper thread to stop. */
+	volatile apr_uint32_t ags_stop_sweeper;
+
+	/** The number of expired objects that have been swept. */
+	volatile apr_uint32_t ags_num_expired;
+
+	/** The function to run after each sweep or NULL if there isn't one. */
+	APRGlobalStorageSweepCallback ags_sweep_callback_fn;
+
+	/** The custom data for ags_sweep_callback_fn. */
+	void *ags_sweep_callback_data_p;
+
+	/**
+	 * The function to run for each object that the storage removes
+	 * by itself or NULL if there isn't one.
+	 */
+	APRGlobalStorageRemovalCallback ags_removal_callback_fn;
+
+	/**
+	 * Chooses which of the removed objects are passed to
+	 * ags_removal_callback_fn or NULL to pass all of them.
+	 */
+	APRGlobalStorageKeyFilter ags_removal_filter_fn;
+
+	/** The custom data for ags_removal_callback_fn and ags_removal_filter_fn. */
+	void *ags_removal_callback_data_p;
+
+	/** The maximum number of bytes to store, or 0 for no limit. */
+	apr_uint64_t ags_capacity;
+
+	/** What to do when adding an object would exceed ags_capacity. */
+	APRGlobalStorageFullPolicy ags_full_policy;
 
 
 	/**
@@ -114,26 +522,30 @@ typedef struct APRGlobalStorage
 
 
 	/**
-	 * The callback function used to compress data prior to it being stored in this APRGlobalStorage
-	 *
-	 * @param src_s  The data to compress.
-	 * @param src_length The length of the source data.
-	 * @param dest_length_p Upon success, the length of the destination buffer will be stored at the address that this points to.
-	 * @param key_s The key to use to for debugging purposes.
-	 * @return The compressed data or <code>NULL</code> upon error.
+	 * The codec used to compress data prior to it being stored in this
+	 * APRGlobalStorage. Each entry records the codec that it was stored
+	 * with, so entries are always decompressed with the right one even
+	 * if this changes.
 	 */
-	unsigned char *(*ags_compress_fn) (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s);
+	const APRCacheCodec *ags_codec_p;
+
+	/** Values shorter than this many bytes are stored uncompressed. */
+	uint32 ags_min_compress_length;
 
 	/**
-	 * The callback function used to decompress data after it has been retrieved from this APRGlobalStorage
-	 *
-	 * @param src_s  The data to decompress.
-	 * @param src_length The length of the source data.
-	 * @param dest_length_p Upon success, the length of the destination buffer will be stored at the address that this points to.
-	 * @param key_s The key to use to for debugging purposes.
-	 * @return The decompressed data or <code>NULL</code> upon error.
+	 * The percentage by which compressing a value must shrink
+	 * it for the compressed form to be stored.
 	 */
-	unsigned char *(*ags_decompress_fn) (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s);
+	uint32 ags_min_compress_saving;
+
+	/** The number of entries that have been stored compressed. */
+	volatile apr_uint32_t ags_num_compressed;
+
+	/**
+	 * The number of entries that have been stored uncompressed
+	 * despite there being a codec.
+	 */
+	volatile apr_uint32_t ags_num_stored_raw;
 
 
 } APRGlobalStorage;
@@ -151,50 +563,50 @@ extern "C"
  *
  * @param storage_p The APRGlobalStorage to initialise.
  * @param pool_p The memory pool used for any allocations.
- * @param hash_fn The callback function used to determine the slot in the underlying shared object cache.
- * to put or get any items.
- * @param make_key_fn The callback function used to create the key that will be used by the hash function.
+ * @param hash_fn The callback function used to hash the keys to choose the stripe to
+ * put or get any items from, or <code>NULL</code> to use apr_hashfunc_default.
+ * @param make_key_fn The callback function used to create the key that will be used by the hash function,
+ * or <code>NULL</code> to use the raw keys as they are.
  * @param free_key_and_value_fn The callback function used to free an entry in the underlying shared object cache.
  * @param server_p The server_rec that will own the APRGlobalStorage.
  * @param mutex_filename_s The filename used to store the mutex variable governing access to the APRGlobalStorage.
  * @param cache_id_s The id used to identify this APRGlobalStorage.
  * @param provider_name_s The name of the shared object cache provider to use.
- * @param compress_fn The callback function to use for compressing data in the given APRGlobalStorage. This can be
+ * @param codec_p The codec to use for compressing data in the given APRGlobalStorage. This can be
  * <code>NULL</code> in which case the data will be stored uncompressed.
- * @param decompress_fn The callback function to use for decompressing data in the given APRGlobalStorage. This can be
- * <code>NULL</code> in which case the data will be retrieved as is.
+ * @param num_stripes The number of stripes to split the locks and shared object cache into. This will be
+ * clamped to between 1 and APR_GLOBAL_STORAGE_MAX_NUM_STRIPES.
  * @return <code>true</code> if the initialisation was successful or <code>false</code> if there was a problem.
  * @memberof APRGlobalStorage
  */
 bool InitAPRGlobalStorage (APRGlobalStorage *storage_p, apr_pool_t *pool_p, apr_hashfunc_t hash_fn, unsigned char *(*make_key_fn) (const void *data_p, uint32 raw_key_length, uint32 *key_len_p), void (*free_key_and_value_fn) (unsigned char *key_p, void *value_p), server_rec *server_p, const char *mutex_filename_s, const char *cache_id_s, const char *provider_name_s,
-	unsigned char *(*compress_fn) (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s),
-	unsigned char *(*decompress_fn) (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s));
+	const APRCacheCodec *codec_p, uint32 num_stripes);
 
 
 /**
  * Allocate an APRGlobalStorage.
  *
  * @param pool_p The memory pool used for any allocations.
- * @param hash_fn The callback function used to determine the slot in the underlying shared object cache.
- * to put or get any items.
- * @param make_key_fn The callback function used to create the key that will be used by the hash function.
+ * @param hash_fn The callback function used to hash the keys to choose the stripe to
+ * put or get any items from, or <code>NULL</code> to use apr_hashfunc_default.
+ * @param make_key_fn The callback function used to create the key that will be used by the hash function,
+ * or <code>NULL</code> to use the raw keys as they are.
  * @param free_key_and_value_fn The callback function used to free an entry in the underlying shared object cache.
  * @param server_p The server_rec that will own the APRGlobalStorage.
  * @param mutex_filename_s The filename used to store the mutex variable governing access to the APRGlobalStorage.
  * @param cache_id_s The id used to identify this APRGlobalStorage.
  * @param provider_name_s The name of the shared object cache provider to use.
- * @param compress_fn The callback function to use for compressing data in the given APRGlobalStorage. This can be
+ * @param codec_p The codec to use for compressing data in the given APRGlobalStorage. This can be
  * <code>NULL</code> in which case the data will be stored uncompressed.
- * @param decompress_fn The callback function to use for decompressing data in the given APRGlobalStorage. This can be
- * <code>NULL</code> in which case the data will be retrieved as is.
+ * @param num_stripes The number of stripes to split the locks and shared object cache into. This will be
+ * clamped to between 1 and APR_GLOBAL_STORAGE_MAX_NUM_STRIPES.
  * @return The newly-allocated APRGlobalStorage or <code>NULL</code> upon error.
  * @see InitAPRGlobalStorage.
  * @see FreeAPRGlobalStorage.
  * @memberof APRGlobalStorage
  */
 APRGlobalStorage *AllocateAPRGlobalStorage (apr_pool_t *pool_p, apr_hashfunc_t hash_fn, unsigned char *(*make_key_fn) (const void *data_p, uint32 raw_key_length, uint32 *key_len_p), void (*free_key_and_value_fn) (unsigned char *key_p, void *value_p), server_rec *server_p, const char *mutex_filename_s, const char *cache_id_s, const char *provider_name_s,
-	unsigned char *(*compress_fn) (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s),
-	unsigned char *(*decompress_fn) (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s));
+	const APRCacheCodec *codec_p, uint32 num_stripes);
 
 /**
  * Free an APRGlobalStorage.
@@ -221,26 +633,70 @@ void DestroyAPRGlobalStorage (APRGlobalStorage *storage_p);
 
 
 /**
- * Calculate a hash code for a given string.
+ * Set how an APRGlobalStorage locks its stripes.
  *
- * @param uuid_s The raw UUID data to calculate the hashed value for.
- * @param len_p The length of the data.
- * @return The hash value.
+ * This should be called before the APRGlobalStorage is used. If
+ * AGS_LM_SHARED_READS is requested on a platform that does not support
+ * reader/writer locks that can be shared between processes, the
+ * APRGlobalStorage will keep using its exclusive mutexes. If this is
+ * called before PostConfigureGlobalStorage(), the reader/writer locks
+ * are set up once the shared memory segment has been created.
+ *
+ * @param storage_p The APRGlobalStorage to adjust.
+ * @param lock_mode The APRGlobalStorageLockMode to use.
+ * @return <code>true</code> if the requested mode is now in use,
+ * <code>false</code> if the APRGlobalStorage has fallen back to AGS_LM_EXCLUSIVE.
+ * @memberof APRGlobalStorage
  */
-unsigned int HashUUIDForAPR (const char *uuid_s, apr_ssize_t *len_p);
+bool SetAPRGlobalStorageLockMode (APRGlobalStorage *storage_p, APRGlobalStorageLockMode lock_mode);
+
+
+/**
+ * Keep a copy of recently retrieved values within this process.
+ *
+ * Each key bucket has a generation counter in shared memory that is
+ * incremented whenever a value in that bucket is added or removed, so
+ * a locally-cached value can be checked for being up to date without
+ * taking any of the cross-process locks.
+ *
+ * @param storage_p The APRGlobalStorage to add the local cache to.
+ * @param max_bytes The maximum number of bytes of values that the local
+ * cache will hold. Once this is reached, the least recently used values
+ * are discarded.
+ * @return <code>true</code> if the local cache was set up successfully,
+ * <code>false</code> otherwise.
+ * @memberof APRGlobalStorage
+ */
+bool EnableAPRGlobalStorageLocalCache (APRGlobalStorage *storage_p, apr_size_t max_bytes);
 
 
 /**
- * Get a string representation of a raw UUID value.
+ * Get the usage counts for the local cache of an APRGlobalStorage.
  *
- * @param data_p Pointer to the raw UUID value.
- * @param raw_key_length The length of the raw value given by data_p.
- * @param key_len_p POinter to where the length of the returned string
- * will be stored.
- * @return The string representation of the UUID value or <code>NULL</code>
- * upon error.
+ * @param storage_p The APRGlobalStorage to query.
+ * @param hits_p If this is not <code>NULL</code>, the number of lookups answered
+ * by the local cache will be stored here.
+ * @param misses_p If this is not <code>NULL</code>, the number of lookups that
+ * had to go to the shared object cache will be stored here.
+ * @param invalidations_p If this is not <code>NULL</code>, the number of local
+ * cache entries discarded for being out of date will be stored here.
+ * @memberof APRGlobalStorage
  */
-unsigned char *MakeKeyFromUUID (const void *data_p, uint32 raw_key_length, uint32 *key_len_p);
+void GetAPRGlobalStorageLocalCacheCounts (APRGlobalStorage *storage_p, uint32 *hits_p, uint32 *misses_p, uint32 *invalidations_p);
+
+
+/**
+ * Calculate a hash code for a raw UUID.
+ *
+ * This folds the bits of the UUID together rather than
+ * converting it to a string first, so it does not allocate
+ * any memory.
+ *
+ * @param uuid_s The raw UUID data to calculate the hashed value for.
+ * @param len_p The length of the data, which should be UUID_RAW_SIZE.
+ * @return The hash value.
+ */
+unsigned int HashUUIDForAPR (const char *uuid_s, apr_ssize_t *len_p);
 
 
 /**
@@ -258,16 +714,46 @@ unsigned char *MakeKeyFromUUID (const void *data_p, uint32 raw_key_length, uint3
 bool AddObjectToAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned char *value_p, unsigned int value_length);
 
 
+/**
+ * Add an object to an APRGlobalStorage that will expire after a given time.
+ *
+ * @param storage_p The APRGlobalStorage to add the object to.
+ * @param raw_key_p The raw key for the object.
+ * @param raw_key_length The size in bytes of the raw key.
+ * @param value_p The value to store.
+ * @param value_length The size in bytes of the value.
+ * @param ttl The time in microseconds until the object expires. Use
+ * APR_GLOBAL_STORAGE_NO_EXPIRY for it to never expire or APR_GLOBAL_STORAGE_DEFAULT_TTL
+ * to use the APRGlobalStorage's default.
+ * @return <code>true</code> if the object was added successfully, <code>false</code> otherwise.
+ * @memberof APRGlobalStorage
+ */
+bool AddObjectToAPRGlobalStorageWithTTL (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned char *value_p, unsigned int value_length, apr_interval_time_t ttl);
+
+
+/**
+ * Set the time to live for objects that are added without their own one.
+ *
+ * @param storage_p The APRGlobalStorage to adjust.
+ * @param ttl The time to live in microseconds. If this is 0 or less, the
+ * objects will never expire.
+ * @memberof APRGlobalStorage
+ */
+void SetAPRGlobalStorageDefaultTTL (APRGlobalStorage *storage_p, apr_interval_time_t ttl);
+
+
 /**
  * Get an object from an APRGlobalStorage.
  *
  * @param storage_p The APRGlobalStorage to search in.
  * @param raw_key_p The raw key for the object that is being searched for.
  * @param raw_key_length The size in bytes of the raw key.
+ * @param value_length_p If this is not <code>NULL</code>, the length in bytes of the
+ * matched value will be stored here, or 0 if the key is not in the APRGlobalStorage.
  * @return The matched value or <code>NULL</code> if the key is not in the APRGlobalStorage.
  * @memberof APRGlobalStorage
  */
-void *GetObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length);
+void *GetObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned int *value_length_p);
 
 
 /**
@@ -276,11 +762,211 @@ void *GetObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *ra
  * @param storage_p The APRGlobalStorage to search in.
  * @param raw_key_p The raw key for the object that is being searched for.
  * @param raw_key_length The size in bytes of the raw key.
+ * @param value_length_p If this is not <code>NULL</code>, the length in bytes of the
+ * matched value will be stored here, or 0 if the key is not in the APRGlobalStorage.
  * @return The matched value or <code>NULL</code> if the key is not in the APRGlobalStorage. If found,
  * the value will be removed from the APRGlobalStorage.
  * @memberof APRGlobalStorage
  */
-void *RemoveObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length);
+void *RemoveObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned int *value_length_p);
+
+
+/**
+ * Run a function against a copy of an object in an APRGlobalStorage
+ * rather than returning a heap copy of it to the caller.
+ *
+ * If the object is in the local cache, the function is run on the cached
+ * bytes. Otherwise, the provider copies the entry out into a buffer, which
+ * is on the stack for entries of up to a few kilobytes, so only larger, or
+ * compressed, entries need any heap memory. The stripe is only locked
+ * whilst the entry is copied, not whilst the function runs.
+ *
+ * @param storage_p The APRGlobalStorage to search in.
+ * @param raw_key_p The raw key for the object.
+ * @param raw_key_length The size in bytes of the raw key.
+ * @param reader_fn The function to run against the object's value.
+ * @param reader_data_p Custom data to pass to reader_fn. This can be <code>NULL</code>.
+ * @return <code>true</code> if the object was found and reader_fn succeeded,
+ * <code>false</code> otherwise.
+ * @memberof APRGlobalStorage
+ */
+bool ReadObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, APRGlobalStorageReader reader_fn, void *reader_data_p);
+
+
+/**
+ * Change an existing object in an APRGlobalStorage without any other
+ * process being able to change it in between reading and storing it.
+ *
+ * The object's stripe is locked exclusively whilst updater_fn runs on a
+ * copy of the value and the result is stored. The object keeps its
+ * length and its expiry time.
+ *
+ * @param storage_p The APRGlobalStorage to update.
+ * @param raw_key_p The raw key for the object.
+ * @param raw_key_length The size in bytes of the raw key.
+ * @param updater_fn The function to change the object's value.
+ * @param updater_data_p Custom data to pass to updater_fn. This can be <code>NULL</code>.
+ * @return <code>true</code> if the object was found and its new value was stored,
+ * <code>false</code> otherwise.
+ * @memberof APRGlobalStorage
+ */
+bool UpdateObjectInAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, APRGlobalStorageUpdater updater_fn, void *updater_data_p);
+
+
+/**
+ * Get a number that changes whenever an object is added to or removed
+ * from an APRGlobalStorage.
+ *
+ * This doesn't take any locks so it is cheap enough to poll. The number
+ * is shared with the other objects whose keys hash to the same value, so
+ * it may also change when they do, but it will always change when the
+ * given object does.
+ *
+ * @param storage_p The APRGlobalStorage.
+ * @param raw_key_p The key for the object.
+ * @param raw_key_length The length of the key.
+ * @return The object's current generation.
+ * @memberof APRGlobalStorage
+ */
+apr_uint32_t GetAPRGlobalStorageObjectGeneration (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length);
+
+
+/**
+ * Wait until an object's generation, as got from GetAPRGlobalStorageObjectGeneration,
+ * changes or until a timeout.
+ *
+ * The change can be made by any httpd process. On Linux the waiting thread
+ * sleeps on a futex in the shared memory and is woken by the change, elsewhere
+ * the generation is checked every APR_GLOBAL_STORAGE_WAIT_POLL_INTERVAL milliseconds.
+ *
+ * @param storage_p The APRGlobalStorage.
+ * @param raw_key_p The key for the object.
+ * @param raw_key_length The length of the key.
+ * @param generation The generation that the caller has already seen.
+ * @param timeout The maximum time to wait in microseconds.
+ * @return APR_SUCCESS if the generation has changed, APR_TIMEUP if the
+ * timeout was reached first or APR_ENOMEM if the key couldn't be made.
+ * @memberof APRGlobalStorage
+ */
+apr_status_t WaitForAPRGlobalStorageObjectChange (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, const apr_uint32_t generation, const apr_interval_time_t timeout);
+
+
+/**
+ * Get a number that changes whenever any object is added to or
+ * removed from an APRGlobalStorage by any httpd process.
+ *
+ * @param storage_p The APRGlobalStorage.
+ * @return The current sequence number.
+ * @memberof APRGlobalStorage
+ */
+apr_uint32_t GetAPRGlobalStorageSequence (APRGlobalStorage *storage_p);
+
+
+/**
+ * Wait until the sequence number from GetAPRGlobalStorageSequence changes
+ * or until a timeout. This lets a thread wait on several objects at once
+ * and then check which of their generations have changed.
+ *
+ * @param storage_p The APRGlobalStorage.
+ * @param sequence The sequence number that the caller has already seen.
+ * @param timeout The maximum time to wait in microseconds.
+ * @return APR_SUCCESS if the sequence number has changed or APR_TIMEUP
+ * if the timeout was reached first.
+ * @memberof APRGlobalStorage
+ */
+apr_status_t WaitForAPRGlobalStorageChange (APRGlobalStorage *storage_p, const apr_uint32_t sequence, const apr_interval_time_t timeout);
+
+
+/**
+ * Increment a counter that is shared between all of the httpd processes,
+ * unless it has already reached a limit. The check and the increment are
+ * done atomically so concurrent callers can never take the counter past
+ * the limit.
+ *
+ * Each name has a counter of its own. The counters are held in a table
+ * in the shared memory that has room for 1024 of them at once, with
+ * a counter being dropped from it when its value falls back to 0. The
+ * names must be no more than 127 characters long. A counter that isn't
+ * in the table can't be added once all of its slots are in use, which
+ * is reported separately from the counter being at its limit. All of the
+ * counters start at 0 when the APRGlobalStorage's shared memory is
+ * created, which happens each time that httpd is started or restarted.
+ *
+ * @param storage_p The APRGlobalStorage.
+ * @param name_s The name of the counter.
+ * @param limit The value that the counter must be below to be incremented
+ * or 0 to always increment it.
+ * @return AGS_CR_ACQUIRED if the counter was incremented or the reason why not.
+ * @memberof APRGlobalStorage
+ */
+APRGlobalStorageCounterResult AcquireAPRGlobalStorageCounter (APRGlobalStorage *storage_p, const char *name_s, const apr_uint32_t limit);
+
+
+/**
+ * Decrement a counter that was incremented by AcquireAPRGlobalStorageCounter.
+ * A counter that is already 0 is left as it is.
+ *
+ * @param storage_p The APRGlobalStorage.
+ * @param name_s The name of the counter.
+ * @memberof APRGlobalStorage
+ */
+void ReleaseAPRGlobalStorageCounter (APRGlobalStorage *storage_p, const char *name_s);
+
+
+/**
+ * Get the current value of a counter used by AcquireAPRGlobalStorageCounter.
+ *
+ * @param storage_p The APRGlobalStorage.
+ * @param name_s The name of the counter.
+ * @return The counter's value.
+ * @memberof APRGlobalStorage
+ */
+apr_uint32_t GetAPRGlobalStorageCounter (APRGlobalStorage *storage_p, const char *name_s);
+
+
+/**
+ * Get several objects from an APRGlobalStorage at once.
+ *
+ * Each stripe that the keys belong to is locked just once, rather
+ * than once per key, and all of the values are returned in a single
+ * allocation.
+ *
+ * @param storage_p The APRGlobalStorage to search in.
+ * @param raw_keys_pp The raw keys for the objects that are being searched for.
+ * @param raw_key_lengths_p The sizes in bytes of each of the raw keys.
+ * @param num_keys The number of keys.
+ * @param value_lengths_p If this is not <code>NULL</code>, the length of each of the
+ * values will be stored in this array, which must have space for num_keys entries.
+ * @return An array of num_keys pointers to the matched values, in the same order as
+ * the keys, where any keys that are not in the APRGlobalStorage will have a
+ * <code>NULL</code> value. The array and the values are in a single block of memory
+ * that should be freed with FreeMemory. This will be <code>NULL</code> upon error.
+ * @memberof APRGlobalStorage
+ */
+void **GetObjectsFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void * const *raw_keys_pp, const unsigned int *raw_key_lengths_p, const uint32 num_keys, unsigned int *value_lengths_p);
+
+
+/**
+ * Add several objects to an APRGlobalStorage at once.
+ *
+ * All of the values are prepared before any locks are taken and then
+ * each stripe that the keys belong to is locked just once.
+ *
+ * @param storage_p The APRGlobalStorage to add the objects to.
+ * @param raw_keys_pp The raw keys for the objects.
+ * @param raw_key_lengths_p The sizes in bytes of each of the raw keys.
+ * @param values_pp The values to store.
+ * @param value_lengths_p The sizes in bytes of each of the values.
+ * @param ttls_p If this is not <code>NULL</code>, the time to live in microseconds
+ * for each of the objects, otherwise the default time to live is used for all of them.
+ * @param num_objects The number of objects to add.
+ * @param results_p If this is not <code>NULL</code>, whether each object was
+ * added successfully will be stored in this array, which must have space for
+ * num_objects entries.
+ * @return The number of objects that were added successfully.
+ * @memberof APRGlobalStorage
+ */
+uint32 AddObjectsToAPRGlobalStorage (APRGlobalStorage *storage_p, const void * const *raw_keys_pp, const unsigned int *raw_key_lengths_p, unsigned char **values_pp, const unsigned int *value_lengths_p, const apr_interval_time_t *ttls_p, const uint32 num_objects, bool *results_p);
 
 
 /**
@@ -295,6 +981,145 @@ void *RemoveObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void
 bool IterateOverAPRGlobalStorage (APRGlobalStorage *storage_p, ap_socache_iterator_t *iterator_p, void *data_p);
 
 
+/**
+ * Iterate over some of the data stored within an APRGlobalStorage.
+ *
+ * @param storage_p The APRGlobalStorage to iterate over.
+ * @param filter_fn The function that chooses which entries are passed to the
+ * iterator. This can be <code>NULL</code> to pass all of them.
+ * @param iterator_p The iterator to use.
+ * @param data_p An optional custom data pointer that is passed to both
+ * the filter and the iterator. This can be <code>NULL</code>.
+ * @return <code>true</code> if the iteration was successful or <code>false</code> if there was a problem.
+ * @memberof APRGlobalStorage
+ */
+bool IterateOverFilteredAPRGlobalStorage (APRGlobalStorage *storage_p, APRGlobalStorageKeyFilter filter_fn, ap_socache_iterator_t *iterator_p, void *data_p);
+
+
+/**
+ * Remove the expired objects from an APRGlobalStorage.
+ *
+ * The stripes are only locked for a small batch of objects at a time
+ * so that this doesn't hold up any other requests for long.
+ *
+ * @param storage_p The APRGlobalStorage to sweep.
+ * @param max_entries The maximum number of objects to remove.
+ * @param pool_p The pool to pass to the shared object cache provider.
+ * @return The number of objects that were removed.
+ * @memberof APRGlobalStorage
+ */
+uint32 SweepAPRGlobalStorage (APRGlobalStorage *storage_p, const uint32 max_entries, apr_pool_t *pool_p);
+
+
+/**
+ * Start a background thread that periodically removes the expired objects
+ * from an APRGlobalStorage.
+ *
+ * Every process can run a sweeper but only one of them will sweep in each
+ * interval. The thread is stopped when pool_p is cleaned up or the
+ * APRGlobalStorage is destroyed.
+ *
+ * @param storage_p The APRGlobalStorage to sweep.
+ * @param interval The time in microseconds between sweeps.
+ * @param pool_p The pool to create the thread in.
+ * @return <code>true</code> if the sweeper is running, <code>false</code> otherwise.
+ * @memberof APRGlobalStorage
+ */
+bool StartAPRGlobalStorageSweeper (APRGlobalStorage *storage_p, apr_interval_time_t interval, apr_pool_t *pool_p);
+
+
+/**
+ * Stop the sweeper thread for an APRGlobalStorage if it is running.
+ *
+ * @param storage_p The APRGlobalStorage to stop sweeping.
+ * @memberof APRGlobalStorage
+ */
+void StopAPRGlobalStorageSweeper (APRGlobalStorage *storage_p);
+
+
+/**
+ * Set a function to run after each time that the sweeper has
+ * removed the expired objects from an APRGlobalStorage.
+ *
+ * @param storage_p The APRGlobalStorage.
+ * @param callback_fn The function to run or <code>NULL</code> to stop running one.
+ * @param data_p The custom data to pass to callback_fn.
+ * @memberof APRGlobalStorage
+ */
+void SetAPRGlobalStorageSweepCallback (APRGlobalStorage *storage_p, APRGlobalStorageSweepCallback callback_fn, void *data_p);
+
+
+/**
+ * Set a function to run for each object that an APRGlobalStorage
+ * removes by itself, i.e. when the sweeper removes the expired objects
+ * or when objects are evicted to make room for others. It isn't run
+ * for the objects removed by RemoveObjectFromAPRGlobalStorage.
+ *
+ * @param storage_p The APRGlobalStorage.
+ * @param filter_fn The function that chooses which of the removed
+ * objects to pass to callback_fn by their keys. Only the values of
+ * these objects are kept until they have been removed. Use
+ * <code>NULL</code> to pass all of them.
+ * @param callback_fn The function to run or <code>NULL</code> to stop running one.
+ * @param data_p The custom data to pass to filter_fn and callback_fn.
+ * @memberof APRGlobalStorage
+ */
+void SetAPRGlobalStorageRemovalCallback (APRGlobalStorage *storage_p, APRGlobalStorageKeyFilter filter_fn, APRGlobalStorageRemovalCallback callback_fn, void *data_p);
+
+
+/**
+ * Limit the amount of data that an APRGlobalStorage holds.
+ *
+ * The usage is counted from the stored entries, so it includes their
+ * headers and is after any compression. Replacing an existing object is
+ * always allowed.
+ *
+ * @param storage_p The APRGlobalStorage to limit.
+ * @param capacity The maximum number of bytes to store, or 0 for no limit.
+ * @param policy What to do when adding an object would go over the capacity.
+ * @memberof APRGlobalStorage
+ */
+void SetAPRGlobalStorageCapacity (APRGlobalStorage *storage_p, apr_uint64_t capacity, APRGlobalStorageFullPolicy policy);
+
+
+/**
+ * Set when an APRGlobalStorage compresses the values that it stores.
+ *
+ * Values that are too short, or that don't compress well enough, are
+ * stored as they are and their entries record why, so reading them
+ * doesn't need to decompress anything. By default, values under 128 bytes
+ * are not compressed and the compressed form must be 10% smaller.
+ *
+ * @param storage_p The APRGlobalStorage to set the thresholds for.
+ * @param min_length Values shorter than this many bytes are not compressed.
+ * @param min_saving The percentage by which compression must shrink a value
+ * for the compressed form to be kept. 0 keeps anything that is smaller at all.
+ * @memberof APRGlobalStorage
+ */
+void SetAPRGlobalStorageCompressionThresholds (APRGlobalStorage *storage_p, uint32 min_length, uint32 min_saving);
+
+
+/**
+ * Get the amount of space used by an APRGlobalStorage across all processes.
+ *
+ * @param storage_p The APRGlobalStorage to check.
+ * @param usage_p Where the usage will be stored.
+ * @memberof APRGlobalStorage
+ */
+void GetAPRGlobalStorageUsage (APRGlobalStorage *storage_p, APRGlobalStorageUsage *usage_p);
+
+
+/**
+ * Check whether an APRGlobalStorage has reached its capacity.
+ *
+ * @param storage_p The APRGlobalStorage to check.
+ * @return <code>true</code> if the APRGlobalStorage has a capacity and
+ * has used all of it, <code>false</code> otherwise.
+ * @memberof APRGlobalStorage
+ */
+bool IsAPRGlobalStorageFull (const APRGlobalStorage *storage_p);
+
+
 /**
  * Initialise an APRGlobalStorage for usage in an Apache child process.
  *
@@ -321,6 +1146,10 @@ bool PreConfigureGlobalStorage (APRGlobalStorage *storage_p, apr_pool_t *config_
  * Configure an APRGlobalStorage in the Apache parent process before any child processes
  * are launched.
  *
+ * This creates the APRGlobalStorage's shared memory segment, with all of its size
+ * hints, usage totals, waiters and counters zeroed, so nothing is carried over from
+ * a previous run. The segment is removed when config_pool_p is cleared.
+ *
  * @param storage_p The APRGlobalStorage to configure.
  * @param config_pool_p The memory pool available to use.
  * @param server_p The Apache server structure.
@@ -0,0 +1,190 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief
+ */
+/*
+ * apr_job_object_cache.h
+ *
+ *  A per-process cache of the decoded ServiceJobs so that repeatedly
+ *  getting the same unchanged ServiceJob doesn't have to decompress
+ *  and parse it each time.
+ */
+
+#ifndef APR_JOB_OBJECT_CACHE_H_
+#define APR_JOB_OBJECT_CACHE_H_
+
+#include "apr_pools.h"
+#include "apr_hash.h"
+#include "apr_thread_mutex.h"
+
+#include "jansson.h"
+#include "typedefs.h"
+#include "uuid_util.h"
+
+
+/**
+ * The longest time, in seconds, that a decoded ServiceJob is used for
+ * before it is decoded again. Changes to the stored ServiceJobs are noticed
+ * straight away, so this only matters if the cache provider drops them.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOB_OBJECT_CACHE_MAX_AGE (30)
+
+
+/**
+ * A decoded ServiceJob in an APRJobObjectCache.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRJobObjectCacheEntry
+{
+	/** The more recently used entry. */
+	struct APRJobObjectCacheEntry *ajoce_prev_p;
+
+	/** The less recently used entry, or the next free one. */
+	struct APRJobObjectCacheEntry *ajoce_next_p;
+
+	/** The UUID of the ServiceJob. */
+	uuid_t ajoce_key;
+
+	/** The generation of the stored ServiceJob when it was decoded. */
+	apr_uint32_t ajoce_generation;
+
+	/** The time that the ServiceJob was decoded. */
+	apr_time_t ajoce_time;
+
+	/** The decoded ServiceJob. */
+	json_t *ajoce_job_json_p;
+} APRJobObjectCacheEntry;
+
+
+/**
+ * A fixed number of decoded ServiceJobs, kept in least recently used order.
+ *
+ * The cache keeps its own copy of each decoded ServiceJob's JSON and hands
+ * out deep copies of it, which is about a third of the cost of parsing the
+ * JSON again and saves the lookup and decompression as well. With jansson
+ * 2.11 or later, whose reference counts are atomic, the mutex is only held
+ * whilst taking a reference to the cached copy and the deep copy is made
+ * after releasing it. With older versions, the copy is made whilst holding
+ * the mutex so that no JSON is ever shared between threads.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRJobObjectCache
+{
+	/** The mutex protecting all of the other fields. */
+	apr_thread_mutex_t *ajoc_mutex_p;
+
+	/** The entries keyed by their ServiceJobs' UUIDs. */
+	apr_hash_t *ajoc_entries_p;
+
+	/** The most recently used entry. */
+	APRJobObjectCacheEntry *ajoc_head_p;
+
+	/** The least recently used entry. */
+	APRJobObjectCacheEntry *ajoc_tail_p;
+
+	/** The unused entries. */
+	APRJobObjectCacheEntry *ajoc_free_p;
+
+	/** The number of times that a ServiceJob was found and up to date. */
+	volatile apr_uint32_t ajoc_num_hits;
+
+	/** The number of times that a ServiceJob had to be decoded. */
+	volatile apr_uint32_t ajoc_num_misses;
+} APRJobObjectCache;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate an APRJobObjectCache.
+ *
+ * @param max_jobs The maximum number of decoded ServiceJobs to keep.
+ * @param pool_p The pool to allocate the APRJobObjectCache from. The cached
+ * ServiceJobs are released when this is cleared.
+ * @return The new APRJobObjectCache or <code>NULL</code> upon error.
+ * @memberof APRJobObjectCache
+ */
+APRJobObjectCache *AllocateAPRJobObjectCache (const uint32 max_jobs, apr_pool_t *pool_p);
+
+
+/**
+ * Get a decoded ServiceJob if it is in the cache and still up to date.
+ *
+ * @param cache_p The APRJobObjectCache.
+ * @param job_key The UUID of the ServiceJob.
+ * @param generation The current generation of the stored ServiceJob.
+ * @return A copy of the ServiceJob's JSON which belongs to the caller and
+ * must be released with json_decref (), or <code>NULL</code> if it
+ * needs decoding again.
+ * @memberof APRJobObjectCache
+ */
+json_t *GetJobFromAPRJobObjectCache (APRJobObjectCache *cache_p, const uuid_t job_key, const apr_uint32_t generation);
+
+
+/**
+ * Add a decoded ServiceJob to the cache, replacing any older copy of it.
+ *
+ * @param cache_p The APRJobObjectCache.
+ * @param job_key The UUID of the ServiceJob.
+ * @param generation The generation of the stored ServiceJob, which must have
+ * been got before the ServiceJob was.
+ * @param job_json_p The ServiceJob's JSON. The cache keeps its own copy
+ * of this so it still belongs to the caller.
+ * @memberof APRJobObjectCache
+ */
+void AddJobToAPRJobObjectCache (APRJobObjectCache *cache_p, const uuid_t job_key, const apr_uint32_t generation, json_t *job_json_p);
+
+
+/**
+ * Remove a ServiceJob from the cache.
+ *
+ * @param cache_p The APRJobObjectCache.
+ * @param job_key The UUID of the ServiceJob.
+ * @memberof APRJobObjectCache
+ */
+void RemoveJobFromAPRJobObjectCache (APRJobObjectCache *cache_p, const uuid_t job_key);
+
+
+/**
+ * Get the number of times that the cache has been used and whether
+ * the ServiceJobs were in it.
+ *
+ * @param cache_p The APRJobObjectCache.
+ * @param hits_p Where to store the number of times that a ServiceJob was found.
+ * @param misses_p Where to store the number of times that a ServiceJob had
+ * to be decoded.
+ * @memberof APRJobObjectCache
+ */
+void GetAPRJobObjectCacheCounts (APRJobObjectCache *cache_p, uint32 *hits_p, uint32 *misses_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* APR_JOB_OBJECT_CACHE_H_ */
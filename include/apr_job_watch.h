@@ -0,0 +1,214 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief
+ */
+/*
+ * apr_job_watch.h
+ *
+ *  Lets a request wait for the statuses of a set of ServiceJobs to
+ *  change rather than the client polling for them.
+ */
+
+#ifndef APR_JOB_WATCH_H_
+#define APR_JOB_WATCH_H_
+
+#include "apr_pools.h"
+
+#include "apr_jobs_manager.h"
+#include "jansson.h"
+#include "uuid_util.h"
+
+
+/**
+ * The maximum number of ServiceJobs that one request can watch.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOB_WATCH_MAX_JOBS (64)
+
+
+/**
+ * The number of seconds that a long-poll waits for a change
+ * if the client doesn't ask for a different time.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOB_WATCH_DEFAULT_TIMEOUT (30)
+
+
+/**
+ * The maximum number of seconds that a long-poll can wait for.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOB_WATCH_MAX_TIMEOUT (120)
+
+
+/**
+ * The maximum number of seconds that a stream of Server-Sent Events
+ * stays open for. Clients reconnect afterwards, so this stops a
+ * forgotten stream from keeping a worker thread forever.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOB_WATCH_MAX_STREAM_TIME (600)
+
+
+/**
+ * The number of seconds between the comments that are sent to keep
+ * a stream of Server-Sent Events open when nothing has changed.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOB_WATCH_KEEP_ALIVE_INTERVAL (15)
+
+
+/**
+ * A ServiceJob that an APRJobWatch is watching.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRWatchedJob
+{
+	/** The UUID of the ServiceJob. */
+	uuid_t awj_key;
+
+	/** The UUID of the ServiceJob as a string. */
+	char awj_uuid_s [UUID_STRING_BUFFER_SIZE];
+
+	/** The generation of the ServiceJob's status when it was last got. */
+	apr_uint32_t awj_generation;
+
+	/** The ServiceJob's latest status, if awj_found_flag is set. */
+	APRJobStatus awj_status;
+
+	/** Whether the ServiceJob has a status record. */
+	bool awj_found_flag;
+
+	/** The update time of the last status that was reported to the client. */
+	apr_time_t awj_reported_time;
+
+	/** Whether the ServiceJob had a status record when it was last reported. */
+	bool awj_reported_found_flag;
+} APRWatchedJob;
+
+
+/**
+ * A set of ServiceJobs whose statuses a request is waiting on.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRJobWatch
+{
+	/** The APRJobsManager storing the ServiceJobs. */
+	APRJobsManager *ajw_manager_p;
+
+	/** The watched ServiceJobs. */
+	APRWatchedJob *ajw_jobs_p;
+
+	/** The number of watched ServiceJobs. */
+	uint32 ajw_num_jobs;
+} APRJobWatch;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate an APRJobWatch and get the current statuses of its ServiceJobs.
+ *
+ * @param manager_p The APRJobsManager storing the ServiceJobs.
+ * @param ids_s The UUIDs of the ServiceJobs to watch, separated by commas.
+ * @param since The time that the client last heard about the ServiceJobs.
+ * Any whose statuses were updated after this, or which no longer exist,
+ * are reported as changed straight away. Use 0 to report all of them.
+ * @param pool_p The pool to allocate the APRJobWatch from.
+ * @return The new APRJobWatch or <code>NULL</code> if none of the UUIDs
+ * were valid or upon error.
+ * @memberof APRJobWatch
+ */
+APRJobWatch *AllocateAPRJobWatch (APRJobsManager *manager_p, const char *ids_s, const apr_time_t since, apr_pool_t *pool_p);
+
+
+/**
+ * Wait until the status of any of the watched ServiceJobs has changed
+ * since it was last reported.
+ *
+ * @param watch_p The APRJobWatch.
+ * @param deadline The time to stop waiting at.
+ * @return The number of ServiceJobs whose statuses have changed,
+ * which is 0 if the deadline was reached first.
+ * @memberof APRJobWatch
+ */
+uint32 WaitForAPRJobWatchChanges (APRJobWatch *watch_p, const apr_time_t deadline);
+
+
+/**
+ * Check whether the status of a watched ServiceJob has changed
+ * since it was last reported.
+ *
+ * @param job_p The APRWatchedJob to check.
+ * @return <code>true</code> if it has changed, <code>false</code> otherwise.
+ * @memberof APRJobWatch
+ */
+bool HasAPRWatchedJobChanged (const APRWatchedJob *job_p);
+
+
+/**
+ * Record that the current status of a watched ServiceJob
+ * has been reported to the client.
+ *
+ * @param job_p The APRWatchedJob.
+ * @memberof APRJobWatch
+ */
+void SetAPRWatchedJobReported (APRWatchedJob *job_p);
+
+
+/**
+ * Check whether all of the watched ServiceJobs have finished or gone,
+ * so that there will be no more changes to report.
+ *
+ * @param watch_p The APRJobWatch.
+ * @return <code>true</code> if all of the ServiceJobs have finished,
+ * <code>false</code> otherwise.
+ * @memberof APRJobWatch
+ */
+bool HaveAPRJobWatchJobsFinished (const APRJobWatch *watch_p);
+
+
+/**
+ * Get the latest status of a watched ServiceJob as JSON.
+ *
+ * @param job_p The APRWatchedJob.
+ * @return The JSON object or <code>NULL</code> upon error. The caller
+ * should call json_decref () on it when it is no longer needed.
+ * @memberof APRJobWatch
+ */
+json_t *GetAPRWatchedJobAsJSON (const APRWatchedJob *job_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* APR_JOB_WATCH_H_ */
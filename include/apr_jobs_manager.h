@@ -74,6 +74,321 @@
 APR_JOBS_MANAGER_PREFIX const char *APR_JOBS_MANAGER_CACHE_ID_S APR_JOBS_MANAGER_VAL("grassroots-jobs-socache");
 
 
+/**
+ * The number of seconds that finished ServiceJobs are kept for
+ * if the GrassrootsJobRetention directive has not been set.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOBS_MANAGER_DEFAULT_JOB_RETENTION (24 * 60 * 60)
+
+
+/**
+ * The number of seconds between each sweep of the expired
+ * ServiceJobs.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOBS_MANAGER_SWEEP_INTERVAL (60)
+
+
+/**
+ * The number of seconds that a client is asked to wait before
+ * trying again when the jobs cache is full.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOBS_MANAGER_RETRY_AFTER (30)
+
+
+/**
+ * The maximum number of serialised ServiceJobs that each httpd child
+ * process saves when the GrassrootsCacheDictionarySamples directive
+ * has been set.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOBS_MANAGER_MAX_DICTIONARY_SAMPLES (1000)
+
+
+/**
+ * The size of the buffer for the Service's name in an APRJobStatus,
+ * including its terminating '\0'. Longer names are truncated.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOB_STATUS_SERVICE_NAME_SIZE (64)
+
+
+/**
+ * The size of the buffer for the error message in an APRJobStatus,
+ * including its terminating '\0'. Longer messages are truncated.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOB_STATUS_ERROR_SIZE (256)
+
+
+/**
+ * The size of the buffer for the name of the user who submitted
+ * the ServiceJob in an APRJobStatus, including its terminating '\0'.
+ * Longer names are truncated.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOB_STATUS_USER_NAME_SIZE (64)
+
+
+/**
+ * The current version of the APRJobStatus records. This is stored
+ * in each record so that any from an incompatible version are ignored.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOB_STATUS_VERSION (3)
+
+
+/**
+ * The largest number of ServiceJobs that can be submitted or
+ * have their statuses got in a single bulk request.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOBS_MANAGER_MAX_BULK_JOBS (1024)
+
+
+/**
+ * The largest number of decoded ServiceJobs that each httpd child
+ * process can be set to keep with GrassrootsJobObjectCacheSize.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOBS_MANAGER_MAX_JOB_OBJECT_CACHE_SIZE (1048576)
+
+
+/**
+ * The largest number of running ServiceJobs that any of the
+ * GrassrootsServiceJobLimit, GrassrootsUserJobLimit and
+ * GrassrootsActiveJobLimit directives can be set to.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOBS_MANAGER_MAX_JOB_LIMIT (1048576)
+
+
+/**
+ * The maximum number of threads in each httpd child process that
+ * decode the ServiceJobs when getting all of them at once.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOBS_MANAGER_REBUILD_THREADS (4)
+
+
+/**
+ * The number of ServiceJobs that each rebuild thread is given to decode
+ * at a time when getting all of the ServiceJobs. If there are no more
+ * ServiceJobs than this, they are decoded by the calling thread.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_JOBS_MANAGER_JOBS_PER_REBUILD_TASK (16)
+
+
+/**
+ * Update the status in UpdateServiceJobStatusInAPRJobsManager.
+ *
+ * @ingroup httpd_server
+ */
+#define AJS_UPDATE_STATUS (1)
+
+
+/**
+ * Update the progress in UpdateServiceJobStatusInAPRJobsManager.
+ *
+ * @ingroup httpd_server
+ */
+#define AJS_UPDATE_PROGRESS (2)
+
+
+/**
+ * Update the error message in UpdateServiceJobStatusInAPRJobsManager.
+ *
+ * @ingroup httpd_server
+ */
+#define AJS_UPDATE_ERROR (4)
+
+
+/**
+ * A small fixed-size record of a ServiceJob's status that is stored
+ * alongside the full ServiceJob. This lets the status of a ServiceJob
+ * be checked without decoding, decompressing and rebuilding the whole
+ * ServiceJob.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRJobStatus
+{
+	/** The time that this status was stored. */
+	apr_time_t ajs_update_time;
+
+	/**
+	 * The time that the ServiceJob will expire from the jobs cache
+	 * or 0 if it won't.
+	 */
+	apr_time_t ajs_expiry_time;
+
+	/** The status of the ServiceJob. */
+	OperationStatus ajs_status;
+
+	/** The version of this record, which will be APR_JOB_STATUS_VERSION. */
+	uint8 ajs_version;
+
+	/** Whether the ServiceJob has any results. */
+	uint8 ajs_results_flag;
+
+	/**
+	 * Whether this status has been updated by UpdateServiceJobStatusInAPRJobsManager
+	 * since the ServiceJob was last stored, and so is newer than the stored ServiceJob.
+	 */
+	uint8 ajs_updated_flag;
+
+	/**
+	 * How far through the ServiceJob is, as a percentage, if its Service
+	 * reports this. Once the ServiceJob has finished, this is 100.
+	 */
+	uint8 ajs_progress;
+
+	/**
+	 * Whether the ServiceJob is included in the counts of active
+	 * ServiceJobs that the job limits are checked against.
+	 */
+	uint8 ajs_counted_flag;
+
+	/** The name of the Service that ran the ServiceJob. */
+	char ajs_service_name_s [APR_JOB_STATUS_SERVICE_NAME_SIZE];
+
+	/**
+	 * The name of the user who submitted the ServiceJob, if it
+	 * was added whilst an APRJobAdmission was in place.
+	 */
+	char ajs_user_s [APR_JOB_STATUS_USER_NAME_SIZE];
+
+	/** The latest error message for the ServiceJob, if any. */
+	char ajs_error_s [APR_JOB_STATUS_ERROR_SIZE];
+} APRJobStatus;
+
+
+/**
+ * The criteria for choosing which ServiceJobs
+ * GetFilteredServiceJobsFromAPRJobsManager returns.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRJobsFilter
+{
+	/** If ajf_status_flag is set, only get the ServiceJobs with this status. */
+	OperationStatus ajf_status;
+
+	/** Whether to filter the ServiceJobs by ajf_status. */
+	bool ajf_status_flag;
+
+	/**
+	 * If this is not <code>NULL</code>, only get the ServiceJobs
+	 * that were run by the Service with this name.
+	 */
+	const char *ajf_service_name_s;
+
+	/** The maximum number of ServiceJobs to get or 0 for all of them. */
+	uint32 ajf_limit;
+} APRJobsFilter;
+
+
+/**
+ * The results of AdmitServiceJobsToAPRJobsManager.
+ *
+ * @ingroup httpd_server
+ */
+typedef enum APRJobAdmissionResult
+{
+	/** The ServiceJobs can be run. */
+	AJA_ADMITTED,
+
+	/** One of the Services already has its limit of active ServiceJobs. */
+	AJA_SERVICE_LIMIT,
+
+	/** The user already has their limit of active ServiceJobs. */
+	AJA_USER_LIMIT,
+
+	/** The server already has its limit of active ServiceJobs. */
+	AJA_ACTIVE_LIMIT,
+
+	/**
+	 * There was no room in the shared memory to start counting
+	 * the ServiceJobs of another Service or user.
+	 */
+	AJA_COUNTERS_FULL,
+
+	/** The admission could not be checked. */
+	AJA_ERROR
+} APRJobAdmissionResult;
+
+
+/**
+ * The number of active ServiceJobs that an APRJobAdmission
+ * has reserved for one Service.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRJobReservation
+{
+	/** The name of the Service. */
+	const char *ajr_service_name_s;
+
+	/** The number of ServiceJobs reserved for the Service. */
+	uint32 ajr_num_jobs;
+} APRJobReservation;
+
+
+/**
+ * The active ServiceJobs that a request has reserved before running
+ * its Services. The ServiceJobs that the request adds take over these
+ * reservations and count against the limits until they finish, and any
+ * left over are given back by EndAPRJobAdmission.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRJobAdmission
+{
+	/** The APRJobsManager that the reservations were made in. */
+	APRJobsManager *aja_manager_p;
+
+	/**
+	 * The pool that the APRJobAdmission was allocated from. Any
+	 * reservations left over are given back when it is cleared.
+	 */
+	apr_pool_t *aja_pool_p;
+
+	/**
+	 * The name of the user running the Services or
+	 * <code>NULL</code> if they are anonymous.
+	 */
+	const char *aja_user_s;
+
+	/** The reservations for each of the Services. */
+	APRJobReservation *aja_reservations_p;
+
+	/** The number of Services in aja_reservations_p. */
+	uint32 aja_num_reservations;
+
+	/** The number of ServiceJobs reserved against the user's limit. */
+	uint32 aja_num_user_jobs;
+
+	/** The number of ServiceJobs reserved against the server's limit. */
+	uint32 aja_num_jobs;
+} APRJobAdmission;
+
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -154,6 +469,306 @@ bool APRJobsManagerPreConfigure (APRJobsManager *manager_p, apr_pool_t *config_p
 void APRServiceJobFinished (JobsManager *jobs_manager_p, uuid_t job_key);
 
 
+/**
+ * Get several ServiceJobs from an APRJobsManager at once.
+ *
+ * This is quicker than getting each ServiceJob in turn as the
+ * underlying storage is only locked once for all of them.
+ *
+ * @param manager_p The APRJobsManager to get the ServiceJobs from.
+ * @param job_keys_p The UUIDs of the ServiceJobs to get.
+ * @param num_jobs The number of UUIDs.
+ * @param jobs_pp An array with space for num_jobs ServiceJob pointers. Upon return,
+ * each entry will either be the ServiceJob for the matching UUID or <code>NULL</code>
+ * if it could not be found. The caller takes ownership of the ServiceJobs.
+ * @return The number of ServiceJobs that were found.
+ * @memberof APRJobsManager
+ */
+uint32 GetServiceJobsFromAPRJobsManager (APRJobsManager *manager_p, const uuid_t *job_keys_p, const uint32 num_jobs, ServiceJob **jobs_pp);
+
+
+/**
+ * Add several ServiceJobs to an APRJobsManager at once, each using
+ * its own UUID as its key.
+ *
+ * @param manager_p The APRJobsManager to add the ServiceJobs to.
+ * @param jobs_pp The ServiceJobs to add.
+ * @param num_jobs The number of ServiceJobs.
+ * @return The number of ServiceJobs that were added successfully.
+ * @memberof APRJobsManager
+ */
+uint32 AddServiceJobsToAPRJobsManager (APRJobsManager *manager_p, ServiceJob **jobs_pp, const uint32 num_jobs);
+
+
+/**
+ * Get the descriptor for the results of a ServiceJob that have been
+ * written to the APRJobsManager's APRResultStore.
+ *
+ * The results of each finished ServiceJob are written to the result store,
+ * if the GrassrootsResultStore directive has been set, the first time
+ * that the finished ServiceJob is stored. They expire along with the
+ * ServiceJob.
+ *
+ * @param manager_p The APRJobsManager storing the ServiceJob.
+ * @param job_key The UUID of the ServiceJob.
+ * @param descriptor_p The APRResultDescriptor to copy the descriptor into.
+ * @return <code>true</code> if the results are in the result store,
+ * <code>false</code> otherwise.
+ * @memberof APRJobsManager
+ */
+bool GetServiceJobResultsFromAPRJobsManager (APRJobsManager *manager_p, const uuid_t job_key, APRResultDescriptor *descriptor_p);
+
+
+/**
+ * Get the status of a ServiceJob without rebuilding the ServiceJob.
+ *
+ * This only reads the small status record that is stored alongside
+ * each ServiceJob so is much quicker than getting the ServiceJob
+ * itself when only its status is needed.
+ *
+ * @param manager_p The APRJobsManager to get the status from.
+ * @param job_key The UUID of the ServiceJob.
+ * @param status_p The APRJobStatus to copy the status into.
+ * @return <code>true</code> if the status was found, <code>false</code>
+ * otherwise. If the status is not found, the ServiceJob may still be
+ * stored, for instance if it was added by an older version of the module,
+ * so the caller should fall back to getting the ServiceJob.
+ * @memberof APRJobsManager
+ */
+bool GetServiceJobStatusFromAPRJobsManager (APRJobsManager *manager_p, const uuid_t job_key, APRJobStatus *status_p);
+
+
+/**
+ * Get the statuses of a number of ServiceJobs at once without rebuilding
+ * them. The status records are got in a single batch, so each of the jobs
+ * cache's stripes is only locked once.
+ *
+ * @param manager_p The APRJobsManager storing the ServiceJobs.
+ * @param job_keys_p The UUIDs of the ServiceJobs.
+ * @param num_jobs The number of ServiceJobs.
+ * @param statuses_p An array of num_jobs APRJobStatuses to copy the statuses into.
+ * @param found_flags_p An array of num_jobs flags that are set to whether
+ * each ServiceJob's status was found.
+ * @return The number of statuses that were found.
+ * @memberof APRJobsManager
+ */
+uint32 GetServiceJobStatusesFromAPRJobsManager (APRJobsManager *manager_p, const uuid_t *job_keys_p, const uint32 num_jobs, APRJobStatus *statuses_p, bool *found_flags_p);
+
+
+/**
+ * Get an APRJobStatus as JSON for sending to a client.
+ *
+ * @param uuid_s The UUID of the ServiceJob as a string.
+ * @param status_p The ServiceJob's status or <code>NULL</code> if it
+ * wasn't found.
+ * @return The JSON object or <code>NULL</code> upon error. The caller
+ * should call json_decref () on it when it is no longer needed.
+ * @memberof APRJobsManager
+ */
+json_t *GetAPRJobStatusAsJSON (const char *uuid_s, const APRJobStatus *status_p);
+
+
+/**
+ * Get a number that changes whenever the status of a ServiceJob is
+ * stored, updated or removed by any httpd process.
+ *
+ * This doesn't lock the jobs cache so it can be checked frequently
+ * and the status only needs getting when it changes. It may also change
+ * when the status of another ServiceJob does.
+ *
+ * @param manager_p The APRJobsManager storing the ServiceJob.
+ * @param job_key The UUID of the ServiceJob.
+ * @return The generation of the ServiceJob's status.
+ * @memberof APRJobsManager
+ */
+apr_uint32_t GetServiceJobStatusGenerationFromAPRJobsManager (APRJobsManager *manager_p, const uuid_t job_key);
+
+
+/**
+ * Wait until the generation of a ServiceJob's status, as got from
+ * GetServiceJobStatusGenerationFromAPRJobsManager, changes in any
+ * httpd process or until a timeout.
+ *
+ * @param manager_p The APRJobsManager storing the ServiceJob.
+ * @param job_key The UUID of the ServiceJob.
+ * @param generation The generation that the caller has already seen.
+ * @param timeout The maximum time to wait in microseconds.
+ * @return <code>true</code> if the generation has changed,
+ * <code>false</code> if the timeout was reached.
+ * @memberof APRJobsManager
+ */
+bool WaitForServiceJobStatusChange (APRJobsManager *manager_p, const uuid_t job_key, const apr_uint32_t generation, const apr_interval_time_t timeout);
+
+
+/**
+ * Get a number that changes whenever any ServiceJob, or its status,
+ * is stored, updated or removed by any httpd process.
+ *
+ * @param manager_p The APRJobsManager.
+ * @return The current sequence number.
+ * @memberof APRJobsManager
+ */
+apr_uint32_t GetServiceJobsSequenceFromAPRJobsManager (APRJobsManager *manager_p);
+
+
+/**
+ * Wait until the sequence number from GetServiceJobsSequenceFromAPRJobsManager
+ * changes or until a timeout. This is for waiting on several ServiceJobs
+ * at once; their generations then show which of them have changed.
+ *
+ * @param manager_p The APRJobsManager to wait on.
+ * @param sequence The sequence number that the caller has already seen.
+ * @param timeout The maximum time to wait in microseconds.
+ * @return <code>true</code> if the sequence number has changed,
+ * <code>false</code> if the timeout was reached.
+ * @memberof APRJobsManager
+ */
+bool WaitForServiceJobsChange (APRJobsManager *manager_p, const apr_uint32_t sequence, const apr_interval_time_t timeout);
+
+
+/**
+ * Check whether an APRJobStatus is for a ServiceJob that has finished,
+ * whether successfully or not.
+ *
+ * @param status_p The APRJobStatus to check.
+ * @return <code>true</code> if the ServiceJob has finished,
+ * <code>false</code> if it is still to run or is running.
+ * @memberof APRJobsManager
+ */
+bool HasAPRJobStatusFinished (const APRJobStatus *status_p);
+
+
+/**
+ * Update some of the fields in a ServiceJob's status without storing
+ * the whole ServiceJob again.
+ *
+ * This only rewrites the small status record, so a Service can report its
+ * status and progress as often as it likes. Any ServiceJob that is got
+ * from the APRJobsManager afterwards has the updated status.
+ *
+ * A ServiceJob that has finished needs to be stored in full, with
+ * its results, so that it expires at the right time. This refuses
+ * to set any of the statuses for a finished ServiceJob.
+ *
+ * @param manager_p The APRJobsManager storing the ServiceJob.
+ * @param job_key The UUID of the ServiceJob.
+ * @param fields The fields to update, any of AJS_UPDATE_STATUS,
+ * AJS_UPDATE_PROGRESS and AJS_UPDATE_ERROR combined with bitwise or.
+ * @param status The new status if AJS_UPDATE_STATUS is set.
+ * @param progress The new progress, as a percentage, if AJS_UPDATE_PROGRESS is set.
+ * @param error_s The new error message if AJS_UPDATE_ERROR is set. This can be
+ * <code>NULL</code> to clear the error message.
+ * @return <code>true</code> if the status was updated, <code>false</code>
+ * if it wasn't, in which case the caller should store the whole ServiceJob
+ * instead.
+ * @memberof APRJobsManager
+ */
+bool UpdateServiceJobStatusInAPRJobsManager (APRJobsManager *manager_p, const uuid_t job_key, const uint32 fields, const OperationStatus status, const uint32 progress, const char *error_s);
+
+
+/**
+ * Get some or all of the ServiceJobs stored in an APRJobsManager.
+ *
+ * The stored ServiceJobs are copied out of the jobs cache one stripe
+ * at a time and are rebuilt on a small pool of threads after the cache
+ * has been unlocked, so other requests aren't held up while this runs.
+ * The status records are used to skip any ServiceJobs that don't match
+ * the filter without copying or rebuilding them.
+ *
+ * @param manager_p The APRJobsManager to get the ServiceJobs from.
+ * @param filter_p The criteria that the ServiceJobs must match. If this is
+ * <code>NULL</code> then all of the ServiceJobs are returned.
+ * @return A LinkedList of ServiceJobNodes or <code>NULL</code> if there
+ * are no matching ServiceJobs or upon error. If a limit was set,
+ * the list may be shorter than it even when there are more matching
+ * ServiceJobs, since ServiceJobs without status records can only be
+ * checked after they have been rebuilt.
+ * @memberof APRJobsManager
+ */
+LinkedList *GetFilteredServiceJobsFromAPRJobsManager (APRJobsManager *manager_p, const APRJobsFilter *filter_p);
+
+
+/**
+ * Get the APRJobsManager that was set up by APRJobsManagerChildInit
+ * for the current httpd child process.
+ *
+ * @return The APRJobsManager or <code>NULL</code> if there isn't one.
+ * @memberof APRJobsManager
+ */
+APRJobsManager *GetChildAPRJobsManager (void);
+
+
+/**
+ * Check whether an APRJobsManager has reached the capacity set
+ * by the GrassrootsCacheCapacity directive.
+ *
+ * @param manager_p The APRJobsManager to check.
+ * @return <code>true</code> if no more ServiceJobs can be stored without
+ * removing others, <code>false</code> otherwise.
+ * @memberof APRJobsManager
+ */
+bool IsAPRJobsManagerFull (const APRJobsManager *manager_p);
+
+
+/**
+ * Check whether an APRJobsManager has any limits on the number of
+ * active ServiceJobs.
+ *
+ * @param manager_p The APRJobsManager to check.
+ * @return <code>true</code> if any of the limits have been set,
+ * <code>false</code> otherwise.
+ * @memberof APRJobsManager
+ */
+bool HasAPRJobsManagerGotJobLimits (const APRJobsManager *manager_p);
+
+
+/**
+ * Reserve the active ServiceJobs that a request is about to start,
+ * checking them against the limits for each Service, for the user
+ * and for the whole server. Either all of the ServiceJobs are reserved
+ * or none of them are.
+ *
+ * The reservations are shared between all of the httpd processes and
+ * are taken atomically, so concurrent requests can't take the number
+ * of active ServiceJobs past any of the limits. Until EndAPRJobAdmission
+ * is called, the ServiceJobs that the calling thread adds are counted
+ * against these reservations.
+ *
+ * Only the limits that have been set are counted. If one of them would
+ * need a new counter and there is no room left for it in the shared
+ * memory, AJA_COUNTERS_FULL is returned rather than letting the
+ * ServiceJobs run uncounted.
+ *
+ * @param manager_p The APRJobsManager.
+ * @param user_s The name of the user or <code>NULL</code> if they are anonymous.
+ * @param service_names_ss The names of the Services, with one entry
+ * for each ServiceJob that will be run.
+ * @param num_services The number of entries in service_names_ss.
+ * @param pool_p The pool to allocate the APRJobAdmission from.
+ * @param admission_pp Where to store the APRJobAdmission if the
+ * ServiceJobs were admitted. This will be <code>NULL</code> if there
+ * are no limits to check.
+ * @return AJA_ADMITTED if the ServiceJobs can be run or the reason why not.
+ * @memberof APRJobsManager
+ */
+APRJobAdmissionResult AdmitServiceJobsToAPRJobsManager (APRJobsManager *manager_p, const char *user_s, const char **service_names_ss, const uint32 num_services, apr_pool_t *pool_p, APRJobAdmission **admission_pp);
+
+
+/**
+ * Stop counting the ServiceJobs that the calling thread adds against
+ * an APRJobAdmission and give back any of its reservations that weren't
+ * used. This is done anyway when the pool that the APRJobAdmission was
+ * allocated from is cleared or destroyed, including when a child process
+ * exits, but the reservations are held until then. If a child process
+ * dies without running its cleanups, its reservations are only reset
+ * along with the rest of the counters when httpd is restarted.
+ *
+ * @param admission_p The APRJobAdmission from AdmitServiceJobsToAPRJobsManager.
+ * @memberof APRJobsManager
+ */
+void EndAPRJobAdmission (APRJobAdmission *admission_p);
+
+
 /**
  * Free an APRJobsManager.
  *
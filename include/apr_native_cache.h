@@ -0,0 +1,140 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief
+ */
+/*
+ * apr_native_cache.h
+ *
+ *  A shared object cache provider that keeps its entries in an
+ *  open-addressing hash table in shared memory.
+ */
+
+#ifndef APR_NATIVE_CACHE_H_
+#define APR_NATIVE_CACHE_H_
+
+#include "httpd.h"
+#include "ap_provider.h"
+#include "ap_socache.h"
+
+#include "typedefs.h"
+
+
+/**
+ * The name used to select the native cache provider with the
+ * GrassrootsCache directive.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_NATIVE_CACHE_PROVIDER_NAME_S "native"
+
+
+/**
+ * The default size in bytes of the shared memory used by each
+ * native cache instance.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_NATIVE_CACHE_DEFAULT_SIZE (4 * 1024 * 1024)
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Get the shared object cache provider for the native cache.
+ *
+ * The entries are kept in an open-addressing hash table in shared
+ * memory with the values in a slab of fixed-size blocks. Each slot
+ * of the table has a sequence counter so that lookups never take a
+ * lock and instead retry if the slot changed whilst they were
+ * reading it. Stores and removals only lock the slot that they change.
+ *
+ * Concurrent stores and removals of the <em>same</em> key must be
+ * serialised by the caller, which APRGlobalStorage does with its
+ * stripe locks.
+ *
+ * @return The provider.
+ * @ingroup httpd_server
+ */
+const ap_socache_provider_t *GetNativeCacheProvider (void);
+
+
+/**
+ * Check whether a shared object cache provider is the native cache.
+ *
+ * @param provider_p The provider to check.
+ * @return <code>true</code> if the provider is the native cache,
+ * <code>false</code> otherwise.
+ * @ingroup httpd_server
+ */
+bool IsNativeCacheProvider (const ap_socache_provider_t *provider_p);
+
+
+/**
+ * Store an entry in a native cache instance and find out what it replaced.
+ *
+ * This is the same as the provider's store function but also reports
+ * the entry previously stored for the key, so that a caller keeping
+ * track of how much is stored doesn't need to retrieve the old entry
+ * first. As with the provider's store function, the caller must
+ * serialise stores and removals of the same key.
+ *
+ * @param instance_p The native cache instance.
+ * @param server_p The server.
+ * @param id_p The key.
+ * @param id_length The length of the key.
+ * @param expiry The time at which the entry expires.
+ * @param data_p The entry to store.
+ * @param data_length The length of the entry.
+ * @param replaced_data_p If this is not NULL, the start of the replaced
+ * entry is copied into it, up to replaced_data_size bytes.
+ * @param replaced_data_size The size of replaced_data_p.
+ * @param replaced_length_p If this is not NULL, it will be set to the full
+ * length of the entry that was replaced or 0 if there wasn't one.
+ * @param pool_p The pool to use for any temporary allocations.
+ * @return APR_SUCCESS if the entry was stored, APR_ENOSPC if there was no
+ * room for it.
+ * @ingroup httpd_server
+ */
+apr_status_t StoreInNativeCache (ap_socache_instance_t *instance_p, server_rec *server_p, const unsigned char *id_p, unsigned int id_length, apr_time_t expiry, unsigned char *data_p, unsigned int data_length, unsigned char *replaced_data_p, const unsigned int replaced_data_size, unsigned int *replaced_length_p, apr_pool_t *pool_p);
+
+
+/**
+ * Register the native cache as a shared object cache provider.
+ *
+ * This needs to be called when the module's hooks are registered so that the
+ * provider can be found when the configuration is processed.
+ *
+ * @param pool_p The pool to register the provider with.
+ * @return <code>true</code> if the provider was registered successfully,
+ * <code>false</code> otherwise.
+ * @ingroup httpd_server
+ */
+bool RegisterNativeCacheProvider (apr_pool_t *pool_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* APR_NATIVE_CACHE_H_ */
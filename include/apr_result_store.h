@@ -0,0 +1,169 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief
+ */
+/*
+ * apr_result_store.h
+ *
+ *  Stores the results of the finished ServiceJobs as files in a
+ *  directory, as they are usually too big for the jobs cache.
+ */
+
+#ifndef APR_RESULT_STORE_H_
+#define APR_RESULT_STORE_H_
+
+#include "apr_pools.h"
+#include "apr_file_io.h"
+#include "apr_file_info.h"
+
+#include "jansson.h"
+#include "typedefs.h"
+
+
+/**
+ * The current version of the APRResultDescriptors. This is stored
+ * in each descriptor so that any from an incompatible version are ignored.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_RESULT_DESCRIPTOR_VERSION (1)
+
+
+/**
+ * The small record that is kept in the jobs cache for a ServiceJob
+ * whose results have been written to an APRResultStore.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRResultDescriptor
+{
+	/** The time that the results were written. */
+	apr_time_t ard_creation_time;
+
+	/** The size of the results file in bytes. */
+	apr_uint64_t ard_size;
+
+	/** The version of this record, which will be APR_RESULT_DESCRIPTOR_VERSION. */
+	uint8 ard_version;
+} APRResultDescriptor;
+
+
+/**
+ * A directory, ideally on tmpfs or an SSD, that the results of the
+ * finished ServiceJobs are written to. Each ServiceJob's results are
+ * written once, as compact JSON, to a file named after its uuid so
+ * that every httpd child process can serve them without going back to
+ * the Service.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRResultStore
+{
+	/** The directory that the results files are written to. */
+	const char *ars_path_s;
+
+	/**
+	 * The parent of the pools that the request threads create
+	 * whilst writing and removing the results files.
+	 */
+	apr_pool_t *ars_pool_p;
+} APRResultStore;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Allocate an APRResultStore, creating its directory if needed.
+ *
+ * @param path_s The directory to store the results in.
+ * @param pool_p The pool to allocate the APRResultStore from.
+ * @return The new APRResultStore or <code>NULL</code> upon error.
+ * @memberof APRResultStore
+ */
+APRResultStore *AllocateAPRResultStore (const char *path_s, apr_pool_t *pool_p);
+
+
+/**
+ * Write the results of a ServiceJob to an APRResultStore.
+ *
+ * The results are written to a temporary file which is then renamed,
+ * so a partially written file is never served.
+ *
+ * @param store_p The APRResultStore to write to.
+ * @param uuid_s The uuid of the ServiceJob as a string.
+ * @param results_p The results to write.
+ * @param descriptor_p If the results are written successfully, this will be
+ * filled in with the details of them.
+ * @return <code>true</code> if the results were written successfully,
+ * <code>false</code> otherwise.
+ * @memberof APRResultStore
+ */
+bool WriteResultsToAPRResultStore (const APRResultStore *store_p, const char *uuid_s, const json_t *results_p, APRResultDescriptor *descriptor_p);
+
+
+/**
+ * Open the results of a ServiceJob so that they can be sent to a client.
+ * The file is opened with sendfile enabled.
+ *
+ * @param store_p The APRResultStore to read from.
+ * @param uuid_s The uuid of the ServiceJob as a string.
+ * @param file_pp Where to store the opened file.
+ * @param finfo_p Where to store the size and modification time of the file.
+ * @param pool_p The pool that the file is opened in and will be closed with.
+ * @return APR_SUCCESS if the file was opened or the APR error code if not.
+ * @memberof APRResultStore
+ */
+apr_status_t OpenResultsInAPRResultStore (const APRResultStore *store_p, const char *uuid_s, apr_file_t **file_pp, apr_finfo_t *finfo_p, apr_pool_t *pool_p);
+
+
+/**
+ * Delete the results of a ServiceJob from an APRResultStore.
+ *
+ * @param store_p The APRResultStore to delete from.
+ * @param uuid_s The uuid of the ServiceJob as a string.
+ * @return <code>true</code> if the results were deleted or didn't exist,
+ * <code>false</code> otherwise.
+ * @memberof APRResultStore
+ */
+bool RemoveResultsFromAPRResultStore (const APRResultStore *store_p, const char *uuid_s);
+
+
+/**
+ * Delete all of the results files, along with any abandoned temporary
+ * files, that were last written before a given time.
+ *
+ * @param store_p The APRResultStore to sweep.
+ * @param cutoff The files last modified before this time are deleted.
+ * @param pool_p A pool for temporary allocations.
+ * @return The number of files that were deleted.
+ * @memberof APRResultStore
+ */
+uint32 SweepAPRResultStore (const APRResultStore *store_p, const apr_time_t cutoff, apr_pool_t *pool_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* APR_RESULT_STORE_H_ */
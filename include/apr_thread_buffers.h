@@ -0,0 +1,154 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief
+ */
+/*
+ * apr_thread_buffers.h
+ *
+ *  Growable buffers that each worker thread keeps and reuses so that
+ *  storing a value doesn't need to allocate memory for it every time.
+ */
+
+#ifndef APR_THREAD_BUFFERS_H_
+#define APR_THREAD_BUFFERS_H_
+
+#include "apr_pools.h"
+
+#include "typedefs.h"
+
+
+/**
+ * Buffers larger than this are freed when they are released rather
+ * than kept, so that one unusually large value doesn't pin the memory
+ * for it in every thread.
+ *
+ * @ingroup httpd_server
+ */
+#define APR_THREAD_BUFFER_MAX_RETAINED_SIZE (1024 * 1024)
+
+
+/**
+ * The buffers that each thread has.
+ *
+ * @ingroup httpd_server
+ */
+typedef enum APRThreadBufferId
+{
+	/** The buffer that a ServiceJob is encoded into. */
+	ATB_ENCODED_JOB,
+
+	/** The buffer that an APRGlobalStorage entry is built in. */
+	ATB_STORAGE_ENTRY,
+
+	/** The number of buffers. */
+	ATB_NUM_BUFFERS
+} APRThreadBufferId;
+
+
+/**
+ * A buffer that a thread reuses. The memory is allocated with
+ * malloc () and realloc () so that it can be grown by other libraries.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct APRThreadBuffer
+{
+	/** The memory for the buffer. */
+	unsigned char *atb_data_p;
+
+	/** The size of atb_data_p in bytes. */
+	size_t atb_size;
+
+	/** Whether the buffer is currently being used. */
+	bool atb_in_use_flag;
+} APRThreadBuffer;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Set up the per-thread buffers. This needs to be called once in
+ * each child process. If it fails, GetAPRThreadBuffer will always
+ * return <code>NULL</code>.
+ *
+ * @param pool_p The pool whose cleanup will release the buffers' key.
+ * @return <code>true</code> if the buffers were set up successfully,
+ * <code>false</code> otherwise.
+ * @ingroup httpd_server
+ */
+bool InitAPRThreadBuffers (apr_pool_t *pool_p);
+
+
+/**
+ * Get one of the calling thread's buffers. Each call must be paired
+ * with a call to ReleaseAPRThreadBuffer.
+ *
+ * @param id The buffer to get.
+ * @return The buffer or <code>NULL</code> if it is not available, in which
+ * case the caller needs to allocate its own memory.
+ * @ingroup httpd_server
+ */
+APRThreadBuffer *GetAPRThreadBuffer (const APRThreadBufferId id);
+
+
+/**
+ * Make sure that a buffer is at least a given size.
+ *
+ * @param buffer_p The buffer.
+ * @param size The number of bytes needed.
+ * @return <code>true</code> if the buffer is big enough, <code>false</code>
+ * if it could not be grown.
+ * @ingroup httpd_server
+ */
+bool ReserveAPRThreadBuffer (APRThreadBuffer *buffer_p, const size_t size);
+
+
+/**
+ * Give a buffer back once it is no longer needed.
+ *
+ * @param buffer_p The buffer.
+ * @ingroup httpd_server
+ */
+void ReleaseAPRThreadBuffer (APRThreadBuffer *buffer_p);
+
+
+/**
+ * Create a pool that any thread can create subpools of. The pool has
+ * its own allocator, guarded by a mutex, which the subpools share so
+ * each thread can make and destroy its own subpool without a root pool
+ * being created every time. The pool itself must only be used for
+ * creating subpools.
+ *
+ * @param parent_pool_p The pool whose cleanup will destroy the new pool.
+ * @return The new pool or <code>NULL</code> upon error.
+ * @ingroup httpd_server
+ */
+apr_pool_t *CreateAPRThreadSafePool (apr_pool_t *parent_pool_p);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* APR_THREAD_BUFFERS_H_ */
@@ -12,10 +12,56 @@
 #include "typedefs.h"
 
 
-unsigned char *CompressToBZ2 (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s);
+/*
+ * The number of blocks of memory that a BZ2Allocator keeps. Compressing
+ * needs 4 and decompressing needs 2 or 3.
+ */
+#define BZ2_ALLOCATOR_NUM_BLOCKS (8)
+
+
+/*
+ * A block of memory that bzip2 has asked for.
+ */
+typedef struct BZ2Block
+{
+	void *bzb_data_p;
+	int bzb_size;
+	bool bzb_in_use_flag;
+} BZ2Block;
+
+
+/*
+ * Keeps the memory that bzip2 allocates for its internal state so
+ * that it can be reused by later calls rather than being allocated
+ * and freed each time. A BZ2Allocator must only be used by one
+ * thread at a time.
+ */
+typedef struct BZ2Allocator
+{
+	BZ2Block bza_blocks [BZ2_ALLOCATOR_NUM_BLOCKS];
+
+	/* The number of times that a new block was needed. */
+	uint32 bza_num_allocations;
+
+	/* The number of times that an existing block was reused. */
+	uint32 bza_num_reuses;
+} BZ2Allocator;
+
+
+BZ2Allocator *AllocateBZ2Allocator (void);
+
+
+void FreeBZ2Allocator (BZ2Allocator *allocator_p);
+
+
+/*
+ * Compress src_p into dest_p. If the compressed data won't fit in
+ * dest_capacity bytes, this still succeeds but *dest_length_p is set to 0.
+ */
+bool CompressToBZ2 (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_capacity, unsigned int *dest_length_p, BZ2Allocator *allocator_p, const char * const key_s);
 
 
-unsigned char *UncompressFromBZ2 (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s);
+bool UncompressFromBZ2 (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_length, BZ2Allocator *allocator_p, const char * const key_s);
 
 
 #endif		/* #ifndef BZIP2_UTIL_H */
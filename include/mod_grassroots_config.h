@@ -29,11 +29,15 @@
 #define MOD_GRASSROOTS_CONFIG_H_
 
 #include "apr_global_storage.h"
+#include "stored_job_encoding.h"
+#include "apr_result_store.h"
+#include "apr_job_object_cache.h"
 #include "httpd.h"
 #include "http_config.h"
 #include "apr_global_mutex.h"
 #include "ap_provider.h"
 #include "ap_socache.h"
+#include "apr_thread_pool.h"
 
 #include "jobs_manager.h"
 #include "servers_manager.h"
@@ -58,6 +62,51 @@ typedef struct APRJobsManager
 	 * ServiceJobs will be stored.
 	 */
 	APRGlobalStorage *ajm_store_p;
+
+	/**
+	 * The directory to save samples of the serialised jobs to
+	 * or NULL if no samples are to be saved.
+	 */
+	const char *ajm_samples_path_s;
+
+	/** The number of samples that this child process has saved. */
+	volatile apr_uint32_t ajm_num_samples;
+
+	/** How the serialised ServiceJobs are encoded when they are stored. */
+	StoredJobEncoding ajm_encoding;
+
+	/**
+	 * The threads that decode the ServiceJobs when getting all of them
+	 * or NULL if they are decoded by the calling thread.
+	 */
+	apr_thread_pool_t *ajm_rebuild_pool_p;
+
+	/**
+	 * The parent of the pools that the request threads create whilst
+	 * sharing out the decoding of the ServiceJobs.
+	 */
+	apr_pool_t *ajm_scratch_pool_p;
+
+	/**
+	 * Where the results of the finished ServiceJobs are written
+	 * or NULL if they aren't stored.
+	 */
+	APRResultStore *ajm_result_store_p;
+
+	/**
+	 * This child process's cache of the decoded ServiceJobs
+	 * or NULL if they are decoded every time.
+	 */
+	APRJobObjectCache *ajm_job_cache_p;
+
+	/** The maximum number of active ServiceJobs for each Service or 0 for no limit. */
+	uint32 ajm_service_job_limit;
+
+	/** The maximum number of active ServiceJobs for each user or 0 for no limit. */
+	uint32 ajm_user_job_limit;
+
+	/** The maximum number of active ServiceJobs in total or 0 for no limit. */
+	uint32 ajm_active_job_limit;
 } APRJobsManager;
 
 
@@ -84,6 +133,27 @@ typedef struct APRServersManager
 } APRServersManager;
 
 
+/**
+ * The value of a uint32 setting that has not been given for
+ * a context, so that it is inherited from the enclosing
+ * context when the configs are merged.
+ *
+ * @ingroup httpd_server
+ */
+#define GLC_UNSET_UINT32 (APR_UINT32_MAX)
+
+
+/**
+ * The value of an int32 setting, including those holding one
+ * of an enumeration's values, that has not been given for a
+ * context, so that it is inherited from the enclosing context
+ * when the configs are merged.
+ *
+ * @ingroup httpd_server
+ */
+#define GLC_UNSET_INT32 (-1)
+
+
 /** @publicsection */
 
 /**
@@ -181,6 +251,137 @@ typedef struct
 	 */
 	char *glc_user_auth_claim_s;
 
+
+	/**
+	 * The number of stripes to split the jobs cache into. Each stripe
+	 * has its own lock and shared object cache partition. If this is 0,
+	 * then a single stripe will be used.
+	 */
+	uint32 glc_num_cache_stripes;
+
+
+	/**
+	 * How the stripes of the jobs cache are locked, as one of the
+	 * APRGlobalStorageLockMode values. If this is GLC_UNSET_INT32,
+	 * every access takes an exclusive lock.
+	 */
+	int32 glc_cache_lock_mode;
+
+
+	/**
+	 * The size, in kilobytes, of the cache of recently used jobs that
+	 * each httpd child process keeps. If this is 0 or GLC_UNSET_UINT32,
+	 * then the children do not keep their own caches.
+	 */
+	uint32 glc_local_cache_size_kb;
+
+
+	/**
+	 * The number of decoded jobs that each httpd child process keeps
+	 * so that repeatedly getting an unchanged job doesn't need to decode
+	 * it again. If this is 0 or GLC_UNSET_UINT32, the decoded jobs are
+	 * not kept.
+	 */
+	uint32 glc_job_object_cache_size;
+
+
+	/**
+	 * The maximum number of jobs that each Service can have running
+	 * at once. If this is 0 or GLC_UNSET_UINT32, there is no limit.
+	 */
+	uint32 glc_service_job_limit;
+
+
+	/**
+	 * The maximum number of jobs that each user can have running
+	 * at once. If this is 0 or GLC_UNSET_UINT32, there is no limit.
+	 */
+	uint32 glc_user_job_limit;
+
+
+	/**
+	 * The maximum number of jobs that can be running at once across
+	 * all of the Services. If this is 0 or GLC_UNSET_UINT32, there
+	 * is no limit.
+	 */
+	uint32 glc_active_job_limit;
+
+
+	/**
+	 * The number of seconds that a finished job is kept in the jobs
+	 * cache for. If this is 0, finished jobs are kept until they are
+	 * removed and if it is negative, the default is used.
+	 */
+	int32 glc_job_retention_secs;
+
+
+	/**
+	 * The maximum size, in kilobytes, of the jobs stored in the
+	 * jobs cache. If this is 0 or GLC_UNSET_UINT32, then there is
+	 * no limit other than the size of the shared object cache itself.
+	 */
+	uint32 glc_cache_capacity_kb;
+
+
+	/**
+	 * What to do when the jobs cache is at its capacity, as one of the
+	 * APRGlobalStorageFullPolicy values. If this is GLC_UNSET_INT32,
+	 * new jobs are rejected.
+	 */
+	int32 glc_cache_full_policy;
+
+
+	/**
+	 * The codec used to compress the values stored in the jobs and
+	 * servers caches. If this is NULL, then they are stored uncompressed.
+	 */
+	const APRCacheCodec *glc_cache_codec_p;
+
+
+	/**
+	 * Values shorter than this many bytes are stored in the caches
+	 * uncompressed. If this is -1, the default is used.
+	 */
+	int32 glc_cache_compress_min_length;
+
+
+	/**
+	 * The percentage by which compressing a value must shrink it for
+	 * the compressed form to be stored. If this is -1, the default is used.
+	 */
+	int32 glc_cache_compress_min_saving;
+
+
+	/**
+	 * The path to a zstd dictionary for the zstd codec to use
+	 * or NULL to compress without one.
+	 */
+	const char *glc_cache_dictionary_s;
+
+
+	/**
+	 * The directory where the jobs manager saves a sample of the
+	 * serialised jobs, for training a zstd dictionary from, or
+	 * NULL if no samples are to be saved.
+	 */
+	const char *glc_cache_dictionary_samples_path_s;
+
+
+	/**
+	 * How the jobs are encoded in the jobs cache, as one of the
+	 * StoredJobEncoding values. If this is GLC_UNSET_INT32, SJE_BSON
+	 * is used. Both encodings can always be read.
+	 */
+	int32 glc_job_encoding;
+
+
+	/**
+	 * The directory that the results of the finished jobs are written
+	 * to, so that they can be served without going back to the services,
+	 * or NULL if they are not stored.
+	 */
+	const char *glc_result_store_path_s;
+
 } GrassrootsLocationConfig;
 
 
@@ -0,0 +1,138 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/**
+ * @file
+ * @brief
+ */
+/*
+ * stored_job_encoding.h
+ *
+ *  How the serialised ServiceJobs are encoded in the jobs cache.
+ */
+
+#ifndef STORED_JOB_ENCODING_H_
+#define STORED_JOB_ENCODING_H_
+
+#include "jansson.h"
+
+#include "typedefs.h"
+
+
+/**
+ * The encodings that the serialised ServiceJobs can be stored in.
+ *
+ * @ingroup httpd_server
+ */
+typedef enum StoredJobEncoding
+{
+	/**
+	 * The jobs are stored as compact JSON text, which is what
+	 * older versions of the module can read.
+	 */
+	SJE_JSON,
+
+	/**
+	 * The jobs are stored as BSON after a StoredJobHeader, which is
+	 * smaller and much quicker to turn back into JSON.
+	 */
+	SJE_BSON
+} StoredJobEncoding;
+
+
+/**
+ * The bytes at the start of each binary encoded job. JSON text
+ * cannot start with these, so the old JSON entries can always be
+ * told apart from the binary ones.
+ *
+ * @ingroup httpd_server
+ */
+#define SJE_MAGIC_S "GSJ"
+
+
+/**
+ * The current version of the binary encoding.
+ *
+ * @ingroup httpd_server
+ */
+#define SJE_VERSION (1)
+
+
+/**
+ * The header in front of each binary encoded job.
+ *
+ * @ingroup httpd_server
+ */
+typedef struct StoredJobHeader
+{
+	/** This is always SJE_MAGIC_S without its terminating '\0'. */
+	char sjh_magic [3];
+
+	/** The version of the encoding that follows. */
+	uint8 sjh_version;
+} StoredJobHeader;
+
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/**
+ * Encode a serialised ServiceJob to store in the jobs cache.
+ *
+ * The job is written straight into a buffer that is grown with realloc () as
+ * needed, so a buffer can be reused for many jobs without allocating memory
+ * for each of them.
+ *
+ * @param job_json_p The JSON for the ServiceJob. This must be a JSON object.
+ * @param encoding The encoding to use.
+ * @param buffer_pp The address of the buffer to write the job into. This can
+ * point to <code>NULL</code> for a new buffer and may be changed if the buffer
+ * needs to grow. The buffer is owned by the caller who should free it with free ().
+ * @param buffer_size_p The address of the size of the buffer in bytes. This is
+ * updated if the buffer grows.
+ * @param length_p Upon success, the length of the encoded job will be stored here.
+ * For SJE_JSON, this includes the terminating '\0'.
+ * @return The encoded job, which is at the start of the buffer, or
+ * <code>NULL</code> upon error.
+ * @ingroup httpd_server
+ */
+unsigned char *EncodeStoredJob (const json_t *job_json_p, const StoredJobEncoding encoding, unsigned char **buffer_pp, size_t *buffer_size_p, unsigned int *length_p);
+
+
+/**
+ * Decode a ServiceJob from the jobs cache back into JSON. This reads
+ * both the binary encoding and the JSON text that older versions of
+ * the module stored.
+ *
+ * @param value_p The encoded job.
+ * @param value_length The length of the encoded job. The lengths recorded
+ * within the job are checked against this, and a length of 0 is rejected.
+ * @return The JSON for the ServiceJob which should be freed with json_decref ()
+ * or <code>NULL</code> upon error.
+ * @ingroup httpd_server
+ */
+json_t *DecodeStoredJob (const unsigned char *value_p, const unsigned int value_length);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif /* STORED_JOB_ENCODING_H_ */
@@ -0,0 +1,691 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * apr_cache_codecs.c
+ *
+ *  The codecs are compiled in depending upon which of the compression
+ *  libraries were available when the module was built, see the
+ *  USE_COMPRESSION variable in the makefile.
+ */
+
+#include <string.h>
+
+#include "apr_atomic.h"
+#include "apr_file_io.h"
+#include "apr_thread_proc.h"
+
+#include "apr_cache_codecs.h"
+#include "memory_allocations.h"
+#include "streams.h"
+
+#ifdef USE_LZ4
+#include "lz4.h"
+#endif
+
+#ifdef USE_ZSTD
+#include "zstd.h"
+#include "zstd_errors.h"
+#endif
+
+#ifdef USE_BZIP2
+#include "bzip2_util.h"
+#endif
+
+
+/**
+ * The Zstandard compression level. The lowest levels are
+ * the fastest and the job values are mostly small JSON
+ * documents that compress well anyway.
+ */
+#define ACC_ZSTD_LEVEL (1)
+
+
+/*
+ * The compression state that each worker thread keeps so that
+ * it isn't allocated and freed again for every value.
+ */
+typedef struct APRCacheCodecContexts
+{
+#ifdef USE_LZ4
+	void *accc_lz4_state_p;
+#endif
+
+#ifdef USE_ZSTD
+	ZSTD_CCtx *accc_zstd_compress_p;
+	ZSTD_DCtx *accc_zstd_decompress_p;
+#endif
+
+#ifdef USE_BZIP2
+	BZ2Allocator *accc_bzip2_allocator_p;
+#endif
+
+	/* Keep the struct non-empty if no codecs were compiled in */
+	uint32 accc_unused;
+} APRCacheCodecContexts;
+
+
+/*
+ * The key for each thread's APRCacheCodecContexts. If this
+ * couldn't be created, the codecs allocate their state
+ * every time that they are called.
+ */
+static apr_threadkey_t *s_contexts_key_p = NULL;
+
+static volatile apr_uint32_t s_num_context_allocations = 0;
+
+static volatile apr_uint32_t s_num_context_reuses = 0;
+
+
+static APRCacheCodecContexts *GetContexts (void);
+
+static void FreeContexts (void *data_p);
+
+static apr_status_t DeleteContextsKey (void *data_p);
+
+#if defined USE_LZ4 || defined USE_ZSTD
+static void CountContextUse (const bool allocated_flag);
+#endif
+
+
+#ifdef USE_ZSTD
+/*
+ * The dictionary loaded by LoadAPRCacheCodecDictionary. These are
+ * only set whilst a child process is starting up and are read-only
+ * afterwards, so the threads can share them.
+ */
+static ZSTD_CDict *s_zstd_compress_dictionary_p = NULL;
+
+static ZSTD_DDict *s_zstd_decompress_dictionary_p = NULL;
+
+static apr_status_t FreeZstdDictionary (void *data_p);
+#endif
+
+
+#ifdef USE_LZ4
+static bool CompressToLZ4 (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_capacity, unsigned int *dest_length_p, const char * const key_s);
+
+static bool UncompressFromLZ4 (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_length, const char * const key_s);
+#endif
+
+
+#ifdef USE_ZSTD
+static bool CompressToZstd (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_capacity, unsigned int *dest_length_p, const char * const key_s);
+
+static bool UncompressFromZstd (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_length, const char * const key_s);
+#endif
+
+
+#ifdef USE_BZIP2
+static bool CompressToBZ2WithContext (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_capacity, unsigned int *dest_length_p, const char * const key_s);
+
+static bool UncompressFromBZ2WithContext (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_length, const char * const key_s);
+#endif
+
+
+/*
+ * The codecs indexed by their ids. Any that were not compiled
+ * in have no compression functions.
+ */
+static const APRCacheCodec s_codecs [ACC_NUM_CODECS] =
+{
+	{ ACC_NONE, "none", NULL, NULL },
+
+#ifdef USE_LZ4
+	{ ACC_LZ4, "lz4", CompressToLZ4, UncompressFromLZ4 },
+#else
+	{ ACC_LZ4, "lz4", NULL, NULL },
+#endif
+
+#ifdef USE_ZSTD
+	{ ACC_ZSTD, "zstd", CompressToZstd, UncompressFromZstd },
+#else
+	{ ACC_ZSTD, "zstd", NULL, NULL },
+#endif
+
+#ifdef USE_BZIP2
+	{ ACC_BZIP2, "bzip2", CompressToBZ2WithContext, UncompressFromBZ2WithContext }
+#else
+	{ ACC_BZIP2, "bzip2", NULL, NULL }
+#endif
+};
+
+
+static const char s_available_codecs_s [] = "none"
+#ifdef USE_LZ4
+	", lz4"
+#endif
+#ifdef USE_ZSTD
+	", zstd"
+#endif
+#ifdef USE_BZIP2
+	", bzip2"
+#endif
+	;
+
+
+/**************************/
+
+
+bool InitAPRCacheCodecs (apr_pool_t *pool_p)
+{
+	apr_status_t status = apr_threadkey_private_create (&s_contexts_key_p, FreeContexts, pool_p);
+
+	if (status == APR_SUCCESS)
+		{
+			apr_pool_cleanup_register (pool_p, NULL, DeleteContextsKey, apr_pool_cleanup_null);
+			return true;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create the key for the compression contexts, %d", status);
+			s_contexts_key_p = NULL;
+		}
+
+	return false;
+}
+
+
+bool LoadAPRCacheCodecDictionary (const char *path_s, apr_pool_t *pool_p)
+{
+	bool success_flag = false;
+
+#ifdef USE_ZSTD
+	apr_file_t *file_p = NULL;
+	apr_status_t status = apr_file_open (&file_p, path_s, APR_FOPEN_READ | APR_FOPEN_BINARY, APR_OS_DEFAULT, pool_p);
+
+	if (status == APR_SUCCESS)
+		{
+			apr_finfo_t info;
+
+			status = apr_file_info_get (&info, APR_FINFO_SIZE, file_p);
+
+			if ((status == APR_SUCCESS) && (info.size > 0))
+				{
+					const apr_size_t size = (apr_size_t) (info.size);
+					void *buffer_p = AllocMemory (size);
+
+					if (buffer_p)
+						{
+							apr_size_t num_read = 0;
+
+							status = apr_file_read_full (file_p, buffer_p, size, &num_read);
+
+							if (status == APR_SUCCESS)
+								{
+									/* Both of these take their own copies of the dictionary */
+									s_zstd_compress_dictionary_p = ZSTD_createCDict (buffer_p, size, ACC_ZSTD_LEVEL);
+									s_zstd_decompress_dictionary_p = ZSTD_createDDict (buffer_p, size);
+
+									if (s_zstd_compress_dictionary_p && s_zstd_decompress_dictionary_p)
+										{
+											apr_pool_cleanup_register (pool_p, NULL, FreeZstdDictionary, apr_pool_cleanup_null);
+
+											PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Loaded zstd dictionary %u from \"%s\"", ZSTD_getDictID_fromDDict (s_zstd_decompress_dictionary_p), path_s);
+											success_flag = true;
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "\"%s\" is not a valid zstd dictionary", path_s);
+											FreeZstdDictionary (NULL);
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to read zstd dictionary \"%s\", %d", path_s, status);
+								}
+
+							FreeMemory (buffer_p);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " bytes for zstd dictionary \"%s\"", size, path_s);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get the size of zstd dictionary \"%s\", %d", path_s, status);
+				}
+
+			apr_file_close (file_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to open zstd dictionary \"%s\", %d", path_s, status);
+		}
+#else
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Cannot load \"%s\" as zstd was not available when the module was built", path_s);
+#endif
+
+	return success_flag;
+}
+
+
+void GetAPRCacheCodecContextCounts (uint32 *allocations_p, uint32 *reuses_p)
+{
+	*allocations_p = apr_atomic_read32 (&s_num_context_allocations);
+	*reuses_p = apr_atomic_read32 (&s_num_context_reuses);
+}
+
+
+const APRCacheCodec *GetAPRCacheCodecByName (const char *name_s)
+{
+	uint32 i;
+
+	for (i = 0; i < ACC_NUM_CODECS; ++ i)
+		{
+			if (strcmp (s_codecs [i].acc_name_s, name_s) == 0)
+				{
+					return GetAPRCacheCodecById (i);
+				}
+		}
+
+	return NULL;
+}
+
+
+const APRCacheCodec *GetAPRCacheCodecById (const uint32 id)
+{
+	if (id == ACC_NONE)
+		{
+			return s_codecs;
+		}
+	else if ((id < ACC_NUM_CODECS) && (s_codecs [id].acc_compress_fn))
+		{
+			return s_codecs + id;
+		}
+
+	return NULL;
+}
+
+
+const char *GetAvailableAPRCacheCodecNames (void)
+{
+	return s_available_codecs_s;
+}
+
+
+/**************************/
+
+
+#ifdef USE_LZ4
+static bool CompressToLZ4 (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_capacity, unsigned int *dest_length_p, const char * const key_s)
+{
+	if (src_length <= LZ4_MAX_INPUT_SIZE)
+		{
+			APRCacheCodecContexts *contexts_p = GetContexts ();
+			int res;
+
+			/*
+			 * LZ4 returns 0 rather than overrunning dest_p if the compressed
+			 * data won't fit, which is the only way that it can fail for a
+			 * valid length.
+			 */
+			if (contexts_p)
+				{
+					/* The state is reset by LZ4 before each use */
+					res = LZ4_compress_fast_extState (contexts_p -> accc_lz4_state_p, (const char *) src_p, (char *) dest_p, (int) src_length, (int) dest_capacity, 1);
+					CountContextUse (false);
+				}
+			else
+				{
+					res = LZ4_compress_default ((const char *) src_p, (char *) dest_p, (int) src_length, (int) dest_capacity);
+					CountContextUse (true);
+				}
+
+			*dest_length_p = (res > 0) ? (unsigned int) res : 0;
+			return true;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "\"%s\" is too large to compress with lz4, " UINT32_FMT " bytes", key_s, src_length);
+		}
+
+	return false;
+}
+
+
+static bool UncompressFromLZ4 (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_length, const char * const key_s)
+{
+	const int res = LZ4_decompress_safe ((const char *) src_p, (char *) dest_p, (int) src_length, (int) dest_length);
+
+	if (res == (int) dest_length)
+		{
+			return true;
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress \"%s\" with lz4 to " UINT32_FMT " bytes, result %d", key_s, dest_length, res);
+
+	return false;
+}
+#endif
+
+
+#ifdef USE_ZSTD
+static bool CompressToZstd (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_capacity, unsigned int *dest_length_p, const char * const key_s)
+{
+	APRCacheCodecContexts *contexts_p = GetContexts ();
+	ZSTD_CCtx *context_p = contexts_p ? contexts_p -> accc_zstd_compress_p : ZSTD_createCCtx ();
+
+	CountContextUse (contexts_p == NULL);
+
+	if (context_p)
+		{
+			size_t res;
+
+			/* The context is reset by zstd before it is used */
+			if (s_zstd_compress_dictionary_p)
+				{
+					res = ZSTD_compress_usingCDict (context_p, dest_p, dest_capacity, src_p, src_length, s_zstd_compress_dictionary_p);
+				}
+			else
+				{
+					res = ZSTD_compressCCtx (context_p, dest_p, dest_capacity, src_p, src_length, ACC_ZSTD_LEVEL);
+				}
+
+			if (!contexts_p)
+				{
+					ZSTD_freeCCtx (context_p);
+				}
+
+			if (!ZSTD_isError (res))
+				{
+					*dest_length_p = (unsigned int) res;
+					return true;
+				}
+			else if (ZSTD_getErrorCode (res) == ZSTD_error_dstSize_tooSmall)
+				{
+					*dest_length_p = 0;
+					return true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress \"%s\" with zstd, %s", key_s, ZSTD_getErrorName (res));
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create zstd context to compress \"%s\"", key_s);
+		}
+
+	return false;
+}
+
+
+static bool UncompressFromZstd (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_length, const char * const key_s)
+{
+	/* Each frame records the id of the dictionary, if any, that it was compressed with */
+	const unsigned int dictionary_id = ZSTD_getDictID_fromFrame (src_p, src_length);
+
+	if ((dictionary_id == 0) || (s_zstd_decompress_dictionary_p && (ZSTD_getDictID_fromDDict (s_zstd_decompress_dictionary_p) == dictionary_id)))
+		{
+			APRCacheCodecContexts *contexts_p = GetContexts ();
+			ZSTD_DCtx *context_p = contexts_p ? contexts_p -> accc_zstd_decompress_p : ZSTD_createDCtx ();
+
+			CountContextUse (contexts_p == NULL);
+
+			if (context_p)
+				{
+					size_t res;
+
+					if (dictionary_id != 0)
+						{
+							res = ZSTD_decompress_usingDDict (context_p, dest_p, dest_length, src_p, src_length, s_zstd_decompress_dictionary_p);
+						}
+					else
+						{
+							res = ZSTD_decompressDCtx (context_p, dest_p, dest_length, src_p, src_length);
+						}
+
+					if (!contexts_p)
+						{
+							ZSTD_freeDCtx (context_p);
+						}
+
+					if (ZSTD_isError (res))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress \"%s\" with zstd, %s", key_s, ZSTD_getErrorName (res));
+						}
+					else if (res != dest_length)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Decompressed \"%s\" to " SIZET_FMT " bytes rather than " UINT32_FMT, key_s, res, dest_length);
+						}
+					else
+						{
+							return true;
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create zstd context to decompress \"%s\"", key_s);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "\"%s\" was compressed with zstd dictionary %u which is not loaded", key_s, dictionary_id);
+		}
+
+	return false;
+}
+#endif
+
+
+#ifdef USE_BZIP2
+static bool CompressToBZ2WithContext (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_capacity, unsigned int *dest_length_p, const char * const key_s)
+{
+	APRCacheCodecContexts *contexts_p = GetContexts ();
+	bool success_flag = false;
+
+	if (contexts_p)
+		{
+			BZ2Allocator *allocator_p = contexts_p -> accc_bzip2_allocator_p;
+			const uint32 num_allocations = allocator_p -> bza_num_allocations;
+			const uint32 num_reuses = allocator_p -> bza_num_reuses;
+
+			success_flag = CompressToBZ2 (src_p, src_length, dest_p, dest_capacity, dest_length_p, allocator_p, key_s);
+
+			apr_atomic_add32 (&s_num_context_allocations, allocator_p -> bza_num_allocations - num_allocations);
+			apr_atomic_add32 (&s_num_context_reuses, allocator_p -> bza_num_reuses - num_reuses);
+		}
+	else
+		{
+			success_flag = CompressToBZ2 (src_p, src_length, dest_p, dest_capacity, dest_length_p, NULL, key_s);
+		}
+
+	return success_flag;
+}
+
+
+static bool UncompressFromBZ2WithContext (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_length, const char * const key_s)
+{
+	APRCacheCodecContexts *contexts_p = GetContexts ();
+	bool success_flag = false;
+
+	if (contexts_p)
+		{
+			BZ2Allocator *allocator_p = contexts_p -> accc_bzip2_allocator_p;
+			const uint32 num_allocations = allocator_p -> bza_num_allocations;
+			const uint32 num_reuses = allocator_p -> bza_num_reuses;
+
+			success_flag = UncompressFromBZ2 (src_p, src_length, dest_p, dest_length, allocator_p, key_s);
+
+			apr_atomic_add32 (&s_num_context_allocations, allocator_p -> bza_num_allocations - num_allocations);
+			apr_atomic_add32 (&s_num_context_reuses, allocator_p -> bza_num_reuses - num_reuses);
+		}
+	else
+		{
+			success_flag = UncompressFromBZ2 (src_p, src_length, dest_p, dest_length, NULL, key_s);
+		}
+
+	return success_flag;
+}
+#endif
+
+
+/*
+ * Get the calling thread's contexts, creating them the first time
+ * that the thread needs them. The contexts are freed when the thread
+ * exits.
+ */
+static APRCacheCodecContexts *GetContexts (void)
+{
+	APRCacheCodecContexts *contexts_p = NULL;
+
+	if (s_contexts_key_p)
+		{
+			void *data_p = NULL;
+
+			if (apr_threadkey_private_get (&data_p, s_contexts_key_p) == APR_SUCCESS)
+				{
+					contexts_p = (APRCacheCodecContexts *) data_p;
+
+					if (!contexts_p)
+						{
+							bool success_flag = true;
+
+							contexts_p = (APRCacheCodecContexts *) AllocMemory (sizeof (APRCacheCodecContexts));
+
+							if (contexts_p)
+								{
+									memset (contexts_p, 0, sizeof (APRCacheCodecContexts));
+
+									#ifdef USE_LZ4
+									if (success_flag)
+										{
+											contexts_p -> accc_lz4_state_p = AllocMemory (LZ4_sizeofState ());
+											success_flag = (contexts_p -> accc_lz4_state_p != NULL);
+										}
+									#endif
+
+									#ifdef USE_ZSTD
+									if (success_flag)
+										{
+											contexts_p -> accc_zstd_compress_p = ZSTD_createCCtx ();
+											contexts_p -> accc_zstd_decompress_p = ZSTD_createDCtx ();
+											success_flag = (contexts_p -> accc_zstd_compress_p != NULL) && (contexts_p -> accc_zstd_decompress_p != NULL);
+										}
+									#endif
+
+									#ifdef USE_BZIP2
+									if (success_flag)
+										{
+											contexts_p -> accc_bzip2_allocator_p = AllocateBZ2Allocator ();
+											success_flag = (contexts_p -> accc_bzip2_allocator_p != NULL);
+										}
+									#endif
+
+									if (success_flag)
+										{
+											success_flag = (apr_threadkey_private_set (contexts_p, s_contexts_key_p) == APR_SUCCESS);
+										}
+
+									if (!success_flag)
+										{
+											PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set up the compression contexts for this thread");
+
+											FreeContexts (contexts_p);
+											contexts_p = NULL;
+										}
+								}
+						}
+				}
+		}
+
+	return contexts_p;
+}
+
+
+static void FreeContexts (void *data_p)
+{
+	APRCacheCodecContexts *contexts_p = (APRCacheCodecContexts *) data_p;
+
+	if (contexts_p)
+		{
+			#ifdef USE_LZ4
+			if (contexts_p -> accc_lz4_state_p)
+				{
+					FreeMemory (contexts_p -> accc_lz4_state_p);
+				}
+			#endif
+
+			#ifdef USE_ZSTD
+			if (contexts_p -> accc_zstd_compress_p)
+				{
+					ZSTD_freeCCtx (contexts_p -> accc_zstd_compress_p);
+				}
+
+			if (contexts_p -> accc_zstd_decompress_p)
+				{
+					ZSTD_freeDCtx (contexts_p -> accc_zstd_decompress_p);
+				}
+			#endif
+
+			#ifdef USE_BZIP2
+			if (contexts_p -> accc_bzip2_allocator_p)
+				{
+					FreeBZ2Allocator (contexts_p -> accc_bzip2_allocator_p);
+				}
+			#endif
+
+			FreeMemory (contexts_p);
+		}
+}
+
+
+static apr_status_t DeleteContextsKey (void *data_p)
+{
+	if (s_contexts_key_p)
+		{
+			apr_threadkey_private_delete (s_contexts_key_p);
+			s_contexts_key_p = NULL;
+		}
+
+	return APR_SUCCESS;
+}
+
+
+#if defined USE_LZ4 || defined USE_ZSTD
+static void CountContextUse (const bool allocated_flag)
+{
+	if (allocated_flag)
+		{
+			apr_atomic_inc32 (&s_num_context_allocations);
+		}
+	else
+		{
+			apr_atomic_inc32 (&s_num_context_reuses);
+		}
+}
+#endif
+
+
+#ifdef USE_ZSTD
+static apr_status_t FreeZstdDictionary (void *data_p)
+{
+	if (s_zstd_compress_dictionary_p)
+		{
+			ZSTD_freeCDict (s_zstd_compress_dictionary_p);
+			s_zstd_compress_dictionary_p = NULL;
+		}
+
+	if (s_zstd_decompress_dictionary_p)
+		{
+			ZSTD_freeDDict (s_zstd_decompress_dictionary_p);
+			s_zstd_decompress_dictionary_p = NULL;
+		}
+
+	return APR_SUCCESS;
+}
+#endif
@@ -37,11 +37,6 @@
 #include "grassroots_server.h"
 
 
-#ifdef USE_BZIP2
-#include "bzip2_util.h"
-#endif
-
-
 #ifdef _DEBUG
 #define APR_SERVERS_MANAGER_DEBUG	(STM_LEVEL_FINEST)
 #else
@@ -64,7 +59,7 @@ static ExternalServer *GetExternalServerFromAprServersManager (ServersManager *m
 static ExternalServer *RemoveExternalServerFromAprServersManager (ServersManager *manager_p, const char * const server_uri_s, ExternalServer *(*deserialise_fn) (const unsigned char *data_p));
 
 
-static ExternalServer *QueryExternalServerFromAprServersManager (ServersManager *jobs_manager_p, const char * const server_uri_s, ExternalServer *(*deserialise_fn) (const unsigned char *data_p), void *(*storage_callback_fn) (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length));
+static ExternalServer *QueryExternalServerFromAprServersManager (ServersManager *jobs_manager_p, const char * const server_uri_s, ExternalServer *(*deserialise_fn) (const unsigned char *data_p), void *(*storage_callback_fn) (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned int *value_length_p));
 
 
 static LinkedList *GetAllExternalServersFromAprServersManager (ServersManager *servers_manager_p, ExternalServer *(*deserialise_fn) (const unsigned char *data_p));
@@ -88,31 +83,31 @@ APRServersManager *AllocateAPRServersManager (server_rec *server_p, const char *
 
 	if (manager_p)
 		{
-			unsigned char *(*compress_fn) (unsigned char *src_s, const unsigned int src_length, unsigned int *dest_length_p, const char * const key_s) = NULL;
-			unsigned char *(*decompress_fn) (unsigned char *src_s, const unsigned int src_length, unsigned int *dest_length_p, const char * const key_s) = NULL;
+			GrassrootsLocationConfig *config_p = ap_get_module_config (server_p -> module_config, GetGrassrootsModule ());
 			APRGlobalStorage *storage_p = NULL;
 
-			#ifdef USE_BZIP2
-			compress_fn  = CompressToBZ2;
-			decompress_fn  = UncompressFromBZ2;
-			#endif
-
-
 			storage_p = AllocateAPRGlobalStorage (pool_p,
-																						HashUUIDForAPR,
+																						NULL,
 																						NULL,
 																						FreeAPRExternalServer,
 																						server_p,
 																						s_mutex_filename_s,
 																						id_s,
 																						provider_name_s,
-																						compress_fn,
-																						decompress_fn);
+																						config_p -> glc_cache_codec_p,
+																						1);
 
 			if (storage_p)
 				{
 					manager_p -> asm_store_p = storage_p;
 
+					if ((config_p -> glc_cache_compress_min_length >= 0) || (config_p -> glc_cache_compress_min_saving >= 0))
+						{
+							SetAPRGlobalStorageCompressionThresholds (storage_p,
+																												(config_p -> glc_cache_compress_min_length >= 0) ? (uint32) (config_p -> glc_cache_compress_min_length) : storage_p -> ags_min_compress_length,
+																												(config_p -> glc_cache_compress_min_saving >= 0) ? (uint32) (config_p -> glc_cache_compress_min_saving) : storage_p -> ags_min_compress_saving);
+						}
+
 					InitServersManager (& (manager_p -> asm_base_manager),
 					                    AddExternalServerToAprServersManager,
 					                    GetExternalServerFromAprServersManager,
@@ -290,7 +285,7 @@ static ExternalServer *RemoveExternalServerFromAprServersManager (ServersManager
 }
 
 
-static ExternalServer *QueryExternalServerFromAprServersManager (ServersManager *server_manager_p, const char * const server_uri_s, ExternalServer *(*deserialise_fn) (const unsigned char *data_p), void *(*storage_callback_fn) (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length))
+static ExternalServer *QueryExternalServerFromAprServersManager (ServersManager *server_manager_p, const char * const server_uri_s, ExternalServer *(*deserialise_fn) (const unsigned char *data_p), void *(*storage_callback_fn) (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned int *value_length_p))
 {
 	APRServersManager *manager_p = (APRServersManager *) server_manager_p;
 	ExternalServer *server_p = NULL;
@@ -301,7 +296,7 @@ static ExternalServer *QueryExternalServerFromAprServersManager (ServersManager
 	#endif
 
 
-	value_p = storage_callback_fn (manager_p -> asm_store_p, server_uri_s, strlen (server_uri_s));
+	value_p = storage_callback_fn (manager_p -> asm_store_p, server_uri_s, strlen (server_uri_s), NULL);
 
 	if (value_p)
 		{
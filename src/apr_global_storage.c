@@ -20,6 +20,21 @@
  *      Author: tyrrells
  */
 
+#include <ctype.h>
+#include <errno.h>
+
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <pthread.h>
+#endif
+
+#ifdef __linux__
+	#include <limits.h>
+	#include <time.h>
+	#include <sys/syscall.h>
+	#include <linux/futex.h>
+#endif
+
 #include "apr_global_storage.h"
 
 #include "memory_allocations.h"
@@ -29,18 +44,500 @@
 #include "string_utils.h"
 #include "util_mutex.h"
 #include "filesystem_utils.h"
+#include "http_config.h"
+#include "apr_strings.h"
 
 #include "uuid_util.h"
 
+#include "apr_native_cache.h"
+#include "apr_thread_buffers.h"
+
 #ifdef _DEBUG
 #define APR_GLOBAL_STORAGE_DEBUG	(STM_LEVEL_FINEST)
 #else
 #define APR_GLOBAL_STORAGE_DEBUG	(STM_LEVEL_NONE)
 #endif
 
-static void *FindObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, const bool remove_flag);
 
-static char *GetKeyAsValidString (char *raw_key_p, unsigned int key_length, bool *alloc_key_flag);
+/*
+ * Reader/writer locks can only be used across the httpd
+ * processes if they can live in shared memory.
+ */
+#if defined (_POSIX_THREAD_PROCESS_SHARED) && (_POSIX_THREAD_PROCESS_SHARED > 0)
+	#define AGS_HAVE_SHARED_RWLOCKS (1)
+#else
+	#define AGS_HAVE_SHARED_RWLOCKS (0)
+#endif
+
+
+/*
+ * Threads waiting for the generations to change can sleep on them
+ * directly if they are futexes, as the shared memory is mapped into
+ * every httpd process. Elsewhere the waiters poll.
+ */
+#ifdef __linux__
+	#define AGS_HAVE_FUTEXES (1)
+#else
+	#define AGS_HAVE_FUTEXES (0)
+#endif
+
+
+/*
+ * The states of the shared reader/writer locks. Whichever
+ * process uses them first initialises them.
+ */
+#define AGS_RWLOCKS_UNINITIALISED (0)
+#define AGS_RWLOCKS_INITIALISING (1)
+#define AGS_RWLOCKS_READY (2)
+#define AGS_RWLOCKS_FAILED (3)
+
+
+/**
+ * Entries up to this size are copied into a buffer on the
+ * stack by ReadObjectFromAPRGlobalStorage rather than the heap.
+ */
+#define AGS_STACK_ENTRY_SIZE (4096)
+
+
+/**
+ * The size of the buffer used to print a key in the log messages.
+ * This is big enough to hold a UUID or 32 bytes of any other binary
+ * key in hexadecimal.
+ */
+#define AGS_KEY_BUFFER_SIZE (72)
+
+
+/**
+ * The number of buckets used to track the sizes of the
+ * stored entries.
+ */
+#define AGS_NUM_SIZE_BUCKETS (4096)
+
+
+/**
+ * The number of named counters that can be in use at once.
+ */
+#define AGS_NUM_COUNTERS (1024)
+
+
+/**
+ * The size of the buffer for a counter's name, including
+ * its terminating '\0'.
+ */
+#define AGS_COUNTER_NAME_SIZE (128)
+
+
+/**
+ * The version of the APRGlobalStorageEntryHeader layout.
+ */
+#define AGS_ENTRY_HEADER_VERSION (3)
+
+
+/**
+ * How long after an entry has expired that the shared object cache
+ * will keep it for. This gives the sweeper the chance to remove it
+ * explicitly rather than leaving the provider to reclaim the space
+ * whenever it gets round to it.
+ */
+#define AGS_DEFAULT_EXPIRY_GRACE_PERIOD (apr_time_from_sec (60))
+
+
+/**
+ * The maximum number of expired entries that the sweeper removes
+ * each time that it locks a stripe.
+ */
+#define AGS_SWEEP_BATCH_SIZE (32)
+
+
+/**
+ * The maximum number of expired entries that the sweeper
+ * removes each time that it runs.
+ */
+#define AGS_SWEEP_MAX_ENTRIES (1024)
+
+
+/**
+ * How often the sweeper thread checks whether it has been
+ * asked to stop.
+ */
+#define AGS_SWEEPER_POLL_INTERVAL (apr_time_from_sec (1))
+
+
+/**
+ * The maximum number of entries that are evicted in one go
+ * when the storage is full.
+ */
+#define AGS_EVICTION_BATCH_SIZE (32)
+
+
+/**
+ * The maximum number of batches that are evicted whilst
+ * trying to make room for a new entry.
+ */
+#define AGS_MAX_EVICTION_PASSES (4)
+
+
+/**
+ * By default, values shorter than this are stored uncompressed
+ * as compressing them would save little, if anything.
+ */
+#define AGS_DEFAULT_MIN_COMPRESS_LENGTH (128)
+
+
+/**
+ * By default, the compressed form of a value is only kept if it
+ * is at least this percentage smaller than the original. Anything
+ * less isn't worth the cost of decompressing it on every read.
+ */
+#define AGS_DEFAULT_MIN_COMPRESS_SAVING (10)
+
+
+/**
+ * The entry was not compressed as it is shorter than
+ * ags_min_compress_length.
+ */
+#define AGS_ENTRY_FLAG_BELOW_THRESHOLD (1)
+
+
+/**
+ * The entry was not compressed as the compressed form
+ * was not at least ags_min_compress_saving percent smaller.
+ */
+#define AGS_ENTRY_FLAG_INCOMPRESSIBLE (2)
+
+
+/**
+ * The codec failed to compress the entry, so it was
+ * stored as it was.
+ */
+#define AGS_ENTRY_FLAG_COMPRESS_FAILED (4)
+
+
+/*
+ * Every value is stored with this header in front of it so that
+ * when it is retrieved we know exactly how much memory is needed
+ * for it without having to guess.
+ */
+typedef struct APRGlobalStorageEntryHeader
+{
+	/** The length of the value as it was given to AddObjectToAPRGlobalStorage. */
+	uint32 ageh_value_length;
+
+	/** The length of the payload that follows this header. */
+	uint32 ageh_stored_length;
+
+	/** The version of this header. */
+	uint16 ageh_version;
+
+	/** The APRCacheCodecId of the codec that the payload was compressed with. */
+	uint8 ageh_codec;
+
+	/**
+	 * If ageh_codec is ACC_NONE, the AGS_ENTRY_FLAG_* value giving
+	 * the reason that the payload was stored uncompressed.
+	 */
+	uint8 ageh_flags;
+
+	/** The time that this entry expires or 0 if it never does. */
+	apr_time_t ageh_expiry;
+} APRGlobalStorageEntryHeader;
+
+
+/*
+ * The space used by the entries in a stripe.
+ */
+typedef struct APRGlobalStorageStripeUsage
+{
+	volatile apr_uint32_t agssu_num_entries;
+
+	/** The bytes used by the entries as stored, so including any compression. */
+	volatile apr_uint64_t agssu_stored_bytes;
+
+	/** The bytes used by the entries' values before compression. */
+	volatile apr_uint64_t agssu_value_bytes;
+} APRGlobalStorageStripeUsage;
+
+
+/*
+ * A named counter used by AcquireAPRGlobalStorageCounter. These are
+ * only read or changed whilst holding ags_counters_mutex_p.
+ */
+typedef struct APRGlobalStorageCounter
+{
+	/** The counter's name or an empty string if this slot is free. */
+	char agsc_name_s [AGS_COUNTER_NAME_SIZE];
+
+	/** The hash of agsc_name_s, which gives the slot that the counter belongs in. */
+	apr_uint32_t agsc_hash;
+
+	/** The counter's value. A counter is freed when this drops to 0. */
+	apr_uint32_t agsc_value;
+} APRGlobalStorageCounter;
+
+
+/*
+ * The data that is shared between all of the httpd processes
+ * using an APRGlobalStorage.
+ */
+typedef struct APRGlobalStorageSharedData
+{
+	/**
+	 * The size of the largest entry stored for the keys
+	 * that hash into each bucket. A lookup only needs to
+	 * allocate the size for its own bucket rather than the
+	 * size of the largest entry stored for any key.
+	 * The buckets are split evenly between the stripes, see
+	 * GetEntrySizeBucket (), so each one is only changed
+	 * whilst its stripe is locked exclusively.
+	 */
+	volatile apr_uint32_t agssd_bucket_sizes [AGS_NUM_SIZE_BUCKETS];
+
+	/**
+	 * The generation of the entries for the keys that hash
+	 * into each bucket. This is incremented every time that
+	 * one of these entries is added or removed so that the
+	 * local caches can tell if their copies are out of date.
+	 */
+	volatile apr_uint32_t agssd_generations [AGS_NUM_SIZE_BUCKETS];
+
+	/**
+	 * The number of threads, in all of the processes, waiting for each
+	 * bucket's generation to change. The waiters are only woken when
+	 * this is non-zero so that changes cost nothing extra otherwise.
+	 */
+	volatile apr_uint32_t agssd_generation_waiters [AGS_NUM_SIZE_BUCKETS];
+
+	/**
+	 * Incremented along with any of the generations, so that a thread
+	 * can wait for changes to the entries in different buckets.
+	 */
+	volatile apr_uint32_t agssd_sequence;
+
+	/** The number of threads waiting for agssd_sequence to change. */
+	volatile apr_uint32_t agssd_sequence_waiters;
+
+	/**
+	 * The last time that any process swept the expired entries
+	 * so that only one of them does so each sweep interval.
+	 */
+	volatile apr_uint64_t agssd_last_sweep_time;
+
+	/**
+	 * The number of entries and bytes in each stripe. These are
+	 * only changed whilst the stripe is locked exclusively.
+	 */
+	APRGlobalStorageStripeUsage agssd_stripe_usage [APR_GLOBAL_STORAGE_MAX_NUM_STRIPES];
+
+	/**
+	 * The time, in seconds, that the entries for the keys that hash
+	 * into each bucket were last used. This is what the least
+	 * recently used eviction policy goes by.
+	 */
+	volatile apr_uint32_t agssd_access_times [AGS_NUM_SIZE_BUCKETS];
+
+	/** The number of entries that have been evicted to make room for others. */
+	volatile apr_uint32_t agssd_num_evictions;
+
+	/** The number of entries that the provider dropped without them being removed. */
+	volatile apr_uint32_t agssd_num_lost;
+
+	/** The number of new entries that were refused as the storage was full. */
+	volatile apr_uint32_t agssd_num_rejections;
+
+	/**
+	 * The named counters used by AcquireAPRGlobalStorageCounter. Each
+	 * counter is in the first free slot from the one that its name
+	 * hashes to, so names with the same hash still get their own ones.
+	 */
+	APRGlobalStorageCounter agssd_counters [AGS_NUM_COUNTERS];
+
+#if AGS_HAVE_SHARED_RWLOCKS == 1
+	/** One of the AGS_RWLOCKS_ values. */
+	volatile apr_uint32_t agssd_rwlocks_state;
+
+	/** The reader/writer locks, one per stripe, used by AGS_LM_SHARED_READS. */
+	pthread_rwlock_t agssd_rwlocks [APR_GLOBAL_STORAGE_MAX_NUM_STRIPES];
+#endif
+} APRGlobalStorageSharedData;
+
+
+/*
+ * The expired entries found in a stripe by the sweeper.
+ */
+typedef struct APRGlobalStorageSweep
+{
+	apr_time_t agss_now;
+
+	uint32 agss_num_keys;
+
+	uint32 agss_max_keys;
+
+	unsigned char *agss_keys [AGS_SWEEP_BATCH_SIZE];
+
+	unsigned int agss_key_lengths [AGS_SWEEP_BATCH_SIZE];
+
+	unsigned int agss_entry_lengths [AGS_SWEEP_BATCH_SIZE];
+
+	unsigned int agss_value_lengths [AGS_SWEEP_BATCH_SIZE];
+
+	/**
+	 * The values of the entries to pass to the storage's removal
+	 * callback, with NULL for the ones that it doesn't want.
+	 */
+	unsigned char *agss_values [AGS_SWEEP_BATCH_SIZE];
+
+	unsigned int agss_copied_value_lengths [AGS_SWEEP_BATCH_SIZE];
+
+	APRGlobalStorage *agss_storage_p;
+} APRGlobalStorageSweep;
+
+
+/*
+ * An entry that could be evicted to make room for others.
+ */
+typedef struct APRGlobalStorageEvictionCandidate
+{
+	unsigned char *agsec_key_p;
+
+	unsigned int agsec_key_length;
+
+	uint32 agsec_stripe;
+
+	/** Candidates with lower scores are evicted first. */
+	apr_time_t agsec_score;
+} APRGlobalStorageEvictionCandidate;
+
+
+/*
+ * The best candidates for eviction found so far.
+ */
+typedef struct APRGlobalStorageEviction
+{
+	APRGlobalStorage *agse_storage_p;
+
+	uint32 agse_stripe;
+
+	uint32 agse_num_candidates;
+
+	APRGlobalStorageEvictionCandidate agse_candidates [AGS_EVICTION_BATCH_SIZE];
+} APRGlobalStorageEviction;
+
+
+/*
+ * The entries counted in a stripe whilst checking its usage.
+ */
+typedef struct APRGlobalStorageStripeCount
+{
+	APRGlobalStorage *agssc_storage_p;
+
+	/**
+	 * The size of the largest entry found for each of
+	 * the stripe's size buckets.
+	 */
+	uint32 *agssc_bucket_sizes_p;
+
+	uint32 agssc_num_entries;
+
+	apr_uint64_t agssc_stored_bytes;
+
+	apr_uint64_t agssc_value_bytes;
+} APRGlobalStorageStripeCount;
+
+
+/*
+ * A value held in the local cache. The key and value are
+ * stored in the same allocation, directly after this.
+ */
+typedef struct APRGlobalStorageLocalEntry
+{
+	struct APRGlobalStorageLocalEntry *agsle_prev_p;
+	struct APRGlobalStorageLocalEntry *agsle_next_p;
+
+	unsigned char *agsle_key_p;
+	unsigned int agsle_key_length;
+
+	unsigned char *agsle_value_p;
+	unsigned int agsle_value_length;
+
+	/** The bucket generation when the value was retrieved. */
+	apr_uint32_t agsle_generation;
+
+	/** The time that the value expires or 0 if it never does. */
+	apr_time_t agsle_expiry;
+} APRGlobalStorageLocalEntry;
+
+
+/*
+ * The per-process cache of recently retrieved values, kept
+ * in least recently used order.
+ */
+typedef struct APRGlobalStorageLocalCache
+{
+	apr_thread_mutex_t *agslc_mutex_p;
+
+	apr_hash_t *agslc_entries_p;
+
+	/** The most recently used entry. */
+	APRGlobalStorageLocalEntry *agslc_head_p;
+
+	/** The least recently used entry. */
+	APRGlobalStorageLocalEntry *agslc_tail_p;
+
+	apr_size_t agslc_current_bytes;
+
+	apr_size_t agslc_max_bytes;
+} APRGlobalStorageLocalCache;
+
+
+/*
+ * The details for each of the keys used by
+ * GetObjectsFromAPRGlobalStorage and AddObjectsToAPRGlobalStorage.
+ */
+typedef struct APRGlobalStorageBatchItem
+{
+	unsigned char *agsbi_key_p;
+	unsigned int agsbi_key_length;
+
+	char agsbi_key_s [AGS_KEY_BUFFER_SIZE];
+
+	uint32 agsbi_hash;
+	uint32 agsbi_stripe;
+
+	/** The bucket generation read before the value was retrieved. */
+	apr_uint32_t agsbi_generation;
+
+	/** The stored entry, including its header. */
+	unsigned char *agsbi_entry_p;
+	unsigned int agsbi_entry_length;
+
+	/** The value, which is either within agsbi_entry_p or a separate allocation. */
+	unsigned char *agsbi_value_p;
+	unsigned int agsbi_value_length;
+	bool agsbi_alloc_value_flag;
+
+	/** The time that the entry expires or 0 if it never does. */
+	apr_time_t agsbi_expiry;
+
+	bool agsbi_success_flag;
+} APRGlobalStorageBatchItem;
+
+
+/*
+ * Used to strip the entry headers from the values when iterating
+ * over the underlying shared object cache.
+ */
+typedef struct APRGlobalStorageIterator
+{
+	APRGlobalStorage *agsi_storage_p;
+	APRGlobalStorageKeyFilter agsi_filter_fn;
+	ap_socache_iterator_t *agsi_iterator_fn;
+	void *agsi_data_p;
+} APRGlobalStorageIterator;
+
+
+static void *FindObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, const bool remove_flag, unsigned int *value_length_p);
+
+static const char *FormatStorageKey (const unsigned char *key_p, const unsigned int key_length, char *buffer_s);
 
 static apr_status_t IterateOverSOCache (ap_socache_instance_t *instance,
     server_rec *s,
@@ -52,754 +549,4240 @@ static apr_status_t IterateOverSOCache (ap_socache_instance_t *instance,
     apr_pool_t *pool);
 
 
-static bool SetLargestEntrySize (APRGlobalStorage *storage_p, const unsigned int size);
+static apr_status_t IterateOverEntries (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p);
+
+
+static void SetEntrySizeHint (APRGlobalStorage *storage_p, const uint32 hash, const unsigned int size);
+
+static uint32 GetEntrySizeHint (APRGlobalStorage *storage_p, const uint32 hash);
+
+static uint32 GetEntrySizeBucket (const APRGlobalStorage *storage_p, const uint32 hash);
+
+
+static apr_status_t RetrieveStorageEntry (APRGlobalStorage *storage_p, ap_socache_instance_t *instance_p, const unsigned char *key_p, const unsigned int key_len, const uint32 hash, unsigned char *entry_p, unsigned int *entry_length_p, unsigned char **larger_entry_pp);
+
+
+static unsigned char *CreateStorageEntry (APRGlobalStorage *storage_p, unsigned char *value_p, const unsigned int value_length, const apr_time_t expiry, APRThreadBuffer *buffer_p, unsigned int *entry_length_p, const char * const key_s);
+
+
+static bool ReadStorageEntryHeader (const unsigned char *entry_p, const unsigned int entry_length, APRGlobalStorageEntryHeader *header_p);
+
+
+static unsigned char *DecodeStorageEntry (APRGlobalStorage *storage_p, unsigned char *entry_p, const unsigned int entry_length, unsigned int *value_length_p, apr_time_t *expiry_p, const char * const key_s);
+
+
+static bool GetStorageEntryValue (APRGlobalStorage *storage_p, unsigned char *entry_p, const unsigned int entry_length, unsigned char **value_pp, unsigned int *value_length_p, bool *alloc_value_flag_p, apr_time_t *expiry_p, const char * const key_s);
+
+
+static bool UnpackStorageEntryValue (APRGlobalStorage *storage_p, const APRGlobalStorageEntryHeader *header_p, unsigned char *payload_p, unsigned char **value_pp, unsigned int *value_length_p, bool *alloc_value_flag_p, const char * const key_s);
+
+
+static unsigned char *CopyRemovedEntryValue (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len, const unsigned char *entry_p, const unsigned int entry_length, unsigned int *value_length_p);
+
+
+static APRGlobalStorageBatchItem *PrepareBatchItems (APRGlobalStorage *storage_p, const void * const *raw_keys_pp, const unsigned int *raw_key_lengths_p, const uint32 num_keys);
+
+
+static void FreeBatchItems (APRGlobalStorageBatchItem *items_p, const void * const *raw_keys_pp, const uint32 num_keys);
+
+
+static unsigned char *RetrieveBatchItems (APRGlobalStorage *storage_p, APRGlobalStorageBatchItem *items_p, const uint32 num_keys);
+
+
+static void **PackBatchValues (APRGlobalStorage *storage_p, APRGlobalStorageBatchItem *items_p, const uint32 num_keys, unsigned int *value_lengths_p);
+
+
+static apr_uint32_t GetEntryGeneration (APRGlobalStorage *storage_p, const uint32 hash);
+
+
+static void IncrementEntryGeneration (APRGlobalStorage *storage_p, const uint32 hash);
+
+static unsigned char *GetObjectKey (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned int *key_len_p);
+
+static void WakeSharedValueWaiters (volatile apr_uint32_t *value_p, volatile apr_uint32_t *num_waiters_p);
+
+static bool IsSharedCounterNameValid (const char *name_s);
+
+static APRGlobalStorageCounter *FindSharedCounter (APRGlobalStorage *storage_p, const char *name_s, const bool create_flag);
+
+static void FreeSharedCounter (APRGlobalStorage *storage_p, APRGlobalStorageCounter *counter_p);
+
+static apr_status_t WaitForSharedValueChange (volatile apr_uint32_t *value_p, volatile apr_uint32_t *num_waiters_p, const apr_uint32_t value, const apr_interval_time_t timeout);
+
+
+static apr_time_t GetEntryExpiry (const APRGlobalStorage *storage_p, apr_interval_time_t ttl);
+
+
+static apr_time_t GetProviderExpiry (const APRGlobalStorage *storage_p, const apr_time_t expiry);
+
+
+static bool IsEntryExpired (const apr_time_t expiry, const apr_time_t now);
+
+
+static uint32 SweepAPRGlobalStorageStripe (APRGlobalStorage *storage_p, const uint32 stripe, const uint32 max_entries, apr_pool_t *pool_p, bool *more_flag_p);
+
+
+static apr_status_t CollectExpiredEntry (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p);
+
+
+static bool ClaimSweep (APRGlobalStorage *storage_p, const apr_time_t now);
+
+
+static void * APR_THREAD_FUNC RunSweeper (apr_thread_t *thread_p, void *data_p);
+
+
+static apr_status_t StopSweeperOnCleanup (void *data_p);
+
+
+static void UpdateStripeUsage (APRGlobalStorage *storage_p, const uint32 stripe, const apr_int32_t num_entries, const apr_int64_t stored_bytes, const apr_int64_t value_bytes);
+
+
+static apr_uint64_t GetStoredBytes (const APRGlobalStorage *storage_p);
+
+
+static bool HasCapacityFor (const APRGlobalStorage *storage_p, const apr_uint64_t num_bytes);
+
+
+static bool GetStoredEntryLengths (APRGlobalStorage *storage_p, ap_socache_instance_t *instance_p, const unsigned char *key_p, const unsigned int key_len, const uint32 hash, unsigned int *entry_length_p, unsigned int *value_length_p, apr_time_t *expiry_p, unsigned char **removed_value_pp, unsigned int *removed_value_length_p, apr_pool_t *pool_p);
+
+
+static apr_status_t StoreStorageEntry (APRGlobalStorage *storage_p, ap_socache_instance_t *instance_p, const unsigned char *key_p, const unsigned int key_len, const apr_time_t expiry, unsigned char *entry_p, const unsigned int entry_length, bool *replaced_flag_p, unsigned int *old_entry_length_p, unsigned int *old_value_length_p);
+
+
+static bool IsUsageExact (const APRGlobalStorage *storage_p);
+
+
+static void TouchEntry (APRGlobalStorage *storage_p, const uint32 hash);
+
+
+static void RejectEntry (APRGlobalStorage *storage_p, const unsigned int entry_length, const char * const key_s);
+
+
+static uint32 MakeRoomInAPRGlobalStorage (APRGlobalStorage *storage_p, const apr_uint64_t num_bytes);
+
+
+static apr_status_t CollectEvictionCandidate (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p);
+
+
+static int CompareEvictionCandidates (const void *v0_p, const void *v1_p);
+
+
+static bool EvictEntry (APRGlobalStorage *storage_p, const APRGlobalStorageEvictionCandidate *candidate_p);
+
+
+static void ReconcileAPRGlobalStorageUsage (APRGlobalStorage *storage_p, apr_pool_t *pool_p);
+
+
+static apr_status_t CountStoredEntry (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p);
+
+
+static unsigned char *GetFromLocalCache (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len, const apr_uint32_t generation, unsigned int *value_length_p);
+
+
+static void AddToLocalCache (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len, const apr_uint32_t generation, const apr_time_t expiry, const unsigned char *value_p, const unsigned int value_length);
+
+
+static bool ReadFromLocalCache (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len, const apr_uint32_t generation, APRGlobalStorageReader reader_fn, void *reader_data_p, bool *reader_result_p);
+
+
+static APRGlobalStorageLocalEntry *FindLocalEntry (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len, const apr_uint32_t generation);
+
+
+static bool RunReader (APRGlobalStorage *storage_p, APRGlobalStorageReader reader_fn, const unsigned char *value_p, const unsigned int value_length, void *reader_data_p);
+
+static void RecordLockHold (APRGlobalStorage *storage_p, const apr_time_t locked_at);
+
+static void RecordElapsedTime (const apr_time_t start, volatile apr_uint32_t *count_p, volatile apr_uint64_t *total_p, volatile apr_uint32_t *max_p);
+
+
+static void RemoveFromLocalCache (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len);
+
+
+static void UnlinkLocalEntry (APRGlobalStorageLocalCache *cache_p, APRGlobalStorageLocalEntry *entry_p);
+
+
+static void ClearLocalCache (APRGlobalStorageLocalCache *cache_p);
+
+
+static uint32 GetAPRGlobalStorageKeyHash (const APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len);
+
+
+static bool CreateStripeMutexes (APRGlobalStorage *storage_p, const char *mutex_filename_s, apr_pool_t *pool_p);
+
+
+static void DestroyStripeMutexes (APRGlobalStorage *storage_p);
+
+
+static uint32 GetAPRGlobalStorageStripe (const APRGlobalStorage *storage_p, const uint32 hash);
+
+
+static apr_status_t LockAPRGlobalStorageStripe (APRGlobalStorage *storage_p, const uint32 stripe, const bool exclusive_flag);
+
+
+static apr_status_t UnlockAPRGlobalStorageStripe (APRGlobalStorage *storage_p, const uint32 stripe);
+
+
+#if AGS_HAVE_SHARED_RWLOCKS == 1
+static bool InitSharedReadWriteLocks (APRGlobalStorageSharedData *shared_data_p);
+#endif
+
+
+static bool CreateSharedData (APRGlobalStorage *storage_p, apr_pool_t *pool_p);
+
+
+static apr_status_t DestroySharedDataOnCleanup (void *data_p);
+
+
+/***************************************************/
+
+
+APRGlobalStorage *AllocateAPRGlobalStorage (apr_pool_t *pool_p, apr_hashfunc_t hash_fn, unsigned char *(*make_key_fn) (const void *data_p, uint32 raw_key_length, uint32 *key_len_p), void (*free_key_and_value_fn) (unsigned char *key_p, void *value_p), server_rec *server_p, const char *mutex_filename_s, const char *cache_id_s, const char *provider_name_s,
+	const APRCacheCodec *codec_p,
+	uint32 num_stripes)
+{
+	APRGlobalStorage *store_p = (APRGlobalStorage *) AllocMemory (sizeof (APRGlobalStorage));
+
+	if (store_p)
+		{
+			memset (store_p, 0, sizeof (APRGlobalStorage));
+
+			if (InitAPRGlobalStorage (store_p, pool_p, hash_fn, make_key_fn, free_key_and_value_fn, server_p, mutex_filename_s, cache_id_s, provider_name_s, codec_p, num_stripes))
+				{
+					return store_p;
+				}
+
+			FreeAPRGlobalStorage (store_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate APRGlobalStorage");
+		}
+
+	return NULL;
+}
+
+
+bool InitAPRGlobalStorage (APRGlobalStorage *storage_p, apr_pool_t *pool_p, apr_hashfunc_t hash_fn, unsigned char *(*make_key_fn) (const void *data_p, uint32 raw_key_length, uint32 *key_len_p), void (*free_key_and_value_fn) (unsigned char *key_p, void *value_p), server_rec *server_p, const char *mutex_filename_s, const char *cache_id_s, const char *provider_name_s,
+	const APRCacheCodec *codec_p,
+	uint32 num_stripes)
+{
+	ap_socache_provider_t *provider_p = ap_lookup_provider (AP_SOCACHE_PROVIDER_GROUP, provider_name_s, AP_SOCACHE_PROVIDER_VERSION);
+
+	if (provider_p)
+		{
+			if (num_stripes < 1)
+				{
+					num_stripes = 1;
+				}
+			else if (num_stripes > APR_GLOBAL_STORAGE_MAX_NUM_STRIPES)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Reducing number of stripes for \"%s\" from " UINT32_FMT " to " UINT32_FMT, cache_id_s, num_stripes, APR_GLOBAL_STORAGE_MAX_NUM_STRIPES);
+					num_stripes = APR_GLOBAL_STORAGE_MAX_NUM_STRIPES;
+				}
+
+			storage_p -> ags_num_stripes = num_stripes;
+			storage_p -> ags_mutexes_pp = (apr_global_mutex_t **) apr_pcalloc (pool_p, num_stripes * sizeof (apr_global_mutex_t *));
+			storage_p -> ags_mutex_lock_filenames_ss = (const char **) apr_pcalloc (pool_p, num_stripes * sizeof (const char *));
+			storage_p -> ags_socache_instances_pp = (ap_socache_instance_t **) apr_pcalloc (pool_p, num_stripes * sizeof (ap_socache_instance_t *));
+
+			if (CreateStripeMutexes (storage_p, mutex_filename_s, pool_p))
+				{
+					/*
+					 * The shared data is created by PostConfigureGlobalStorage ()
+					 * so that each APRGlobalStorage gets its own zeroed segment.
+					 */
+					storage_p -> ags_entries_p = apr_hash_make_custom (pool_p, hash_fn);
+
+					if (storage_p -> ags_entries_p)
+						{
+							storage_p -> ags_pool_p = pool_p;
+							storage_p -> ags_server_p = server_p;
+							storage_p -> ags_hash_fn = hash_fn;
+							storage_p -> ags_make_key_fn = make_key_fn;
+							storage_p -> ags_free_key_and_value_fn = free_key_and_value_fn;
+
+							storage_p -> ags_cache_id_s = cache_id_s;
+							storage_p -> ags_shm_p = NULL;
+							storage_p -> ags_shm_pool_p = NULL;
+							storage_p -> ags_shared_data_p = NULL;
+							storage_p -> ags_mutex_lock_filename_s = mutex_filename_s;
+
+							storage_p -> ags_socache_provider_p = provider_p;
+							storage_p -> ags_lock_mode = AGS_LM_EXCLUSIVE;
+							storage_p -> ags_lock_free_reads_flag = IsNativeCacheProvider (provider_p);
+
+							apr_atomic_set32 (& (storage_p -> ags_num_lock_acquisitions), 0);
+							apr_atomic_set32 (& (storage_p -> ags_num_lock_contentions), 0);
+							apr_atomic_set32 (& (storage_p -> ags_num_lookups), 0);
+							apr_atomic_set64 (& (storage_p -> ags_lookup_bytes_allocated), 0);
+
+							storage_p -> ags_local_cache_p = NULL;
+							apr_atomic_set32 (& (storage_p -> ags_local_cache_hits), 0);
+							apr_atomic_set32 (& (storage_p -> ags_local_cache_misses), 0);
+							apr_atomic_set32 (& (storage_p -> ags_local_cache_invalidations), 0);
+
+							storage_p -> ags_default_ttl = 0;
+							storage_p -> ags_expiry_grace_period = AGS_DEFAULT_EXPIRY_GRACE_PERIOD;
+							storage_p -> ags_sweeper_thread_p = NULL;
+							storage_p -> ags_sweeper_pool_p = NULL;
+							storage_p -> ags_sweep_scratch_pool_p = NULL;
+							storage_p -> ags_sweep_interval = 0;
+							apr_atomic_set32 (& (storage_p -> ags_stop_sweeper), 0);
+							apr_atomic_set32 (& (storage_p -> ags_num_expired), 0);
+							storage_p -> ags_sweep_callback_fn = NULL;
+							storage_p -> ags_sweep_callback_data_p = NULL;
+							storage_p -> ags_removal_callback_fn = NULL;
+							storage_p -> ags_removal_filter_fn = NULL;
+							storage_p -> ags_removal_callback_data_p = NULL;
+
+							storage_p -> ags_capacity = 0;
+							storage_p -> ags_full_policy = AGS_FP_REJECT;
+							apr_atomic_set32 (& (storage_p -> ags_num_reads), 0);
+							apr_atomic_set32 (& (storage_p -> ags_max_read_time), 0);
+							apr_atomic_set64 (& (storage_p -> ags_total_read_time), 0);
+							apr_atomic_set32 (& (storage_p -> ags_num_lock_holds), 0);
+							apr_atomic_set32 (& (storage_p -> ags_max_lock_hold_time), 0);
+							apr_atomic_set64 (& (storage_p -> ags_total_lock_hold_time), 0);
+
+							storage_p -> ags_codec_p = codec_p;
+							storage_p -> ags_min_compress_length = AGS_DEFAULT_MIN_COMPRESS_LENGTH;
+							storage_p -> ags_min_compress_saving = AGS_DEFAULT_MIN_COMPRESS_SAVING;
+							apr_atomic_set32 (& (storage_p -> ags_num_compressed), 0);
+							apr_atomic_set32 (& (storage_p -> ags_num_stored_raw), 0);
+
+							apr_pool_cleanup_register (pool_p, storage_p, (const void *) FreeAPRGlobalStorage, apr_pool_cleanup_null);
+
+							return true;
+						}		/* if (storage_p -> ags_entries_p) */
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate shared memory hash table");
+						}
+
+					DestroyStripeMutexes (storage_p);
+				}		/* if (CreateStripeMutexes (storage_p, mutex_filename_s, pool_p)) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create global mutexes for shared memory at %s", mutex_filename_s);
+				}
+
+		}		/* if (provider_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to find provider \"%s\"", provider_name_s ? provider_name_s : "NULL");
+		}
+
+	return false;
+}
+
+
+apr_status_t FreeAPRGlobalStorage (void *data_p)
+{
+	APRGlobalStorage *storage_p = (APRGlobalStorage *) data_p;
+	DestroyAPRGlobalStorage (storage_p);
+	FreeMemory (storage_p);
+
+	return APR_SUCCESS;
+}
+
+
+void DestroyAPRGlobalStorage (APRGlobalStorage *storage_p)
+{
+	if (storage_p)
+		{
+			if (storage_p -> ags_sweeper_pool_p)
+				{
+					apr_pool_cleanup_kill (storage_p -> ags_sweeper_pool_p, storage_p, StopSweeperOnCleanup);
+					StopAPRGlobalStorageSweeper (storage_p);
+				}
+
+			if (storage_p -> ags_entries_p)
+				{
+					unsigned char *key_s = NULL;
+					apr_ssize_t keylen = 0;
+					void *value_p = NULL;
+					apr_hash_index_t *index_p =	apr_hash_first (storage_p -> ags_pool_p, storage_p -> ags_entries_p);
+
+					while (index_p)
+						{
+							apr_hash_this (index_p, (const void **) &key_s, &keylen, (void **) &value_p);
+
+							storage_p -> ags_free_key_and_value_fn (key_s, value_p);
+
+							index_p = apr_hash_next (index_p);
+						}
+
+					apr_hash_clear (storage_p -> ags_entries_p);
+				}
+
+			/*
+			 * The local cache's mutex belongs to ags_pool_p so
+			 * we only need to free the cached values.
+			 */
+			if (storage_p -> ags_local_cache_p)
+				{
+					ClearLocalCache (storage_p -> ags_local_cache_p);
+					storage_p -> ags_local_cache_p = NULL;
+				}
+
+			storage_p -> ags_pool_p = NULL;
+
+			DestroyStripeMutexes (storage_p);
+
+			if (storage_p -> ags_socache_instances_pp)
+				{
+					uint32 i;
+
+					for (i = 0; i < storage_p -> ags_num_stripes; ++ i)
+						{
+							ap_socache_instance_t *instance_p = * (storage_p -> ags_socache_instances_pp + i);
+
+							if (instance_p)
+								{
+									storage_p -> ags_socache_provider_p -> destroy (instance_p, storage_p -> ags_server_p);
+									* (storage_p -> ags_socache_instances_pp + i) = NULL;
+								}
+						}
+				}
+
+			if (storage_p -> ags_shm_p)
+				{
+					apr_pool_cleanup_run (storage_p -> ags_shm_pool_p, storage_p, DestroySharedDataOnCleanup);
+				}
+		}
+}
+
+
+bool SetAPRGlobalStorageLockMode (APRGlobalStorage *storage_p, APRGlobalStorageLockMode lock_mode)
+{
+	bool success_flag = false;
+
+	if (lock_mode == AGS_LM_SHARED_READS)
+		{
+			#if AGS_HAVE_SHARED_RWLOCKS == 1
+			if (!storage_p -> ags_shared_data_p)
+				{
+					/* The locks will be set up by PostConfigureGlobalStorage () */
+					storage_p -> ags_lock_mode = AGS_LM_SHARED_READS;
+					success_flag = true;
+				}
+			else if (InitSharedReadWriteLocks (storage_p -> ags_shared_data_p))
+				{
+					storage_p -> ags_lock_mode = AGS_LM_SHARED_READS;
+					success_flag = true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set up shared reader/writer locks for \"%s\", using exclusive locks", storage_p -> ags_cache_id_s);
+					storage_p -> ags_lock_mode = AGS_LM_EXCLUSIVE;
+				}
+			#else
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Process-shared reader/writer locks are not available on this platform, \"%s\" will use exclusive locks", storage_p -> ags_cache_id_s);
+			storage_p -> ags_lock_mode = AGS_LM_EXCLUSIVE;
+			#endif
+		}
+	else
+		{
+			storage_p -> ags_lock_mode = AGS_LM_EXCLUSIVE;
+			success_flag = true;
+		}
+
+	return success_flag;
+}
+
+
+bool EnableAPRGlobalStorageLocalCache (APRGlobalStorage *storage_p, apr_size_t max_bytes)
+{
+	APRGlobalStorageLocalCache *cache_p = (APRGlobalStorageLocalCache *) apr_pcalloc (storage_p -> ags_pool_p, sizeof (APRGlobalStorageLocalCache));
+
+	if (cache_p)
+		{
+			apr_status_t status = apr_thread_mutex_create (& (cache_p -> agslc_mutex_p), APR_THREAD_MUTEX_UNNESTED, storage_p -> ags_pool_p);
+
+			if (status == APR_SUCCESS)
+				{
+					cache_p -> agslc_entries_p = apr_hash_make (storage_p -> ags_pool_p);
+
+					if (cache_p -> agslc_entries_p)
+						{
+							cache_p -> agslc_max_bytes = max_bytes;
+							storage_p -> ags_local_cache_p = cache_p;
+
+							return true;
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate local cache table for \"%s\"", storage_p -> ags_cache_id_s);
+						}
+
+					apr_thread_mutex_destroy (cache_p -> agslc_mutex_p);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create local cache mutex for \"%s\", status %d", storage_p -> ags_cache_id_s, status);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate local cache for \"%s\"", storage_p -> ags_cache_id_s);
+		}
+
+	return false;
+}
+
+
+void GetAPRGlobalStorageLocalCacheCounts (APRGlobalStorage *storage_p, uint32 *hits_p, uint32 *misses_p, uint32 *invalidations_p)
+{
+	if (hits_p)
+		{
+			*hits_p = apr_atomic_read32 (& (storage_p -> ags_local_cache_hits));
+		}
+
+	if (misses_p)
+		{
+			*misses_p = apr_atomic_read32 (& (storage_p -> ags_local_cache_misses));
+		}
+
+	if (invalidations_p)
+		{
+			*invalidations_p = apr_atomic_read32 (& (storage_p -> ags_local_cache_invalidations));
+		}
+}
+
+
+unsigned int HashUUIDForAPR (const char *key_s, apr_ssize_t *len_p)
+{
+	unsigned int res = 0;
+
+	if (*len_p == UUID_RAW_SIZE)
+		{
+			apr_uint32_t words [UUID_RAW_SIZE / sizeof (apr_uint32_t)];
+
+			/*
+			 * The uuid may not be aligned, so copy it before splitting it into words
+			 * and then mix them so that every bit affects the lower ones that are
+			 * used to choose the stripes and buckets.
+			 */
+			memcpy (words, key_s, UUID_RAW_SIZE);
+
+			res = words [0] ^ words [1] ^ words [2] ^ words [3];
+			res ^= res >> 16;
+			res *= 0x85EBCA6B;
+			res ^= res >> 13;
+			res *= 0xC2B2AE35;
+			res ^= res >> 16;
+		}
+	else
+		{
+			res = apr_hashfunc_default (key_s, len_p);
+		}
+
+	return res;
+}
+
+
+void PrintAPRGlobalStorage (APRGlobalStorage *storage_p)
+{
+	uint32 i;
+
+	PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Begin iterating storage, " UINT32_FMT " stripes, " UINT32_FMT " lock acquisitions, " UINT32_FMT " contended",
+						storage_p -> ags_num_stripes,
+						apr_atomic_read32 (& (storage_p -> ags_num_lock_acquisitions)),
+						apr_atomic_read32 (& (storage_p -> ags_num_lock_contentions)));
+
+	PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, UINT32_FMT " lookups allocated %" APR_UINT64_T_FMT " bytes",
+						apr_atomic_read32 (& (storage_p -> ags_num_lookups)),
+						apr_atomic_read64 (& (storage_p -> ags_lookup_bytes_allocated)));
+
+	if (storage_p -> ags_local_cache_p)
+		{
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Local cache " UINT32_FMT " hits, " UINT32_FMT " misses, " UINT32_FMT " invalidations",
+								apr_atomic_read32 (& (storage_p -> ags_local_cache_hits)),
+								apr_atomic_read32 (& (storage_p -> ags_local_cache_misses)),
+								apr_atomic_read32 (& (storage_p -> ags_local_cache_invalidations)));
+		}
+
+	PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, UINT32_FMT " expired entries have been swept", apr_atomic_read32 (& (storage_p -> ags_num_expired)));
+
+	if (storage_p -> ags_shared_data_p)
+		{
+			APRGlobalStorageUsage usage;
+
+			GetAPRGlobalStorageUsage (storage_p, &usage);
+
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, UINT32_FMT " entries using %" APR_UINT64_T_FMT " bytes, %" APR_UINT64_T_FMT " uncompressed, capacity %" APR_UINT64_T_FMT ", " UINT32_FMT " evicted, " UINT32_FMT " lost, " UINT32_FMT " rejected",
+								usage.agsu_num_entries, usage.agsu_stored_bytes, usage.agsu_value_bytes, usage.agsu_capacity, usage.agsu_num_evictions, usage.agsu_num_lost, usage.agsu_num_rejections);
+		}
+
+	if (storage_p -> ags_codec_p)
+		{
+			uint32 num_allocations;
+			uint32 num_reuses;
+
+			GetAPRCacheCodecContextCounts (&num_allocations, &num_reuses);
+
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, UINT32_FMT " entries have been compressed with %s and " UINT32_FMT " stored uncompressed",
+								apr_atomic_read32 (& (storage_p -> ags_num_compressed)), storage_p -> ags_codec_p -> acc_name_s, apr_atomic_read32 (& (storage_p -> ags_num_stored_raw)));
+
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Compression with %s has allocated its state " UINT32_FMT " times and reused it " UINT32_FMT " times",
+								storage_p -> ags_codec_p -> acc_name_s, num_allocations, num_reuses);
+		}
+
+	PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, UINT32_FMT " reads took %" APR_UINT64_T_FMT " microseconds in total and the longest took " UINT32_FMT " microseconds",
+						apr_atomic_read32 (& (storage_p -> ags_num_reads)),
+						apr_atomic_read64 (& (storage_p -> ags_total_read_time)),
+						apr_atomic_read32 (& (storage_p -> ags_max_read_time)));
+
+	PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Stripes were held " UINT32_FMT " times for single entries for %" APR_UINT64_T_FMT " microseconds in total and the longest hold was " UINT32_FMT " microseconds",
+						apr_atomic_read32 (& (storage_p -> ags_num_lock_holds)),
+						apr_atomic_read64 (& (storage_p -> ags_total_lock_hold_time)),
+						apr_atomic_read32 (& (storage_p -> ags_max_lock_hold_time)));
+
+	for (i = 0; i < storage_p -> ags_num_stripes; ++ i)
+		{
+			storage_p -> ags_socache_provider_p -> iterate (* (storage_p -> ags_socache_instances_pp + i),
+																											storage_p -> ags_server_p,
+																											NULL,
+																											IterateOverSOCache,
+																											storage_p -> ags_pool_p);
+		}
+
+	PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "End iterating storage");
+}
+
+
+static apr_status_t IterateOverSOCache (ap_socache_instance_t *instance,
+    server_rec *s,
+    void *userctx,
+    const unsigned char *id,
+    unsigned int idlen,
+    const unsigned char *data,
+    unsigned int datalen,
+    apr_pool_t *pool)
+{
+	apr_status_t ret = OK;
+
+	char *copied_id_s = CopyToNewString ((const char *) id, idlen, false);
+
+	if (copied_id_s)
+		{
+			char *copied_data_s = CopyToNewString ((const char *) data, datalen, false);
+
+			if (copied_data_s)
+				{
+					PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "id \"%s\" idlen %u data \"%s\" datalen %u  %X", copied_id_s, idlen, copied_data_s, datalen, data);
+
+					FreeCopiedString (copied_data_s);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy data \"%s\"", (char *) data);
+					ret = APR_EGENERAL;
+				}
+
+			FreeCopiedString (copied_id_s);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy id \"%s\"", (char *) id);
+			ret = APR_EGENERAL;
+		}
+
+	return ret;
+}
+
+
+bool AddObjectToAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned char *value_p, unsigned int value_length)
+{
+	return AddObjectToAPRGlobalStorageWithTTL (storage_p, raw_key_p, raw_key_length, value_p, value_length, APR_GLOBAL_STORAGE_DEFAULT_TTL);
+}
+
+
+bool AddObjectToAPRGlobalStorageWithTTL (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned char *value_p, unsigned int value_length, apr_interval_time_t ttl)
+{
+	bool success_flag = false;
+	unsigned int key_len = 0;
+	unsigned char *key_p = NULL;
+
+	if (storage_p -> ags_make_key_fn)
+		{
+			key_p = storage_p -> ags_make_key_fn (raw_key_p, raw_key_length, &key_len);
+		}
+	else
+		{
+			key_p = (unsigned char *) raw_key_p;
+			key_len = raw_key_length;
+		}
+
+	if (key_p)
+		{
+			char key_buffer_s [AGS_KEY_BUFFER_SIZE];
+			const char *key_s = FormatStorageKey (key_p, key_len, key_buffer_s);
+			unsigned int entry_length = 0;
+			const apr_time_t expiry = GetEntryExpiry (storage_p, ttl);
+
+			/* The entry is only needed until the socache has copied it, so reuse the thread's buffer for it */
+			APRThreadBuffer *buffer_p = GetAPRThreadBuffer (ATB_STORAGE_ENTRY);
+
+			/*
+			 * Build the entry, compressing it if needed, before we take the
+			 * lock so that we hold it for as short a time as possible.
+			 */
+			unsigned char *entry_p = CreateStorageEntry (storage_p, value_p, value_length, expiry, buffer_p, &entry_length, key_s);
+
+			if (entry_p)
+				{
+					const uint32 hash = GetAPRGlobalStorageKeyHash (storage_p, key_p, key_len);
+					const uint32 stripe = GetAPRGlobalStorageStripe (storage_p, hash);
+					ap_socache_instance_t *instance_p = * (storage_p -> ags_socache_instances_pp + stripe);
+					apr_status_t status;
+
+					/*
+					 * Evicting needs to lock other stripes, so it has to be
+					 * done before we lock our own one.
+					 */
+					if ((storage_p -> ags_full_policy != AGS_FP_REJECT) && (!HasCapacityFor (storage_p, entry_length)))
+						{
+							MakeRoomInAPRGlobalStorage (storage_p, entry_length);
+						}
+
+					status = LockAPRGlobalStorageStripe (storage_p, stripe, true);
+
+					if (status == APR_SUCCESS)
+						{
+							const apr_time_t locked_at = apr_time_now ();
+							unsigned int old_entry_length = 0;
+							unsigned int old_value_length = 0;
+							bool exists_flag = false;
+							bool allowed_flag = HasCapacityFor (storage_p, entry_length);
+
+							/*
+							 * Updates to existing entries are always allowed so that we never lose
+							 * their state, so we only need to look for one if we're out of room.
+							 */
+							if (!allowed_flag)
+								{
+									exists_flag = GetStoredEntryLengths (storage_p, instance_p, key_p, key_len, hash, &old_entry_length, &old_value_length, NULL, NULL, NULL, storage_p -> ags_pool_p);
+									allowed_flag = exists_flag;
+								}
+
+							if (allowed_flag)
+								{
+									/*
+									 * Raise the size hint before the entry becomes visible so that
+									 * any reader that misses it because its buffer was too small
+									 * will see the larger size when it tries again.
+									 */
+									SetEntrySizeHint (storage_p, hash, entry_length);
+
+									/* store it */
+									status = StoreStorageEntry (storage_p, instance_p, key_p, key_len, expiry, entry_p, entry_length, &exists_flag, &old_entry_length, &old_value_length);
+
+									if (status == APR_SUCCESS)
+										{
+											success_flag = true;
+
+											IncrementEntryGeneration (storage_p, hash);
+											UpdateStripeUsage (storage_p, stripe, exists_flag ? 0 : 1, (apr_int64_t) entry_length - old_entry_length, (apr_int64_t) value_length - old_value_length);
+											TouchEntry (storage_p, hash);
+
+											#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINE
+											PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Added \"%s\" length %u, value %.16X length %u as " UINT32_FMT " bytes to global store", key_s, key_len, value_p, value_length, entry_length);
+											#endif
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_FINE, __FILE__, __LINE__, "Failed to add \"%s\" length %u, value %.16X length %u to global store", key_s, key_len, value_p, value_length);
+										}
+								}
+							else
+								{
+									RejectEntry (storage_p, entry_length, key_s);
+								}
+
+							RecordLockHold (storage_p, locked_at);
+							status = UnlockAPRGlobalStorageStripe (storage_p, stripe);
+
+							if (status != APR_SUCCESS)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to unlock mutex, status %d after adding %s", status, key_s);
+								} /* if (status != APR_SUCCESS) */
+
+						}		/* if (status == APR_SUCCESS) */
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock mutex, status %d to add %s", status, key_s);
+						}
+
+					if (!buffer_p)
+						{
+							FreeMemory (entry_p);
+						}
+				}		/* if (entry_p) */
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create entry for \"%s\", unable to store", key_s);
+				}
+
+			if (buffer_p)
+				{
+					ReleaseAPRThreadBuffer (buffer_p);
+				}
+
+			/*
+			 * If the key_p isn't pointing to the same address
+			 * as raw_key_p it must be new, so delete it.
+			 */
+			if (key_p != raw_key_p)
+				{
+					FreeMemory (key_p);
+				}
+		} /* if (key_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make key");
+		}
+
+	#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
+	PrintAPRGlobalStorage (storage_p);
+	#endif
+
+	return success_flag;
+}
+
+
+
+void *GetObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned int *value_length_p)
+{
+	return FindObjectFromAPRGlobalStorage (storage_p, raw_key_p, raw_key_length, false, value_length_p);
+}
+
+
+void *RemoveObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned int *value_length_p)
+{
+	return FindObjectFromAPRGlobalStorage (storage_p, raw_key_p, raw_key_length, true, value_length_p);
+}
+
+
+bool ReadObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, APRGlobalStorageReader reader_fn, void *reader_data_p)
+{
+	bool success_flag = false;
+	unsigned int key_len = 0;
+	unsigned char *key_p = NULL;
+
+	if (storage_p -> ags_make_key_fn)
+		{
+			key_p = storage_p -> ags_make_key_fn (raw_key_p, raw_key_length, &key_len);
+		}
+	else
+		{
+			key_p = (unsigned char *) raw_key_p;
+			key_len = raw_key_length;
+		}
+
+	if (key_p)
+		{
+			char key_buffer_s [AGS_KEY_BUFFER_SIZE];
+			const char *key_s = FormatStorageKey (key_p, key_len, key_buffer_s);
+			const uint32 hash = GetAPRGlobalStorageKeyHash (storage_p, key_p, key_len);
+			unsigned int array_size = GetEntrySizeHint (storage_p, hash);
+			apr_uint32_t generation = 0;
+			bool found_flag = false;
+
+			apr_atomic_inc32 (& (storage_p -> ags_num_lookups));
+
+			if (storage_p -> ags_local_cache_p)
+				{
+					generation = GetEntryGeneration (storage_p, hash);
+					found_flag = ReadFromLocalCache (storage_p, key_p, key_len, generation, reader_fn, reader_data_p, &success_flag);
+
+					if (found_flag)
+						{
+							TouchEntry (storage_p, hash);
+						}
+				}
+
+			if ((!found_flag) && (array_size > 0))
+				{
+					/* Small entries don't need to touch the heap at all */
+					unsigned char local_buffer [AGS_STACK_ENTRY_SIZE];
+					unsigned char *entry_p = (array_size <= AGS_STACK_ENTRY_SIZE) ? local_buffer : (unsigned char *) AllocMemory (array_size);
+
+					if (entry_p)
+						{
+							const uint32 stripe = GetAPRGlobalStorageStripe (storage_p, hash);
+							apr_status_t status = APR_SUCCESS;
+
+							if (entry_p != local_buffer)
+								{
+									apr_atomic_add64 (& (storage_p -> ags_lookup_bytes_allocated), array_size);
+								}
+
+							if (!storage_p -> ags_lock_free_reads_flag)
+								{
+									status = LockAPRGlobalStorageStripe (storage_p, stripe, false);
+								}
+
+							if (status == APR_SUCCESS)
+								{
+									const apr_time_t locked_at = apr_time_now ();
+									unsigned char *larger_entry_p = NULL;
+
+									status = RetrieveStorageEntry (storage_p, * (storage_p -> ags_socache_instances_pp + stripe), key_p, key_len, hash, entry_p, &array_size, &larger_entry_p);
+
+									if (larger_entry_p)
+										{
+											if (entry_p != local_buffer)
+												{
+													FreeMemory (entry_p);
+												}
+
+											entry_p = larger_entry_p;
+										}
+
+									if (!storage_p -> ags_lock_free_reads_flag)
+										{
+											apr_status_t lock_status;
+
+											RecordLockHold (storage_p, locked_at);
+											lock_status = UnlockAPRGlobalStorageStripe (storage_p, stripe);
+
+											if (lock_status != APR_SUCCESS)
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to unlock mutex for %s, status %d", key_s, lock_status);
+												}
+										}
+
+									if (status == APR_SUCCESS)
+										{
+											unsigned char *value_p = NULL;
+											unsigned int value_length = 0;
+											bool alloc_value_flag = false;
+											apr_time_t expiry = 0;
+
+											/*
+											 * The shared object cache API always copies the entry out for us,
+											 * so there's no need to keep the stripe locked whilst the reader runs.
+											 */
+											if (GetStorageEntryValue (storage_p, entry_p, array_size, &value_p, &value_length, &alloc_value_flag, &expiry, key_s))
+												{
+													success_flag = RunReader (storage_p, reader_fn, value_p, value_length, reader_data_p);
+													TouchEntry (storage_p, hash);
+
+													if (storage_p -> ags_local_cache_p)
+														{
+															AddToLocalCache (storage_p, key_p, key_len, generation, expiry, value_p, value_length);
+														}
+
+													if (alloc_value_flag)
+														{
+															FreeMemory (value_p);
+														}
+												}
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock mutex for %s, status %d", key_s, status);
+								}
+
+							if (entry_p != local_buffer)
+								{
+									FreeMemory (entry_p);
+								}
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__,"Failed to allocate " UINT32_FMT " bytes when looking up key \"%s\"", array_size, key_s);
+						}
+				}
+
+			if (key_p != raw_key_p)
+				{
+					FreeMemory (key_p);
+				}
+		}		/* if (key_p) */
+
+	return success_flag;
+}
+
+
+bool UpdateObjectInAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, APRGlobalStorageUpdater updater_fn, void *updater_data_p)
+{
+	bool success_flag = false;
+	unsigned int key_len = 0;
+	unsigned char *key_p = GetObjectKey (storage_p, raw_key_p, raw_key_length, &key_len);
+
+	if (key_p)
+		{
+			char key_buffer_s [AGS_KEY_BUFFER_SIZE];
+			const char *key_s = FormatStorageKey (key_p, key_len, key_buffer_s);
+			const uint32 hash = GetAPRGlobalStorageKeyHash (storage_p, key_p, key_len);
+			unsigned int array_size = GetEntrySizeHint (storage_p, hash);
+
+			/* If nothing has ever been stored for this bucket, there's nothing to update */
+			if (array_size > 0)
+				{
+					unsigned char *entry_p = (unsigned char *) AllocMemory (array_size);
+
+					if (entry_p)
+						{
+							const uint32 stripe = GetAPRGlobalStorageStripe (storage_p, hash);
+							ap_socache_instance_t *instance_p = * (storage_p -> ags_socache_instances_pp + stripe);
+							apr_status_t status;
+
+							apr_atomic_add64 (& (storage_p -> ags_lookup_bytes_allocated), array_size);
+
+							status = LockAPRGlobalStorageStripe (storage_p, stripe, true);
+
+							if (status == APR_SUCCESS)
+								{
+									const apr_time_t locked_at = apr_time_now ();
+									unsigned char *larger_entry_p = NULL;
+
+									status = RetrieveStorageEntry (storage_p, instance_p, key_p, key_len, hash, entry_p, &array_size, &larger_entry_p);
+
+									if (larger_entry_p)
+										{
+											FreeMemory (entry_p);
+											entry_p = larger_entry_p;
+										}
+
+									if (status == APR_SUCCESS)
+										{
+											unsigned char *value_p = NULL;
+											unsigned int value_length = 0;
+											bool alloc_value_flag = false;
+											apr_time_t expiry = 0;
+
+											if (GetStorageEntryValue (storage_p, entry_p, array_size, &value_p, &value_length, &alloc_value_flag, &expiry, key_s) && updater_fn (value_p, value_length, expiry, updater_data_p))
+												{
+													unsigned int new_entry_length = 0;
+													unsigned char *new_entry_p = CreateStorageEntry (storage_p, value_p, value_length, expiry, NULL, &new_entry_length, key_s);
+
+													if (new_entry_p)
+														{
+															unsigned int old_entry_length = array_size;
+															unsigned int old_value_length = value_length;
+															bool exists_flag = true;
+
+															/* As when adding, raise the size hint before the new entry becomes visible */
+															SetEntrySizeHint (storage_p, hash, new_entry_length);
+
+															status = StoreStorageEntry (storage_p, instance_p, key_p, key_len, expiry, new_entry_p, new_entry_length, &exists_flag, &old_entry_length, &old_value_length);
+
+															if (status == APR_SUCCESS)
+																{
+																	success_flag = true;
+
+																	IncrementEntryGeneration (storage_p, hash);
+																	UpdateStripeUsage (storage_p, stripe, 0, (apr_int64_t) new_entry_length - old_entry_length, 0);
+																	TouchEntry (storage_p, hash);
+																}
+															else
+																{
+																	PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to store the update to \"%s\", status %d", key_s, status);
+																}
+
+															FreeMemory (new_entry_p);
+														}
+													else
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create entry for \"%s\", unable to update", key_s);
+														}
+												}
+
+											if (alloc_value_flag)
+												{
+													FreeMemory (value_p);
+												}
+										}
+
+									RecordLockHold (storage_p, locked_at);
+									status = UnlockAPRGlobalStorageStripe (storage_p, stripe);
+
+									if (status != APR_SUCCESS)
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to unlock mutex, status %d after updating %s", status, key_s);
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock mutex, status %d to update %s", status, key_s);
+								}
+
+							FreeMemory (entry_p);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__,"Failed to allocate " UINT32_FMT " bytes when updating key \"%s\"", array_size, key_s);
+						}
+				}
+
+			if (key_p != raw_key_p)
+				{
+					FreeMemory (key_p);
+				}
+		}		/* if (key_p) */
+
+	return success_flag;
+}
+
+
+apr_uint32_t GetAPRGlobalStorageObjectGeneration (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length)
+{
+	apr_uint32_t generation = 0;
+	unsigned int key_len = 0;
+	unsigned char *key_p = GetObjectKey (storage_p, raw_key_p, raw_key_length, &key_len);
+
+	if (key_p)
+		{
+			generation = GetEntryGeneration (storage_p, GetAPRGlobalStorageKeyHash (storage_p, key_p, key_len));
+
+			if (key_p != raw_key_p)
+				{
+					FreeMemory (key_p);
+				}
+		}
+
+	return generation;
+}
+
+
+apr_status_t WaitForAPRGlobalStorageObjectChange (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, const apr_uint32_t generation, const apr_interval_time_t timeout)
+{
+	apr_status_t status = APR_ENOMEM;
+	unsigned int key_len = 0;
+	unsigned char *key_p = GetObjectKey (storage_p, raw_key_p, raw_key_length, &key_len);
+
+	if (key_p)
+		{
+			const uint32 bucket = GetAPRGlobalStorageKeyHash (storage_p, key_p, key_len) % AGS_NUM_SIZE_BUCKETS;
+			APRGlobalStorageSharedData *shared_data_p = storage_p -> ags_shared_data_p;
+
+			if (key_p != raw_key_p)
+				{
+					FreeMemory (key_p);
+				}
+
+			status = WaitForSharedValueChange (shared_data_p -> agssd_generations + bucket, shared_data_p -> agssd_generation_waiters + bucket, generation, timeout);
+		}
+
+	return status;
+}
+
+
+apr_uint32_t GetAPRGlobalStorageSequence (APRGlobalStorage *storage_p)
+{
+	return apr_atomic_read32 (& (storage_p -> ags_shared_data_p -> agssd_sequence));
+}
+
+
+apr_status_t WaitForAPRGlobalStorageChange (APRGlobalStorage *storage_p, const apr_uint32_t sequence, const apr_interval_time_t timeout)
+{
+	APRGlobalStorageSharedData *shared_data_p = storage_p -> ags_shared_data_p;
+
+	return WaitForSharedValueChange (& (shared_data_p -> agssd_sequence), & (shared_data_p -> agssd_sequence_waiters), sequence, timeout);
+}
+
+
+APRGlobalStorageCounterResult AcquireAPRGlobalStorageCounter (APRGlobalStorage *storage_p, const char *name_s, const apr_uint32_t limit)
+{
+	APRGlobalStorageCounterResult result = AGS_CR_ERROR;
+	apr_status_t status;
+
+	if (!IsSharedCounterNameValid (name_s))
+		{
+			return AGS_CR_ERROR;
+		}
+
+	status = apr_global_mutex_lock (storage_p -> ags_counters_mutex_p);
+
+	if (status == APR_SUCCESS)
+		{
+			/* As the name is valid, the only reason for this to fail is that the table is full */
+			APRGlobalStorageCounter *counter_p = FindSharedCounter (storage_p, name_s, true);
+
+			if (counter_p)
+				{
+					if ((limit == 0) || (counter_p -> agsc_value < limit))
+						{
+							++ (counter_p -> agsc_value);
+							result = AGS_CR_ACQUIRED;
+						}
+					else
+						{
+							result = AGS_CR_AT_LIMIT;
+						}
+				}
+			else
+				{
+					result = AGS_CR_NO_ROOM;
+				}
+
+			apr_global_mutex_unlock (storage_p -> ags_counters_mutex_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock the counters in %s to acquire \"%s\", status %d", storage_p -> ags_cache_id_s, name_s, status);
+		}
+
+	return result;
+}
+
+
+void ReleaseAPRGlobalStorageCounter (APRGlobalStorage *storage_p, const char *name_s)
+{
+	apr_status_t status = apr_global_mutex_lock (storage_p -> ags_counters_mutex_p);
+
+	if (status == APR_SUCCESS)
+		{
+			APRGlobalStorageCounter *counter_p = FindSharedCounter (storage_p, name_s, false);
+
+			/* Never wrap round below 0 if something was released twice */
+			if (counter_p && (counter_p -> agsc_value > 0))
+				{
+					-- (counter_p -> agsc_value);
+
+					if (counter_p -> agsc_value == 0)
+						{
+							FreeSharedCounter (storage_p, counter_p);
+						}
+				}
+
+			apr_global_mutex_unlock (storage_p -> ags_counters_mutex_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock the counters in %s to release \"%s\", status %d", storage_p -> ags_cache_id_s, name_s, status);
+		}
+}
+
+
+apr_uint32_t GetAPRGlobalStorageCounter (APRGlobalStorage *storage_p, const char *name_s)
+{
+	apr_uint32_t value = 0;
+	apr_status_t status = apr_global_mutex_lock (storage_p -> ags_counters_mutex_p);
+
+	if (status == APR_SUCCESS)
+		{
+			APRGlobalStorageCounter *counter_p = FindSharedCounter (storage_p, name_s, false);
+
+			if (counter_p)
+				{
+					value = counter_p -> agsc_value;
+				}
+
+			apr_global_mutex_unlock (storage_p -> ags_counters_mutex_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock the counters in %s to get \"%s\", status %d", storage_p -> ags_cache_id_s, name_s, status);
+		}
+
+	return value;
+}
+
+
+void **GetObjectsFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void * const *raw_keys_pp, const unsigned int *raw_key_lengths_p, const uint32 num_keys, unsigned int *value_lengths_p)
+{
+	void **values_pp = NULL;
+	APRGlobalStorageBatchItem *items_p = PrepareBatchItems (storage_p, raw_keys_pp, raw_key_lengths_p, num_keys);
+
+	if (items_p)
+		{
+			unsigned char *buffer_p = RetrieveBatchItems (storage_p, items_p, num_keys);
+
+			values_pp = PackBatchValues (storage_p, items_p, num_keys, value_lengths_p);
+
+			if (buffer_p)
+				{
+					FreeMemory (buffer_p);
+				}
+
+			FreeBatchItems (items_p, raw_keys_pp, num_keys);
+		}
+
+	return values_pp;
+}
+
+
+uint32 AddObjectsToAPRGlobalStorage (APRGlobalStorage *storage_p, const void * const *raw_keys_pp, const unsigned int *raw_key_lengths_p, unsigned char **values_pp, const unsigned int *value_lengths_p, const apr_interval_time_t *ttls_p, const uint32 num_objects, bool *results_p)
+{
+	uint32 num_added = 0;
+	APRGlobalStorageBatchItem *items_p = PrepareBatchItems (storage_p, raw_keys_pp, raw_key_lengths_p, num_objects);
+
+	if (items_p)
+		{
+			uint32 stripe;
+			uint32 i;
+
+			/* Build all of the entries before taking any locks */
+			for (i = 0; i < num_objects; ++ i)
+				{
+					APRGlobalStorageBatchItem *item_p = items_p + i;
+
+					if (item_p -> agsbi_key_p)
+						{
+							item_p -> agsbi_expiry = GetEntryExpiry (storage_p, ttls_p ? * (ttls_p + i) : APR_GLOBAL_STORAGE_DEFAULT_TTL);
+							item_p -> agsbi_entry_p = CreateStorageEntry (storage_p, * (values_pp + i), * (value_lengths_p + i), item_p -> agsbi_expiry, NULL, & (item_p -> agsbi_entry_length), item_p -> agsbi_key_s);
+
+							if (!item_p -> agsbi_entry_p)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create entry for \"%s\", unable to store", item_p -> agsbi_key_s);
+								}
+						}
+				}
+
+			if (storage_p -> ags_full_policy != AGS_FP_REJECT)
+				{
+					apr_uint64_t num_bytes = 0;
+
+					for (i = 0; i < num_objects; ++ i)
+						{
+							num_bytes += (items_p + i) -> agsbi_entry_length;
+						}
+
+					if (!HasCapacityFor (storage_p, num_bytes))
+						{
+							MakeRoomInAPRGlobalStorage (storage_p, num_bytes);
+						}
+				}
+
+			/* Each stripe that we need is locked once for all of its entries */
+			for (stripe = 0; stripe < storage_p -> ags_num_stripes; ++ stripe)
+				{
+					bool locked_flag = false;
+
+					for (i = 0; i < num_objects; ++ i)
+						{
+							APRGlobalStorageBatchItem *item_p = items_p + i;
+
+							if ((item_p -> agsbi_entry_p) && (item_p -> agsbi_stripe == stripe))
+								{
+									ap_socache_instance_t *instance_p = * (storage_p -> ags_socache_instances_pp + stripe);
+									unsigned int old_entry_length = 0;
+									unsigned int old_value_length = 0;
+									bool exists_flag = false;
+									apr_status_t status;
+
+									if (!locked_flag)
+										{
+											status = LockAPRGlobalStorageStripe (storage_p, stripe, true);
+
+											if (status != APR_SUCCESS)
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock stripe " UINT32_FMT ", status %d", stripe, status);
+													break;
+												}
+
+											locked_flag = true;
+										}
+
+									if (!HasCapacityFor (storage_p, item_p -> agsbi_entry_length))
+										{
+											exists_flag = GetStoredEntryLengths (storage_p, instance_p, item_p -> agsbi_key_p, item_p -> agsbi_key_length, item_p -> agsbi_hash, &old_entry_length, &old_value_length, NULL, NULL, NULL, storage_p -> ags_pool_p);
+										}
+
+									if ((!exists_flag) && (!HasCapacityFor (storage_p, item_p -> agsbi_entry_length)))
+										{
+											RejectEntry (storage_p, item_p -> agsbi_entry_length, item_p -> agsbi_key_s);
+											continue;
+										}
+
+									/* As for a single entry, the hint must be raised before the entry is visible */
+									SetEntrySizeHint (storage_p, item_p -> agsbi_hash, item_p -> agsbi_entry_length);
+
+									status = StoreStorageEntry (storage_p, instance_p, item_p -> agsbi_key_p, item_p -> agsbi_key_length, item_p -> agsbi_expiry, item_p -> agsbi_entry_p, item_p -> agsbi_entry_length, &exists_flag, &old_entry_length, &old_value_length);
+
+									if (status == APR_SUCCESS)
+										{
+											IncrementEntryGeneration (storage_p, item_p -> agsbi_hash);
+											UpdateStripeUsage (storage_p, stripe, exists_flag ? 0 : 1, (apr_int64_t) item_p -> agsbi_entry_length - old_entry_length, (apr_int64_t) (* (value_lengths_p + i)) - old_value_length);
+											TouchEntry (storage_p, item_p -> agsbi_hash);
+
+											item_p -> agsbi_success_flag = true;
+											++ num_added;
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_FINE, __FILE__, __LINE__, "Failed to add \"%s\" to global store, status %d", item_p -> agsbi_key_s, status);
+										}
+								}
+						}
+
+					if (locked_flag)
+						{
+							apr_status_t status = UnlockAPRGlobalStorageStripe (storage_p, stripe);
+
+							if (status != APR_SUCCESS)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to unlock stripe " UINT32_FMT ", status %d", stripe, status);
+								}
+						}
+				}
+
+			if (results_p)
+				{
+					for (i = 0; i < num_objects; ++ i)
+						{
+							* (results_p + i) = (items_p + i) -> agsbi_success_flag;
+						}
+				}
+
+			FreeBatchItems (items_p, raw_keys_pp, num_objects);
+		}
+
+	return num_added;
+}
+
+
+
+/*
+ * Get a printable version of a key for the log messages without
+ * allocating any memory. Binary keys are printed as UUIDs if they are
+ * the right size and in hexadecimal otherwise, truncated if need be.
+ */
+static const char *FormatStorageKey (const unsigned char *key_p, const unsigned int key_length, char *buffer_s)
+{
+	static const char s_hex_digits [] = "0123456789abcdef";
+	bool printable_flag = (key_length < AGS_KEY_BUFFER_SIZE);
+	unsigned int i;
+
+	for (i = 0; printable_flag && (i < key_length); ++ i)
+		{
+			printable_flag = (isprint (* (key_p + i)) != 0);
+		}
+
+	if (printable_flag)
+		{
+			memcpy (buffer_s, key_p, key_length);
+			* (buffer_s + key_length) = '\0';
+		}
+	else if (key_length == UUID_RAW_SIZE)
+		{
+			ConvertUUIDToString (* ((const uuid_t *) key_p), buffer_s);
+		}
+	else
+		{
+			const unsigned int num_bytes = (key_length < (AGS_KEY_BUFFER_SIZE - 1) / 2) ? key_length : (AGS_KEY_BUFFER_SIZE - 1) / 2;
+			char *hex_p = buffer_s;
+
+			for (i = 0; i < num_bytes; ++ i)
+				{
+					* (hex_p ++) = s_hex_digits [(* (key_p + i)) >> 4];
+					* (hex_p ++) = s_hex_digits [(* (key_p + i)) & 0xF];
+				}
+
+			*hex_p = '\0';
+		}
+
+	return buffer_s;
+}
+
+
+static void *FindObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, const bool remove_flag, unsigned int *value_length_p)
+{
+	void *result_p = NULL;
+	unsigned int key_len = 0;
+	unsigned char *key_p = NULL;
+
+	if (storage_p -> ags_make_key_fn)
+		{
+			key_p = storage_p -> ags_make_key_fn (raw_key_p, raw_key_length, &key_len);
+		}
+	else
+		{
+			key_p = (unsigned char *) raw_key_p;
+			key_len = raw_key_length;
+		}
+
+	if (key_p)
+		{
+			char key_buffer_s [AGS_KEY_BUFFER_SIZE];
+			const char *key_s = FormatStorageKey (key_p, key_len, key_buffer_s);
+			const uint32 hash = GetAPRGlobalStorageKeyHash (storage_p, key_p, key_len);
+			unsigned int array_size = GetEntrySizeHint (storage_p, hash);
+			apr_uint32_t generation = 0;
+			unsigned int value_length = 0;
+
+			#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
+			PrintLog (STM_LEVEL_FINEST,  __FILE__, __LINE__,"Made key: %s", key_s);
+			#endif
+
+			apr_atomic_inc32 (& (storage_p -> ags_num_lookups));
+
+			if (storage_p -> ags_local_cache_p)
+				{
+					/*
+					 * The generation must be read before the shared object cache
+					 * so that if the value changes in between, the copy that we
+					 * keep will already be seen as out of date.
+					 */
+					generation = GetEntryGeneration (storage_p, hash);
+
+					if (remove_flag)
+						{
+							RemoveFromLocalCache (storage_p, key_p, key_len);
+						}
+					else
+						{
+							result_p = GetFromLocalCache (storage_p, key_p, key_len, generation, &value_length);
+						}
+				}
+
+			/*
+			 * If nothing has ever been stored for this bucket, then
+			 * there's no need to look any further.
+			 */
+			if ((array_size > 0) && (!result_p))
+				{
+					/* We only need enough memory for the largest entry that has been stored in this key's bucket */
+					unsigned char *temp_p = (unsigned char *) AllocMemory (array_size);
+
+					if (temp_p)
+						{
+							const uint32 stripe = GetAPRGlobalStorageStripe (storage_p, hash);
+							ap_socache_instance_t *instance_p = * (storage_p -> ags_socache_instances_pp + stripe);
+							const bool lock_flag = remove_flag || (!storage_p -> ags_lock_free_reads_flag);
+							apr_status_t status = APR_SUCCESS;
+
+							apr_atomic_add64 (& (storage_p -> ags_lookup_bytes_allocated), array_size);
+
+							/*
+							 * A plain lookup only needs a shared lock, removing the
+							 * entry needs it exclusively. If the provider supports
+							 * lock-free reads, a plain lookup doesn't need a lock at all.
+							 */
+							if (lock_flag)
+								{
+									status = LockAPRGlobalStorageStripe (storage_p, stripe, remove_flag);
+								}
+
+							if (status == APR_SUCCESS)
+								{
+									const apr_time_t locked_at = apr_time_now ();
+									apr_status_t lock_status;
+									unsigned char *larger_entry_p = NULL;
+
+									#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
+									PrintLog (STM_LEVEL_FINEST,  __FILE__, __LINE__,"Locked mutex");
+									#endif
+
+									/* get the value */
+									status = RetrieveStorageEntry (storage_p, instance_p, key_p, key_len, hash, temp_p, &array_size, &larger_entry_p);
+
+									if (larger_entry_p)
+										{
+											FreeMemory (temp_p);
+											temp_p = larger_entry_p;
+										}
+
+									#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
+									PrintLog (STM_LEVEL_FINEST,  __FILE__, __LINE__,"status %d key %s length %u result_p %0.16X remove_flag %d", status, key_s, key_len, temp_p, remove_flag);
+									#endif
+
+									if ((status == APR_SUCCESS) && (remove_flag == true))
+										{
+											apr_status_t remove_status = storage_p -> ags_socache_provider_p -> remove (instance_p,
+																																																	storage_p -> ags_server_p,
+																																																	key_p,
+																																																	key_len,
+																																																	storage_p -> ags_pool_p);
+
+											#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
+											PrintLog (STM_LEVEL_FINEST,  __FILE__, __LINE__,"status after removal %d", remove_status);
+											#endif
+
+											if (remove_status == APR_SUCCESS)
+												{
+													APRGlobalStorageEntryHeader header;
+
+													IncrementEntryGeneration (storage_p, hash);
+
+													if (ReadStorageEntryHeader (temp_p, array_size, &header))
+														{
+															UpdateStripeUsage (storage_p, stripe, -1, - ((apr_int64_t) array_size), - ((apr_int64_t) header.ageh_value_length));
+														}
+												}
+											else
+												{
+													PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to remove \"%s\", status %d", key_s, remove_status);
+												}
+										}
+
+									if (lock_flag)
+										{
+											RecordLockHold (storage_p, locked_at);
+										}
+
+									lock_status = lock_flag ? UnlockAPRGlobalStorageStripe (storage_p, stripe) : APR_SUCCESS;
+
+									if (lock_status != APR_SUCCESS)
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to unlock mutex for %s, status %d", key_s, lock_status);
+										} /* if (lock_status != APR_SUCCESS) */
+
+									/*
+									 * Now that we have our own copy of the entry, we can
+									 * decompress it without holding the lock.
+									 */
+									if (status == APR_SUCCESS)
+										{
+											apr_time_t expiry = 0;
+
+											result_p = DecodeStorageEntry (storage_p, temp_p, array_size, &value_length, &expiry, key_s);
+											temp_p = NULL;
+
+											if (result_p && (!remove_flag) && (storage_p -> ags_local_cache_p))
+												{
+													AddToLocalCache (storage_p, key_p, key_len, generation, expiry, (const unsigned char *) result_p, value_length);
+												}
+										}
+
+								}		/* if (status == APR_SUCCESS) */
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock mutex for %s, status %d", key_s, status);
+								}
+
+							if (temp_p)
+								{
+									FreeMemory (temp_p);
+								}
+
+						}		/* if (temp_p) */
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__,"Failed to allocate " UINT32_FMT " bytes when looking up key \"%s\"", array_size, key_s);
+						}
+
+				}		/* if (array_size > 0) */
+
+			if (result_p && (!remove_flag))
+				{
+					TouchEntry (storage_p, hash);
+				}
+
+			if (value_length_p)
+				{
+					*value_length_p = result_p ? value_length : 0;
+				}
+
+			if (key_p != raw_key_p)
+				{
+					FreeMemory (key_p);
+				}
+		} /* if (key_p) */
+
+	#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
+	PrintAPRGlobalStorage (storage_p);
+	#endif
+
+
+	return result_p;
+}
+
+
+bool IterateOverAPRGlobalStorage (APRGlobalStorage *storage_p, ap_socache_iterator_t *iterator_p, void *data_p)
+{
+	return IterateOverFilteredAPRGlobalStorage (storage_p, NULL, iterator_p, data_p);
+}
+
+
+bool IterateOverFilteredAPRGlobalStorage (APRGlobalStorage *storage_p, APRGlobalStorageKeyFilter filter_fn, ap_socache_iterator_t *iterator_p, void *data_p)
+{
+	bool did_all_elements_flag = true;
+	APRGlobalStorageIterator entries_iterator;
+	uint32 i;
+
+	entries_iterator.agsi_storage_p = storage_p;
+	entries_iterator.agsi_filter_fn = filter_fn;
+	entries_iterator.agsi_iterator_fn = iterator_p;
+	entries_iterator.agsi_data_p = data_p;
+
+	/*
+	 * Each partition is only locked whilst it is being iterated over
+	 * so the other stripes remain available to everyone else.
+	 */
+	for (i = 0; i < storage_p -> ags_num_stripes; ++ i)
+		{
+			apr_status_t status = LockAPRGlobalStorageStripe (storage_p, i, true);
+
+			if (status == APR_SUCCESS)
+				{
+					status = storage_p -> ags_socache_provider_p -> iterate (* (storage_p -> ags_socache_instances_pp + i), storage_p -> ags_server_p, &entries_iterator, IterateOverEntries, storage_p -> ags_pool_p);
+
+					if (status != APR_SUCCESS)
+						{
+							did_all_elements_flag = false;
+						}
+
+					status = UnlockAPRGlobalStorageStripe (storage_p, i);
+				}		/* if (status == APR_SUCCESS) */
+			else
+				{
+					did_all_elements_flag = false;
+				}
+		}
+
+
+	return did_all_elements_flag;
+}
+
+
+
+void SetAPRGlobalStorageDefaultTTL (APRGlobalStorage *storage_p, apr_interval_time_t ttl)
+{
+	storage_p -> ags_default_ttl = (ttl > 0) ? ttl : 0;
+}
+
+
+uint32 SweepAPRGlobalStorage (APRGlobalStorage *storage_p, const uint32 max_entries, apr_pool_t *pool_p)
+{
+	uint32 num_removed = 0;
+	uint32 stripe;
+
+	for (stripe = 0; (stripe < storage_p -> ags_num_stripes) && (num_removed < max_entries); ++ stripe)
+		{
+			bool more_flag = true;
+
+			/*
+			 * Each batch only holds the stripe's lock for a short time and we
+			 * give everyone else a chance to get it in between batches.
+			 */
+			while (more_flag && (num_removed < max_entries))
+				{
+					num_removed += SweepAPRGlobalStorageStripe (storage_p, stripe, max_entries - num_removed, pool_p, &more_flag);
+					apr_thread_yield ();
+				}
+		}
+
+	if (num_removed > 0)
+		{
+			apr_atomic_add32 (& (storage_p -> ags_num_expired), num_removed);
+
+			#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINE
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Swept " UINT32_FMT " expired entries from %s", num_removed, storage_p -> ags_cache_id_s);
+			#endif
+		}
+
+	return num_removed;
+}
+
+
+bool StartAPRGlobalStorageSweeper (APRGlobalStorage *storage_p, apr_interval_time_t interval, apr_pool_t *pool_p)
+{
+	bool success_flag = false;
+
+	if (storage_p -> ags_sweeper_thread_p)
+		{
+			return true;
+		}
+
+	if (interval <= 0)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Invalid sweep interval %" APR_TIME_T_FMT " for %s", interval, storage_p -> ags_cache_id_s);
+			return false;
+		}
+
+	storage_p -> ags_sweep_interval = interval;
+
+	/* Make sure that expired entries are kept for long enough for us to see them */
+	if (storage_p -> ags_expiry_grace_period < 2 * interval)
+		{
+			storage_p -> ags_expiry_grace_period = 2 * interval;
+		}
+
+	/*
+	 * The sweeper gets its own pools as pools can't be shared between threads.
+	 * The scratch pool is created first so that it outlives the thread's pool
+	 * when pool_p is destroyed.
+	 */
+	if ((apr_pool_create (& (storage_p -> ags_sweep_scratch_pool_p), pool_p) == APR_SUCCESS) && (apr_pool_create (& (storage_p -> ags_sweeper_pool_p), pool_p) == APR_SUCCESS))
+		{
+			apr_status_t status;
+
+			apr_atomic_set32 (& (storage_p -> ags_stop_sweeper), 0);
+
+			status = apr_thread_create (& (storage_p -> ags_sweeper_thread_p), NULL, RunSweeper, storage_p, storage_p -> ags_sweeper_pool_p);
+
+			if (status == APR_SUCCESS)
+				{
+					apr_pool_cleanup_register (storage_p -> ags_sweeper_pool_p, storage_p, StopSweeperOnCleanup, apr_pool_cleanup_null);
+					success_flag = true;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to start sweeper thread for %s, status %d", storage_p -> ags_cache_id_s, status);
+
+					storage_p -> ags_sweeper_thread_p = NULL;
+					apr_pool_destroy (storage_p -> ags_sweeper_pool_p);
+					storage_p -> ags_sweeper_pool_p = NULL;
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create pool for sweeper thread for %s", storage_p -> ags_cache_id_s);
+			storage_p -> ags_sweeper_pool_p = NULL;
+		}
+
+	return success_flag;
+}
+
+
+void StopAPRGlobalStorageSweeper (APRGlobalStorage *storage_p)
+{
+	if (storage_p -> ags_sweeper_thread_p)
+		{
+			apr_status_t thread_status;
+			apr_status_t status;
+
+			apr_atomic_set32 (& (storage_p -> ags_stop_sweeper), 1);
+
+			status = apr_thread_join (&thread_status, storage_p -> ags_sweeper_thread_p);
+
+			if (status != APR_SUCCESS)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to join sweeper thread for %s, status %d", storage_p -> ags_cache_id_s, status);
+				}
+
+			storage_p -> ags_sweeper_thread_p = NULL;
+		}
+}
+
+
+void SetAPRGlobalStorageSweepCallback (APRGlobalStorage *storage_p, APRGlobalStorageSweepCallback callback_fn, void *data_p)
+{
+	storage_p -> ags_sweep_callback_data_p = data_p;
+	storage_p -> ags_sweep_callback_fn = callback_fn;
+}
+
+
+void SetAPRGlobalStorageRemovalCallback (APRGlobalStorage *storage_p, APRGlobalStorageKeyFilter filter_fn, APRGlobalStorageRemovalCallback callback_fn, void *data_p)
+{
+	storage_p -> ags_removal_callback_data_p = data_p;
+	storage_p -> ags_removal_filter_fn = filter_fn;
+	storage_p -> ags_removal_callback_fn = callback_fn;
+}
+
+
+void SetAPRGlobalStorageCapacity (APRGlobalStorage *storage_p, apr_uint64_t capacity, APRGlobalStorageFullPolicy policy)
+{
+	storage_p -> ags_capacity = capacity;
+	storage_p -> ags_full_policy = policy;
+}
+
+
+void SetAPRGlobalStorageCompressionThresholds (APRGlobalStorage *storage_p, uint32 min_length, uint32 min_saving)
+{
+	storage_p -> ags_min_compress_length = min_length;
+	storage_p -> ags_min_compress_saving = (min_saving < 100) ? min_saving : 99;
+}
+
+
+void GetAPRGlobalStorageUsage (APRGlobalStorage *storage_p, APRGlobalStorageUsage *usage_p)
+{
+	APRGlobalStorageSharedData *shared_data_p = storage_p -> ags_shared_data_p;
+	uint32 i;
+
+	memset (usage_p, 0, sizeof (APRGlobalStorageUsage));
+
+	for (i = 0; i < storage_p -> ags_num_stripes; ++ i)
+		{
+			APRGlobalStorageStripeUsage *stripe_usage_p = shared_data_p -> agssd_stripe_usage + i;
+
+			usage_p -> agsu_num_entries += apr_atomic_read32 (& (stripe_usage_p -> agssu_num_entries));
+			usage_p -> agsu_stored_bytes += apr_atomic_read64 (& (stripe_usage_p -> agssu_stored_bytes));
+			usage_p -> agsu_value_bytes += apr_atomic_read64 (& (stripe_usage_p -> agssu_value_bytes));
+		}
+
+	usage_p -> agsu_capacity = storage_p -> ags_capacity;
+	usage_p -> agsu_num_evictions = apr_atomic_read32 (& (shared_data_p -> agssd_num_evictions));
+	usage_p -> agsu_num_lost = apr_atomic_read32 (& (shared_data_p -> agssd_num_lost));
+	usage_p -> agsu_num_rejections = apr_atomic_read32 (& (shared_data_p -> agssd_num_rejections));
+}
+
+
+bool IsAPRGlobalStorageFull (const APRGlobalStorage *storage_p)
+{
+	return ((storage_p -> ags_capacity > 0) && (GetStoredBytes (storage_p) >= storage_p -> ags_capacity));
+}
+
+
+bool PreConfigureGlobalStorage (APRGlobalStorage *storage_p, apr_pool_t *config_pool_p)
+{
+	bool success_flag = false;
+	apr_status_t status = ap_mutex_register (config_pool_p, storage_p -> ags_cache_id_s, NULL, APR_LOCK_DEFAULT, 0);
+
+	if (status == APR_SUCCESS)
+		{
+			storage_p -> ags_socache_provider_p = ap_lookup_provider (AP_SOCACHE_PROVIDER_GROUP, AP_SOCACHE_DEFAULT_PROVIDER, AP_SOCACHE_PROVIDER_VERSION);
+			success_flag = true;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "failed to register %s mutex", storage_p -> ags_cache_id_s);
+		}
+
+	return success_flag;
+}
+
+
+bool PostConfigureGlobalStorage  (APRGlobalStorage *storage_p, apr_pool_t *server_pool_p, server_rec *server_p, const char *provider_name_s, struct ap_socache_hints *cache_hints_p)
+{
+	apr_status_t res;
+	bool success_flag = true;
+
+	/*
+	 * Have we got a valid set of config directives?
+	 */
+	if (storage_p -> ags_socache_provider_p)
+		{
+			uint32 i;
+
+			if (!CreateSharedData (storage_p, server_pool_p))
+				{
+					return false;
+				}
+
+			for (i = 0; (i < storage_p -> ags_num_stripes) && success_flag; ++ i)
+				{
+					ap_socache_instance_t **instance_pp = storage_p -> ags_socache_instances_pp + i;
+
+					/*
+					 * If we have more than one stripe, each partition needs its own
+					 * name so that the providers don't end up sharing the same
+					 * underlying storage.
+					 */
+					const char *stripe_id_s = (storage_p -> ags_num_stripes > 1) ? apr_psprintf (server_pool_p, UINT32_FMT, i) : NULL;
+					const char *cache_name_s = stripe_id_s ? apr_psprintf (server_pool_p, "%s-%s", storage_p -> ags_cache_id_s, stripe_id_s) : storage_p -> ags_cache_id_s;
+
+					/* We have socache_provider, but do not have socache_instance. This should
+					 * happen only when using "default" socache_provider, so create default
+					 * socache_instance in this case. */
+					if (! (*instance_pp))
+						{
+							const char *err_msg_s = storage_p -> ags_socache_provider_p -> create (instance_pp, NULL, server_pool_p, server_pool_p);
+
+							if (err_msg_s)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "failed to create mod_socache_shmcb socache instance for %s: %s", cache_name_s, err_msg_s);
+									success_flag = false;
+								}
+						}
+
+					if (success_flag)
+						{
+							res = ap_global_mutex_create (storage_p -> ags_mutexes_pp + i, NULL, storage_p -> ags_cache_id_s, stripe_id_s, server_p, server_pool_p, 0);
+
+							if (res == APR_SUCCESS)
+								{
+									res = storage_p -> ags_socache_provider_p -> init (*instance_pp, cache_name_s, cache_hints_p, server_p, server_pool_p);
+
+									if (res != APR_SUCCESS)
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to initialise %s cache", cache_name_s);
+											success_flag = false;
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "failed to create %s mutex", cache_name_s);
+									success_flag = false;
+								}
+						}
+
+				}		/* for (i = 0; (i < storage_p -> ags_num_stripes) && success_flag; ++ i) */
+
+			if (success_flag)
+				{
+					res = ap_global_mutex_create (& (storage_p -> ags_counters_mutex_p), NULL, storage_p -> ags_cache_id_s, "counters", server_p, server_pool_p, 0);
+
+					if (res != APR_SUCCESS)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "failed to create %s counters mutex", storage_p -> ags_cache_id_s);
+							success_flag = false;
+						}
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Please select a socache provider with AuthnCacheSOCache (no default found on this platform). Maybe you need to load mod_socache_shmcb or another socache module first");
+			success_flag = false;
+		}
+
+
+	return success_flag;
+}
+
+
+bool InitAPRGlobalStorageForChild (APRGlobalStorage *storage_p, apr_pool_t *pool_p)
+{
+	bool success_flag = true;
+	uint32 i;
+
+	/* Now that we are in a child process, we have to reconnect
+	 * to the global mutexes and the shared segment. We also
+	 * have to find out the base address of the segment, in case
+	 * it moved to a new address. */
+	for (i = 0; (i < storage_p -> ags_num_stripes) && success_flag; ++ i)
+		{
+			const char *filename_s = * (storage_p -> ags_mutex_lock_filenames_ss + i);
+			apr_status_t res = apr_global_mutex_child_init (storage_p -> ags_mutexes_pp + i, filename_s, pool_p);
+
+			if (res != APR_SUCCESS)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to attach grassroots child to global mutex file '%s', res %d", filename_s, res);
+					success_flag = false;
+				}
+		}
+
+	if (success_flag)
+		{
+			const char *filename_s = storage_p -> ags_counters_mutex_filename_s;
+			apr_status_t res = apr_global_mutex_child_init (& (storage_p -> ags_counters_mutex_p), filename_s, pool_p);
+
+			if (res != APR_SUCCESS)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to attach grassroots child to global mutex file '%s', res %d", filename_s, res);
+					success_flag = false;
+				}
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Create the shared memory segment for an APRGlobalStorage. Each one gets
+ * its own segment so that the usage totals, waiters and counters of
+ * different caches never mix, and it starts zeroed so that nothing is
+ * left over from before a restart. Like mod_socache_shmcb, we use
+ * anonymous shared memory which the child processes inherit and only
+ * fall back to a named segment, keyed on the cache id, if that isn't
+ * available.
+ */
+static bool CreateSharedData (APRGlobalStorage *storage_p, apr_pool_t *pool_p)
+{
+	apr_status_t status;
+
+	if (storage_p -> ags_shm_p)
+		{
+			return true;
+		}
+
+	status = apr_shm_create (& (storage_p -> ags_shm_p), sizeof (APRGlobalStorageSharedData), NULL, pool_p);
+
+	if (APR_STATUS_IS_ENOTIMPL (status))
+		{
+			const char *filename_s = ap_runtime_dir_relative (pool_p, apr_pstrcat (pool_p, storage_p -> ags_cache_id_s, ".shm", NULL));
+
+			if (filename_s)
+				{
+					/* Remove any segment left behind by an unclean shutdown, which may also be the wrong size */
+					apr_shm_remove (filename_s, pool_p);
+					status = apr_shm_create (& (storage_p -> ags_shm_p), sizeof (APRGlobalStorageSharedData), filename_s, pool_p);
+				}
+		}
+
+	if (status == APR_SUCCESS)
+		{
+			storage_p -> ags_shm_pool_p = pool_p;
+			storage_p -> ags_shared_data_p = (APRGlobalStorageSharedData *) apr_shm_baseaddr_get (storage_p -> ags_shm_p);
+			memset (storage_p -> ags_shared_data_p, 0, sizeof (APRGlobalStorageSharedData));
+
+			apr_pool_cleanup_register (pool_p, storage_p, DestroySharedDataOnCleanup, apr_pool_cleanup_null);
+
+			/* If shared reads were asked for before we had anywhere to put the locks, set them up now */
+			if (storage_p -> ags_lock_mode == AGS_LM_SHARED_READS)
+				{
+					SetAPRGlobalStorageLockMode (storage_p, AGS_LM_SHARED_READS);
+				}
+
+			return true;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create " SIZET_FMT " bytes of shared memory for \"%s\", status %d", sizeof (APRGlobalStorageSharedData), storage_p -> ags_cache_id_s, status);
+			storage_p -> ags_shm_p = NULL;
+		}
+
+	return false;
+}
+
+
+static apr_status_t DestroySharedDataOnCleanup (void *data_p)
+{
+	APRGlobalStorage *storage_p = (APRGlobalStorage *) data_p;
+
+	if (storage_p -> ags_shm_p)
+		{
+			apr_shm_destroy (storage_p -> ags_shm_p);
+
+			storage_p -> ags_shm_p = NULL;
+			storage_p -> ags_shm_pool_p = NULL;
+			storage_p -> ags_shared_data_p = NULL;
+		}
+
+	return APR_SUCCESS;
+}
+
+
+static bool CreateStripeMutexes (APRGlobalStorage *storage_p, const char *mutex_filename_s, apr_pool_t *pool_p)
+{
+	uint32 i;
+
+	storage_p -> ags_mutex_lock_filename_s = mutex_filename_s;
+
+	for (i = 0; i < storage_p -> ags_num_stripes; ++ i)
+		{
+			const char *filename_s = (storage_p -> ags_num_stripes > 1) ? apr_psprintf (pool_p, "%s." UINT32_FMT, mutex_filename_s, i) : mutex_filename_s;
+			apr_status_t status = apr_global_mutex_create (storage_p -> ags_mutexes_pp + i, filename_s, APR_THREAD_MUTEX_UNNESTED, pool_p);
+
+			if (status == APR_SUCCESS)
+				{
+					* (storage_p -> ags_mutex_lock_filenames_ss + i) = filename_s;
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create global mutex " UINT32_FMT " at %s", i, filename_s);
+					DestroyStripeMutexes (storage_p);
+
+					return false;
+				}
+		}
+
+	/*
+	 * The counters get a mutex of their own rather than sharing one
+	 * with any of the stripes, so that admitting and finishing jobs
+	 * doesn't hold up the entries that hash to that stripe.
+	 */
+	storage_p -> ags_counters_mutex_filename_s = apr_psprintf (pool_p, "%s.counters", mutex_filename_s);
+
+	if (apr_global_mutex_create (& (storage_p -> ags_counters_mutex_p), storage_p -> ags_counters_mutex_filename_s, APR_THREAD_MUTEX_UNNESTED, pool_p) != APR_SUCCESS)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create the counters' global mutex at %s", storage_p -> ags_counters_mutex_filename_s);
+			DestroyStripeMutexes (storage_p);
+
+			return false;
+		}
+
+	return true;
+}
+
+
+static void DestroyStripeMutexes (APRGlobalStorage *storage_p)
+{
+	if (storage_p -> ags_mutexes_pp)
+		{
+			uint32 i;
+
+			for (i = 0; i < storage_p -> ags_num_stripes; ++ i)
+				{
+					apr_global_mutex_t **mutex_pp = storage_p -> ags_mutexes_pp + i;
+
+					if (*mutex_pp)
+						{
+							apr_global_mutex_destroy (*mutex_pp);
+							*mutex_pp = NULL;
+						}
+				}
+		}
+
+	if (storage_p -> ags_counters_mutex_p)
+		{
+			apr_global_mutex_destroy (storage_p -> ags_counters_mutex_p);
+			storage_p -> ags_counters_mutex_p = NULL;
+		}
+}
+
+
+static uint32 GetAPRGlobalStorageKeyHash (const APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len)
+{
+	apr_ssize_t len = (apr_ssize_t) key_len;
+
+	return storage_p -> ags_hash_fn ? storage_p -> ags_hash_fn ((const char *) key_p, &len) : apr_hashfunc_default ((const char *) key_p, &len);
+}
+
+
+static uint32 GetAPRGlobalStorageStripe (const APRGlobalStorage *storage_p, const uint32 hash)
+{
+	return (storage_p -> ags_num_stripes > 1) ? (hash % (storage_p -> ags_num_stripes)) : 0;
+}
+
+
+/*
+ * Lock a stripe. For AGS_LM_SHARED_READS, callers that only read from the
+ * shared object cache may take the lock as shared. The shmcb provider's
+ * retrieve only marks stale entries as removed and bumps its statistics,
+ * neither of which can corrupt the cache if two readers do so at once.
+ *
+ * Unlike the global mutexes, a reader/writer lock is not released by the
+ * operating system if its holder dies, so it is only used when asked for.
+ */
+static apr_status_t LockAPRGlobalStorageStripe (APRGlobalStorage *storage_p, const uint32 stripe, const bool exclusive_flag)
+{
+	apr_status_t status;
+
+	#if AGS_HAVE_SHARED_RWLOCKS == 1
+	if (storage_p -> ags_lock_mode == AGS_LM_SHARED_READS)
+		{
+			pthread_rwlock_t *rwlock_p = storage_p -> ags_shared_data_p -> agssd_rwlocks + stripe;
+			int res = exclusive_flag ? pthread_rwlock_trywrlock (rwlock_p) : pthread_rwlock_tryrdlock (rwlock_p);
+
+			if (res == EBUSY)
+				{
+					apr_atomic_inc32 (& (storage_p -> ags_num_lock_contentions));
+
+					res = exclusive_flag ? pthread_rwlock_wrlock (rwlock_p) : pthread_rwlock_rdlock (rwlock_p);
+				}
+
+			if (res == 0)
+				{
+					apr_atomic_inc32 (& (storage_p -> ags_num_lock_acquisitions));
+				}
+
+			return ((res == 0) ? APR_SUCCESS : APR_FROM_OS_ERROR (res));
+		}
+	#endif
+
+	{
+		apr_global_mutex_t *mutex_p = * (storage_p -> ags_mutexes_pp + stripe);
+
+		status = apr_global_mutex_trylock (mutex_p);
+
+		if (status != APR_SUCCESS)
+			{
+				/*
+				 * Not every lock mechanism supports trylock, so only
+				 * count the genuinely busy cases as contention.
+				 */
+				if (APR_STATUS_IS_EBUSY (status))
+					{
+						apr_atomic_inc32 (& (storage_p -> ags_num_lock_contentions));
+					}
+
+				status = apr_global_mutex_lock (mutex_p);
+			}
+
+		if (status == APR_SUCCESS)
+			{
+				apr_atomic_inc32 (& (storage_p -> ags_num_lock_acquisitions));
+			}
+	}
+
+	return status;
+}
+
+
+static apr_status_t UnlockAPRGlobalStorageStripe (APRGlobalStorage *storage_p, const uint32 stripe)
+{
+	#if AGS_HAVE_SHARED_RWLOCKS == 1
+	if (storage_p -> ags_lock_mode == AGS_LM_SHARED_READS)
+		{
+			int res = pthread_rwlock_unlock (storage_p -> ags_shared_data_p -> agssd_rwlocks + stripe);
+
+			return ((res == 0) ? APR_SUCCESS : APR_FROM_OS_ERROR (res));
+		}
+	#endif
+
+	return apr_global_mutex_unlock (* (storage_p -> ags_mutexes_pp + stripe));
+}
+
+
+
+#if AGS_HAVE_SHARED_RWLOCKS == 1
+static bool InitSharedReadWriteLocks (APRGlobalStorageSharedData *shared_data_p)
+{
+	apr_uint32_t state = apr_atomic_cas32 (& (shared_data_p -> agssd_rwlocks_state), AGS_RWLOCKS_INITIALISING, AGS_RWLOCKS_UNINITIALISED);
+
+	if (state == AGS_RWLOCKS_UNINITIALISED)
+		{
+			/* We're the first, so it's up to us to set the locks up */
+			pthread_rwlockattr_t attrs;
+			bool success_flag = false;
+
+			if (pthread_rwlockattr_init (&attrs) == 0)
+				{
+					if (pthread_rwlockattr_setpshared (&attrs, PTHREAD_PROCESS_SHARED) == 0)
+						{
+							uint32 i;
+
+							#ifdef __GLIBC__
+							/*
+							 * glibc prefers readers by default which, given how much more often
+							 * jobs are polled than written, could starve the writers.
+							 */
+							pthread_rwlockattr_setkind_np (&attrs, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+							#endif
+
+							success_flag = true;
+
+							for (i = 0; (i < APR_GLOBAL_STORAGE_MAX_NUM_STRIPES) && success_flag; ++ i)
+								{
+									if (pthread_rwlock_init (shared_data_p -> agssd_rwlocks + i, &attrs) != 0)
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to initialise reader/writer lock " UINT32_FMT, i);
+											success_flag = false;
+										}
+								}
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make reader/writer locks process-shared");
+						}
+
+					pthread_rwlockattr_destroy (&attrs);
+				}
+
+			apr_atomic_set32 (& (shared_data_p -> agssd_rwlocks_state), success_flag ? AGS_RWLOCKS_READY : AGS_RWLOCKS_FAILED);
+
+			return success_flag;
+		}
+
+	/* Another process is setting the locks up, so wait for it */
+	while (state == AGS_RWLOCKS_INITIALISING)
+		{
+			apr_sleep (1000);
+			state = apr_atomic_read32 (& (shared_data_p -> agssd_rwlocks_state));
+		}
+
+	return (state == AGS_RWLOCKS_READY);
+}
+#endif
+
+
+/*
+ * This must be called with the key's stripe locked exclusively. The
+ * hint only grows here and is lowered back to the largest entry that
+ * is really stored when the sweeper reconciles the stripe's usage.
+ */
+static void SetEntrySizeHint (APRGlobalStorage *storage_p, const uint32 hash, const unsigned int size)
+{
+	volatile apr_uint32_t *bucket_size_p = storage_p -> ags_shared_data_p -> agssd_bucket_sizes + GetEntrySizeBucket (storage_p, hash);
+
+	if (apr_atomic_read32 (bucket_size_p) < size)
+		{
+			apr_atomic_set32 (bucket_size_p, size);
+		}
+}
+
+
+static uint32 GetEntrySizeHint (APRGlobalStorage *storage_p, const uint32 hash)
+{
+	return apr_atomic_read32 (storage_p -> ags_shared_data_p -> agssd_bucket_sizes + GetEntrySizeBucket (storage_p, hash));
+}
+
+
+/*
+ * Each stripe has its own contiguous run of the size buckets so that
+ * keys from different stripes never share one. This lets a bucket be
+ * changed, and lowered, whilst holding just its stripe's lock.
+ */
+static uint32 GetEntrySizeBucket (const APRGlobalStorage *storage_p, const uint32 hash)
+{
+	const uint32 num_stripes = (storage_p -> ags_num_stripes > 1) ? storage_p -> ags_num_stripes : 1;
+	const uint32 buckets_per_stripe = AGS_NUM_SIZE_BUCKETS / num_stripes;
+
+	return (GetAPRGlobalStorageStripe (storage_p, hash) * buckets_per_stripe) + ((hash / num_stripes) % buckets_per_stripe);
+}
+
+
+/*
+ * Copy the entry for a key into entry_p which has room for *entry_length_p bytes.
+ * The size hint that entry_p was sized from is read before the stripe is locked,
+ * so a concurrent writer may have stored a larger entry in the meantime, which
+ * the provider reports as not found. If that happens and the hint has grown, we
+ * try once more with a buffer of the new size. This is returned in larger_entry_pp
+ * and the caller must free it.
+ */
+static apr_status_t RetrieveStorageEntry (APRGlobalStorage *storage_p, ap_socache_instance_t *instance_p, const unsigned char *key_p, const unsigned int key_len, const uint32 hash, unsigned char *entry_p, unsigned int *entry_length_p, unsigned char **larger_entry_pp)
+{
+	const unsigned int buffer_size = *entry_length_p;
+	apr_status_t status = storage_p -> ags_socache_provider_p -> retrieve (instance_p, storage_p -> ags_server_p, key_p, key_len, entry_p, entry_length_p, storage_p -> ags_pool_p);
+
+	*larger_entry_pp = NULL;
+
+	if (status != APR_SUCCESS)
+		{
+			const unsigned int hint = GetEntrySizeHint (storage_p, hash);
+
+			*entry_length_p = buffer_size;
+
+			if (hint > buffer_size)
+				{
+					unsigned char *larger_entry_p = (unsigned char *) AllocMemory (hint);
+
+					if (larger_entry_p)
+						{
+							unsigned int entry_length = hint;
+
+							apr_atomic_add64 (& (storage_p -> ags_lookup_bytes_allocated), hint);
+
+							status = storage_p -> ags_socache_provider_p -> retrieve (instance_p, storage_p -> ags_server_p, key_p, key_len, larger_entry_p, &entry_length, storage_p -> ags_pool_p);
+
+							if (status == APR_SUCCESS)
+								{
+									*entry_length_p = entry_length;
+									*larger_entry_pp = larger_entry_p;
+								}
+							else
+								{
+									FreeMemory (larger_entry_p);
+								}
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__,"Failed to allocate %u bytes to retry a lookup", hint);
+						}
+				}
+		}
+
+	return status;
+}
+
+
+/*
+ * The entry is built in buffer_p if it is not NULL, otherwise it is
+ * allocated and must be freed with FreeMemory. Any compression is done
+ * straight into the entry after its header so the compressed value
+ * doesn't need a buffer or copy of its own.
+ */
+static unsigned char *CreateStorageEntry (APRGlobalStorage *storage_p, unsigned char *value_p, const unsigned int value_length, const apr_time_t expiry, APRThreadBuffer *buffer_p, unsigned int *entry_length_p, const char * const key_s)
+{
+	unsigned char *entry_p = NULL;
+	const size_t max_entry_length = sizeof (APRGlobalStorageEntryHeader) + value_length;
+
+	if (buffer_p)
+		{
+			if (ReserveAPRThreadBuffer (buffer_p, max_entry_length))
+				{
+					entry_p = buffer_p -> atb_data_p;
+				}
+		}
+	else
+		{
+			entry_p = (unsigned char *) AllocMemory (max_entry_length);
+		}
+
+	if (entry_p)
+		{
+			APRGlobalStorageEntryHeader header;
+			unsigned char *payload_p = entry_p + sizeof (APRGlobalStorageEntryHeader);
+			unsigned int payload_length = 0;
+			uint8 codec = ACC_NONE;
+			uint8 flags = 0;
+			const APRCacheCodec *codec_p = storage_p -> ags_codec_p;
+
+			if (codec_p && (codec_p -> acc_compress_fn))
+				{
+					if (value_length >= storage_p -> ags_min_compress_length)
+						{
+							/*
+							 * Only keep the compressed version if it saves enough to be
+							 * worth decompressing on every read, so that is all the room
+							 * that the codec gets.
+							 */
+							apr_uint64_t max_length = ((apr_uint64_t) value_length) * (100 - storage_p -> ags_min_compress_saving) / 100;
+							unsigned int compressed_length = 0;
+
+							if (max_length >= value_length)
+								{
+									max_length = value_length - 1;
+								}
+
+							if (max_length == 0)
+								{
+									flags = AGS_ENTRY_FLAG_INCOMPRESSIBLE;
+								}
+							else if (codec_p -> acc_compress_fn (value_p, value_length, payload_p, (unsigned int) max_length, &compressed_length, key_s))
+								{
+									if (compressed_length > 0)
+										{
+											payload_length = compressed_length;
+											codec = (uint8) (codec_p -> acc_id);
+										}
+									else
+										{
+											flags = AGS_ENTRY_FLAG_INCOMPRESSIBLE;
+										}
+								}
+							else
+								{
+									/* The value can still be stored as it is */
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to compress data for \"%s\", storing it uncompressed", key_s);
+									flags = AGS_ENTRY_FLAG_COMPRESS_FAILED;
+								}
+						}
+					else
+						{
+							flags = AGS_ENTRY_FLAG_BELOW_THRESHOLD;
+						}
+
+					if (codec != ACC_NONE)
+						{
+							apr_atomic_inc32 (& (storage_p -> ags_num_compressed));
+						}
+					else
+						{
+							apr_atomic_inc32 (& (storage_p -> ags_num_stored_raw));
+						}
+				}
+
+			if (codec == ACC_NONE)
+				{
+					memcpy (payload_p, value_p, value_length);
+					payload_length = value_length;
+				}
+
+			header.ageh_value_length = value_length;
+			header.ageh_stored_length = payload_length;
+			header.ageh_version = AGS_ENTRY_HEADER_VERSION;
+			header.ageh_codec = codec;
+			header.ageh_flags = flags;
+			header.ageh_expiry = expiry;
+
+			memcpy (entry_p, &header, sizeof (APRGlobalStorageEntryHeader));
+
+			*entry_length_p = sizeof (APRGlobalStorageEntryHeader) + payload_length;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " bytes for entry \"%s\"", max_entry_length, key_s);
+		}
+
+	return entry_p;
+}
+
+
+static bool ReadStorageEntryHeader (const unsigned char *entry_p, const unsigned int entry_length, APRGlobalStorageEntryHeader *header_p)
+{
+	if (entry_length >= sizeof (APRGlobalStorageEntryHeader))
+		{
+			/*
+			 * The entry may not be suitably aligned when it comes straight
+			 * from the shared object cache, so copy the header out.
+			 */
+			memcpy (header_p, entry_p, sizeof (APRGlobalStorageEntryHeader));
+
+			if ((header_p -> ageh_version == AGS_ENTRY_HEADER_VERSION) && (header_p -> ageh_stored_length == entry_length - sizeof (APRGlobalStorageEntryHeader)))
+				{
+					return true;
+				}
+		}
+
+	return false;
+}
+
+
+/*
+ * This takes ownership of entry_p and returns the value that was
+ * originally stored.
+ */
+static unsigned char *DecodeStorageEntry (APRGlobalStorage *storage_p, unsigned char *entry_p, const unsigned int entry_length, unsigned int *value_length_p, apr_time_t *expiry_p, const char * const key_s)
+{
+	unsigned char *value_p = NULL;
+	bool alloc_value_flag = false;
+
+	if (GetStorageEntryValue (storage_p, entry_p, entry_length, &value_p, value_length_p, &alloc_value_flag, expiry_p, key_s))
+		{
+			if (alloc_value_flag)
+				{
+					FreeMemory (entry_p);
+				}
+			else
+				{
+					/* Shuffle the value to the start of the buffer so the caller can free it */
+					memmove (entry_p, value_p, *value_length_p);
+					value_p = entry_p;
+				}
+		}
+	else
+		{
+			FreeMemory (entry_p);
+		}
+
+	return value_p;
+}
+
+
+/*
+ * Get the value from an entry. If the entry is compressed, the value is
+ * decompressed into a new allocation and alloc_value_flag_p is set to
+ * true, otherwise the value points into entry_p. Entries that have
+ * expired but not yet been swept are treated as missing.
+ */
+static bool GetStorageEntryValue (APRGlobalStorage *storage_p, unsigned char *entry_p, const unsigned int entry_length, unsigned char **value_pp, unsigned int *value_length_p, bool *alloc_value_flag_p, apr_time_t *expiry_p, const char * const key_s)
+{
+	APRGlobalStorageEntryHeader header;
+
+	if (ReadStorageEntryHeader (entry_p, entry_length, &header))
+		{
+			if (expiry_p)
+				{
+					*expiry_p = header.ageh_expiry;
+				}
+
+			if (IsEntryExpired (header.ageh_expiry, apr_time_now ()))
+				{
+					#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINER
+					PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "\"%s\" has expired", key_s);
+					#endif
+				}
+			else
+				{
+					return UnpackStorageEntryValue (storage_p, &header, entry_p + sizeof (APRGlobalStorageEntryHeader), value_pp, value_length_p, alloc_value_flag_p, key_s);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__, "Invalid entry header for \"%s\"", key_s);
+		}
+
+	return false;
+}
+
+
+/*
+ * Get the value from the payload that follows an entry's header, in the
+ * same way as GetStorageEntryValue but whether it has expired or not.
+ */
+static bool UnpackStorageEntryValue (APRGlobalStorage *storage_p, const APRGlobalStorageEntryHeader *header_p, unsigned char *payload_p, unsigned char **value_pp, unsigned int *value_length_p, bool *alloc_value_flag_p, const char * const key_s)
+{
+	if (header_p -> ageh_codec != ACC_NONE)
+		{
+			const APRCacheCodec *codec_p = GetAPRCacheCodecById (header_p -> ageh_codec);
+
+			if (codec_p)
+				{
+					unsigned char *value_p = (unsigned char *) AllocMemory (header_p -> ageh_value_length);
+
+					if (value_p)
+						{
+							if (codec_p -> acc_decompress_fn (payload_p, header_p -> ageh_stored_length, value_p, header_p -> ageh_value_length, key_s))
+								{
+									apr_atomic_add64 (& (storage_p -> ags_lookup_bytes_allocated), header_p -> ageh_value_length);
+
+									*value_pp = value_p;
+									*value_length_p = header_p -> ageh_value_length;
+									*alloc_value_flag_p = true;
+
+									return true;
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__, "Failed to uncompress data for \"%s\"", key_s);
+								}
+
+							FreeMemory (value_p);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__, "Failed to allocate " UINT32_FMT " bytes to uncompress \"%s\"", header_p -> ageh_value_length, key_s);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__, "Codec " UINT32_FMT " is not available to uncompress \"%s\"", (uint32) header_p -> ageh_codec, key_s);
+				}
+		}
+	else
+		{
+			*value_pp = payload_p;
+			*value_length_p = header_p -> ageh_stored_length;
+			*alloc_value_flag_p = false;
+
+			return true;
+		}
+
+	return false;
+}
+
+
+/*
+ * If the storage's removal callback wants to know about an entry that
+ * is about to be removed, make a copy of its value for it. This is
+ * called whilst the entry's stripe is locked, with the callback being
+ * run once the lock has been released.
+ */
+static unsigned char *CopyRemovedEntryValue (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len, const unsigned char *entry_p, const unsigned int entry_length, unsigned int *value_length_p)
+{
+	unsigned char *copy_p = NULL;
+
+	if ((storage_p -> ags_removal_callback_fn) && ((! (storage_p -> ags_removal_filter_fn)) || (storage_p -> ags_removal_filter_fn (key_p, key_len, storage_p -> ags_removal_callback_data_p))))
+		{
+			APRGlobalStorageEntryHeader header;
+
+			if (ReadStorageEntryHeader (entry_p, entry_length, &header))
+				{
+					char key_buffer_s [AGS_KEY_BUFFER_SIZE];
+					const char *key_s = FormatStorageKey (key_p, key_len, key_buffer_s);
+					unsigned char *value_p = NULL;
+					bool alloc_value_flag = false;
+
+					if (UnpackStorageEntryValue (storage_p, &header, (unsigned char *) (entry_p + sizeof (APRGlobalStorageEntryHeader)), &value_p, value_length_p, &alloc_value_flag, key_s))
+						{
+							if (alloc_value_flag)
+								{
+									copy_p = value_p;
+								}
+							else
+								{
+									copy_p = (unsigned char *) AllocMemory (*value_length_p);
+
+									if (copy_p)
+										{
+											memcpy (copy_p, value_p, *value_length_p);
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__, "Failed to allocate " UINT32_FMT " bytes to copy removed entry \"%s\"", *value_length_p, key_s);
+										}
+								}
+						}
+				}
+		}
+
+	return copy_p;
+}
+
+
+static apr_status_t IterateOverEntries (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p)
+{
+	APRGlobalStorageIterator *entries_iterator_p = (APRGlobalStorageIterator *) user_data_p;
+	char key_buffer_s [AGS_KEY_BUFFER_SIZE];
+	const char *key_s = FormatStorageKey (id_s, id_length, key_buffer_s);
+	unsigned char *value_p = NULL;
+	unsigned int value_length = 0;
+	bool alloc_value_flag = false;
+	apr_status_t status = APR_SUCCESS;
+
+	/* Check the key first so that the skipped entries aren't decompressed */
+	if ((entries_iterator_p -> agsi_filter_fn) && (! (entries_iterator_p -> agsi_filter_fn (id_s, id_length, entries_iterator_p -> agsi_data_p))))
+		{
+			return status;
+		}
+
+	/* The iterator gets the original values, so any compressed ones need decompressing */
+	if (GetStorageEntryValue (entries_iterator_p -> agsi_storage_p, (unsigned char *) data_p, data_length, &value_p, &value_length, &alloc_value_flag, NULL, key_s))
+		{
+			status = entries_iterator_p -> agsi_iterator_fn (instance_p, server_p, entries_iterator_p -> agsi_data_p, id_s, id_length, value_p, value_length, pool_p);
+
+			if (alloc_value_flag)
+				{
+					FreeMemory (value_p);
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_FINE,  __FILE__, __LINE__, "Skipping entry \"%s\" of length " UINT32_FMT, key_s, data_length);
+		}
+
+	return status;
+}
+
+
+/*
+ * Remove a batch of the expired entries from a stripe. more_flag_p is set
+ * to true if there may be more expired entries left in the stripe.
+ */
+static uint32 SweepAPRGlobalStorageStripe (APRGlobalStorage *storage_p, const uint32 stripe, const uint32 max_entries, apr_pool_t *pool_p, bool *more_flag_p)
+{
+	APRGlobalStorageSweep sweep;
+	ap_socache_instance_t *instance_p = * (storage_p -> ags_socache_instances_pp + stripe);
+	uint32 num_removed = 0;
+	apr_status_t status;
+
+	*more_flag_p = false;
+
+	sweep.agss_now = apr_time_now ();
+	sweep.agss_num_keys = 0;
+	sweep.agss_storage_p = storage_p;
+	sweep.agss_max_keys = (max_entries < AGS_SWEEP_BATCH_SIZE) ? max_entries : AGS_SWEEP_BATCH_SIZE;
+
+	status = LockAPRGlobalStorageStripe (storage_p, stripe, true);
+
+	if (status == APR_SUCCESS)
+		{
+			uint32 i;
+
+			/*
+			 * We can't remove the entries whilst the provider is iterating
+			 * over them so gather them up first.
+			 */
+			status = storage_p -> ags_socache_provider_p -> iterate (instance_p, storage_p -> ags_server_p, &sweep, CollectExpiredEntry, pool_p);
+
+			if ((status != APR_SUCCESS) && (status != APR_INCOMPLETE))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to iterate over stripe " UINT32_FMT " of %s, status %d", stripe, storage_p -> ags_cache_id_s, status);
+				}
+
+			for (i = 0; i < sweep.agss_num_keys; ++ i)
+				{
+					unsigned char *key_p = sweep.agss_keys [i];
+					const unsigned int key_len = sweep.agss_key_lengths [i];
+
+					status = storage_p -> ags_socache_provider_p -> remove (instance_p, storage_p -> ags_server_p, key_p, key_len, pool_p);
+
+					if (status == APR_SUCCESS)
+						{
+							IncrementEntryGeneration (storage_p, GetAPRGlobalStorageKeyHash (storage_p, key_p, key_len));
+							UpdateStripeUsage (storage_p, stripe, -1, - ((apr_int64_t) sweep.agss_entry_lengths [i]), - ((apr_int64_t) sweep.agss_value_lengths [i]));
+							++ num_removed;
+						}
+					else if (sweep.agss_values [i])
+						{
+							/* It's still there, so there's nothing to tell the removal callback */
+							FreeMemory (sweep.agss_values [i]);
+							sweep.agss_values [i] = NULL;
+						}
+				}
+
+			status = UnlockAPRGlobalStorageStripe (storage_p, stripe);
+
+			if (status != APR_SUCCESS)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to unlock stripe " UINT32_FMT ", status %d", stripe, status);
+				}
+
+			for (i = 0; i < sweep.agss_num_keys; ++ i)
+				{
+					if (sweep.agss_values [i])
+						{
+							storage_p -> ags_removal_callback_fn (sweep.agss_keys [i], sweep.agss_key_lengths [i], sweep.agss_values [i], sweep.agss_copied_value_lengths [i], storage_p -> ags_removal_callback_data_p);
+							FreeMemory (sweep.agss_values [i]);
+						}
+
+					FreeMemory (sweep.agss_keys [i]);
+				}
+
+			/*
+			 * If the batch was full there may be more to do, unless nothing
+			 * could be removed in which case trying again won't help.
+			 */
+			*more_flag_p = (sweep.agss_num_keys == sweep.agss_max_keys) && (num_removed > 0);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock stripe " UINT32_FMT " for sweeping, status %d", stripe, status);
+		}
+
+	return num_removed;
+}
+
+
+static apr_status_t CollectExpiredEntry (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p)
+{
+	APRGlobalStorageSweep *sweep_p = (APRGlobalStorageSweep *) user_data_p;
+	APRGlobalStorageEntryHeader header;
+
+	if (ReadStorageEntryHeader (data_p, data_length, &header) && IsEntryExpired (header.ageh_expiry, sweep_p -> agss_now))
+		{
+			unsigned char *key_p = (unsigned char *) AllocMemory (id_length);
+
+			if (key_p)
+				{
+					memcpy (key_p, id_s, id_length);
+
+					sweep_p -> agss_keys [sweep_p -> agss_num_keys] = key_p;
+					sweep_p -> agss_key_lengths [sweep_p -> agss_num_keys] = id_length;
+					sweep_p -> agss_entry_lengths [sweep_p -> agss_num_keys] = data_length;
+					sweep_p -> agss_value_lengths [sweep_p -> agss_num_keys] = header.ageh_value_length;
+					sweep_p -> agss_values [sweep_p -> agss_num_keys] = CopyRemovedEntryValue (sweep_p -> agss_storage_p, id_s, id_length, data_p, data_length, sweep_p -> agss_copied_value_lengths + sweep_p -> agss_num_keys);
+					++ (sweep_p -> agss_num_keys);
+				}
+			else
+				{
+					return APR_ENOMEM;
+				}
+
+			/* Stop once the batch is full */
+			if (sweep_p -> agss_num_keys == sweep_p -> agss_max_keys)
+				{
+					return APR_INCOMPLETE;
+				}
+		}
+
+	return APR_SUCCESS;
+}
+
+
+/*
+ * Only one process needs to sweep each interval, so the first one
+ * to update the shared sweep time does so.
+ */
+static bool ClaimSweep (APRGlobalStorage *storage_p, const apr_time_t now)
+{
+	volatile apr_uint64_t *last_sweep_p = & (storage_p -> ags_shared_data_p -> agssd_last_sweep_time);
+	const apr_uint64_t last_sweep_time = apr_atomic_read64 (last_sweep_p);
+
+	if ((apr_time_t) (now - last_sweep_time) < storage_p -> ags_sweep_interval)
+		{
+			return false;
+		}
+
+	return (apr_atomic_cas64 (last_sweep_p, (apr_uint64_t) now, last_sweep_time) == last_sweep_time);
+}
+
+
+static void * APR_THREAD_FUNC RunSweeper (apr_thread_t *thread_p, void *data_p)
+{
+	APRGlobalStorage *storage_p = (APRGlobalStorage *) data_p;
+	apr_interval_time_t time_since_sweep = 0;
+	const apr_interval_time_t poll_interval = (storage_p -> ags_sweep_interval < AGS_SWEEPER_POLL_INTERVAL) ? storage_p -> ags_sweep_interval : AGS_SWEEPER_POLL_INTERVAL;
+
+	/* Sleep in short steps so that we can stop quickly when the child exits */
+	while (apr_atomic_read32 (& (storage_p -> ags_stop_sweeper)) == 0)
+		{
+			apr_sleep (poll_interval);
+			time_since_sweep += poll_interval;
+
+			if ((time_since_sweep >= storage_p -> ags_sweep_interval) && (apr_atomic_read32 (& (storage_p -> ags_stop_sweeper)) == 0))
+				{
+					time_since_sweep = 0;
+
+					if (ClaimSweep (storage_p, apr_time_now ()))
+						{
+							SweepAPRGlobalStorage (storage_p, AGS_SWEEP_MAX_ENTRIES, storage_p -> ags_sweep_scratch_pool_p);
+							ReconcileAPRGlobalStorageUsage (storage_p, storage_p -> ags_sweep_scratch_pool_p);
+
+							if (storage_p -> ags_sweep_callback_fn)
+								{
+									storage_p -> ags_sweep_callback_fn (storage_p -> ags_sweep_scratch_pool_p, storage_p -> ags_sweep_callback_data_p);
+								}
+
+							apr_pool_clear (storage_p -> ags_sweep_scratch_pool_p);
+						}
+				}
+		}
+
+	apr_thread_exit (thread_p, APR_SUCCESS);
+
+	return NULL;
+}
+
+
+static apr_status_t StopSweeperOnCleanup (void *data_p)
+{
+	APRGlobalStorage *storage_p = (APRGlobalStorage *) data_p;
+
+	StopAPRGlobalStorageSweeper (storage_p);
+
+	/* The pool is being destroyed, so don't let anything else try to use it */
+	storage_p -> ags_sweeper_pool_p = NULL;
+
+	return APR_SUCCESS;
+}
+
+
+static apr_uint32_t GetEntryGeneration (APRGlobalStorage *storage_p, const uint32 hash)
+{
+	return apr_atomic_read32 (storage_p -> ags_shared_data_p -> agssd_generations + (hash % AGS_NUM_SIZE_BUCKETS));
+}
+
+
+static void IncrementEntryGeneration (APRGlobalStorage *storage_p, const uint32 hash)
+{
+	/*
+	 * As with the size hints, keys from different stripes can share a
+	 * bucket so this has to be atomic even though we hold the stripe lock.
+	 */
+	APRGlobalStorageSharedData *shared_data_p = storage_p -> ags_shared_data_p;
+	const uint32 bucket = hash % AGS_NUM_SIZE_BUCKETS;
+
+	apr_atomic_inc32 (shared_data_p -> agssd_generations + bucket);
+	WakeSharedValueWaiters (shared_data_p -> agssd_generations + bucket, shared_data_p -> agssd_generation_waiters + bucket);
+
+	apr_atomic_inc32 (& (shared_data_p -> agssd_sequence));
+	WakeSharedValueWaiters (& (shared_data_p -> agssd_sequence), & (shared_data_p -> agssd_sequence_waiters));
+}
+
+
+static unsigned char *GetObjectKey (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned int *key_len_p)
+{
+	if (storage_p -> ags_make_key_fn)
+		{
+			return storage_p -> ags_make_key_fn (raw_key_p, raw_key_length, key_len_p);
+		}
+
+	*key_len_p = raw_key_length;
+
+	return (unsigned char *) raw_key_p;
+}
+
+
+static void WakeSharedValueWaiters (volatile apr_uint32_t *value_p, volatile apr_uint32_t *num_waiters_p)
+{
+	/*
+	 * The waiters register themselves before checking the value, and the
+	 * value has already been changed, so either they see the change or
+	 * we see them.
+	 */
+	if (apr_atomic_read32 (num_waiters_p) > 0)
+		{
+			#if AGS_HAVE_FUTEXES == 1
+			syscall (SYS_futex, (apr_uint32_t *) value_p, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+			#endif
+		}
+}
+
+
+static bool IsSharedCounterNameValid (const char *name_s)
+{
+	const size_t name_length = strlen (name_s);
+
+	if ((name_length == 0) || (name_length >= AGS_COUNTER_NAME_SIZE))
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Counter name \"%s\" must be between 1 and %d characters long", name_s, AGS_COUNTER_NAME_SIZE - 1);
+			return false;
+		}
+
+	return true;
+}
+
+
+/*
+ * Find a counter by looking at each slot in turn from the one that its
+ * name hashes to, until either it or a free slot is found. If it isn't
+ * there and create_flag is true, it is added with a value of 0 in that
+ * free slot. The caller must hold ags_counters_mutex_p.
+ */
+static APRGlobalStorageCounter *FindSharedCounter (APRGlobalStorage *storage_p, const char *name_s, const bool create_flag)
+{
+	APRGlobalStorageCounter *counters_p = storage_p -> ags_shared_data_p -> agssd_counters;
+	const size_t name_length = strlen (name_s);
+	apr_ssize_t len = (apr_ssize_t) name_length;
+	const apr_uint32_t hash = (apr_uint32_t) apr_hashfunc_default (name_s, &len);
+	uint32 index = hash % AGS_NUM_COUNTERS;
+	uint32 i;
+
+	if (!IsSharedCounterNameValid (name_s))
+		{
+			return NULL;
+		}
+
+	for (i = 0; i < AGS_NUM_COUNTERS; ++ i)
+		{
+			APRGlobalStorageCounter *counter_p = counters_p + index;
+
+			if (* (counter_p -> agsc_name_s) == '\0')
+				{
+					if (create_flag)
+						{
+							memcpy (counter_p -> agsc_name_s, name_s, name_length + 1);
+							counter_p -> agsc_hash = hash;
+							counter_p -> agsc_value = 0;
+
+							return counter_p;
+						}
+
+					return NULL;
+				}
+			else if ((counter_p -> agsc_hash == hash) && (strcmp (counter_p -> agsc_name_s, name_s) == 0))
+				{
+					return counter_p;
+				}
+
+			index = (index + 1) % AGS_NUM_COUNTERS;
+		}
+
+	if (create_flag)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "All %d counters in %s are in use so \"%s\" can't be added", AGS_NUM_COUNTERS, storage_p -> ags_cache_id_s, name_s);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Free a counter's slot. Any of the counters after it that couldn't go
+ * in their own slots are moved back into the gap when they are allowed
+ * to be there, so that FindSharedCounter doesn't stop looking for them
+ * too soon. The caller must hold ags_counters_mutex_p.
+ */
+static void FreeSharedCounter (APRGlobalStorage *storage_p, APRGlobalStorageCounter *counter_p)
+{
+	APRGlobalStorageCounter *counters_p = storage_p -> ags_shared_data_p -> agssd_counters;
+	uint32 free_index = (uint32) (counter_p - counters_p);
+	uint32 index = free_index;
+	uint32 i;
+
+	for (i = 1; i < AGS_NUM_COUNTERS; ++ i)
+		{
+			APRGlobalStorageCounter *next_counter_p;
+			uint32 home_index;
+
+			index = (index + 1) % AGS_NUM_COUNTERS;
+			next_counter_p = counters_p + index;
+
+			if (* (next_counter_p -> agsc_name_s) == '\0')
+				{
+					break;
+				}
+
+			home_index = next_counter_p -> agsc_hash % AGS_NUM_COUNTERS;
+
+			/* It can only move back if the gap is no nearer to it than its own slot */
+			if (((index + AGS_NUM_COUNTERS - home_index) % AGS_NUM_COUNTERS) >= ((index + AGS_NUM_COUNTERS - free_index) % AGS_NUM_COUNTERS))
+				{
+					memcpy (counters_p + free_index, next_counter_p, sizeof (APRGlobalStorageCounter));
+					free_index = index;
+				}
+		}
+
+	memset (counters_p + free_index, 0, sizeof (APRGlobalStorageCounter));
+}
+
+
+static apr_status_t WaitForSharedValueChange (volatile apr_uint32_t *value_p, volatile apr_uint32_t *num_waiters_p, const apr_uint32_t value, const apr_interval_time_t timeout)
+{
+	apr_status_t status = APR_TIMEUP;
+	const apr_time_t deadline = apr_time_now () + timeout;
+
+	apr_atomic_inc32 (num_waiters_p);
+
+	while (true)
+		{
+			apr_interval_time_t remaining;
+			bool polling_flag = true;
+
+			if (apr_atomic_read32 (value_p) != value)
+				{
+					status = APR_SUCCESS;
+					break;
+				}
+
+			remaining = deadline - apr_time_now ();
+
+			if (remaining <= 0)
+				{
+					break;
+				}
+
+			#if AGS_HAVE_FUTEXES == 1
+				{
+					struct timespec wait_time;
+
+					wait_time.tv_sec = (time_t) apr_time_sec (remaining);
+					wait_time.tv_nsec = (long) (apr_time_usec (remaining) * 1000);
+
+					/*
+					 * This only sleeps if the value is still the one that we were given,
+					 * so a change made since we checked it can't be missed. Being woken
+					 * early or interrupted just goes round the loop again.
+					 */
+					if ((syscall (SYS_futex, (apr_uint32_t *) value_p, FUTEX_WAIT, value, &wait_time, NULL, 0) == 0) || (errno == EAGAIN) || (errno == EINTR) || (errno == ETIMEDOUT))
+						{
+							polling_flag = false;
+						}
+				}
+			#endif
+
+			if (polling_flag)
+				{
+					const apr_interval_time_t poll_interval = apr_time_from_msec (APR_GLOBAL_STORAGE_WAIT_POLL_INTERVAL);
+
+					apr_sleep ((remaining < poll_interval) ? remaining : poll_interval);
+				}
+		}
+
+	apr_atomic_dec32 (num_waiters_p);
+
+	return status;
+}
+
+
+static apr_time_t GetEntryExpiry (const APRGlobalStorage *storage_p, apr_interval_time_t ttl)
+{
+	if (ttl == APR_GLOBAL_STORAGE_DEFAULT_TTL)
+		{
+			ttl = storage_p -> ags_default_ttl;
+		}
+
+	return (ttl > 0) ? apr_time_now () + ttl : 0;
+}
+
+
+/*
+ * The shared object cache keeps expired entries for a little longer
+ * than their real expiry so that the sweeper can see and remove them.
+ */
+static apr_time_t GetProviderExpiry (const APRGlobalStorage *storage_p, const apr_time_t expiry)
+{
+	if ((expiry == 0) || (expiry > APR_INT64_MAX - storage_p -> ags_expiry_grace_period))
+		{
+			return APR_INT64_MAX;
+		}
+
+	return expiry + storage_p -> ags_expiry_grace_period;
+}
+
+
+static bool IsEntryExpired (const apr_time_t expiry, const apr_time_t now)
+{
+	return ((expiry != 0) && (expiry <= now));
+}
+
+
+/*
+ * This must be called whilst holding the stripe's lock exclusively,
+ * the atomics are so that the usage can be read at any time.
+ */
+static void UpdateStripeUsage (APRGlobalStorage *storage_p, const uint32 stripe, const apr_int32_t num_entries, const apr_int64_t stored_bytes, const apr_int64_t value_bytes)
+{
+	APRGlobalStorageStripeUsage *usage_p = storage_p -> ags_shared_data_p -> agssd_stripe_usage + stripe;
+
+	/* Adding the unsigned equivalents of negative values wraps round to subtract them */
+	apr_atomic_add32 (& (usage_p -> agssu_num_entries), (apr_uint32_t) num_entries);
+	apr_atomic_add64 (& (usage_p -> agssu_stored_bytes), (apr_uint64_t) stored_bytes);
+	apr_atomic_add64 (& (usage_p -> agssu_value_bytes), (apr_uint64_t) value_bytes);
+}
+
+
+static apr_uint64_t GetStoredBytes (const APRGlobalStorage *storage_p)
+{
+	apr_uint64_t num_bytes = 0;
+	uint32 i;
+
+	for (i = 0; i < storage_p -> ags_num_stripes; ++ i)
+		{
+			num_bytes += apr_atomic_read64 (& (storage_p -> ags_shared_data_p -> agssd_stripe_usage [i].agssu_stored_bytes));
+		}
+
+	return num_bytes;
+}
+
+
+static bool HasCapacityFor (const APRGlobalStorage *storage_p, const apr_uint64_t num_bytes)
+{
+	return ((storage_p -> ags_capacity == 0) || (GetStoredBytes (storage_p) + num_bytes <= storage_p -> ags_capacity));
+}
+
+
+/*
+ * Find the lengths of the entry currently stored for a key, if there is one,
+ * and its expiry time if expiry_p isn't NULL.
+ * This must be called whilst holding the stripe's lock. If removed_value_pp
+ * isn't NULL, the entry is about to be removed so it is also set to a copy
+ * of the value for the removal callback, if that wants one.
+ */
+static bool GetStoredEntryLengths (APRGlobalStorage *storage_p, ap_socache_instance_t *instance_p, const unsigned char *key_p, const unsigned int key_len, const uint32 hash, unsigned int *entry_length_p, unsigned int *value_length_p, apr_time_t *expiry_p, unsigned char **removed_value_pp, unsigned int *removed_value_length_p, apr_pool_t *pool_p)
+{
+	bool found_flag = false;
+	unsigned int array_size = GetEntrySizeHint (storage_p, hash);
+
+	/* If nothing has been stored for this bucket, there's nothing to find */
+	if (array_size > 0)
+		{
+			unsigned char local_buffer [AGS_STACK_ENTRY_SIZE];
+			unsigned char *entry_p = (array_size <= AGS_STACK_ENTRY_SIZE) ? local_buffer : (unsigned char *) AllocMemory (array_size);
+
+			if (entry_p)
+				{
+					apr_status_t status = storage_p -> ags_socache_provider_p -> retrieve (instance_p, storage_p -> ags_server_p, key_p, key_len, entry_p, &array_size, pool_p);
+
+					if (status == APR_SUCCESS)
+						{
+							APRGlobalStorageEntryHeader header;
+
+							if (ReadStorageEntryHeader (entry_p, array_size, &header))
+								{
+									*entry_length_p = array_size;
+									*value_length_p = header.ageh_value_length;
+									found_flag = true;
+
+									if (expiry_p)
+										{
+											*expiry_p = header.ageh_expiry;
+										}
+
+									if (removed_value_pp)
+										{
+											*removed_value_pp = CopyRemovedEntryValue (storage_p, key_p, key_len, entry_p, array_size, removed_value_length_p);
+										}
+								}
+						}
+
+					if (entry_p != local_buffer)
+						{
+							FreeMemory (entry_p);
+						}
+				}
+		}
+
+	return found_flag;
+}
+
+
+/*
+ * Store an entry whilst holding its stripe's lock exclusively. If *replaced_flag_p
+ * is already true, the caller has found the lengths of the entry that this replaces.
+ * Otherwise they are found here when that is cheap enough. The native cache reports
+ * them as part of the store. Other providers would need the old entry to be retrieved
+ * first, which is only worth doing when there is a capacity to check the totals against.
+ * Without one, the entry is counted as new and ReconcileAPRGlobalStorageUsage () puts
+ * the totals right on its next sweep.
+ */
+static apr_status_t StoreStorageEntry (APRGlobalStorage *storage_p, ap_socache_instance_t *instance_p, const unsigned char *key_p, const unsigned int key_len, const apr_time_t expiry, unsigned char *entry_p, const unsigned int entry_length, bool *replaced_flag_p, unsigned int *old_entry_length_p, unsigned int *old_value_length_p)
+{
+	apr_status_t status;
+
+	if ((!*replaced_flag_p) && IsNativeCacheProvider (storage_p -> ags_socache_provider_p))
+		{
+			unsigned char replaced_header [sizeof (APRGlobalStorageEntryHeader)];
+			unsigned int replaced_length = 0;
+
+			status = StoreInNativeCache (instance_p, storage_p -> ags_server_p, key_p, key_len, GetProviderExpiry (storage_p, expiry), entry_p, entry_length, replaced_header, sizeof (replaced_header), &replaced_length, storage_p -> ags_pool_p);
+
+			if ((status == APR_SUCCESS) && (replaced_length > 0))
+				{
+					APRGlobalStorageEntryHeader header;
+
+					/* As with GetStoredEntryLengths (), only valid entries have been counted */
+					if (ReadStorageEntryHeader (replaced_header, replaced_length, &header))
+						{
+							*replaced_flag_p = true;
+							*old_entry_length_p = replaced_length;
+							*old_value_length_p = header.ageh_value_length;
+						}
+				}
+		}
+	else
+		{
+			if ((!*replaced_flag_p) && (storage_p -> ags_capacity > 0))
+				{
+					*replaced_flag_p = GetStoredEntryLengths (storage_p, instance_p, key_p, key_len, GetAPRGlobalStorageKeyHash (storage_p, key_p, key_len), old_entry_length_p, old_value_length_p, NULL, NULL, NULL, storage_p -> ags_pool_p);
+				}
+
+			status = storage_p -> ags_socache_provider_p -> store (instance_p, storage_p -> ags_server_p, key_p, key_len, GetProviderExpiry (storage_p, expiry), entry_p, entry_length, storage_p -> ags_pool_p);
+		}
+
+	return status;
+}
+
+
+/*
+ * Whether the stripes' totals are updated exactly as entries are
+ * replaced, or only estimated until the next reconciliation.
+ */
+static bool IsUsageExact (const APRGlobalStorage *storage_p)
+{
+	return (IsNativeCacheProvider (storage_p -> ags_socache_provider_p) || (storage_p -> ags_capacity > 0));
+}
+
+
+static void TouchEntry (APRGlobalStorage *storage_p, const uint32 hash)
+{
+	apr_atomic_set32 (storage_p -> ags_shared_data_p -> agssd_access_times + (hash % AGS_NUM_SIZE_BUCKETS), (apr_uint32_t) apr_time_sec (apr_time_now ()));
+}
 
-static bool GetLargestEntrySize (APRGlobalStorage *storage_p, unsigned int *size_p);
 
+static void RejectEntry (APRGlobalStorage *storage_p, const unsigned int entry_length, const char * const key_s)
+{
+	apr_atomic_inc32 (& (storage_p -> ags_shared_data_p -> agssd_num_rejections));
 
-/***************************************************/
+	PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Not adding \"%s\" of " UINT32_FMT " bytes as %s is full, %" APR_UINT64_T_FMT " of %" APR_UINT64_T_FMT " bytes used",
+							 key_s, entry_length, storage_p -> ags_cache_id_s, GetStoredBytes (storage_p), storage_p -> ags_capacity);
+}
 
 
-APRGlobalStorage *AllocateAPRGlobalStorage (apr_pool_t *pool_p, apr_hashfunc_t hash_fn, unsigned char *(*make_key_fn) (const void *data_p, uint32 raw_key_length, uint32 *key_len_p), void (*free_key_and_value_fn) (unsigned char *key_p, void *value_p), server_rec *server_p, const char *mutex_filename_s, const char *cache_id_s, const char *provider_name_s,
-	unsigned char *(*compress_fn) (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s),
-	unsigned char *(*decompress_fn) (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s))
+/*
+ * Evict entries, according to the storage's policy, until there is room
+ * for num_bytes more. This must not be called whilst holding any of the
+ * stripe locks.
+ */
+static uint32 MakeRoomInAPRGlobalStorage (APRGlobalStorage *storage_p, const apr_uint64_t num_bytes)
 {
-	APRGlobalStorage *store_p = (APRGlobalStorage *) AllocMemory (sizeof (APRGlobalStorage));
+	uint32 num_evicted = 0;
+	uint32 pass;
 
-	if (store_p)
+	for (pass = 0; (pass < AGS_MAX_EVICTION_PASSES) && (!HasCapacityFor (storage_p, num_bytes)); ++ pass)
 		{
-			memset (store_p, 0, sizeof (APRGlobalStorage));
+			APRGlobalStorageEviction eviction;
+			uint32 i;
 
-			if (InitAPRGlobalStorage (store_p, pool_p, hash_fn, make_key_fn, free_key_and_value_fn, server_p, mutex_filename_s, cache_id_s, provider_name_s, compress_fn, decompress_fn))
+			eviction.agse_storage_p = storage_p;
+			eviction.agse_num_candidates = 0;
+
+			/* Find the best candidates across all of the stripes, locking each one in turn */
+			for (eviction.agse_stripe = 0; eviction.agse_stripe < storage_p -> ags_num_stripes; ++ eviction.agse_stripe)
 				{
-					return store_p;
+					apr_status_t status = LockAPRGlobalStorageStripe (storage_p, eviction.agse_stripe, false);
+
+					if (status == APR_SUCCESS)
+						{
+							storage_p -> ags_socache_provider_p -> iterate (* (storage_p -> ags_socache_instances_pp + eviction.agse_stripe), storage_p -> ags_server_p, &eviction, CollectEvictionCandidate, storage_p -> ags_pool_p);
+							UnlockAPRGlobalStorageStripe (storage_p, eviction.agse_stripe);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock stripe " UINT32_FMT " to find entries to evict, status %d", eviction.agse_stripe, status);
+						}
 				}
 
-			FreeAPRGlobalStorage (store_p);
+			if (eviction.agse_num_candidates == 0)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "No entries can be evicted from %s", storage_p -> ags_cache_id_s);
+					break;
+				}
+
+			qsort (eviction.agse_candidates, eviction.agse_num_candidates, sizeof (APRGlobalStorageEvictionCandidate), CompareEvictionCandidates);
+
+			for (i = 0; i < eviction.agse_num_candidates; ++ i)
+				{
+					APRGlobalStorageEvictionCandidate *candidate_p = eviction.agse_candidates + i;
+
+					if ((!HasCapacityFor (storage_p, num_bytes)) && EvictEntry (storage_p, candidate_p))
+						{
+							++ num_evicted;
+						}
+
+					FreeMemory (candidate_p -> agsec_key_p);
+				}
 		}
-	else
+
+	if (num_evicted > 0)
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate APRGlobalStorage");
+			apr_atomic_add32 (& (storage_p -> ags_shared_data_p -> agssd_num_evictions), num_evicted);
+
+			PrintLog (STM_LEVEL_INFO, __FILE__, __LINE__, "Evicted " UINT32_FMT " entries from %s to make room for %" APR_UINT64_T_FMT " bytes", num_evicted, storage_p -> ags_cache_id_s, num_bytes);
 		}
 
-	return NULL;
+	return num_evicted;
 }
 
 
-bool InitAPRGlobalStorage (APRGlobalStorage *storage_p, apr_pool_t *pool_p, apr_hashfunc_t hash_fn, unsigned char *(*make_key_fn) (const void *data_p, uint32 raw_key_length, uint32 *key_len_p), void (*free_key_and_value_fn) (unsigned char *key_p, void *value_p), server_rec *server_p, const char *mutex_filename_s, const char *cache_id_s, const char *provider_name_s,
-	unsigned char *(*compress_fn) (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s),
-	unsigned char *(*decompress_fn) (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s))
+static apr_status_t CollectEvictionCandidate (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p)
 {
-	ap_socache_provider_t *provider_p = ap_lookup_provider (AP_SOCACHE_PROVIDER_GROUP, provider_name_s, AP_SOCACHE_PROVIDER_VERSION);
+	APRGlobalStorageEviction *eviction_p = (APRGlobalStorageEviction *) user_data_p;
+	APRGlobalStorage *storage_p = eviction_p -> agse_storage_p;
+	APRGlobalStorageEntryHeader header;
+	apr_time_t score;
+	uint32 index;
 
-	if (provider_p)
+	/*
+	 * Entries without an expiry time, such as running jobs, are never
+	 * evicted whatever the policy. If they are all that is left, there
+	 * will be no candidates and the new entry is rejected.
+	 */
+	if ((!ReadStorageEntryHeader (data_p, data_length, &header)) || (header.ageh_expiry == 0))
 		{
-			apr_status_t status = apr_global_mutex_create (& (storage_p -> ags_mutex_p), mutex_filename_s, APR_THREAD_MUTEX_UNNESTED, pool_p);
+			return APR_SUCCESS;
+		}
 
-			if (status == APR_SUCCESS)
-				{
-					char *current_dir_s = GetCurrentWorkingDirectory ();
+	if (storage_p -> ags_full_policy == AGS_FP_EVICT_EXPIRING)
+		{
+			score = header.ageh_expiry;
+		}
+	else
+		{
+			const uint32 hash = GetAPRGlobalStorageKeyHash (storage_p, id_s, id_length);
+
+			score = apr_atomic_read32 (storage_p -> ags_shared_data_p -> agssd_access_times + (hash % AGS_NUM_SIZE_BUCKETS));
+		}
+
+	if (eviction_p -> agse_num_candidates < AGS_EVICTION_BATCH_SIZE)
+		{
+			index = eviction_p -> agse_num_candidates;
+		}
+	else
+		{
+			uint32 i;
 
-					if (current_dir_s)
+			/* Replace the worst of the current candidates if this one is better */
+			index = 0;
+
+			for (i = 1; i < AGS_EVICTION_BATCH_SIZE; ++ i)
+				{
+					if (eviction_p -> agse_candidates [i].agsec_score > eviction_p -> agse_candidates [index].agsec_score)
 						{
-							storage_p ->ags_mapped_mem_p = AllocateSharedMemory (current_dir_s, sizeof (unsigned int), 0666);
+							index = i;
+						}
+				}
+
+			if (score >= eviction_p -> agse_candidates [index].agsec_score)
+				{
+					return APR_SUCCESS;
+				}
+		}
 
-							FreeCopiedString (current_dir_s);
+	{
+		APRGlobalStorageEvictionCandidate *candidate_p = eviction_p -> agse_candidates + index;
+		unsigned char *key_p = (unsigned char *) AllocMemory (id_length);
 
-							if (storage_p ->ags_mapped_mem_p)
-								{
-									storage_p -> ags_entries_p = apr_hash_make_custom (pool_p, hash_fn);
+		if (!key_p)
+			{
+				return APR_ENOMEM;
+			}
+
+		memcpy (key_p, id_s, id_length);
 
-										if (storage_p -> ags_entries_p)
-											{
-												storage_p -> ags_pool_p = pool_p;
-												storage_p -> ags_server_p = server_p;
-												storage_p -> ags_make_key_fn = make_key_fn;
-												storage_p -> ags_free_key_and_value_fn = free_key_and_value_fn;
+		if (index < eviction_p -> agse_num_candidates)
+			{
+				FreeMemory (candidate_p -> agsec_key_p);
+			}
+		else
+			{
+				++ (eviction_p -> agse_num_candidates);
+			}
 
-												storage_p -> ags_cache_id_s = cache_id_s;
-												storage_p -> ags_mutex_lock_filename_s = mutex_filename_s;
+		candidate_p -> agsec_key_p = key_p;
+		candidate_p -> agsec_key_length = id_length;
+		candidate_p -> agsec_stripe = eviction_p -> agse_stripe;
+		candidate_p -> agsec_score = score;
+	}
 
-												storage_p -> ags_socache_instance_p = NULL;
-												storage_p -> ags_socache_provider_p = provider_p;
+	return APR_SUCCESS;
+}
 
-												storage_p -> ags_compress_fn = compress_fn;
-												storage_p -> ags_decompress_fn = decompress_fn;
 
-												apr_pool_cleanup_register (pool_p, storage_p, (const void *) FreeAPRGlobalStorage, apr_pool_cleanup_null);
+static int CompareEvictionCandidates (const void *v0_p, const void *v1_p)
+{
+	const APRGlobalStorageEvictionCandidate *c0_p = (const APRGlobalStorageEvictionCandidate *) v0_p;
+	const APRGlobalStorageEvictionCandidate *c1_p = (const APRGlobalStorageEvictionCandidate *) v1_p;
 
-												return true;
-											}		/* if (storage_p -> ags_entries_p) */
-										else
-											{
-												PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate shared memory hash table");
-											}
+	if (c0_p -> agsec_score < c1_p -> agsec_score)
+		{
+			return -1;
+		}
+	else if (c0_p -> agsec_score > c1_p -> agsec_score)
+		{
+			return 1;
+		}
 
-									FreeSharedMemory (storage_p -> ags_mapped_mem_p);
-								}		/* if (storage_p -> ags_largest_entry_memory_id != -1) */
-							else
-								{
-									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate shared memory for largest chunk size");
-								}
+	return 0;
+}
 
-						}		/* if (mem_key_s) */
-					else
+
+static bool EvictEntry (APRGlobalStorage *storage_p, const APRGlobalStorageEvictionCandidate *candidate_p)
+{
+	bool evicted_flag = false;
+	const uint32 stripe = candidate_p -> agsec_stripe;
+	apr_status_t status = LockAPRGlobalStorageStripe (storage_p, stripe, true);
+
+	if (status == APR_SUCCESS)
+		{
+			ap_socache_instance_t *instance_p = * (storage_p -> ags_socache_instances_pp + stripe);
+			const uint32 hash = GetAPRGlobalStorageKeyHash (storage_p, candidate_p -> agsec_key_p, candidate_p -> agsec_key_length);
+			unsigned int entry_length = 0;
+			unsigned int value_length = 0;
+			apr_time_t expiry = 0;
+			unsigned char *removed_value_p = NULL;
+			unsigned int removed_value_length = 0;
+
+			/*
+			 * The entry may have changed or gone since we found it, including
+			 * being replaced by one that never expires, which we must keep.
+			 */
+			if (GetStoredEntryLengths (storage_p, instance_p, candidate_p -> agsec_key_p, candidate_p -> agsec_key_length, hash, &entry_length, &value_length, &expiry, &removed_value_p, &removed_value_length, storage_p -> ags_pool_p) && (expiry != 0))
+				{
+					status = storage_p -> ags_socache_provider_p -> remove (instance_p, storage_p -> ags_server_p, candidate_p -> agsec_key_p, candidate_p -> agsec_key_length, storage_p -> ags_pool_p);
+
+					if (status == APR_SUCCESS)
 						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create memory key from \"%s\" and \".memory\"", cache_id_s);
+							IncrementEntryGeneration (storage_p, hash);
+							UpdateStripeUsage (storage_p, stripe, -1, - ((apr_int64_t) entry_length), - ((apr_int64_t) value_length));
+							evicted_flag = true;
 						}
+				}
 
-					apr_global_mutex_destroy (storage_p -> ags_mutex_p);
-					storage_p -> ags_mutex_p = NULL;
-				}		/* if (status == APR_SUCCESS) */
-			else
+			UnlockAPRGlobalStorageStripe (storage_p, stripe);
+
+			if (removed_value_p)
 				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create global mutex for shared memory at %s", mutex_filename_s);
-				}
+					if (evicted_flag)
+						{
+							storage_p -> ags_removal_callback_fn (candidate_p -> agsec_key_p, candidate_p -> agsec_key_length, removed_value_p, removed_value_length, storage_p -> ags_removal_callback_data_p);
+						}
 
-		}		/* if (provider_p) */
+					FreeMemory (removed_value_p);
+				}
+		}
 	else
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to find provider \"%s\"", provider_name_s ? provider_name_s : "NULL");
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock stripe " UINT32_FMT " to evict an entry, status %d", stripe, status);
 		}
 
-	return false;
+	return evicted_flag;
 }
 
 
-apr_status_t FreeAPRGlobalStorage (void *data_p)
+/*
+ * Count what is really in each stripe. Anything that we think should be
+ * there but isn't has been dropped by the provider, e.g. when shmcb runs
+ * out of space and overwrites its oldest entries. The stripe's size hints
+ * are also set back to the largest entries that are still stored, so that
+ * lookups stop allocating for entries that have since shrunk or gone.
+ */
+static void ReconcileAPRGlobalStorageUsage (APRGlobalStorage *storage_p, apr_pool_t *pool_p)
 {
-	APRGlobalStorage *storage_p = (APRGlobalStorage *) data_p;
-	DestroyAPRGlobalStorage (storage_p);
-	FreeMemory (storage_p);
-
-	return APR_SUCCESS;
-}
+	const uint32 num_stripes = (storage_p -> ags_num_stripes > 1) ? storage_p -> ags_num_stripes : 1;
+	const uint32 buckets_per_stripe = AGS_NUM_SIZE_BUCKETS / num_stripes;
+	uint32 *bucket_sizes_p = (uint32 *) apr_palloc (pool_p, buckets_per_stripe * sizeof (uint32));
+	uint32 stripe;
 
-
-void DestroyAPRGlobalStorage (APRGlobalStorage *storage_p)
-{
-	if (storage_p)
+	for (stripe = 0; stripe < storage_p -> ags_num_stripes; ++ stripe)
 		{
-			if (storage_p -> ags_entries_p)
+			apr_status_t status = LockAPRGlobalStorageStripe (storage_p, stripe, true);
+
+			if (status == APR_SUCCESS)
 				{
-					unsigned char *key_s = NULL;
-					apr_ssize_t keylen = 0;
-					void *value_p = NULL;
-					apr_hash_index_t *index_p =	apr_hash_first (storage_p -> ags_pool_p, storage_p -> ags_entries_p);
+					APRGlobalStorageStripeCount count;
 
-					while (index_p)
+					memset (&count, 0, sizeof (APRGlobalStorageStripeCount));
+					memset (bucket_sizes_p, 0, buckets_per_stripe * sizeof (uint32));
+					count.agssc_storage_p = storage_p;
+					count.agssc_bucket_sizes_p = bucket_sizes_p;
+
+					status = storage_p -> ags_socache_provider_p -> iterate (* (storage_p -> ags_socache_instances_pp + stripe), storage_p -> ags_server_p, &count, CountStoredEntry, pool_p);
+
+					if (status == APR_SUCCESS)
 						{
-							apr_hash_this (index_p, (const void **) &key_s, &keylen, (void **) &value_p);
+							APRGlobalStorageStripeUsage *usage_p = storage_p -> ags_shared_data_p -> agssd_stripe_usage + stripe;
+							const apr_uint32_t num_entries = apr_atomic_read32 (& (usage_p -> agssu_num_entries));
 
-							storage_p -> ags_free_key_and_value_fn (key_s, value_p);
+							/* Replaced entries may have been counted as new if the totals are only estimates */
+							if ((count.agssc_num_entries < num_entries) && IsUsageExact (storage_p))
+								{
+									const uint32 num_lost = num_entries - count.agssc_num_entries;
 
-							index_p = apr_hash_next (index_p);
-						}
+									apr_atomic_add32 (& (storage_p -> ags_shared_data_p -> agssd_num_lost), num_lost);
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, UINT32_FMT " entries have been dropped from stripe " UINT32_FMT " of %s by its provider", num_lost, stripe, storage_p -> ags_cache_id_s);
+								}
 
-					apr_hash_clear (storage_p -> ags_entries_p);
-				}
+							volatile apr_uint32_t *stripe_bucket_sizes_p = storage_p -> ags_shared_data_p -> agssd_bucket_sizes + (stripe * buckets_per_stripe);
+							uint32 i;
 
-			storage_p -> ags_pool_p = NULL;
+							apr_atomic_set32 (& (usage_p -> agssu_num_entries), count.agssc_num_entries);
+							apr_atomic_set64 (& (usage_p -> agssu_stored_bytes), count.agssc_stored_bytes);
+							apr_atomic_set64 (& (usage_p -> agssu_value_bytes), count.agssc_value_bytes);
 
-			if (storage_p -> ags_mutex_p)
-				{
-					apr_global_mutex_destroy (storage_p -> ags_mutex_p);
-					storage_p -> ags_mutex_p = NULL;
-				}
+							/*
+							 * We hold the stripe exclusively so nothing can be stored in it
+							 * whilst we do this. A reader that sized its buffer from the old,
+							 * larger, hint is unaffected and one that misses a larger entry
+							 * stored after we unlock will retry with the raised hint.
+							 */
+							for (i = 0; i < buckets_per_stripe; ++ i)
+								{
+									apr_atomic_set32 (stripe_bucket_sizes_p + i, * (bucket_sizes_p + i));
+								}
+						}
 
-			if (storage_p -> ags_socache_instance_p)
-				{
-					storage_p -> ags_socache_provider_p -> destroy (storage_p -> ags_socache_instance_p, storage_p -> ags_server_p);
+					UnlockAPRGlobalStorageStripe (storage_p, stripe);
 				}
 
-			if (storage_p -> ags_mapped_mem_p)
-				{
-					FreeSharedMemory (storage_p -> ags_mapped_mem_p);
-				}
+			apr_thread_yield ();
 		}
 }
 
 
-unsigned int HashUUIDForAPR (const char *key_s, apr_ssize_t *len_p)
+static apr_status_t CountStoredEntry (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p)
 {
-	unsigned int res = 0;
-	const uuid_t *id_p = (const uuid_t *) key_s;
-	char *uuid_s = GetUUIDAsString (*id_p);
+	APRGlobalStorageStripeCount *count_p = (APRGlobalStorageStripeCount *) user_data_p;
+	APRGlobalStorageEntryHeader header;
 
-	if (uuid_s)
+	if (ReadStorageEntryHeader (data_p, data_length, &header))
 		{
-			apr_ssize_t len = APR_HASH_KEY_STRING;
-			res = apr_hashfunc_default (uuid_s, &len);
+			APRGlobalStorage *storage_p = count_p -> agssc_storage_p;
+			const uint32 num_stripes = (storage_p -> ags_num_stripes > 1) ? storage_p -> ags_num_stripes : 1;
+			uint32 *bucket_size_p = count_p -> agssc_bucket_sizes_p + (GetEntrySizeBucket (storage_p, GetAPRGlobalStorageKeyHash (storage_p, id_s, id_length)) % (AGS_NUM_SIZE_BUCKETS / num_stripes));
 
-			#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINER
-			PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "uuid \"%s\" res %u len %u", uuid_s, res, len);
-			#endif
+			++ (count_p -> agssc_num_entries);
+			count_p -> agssc_stored_bytes += data_length;
+			count_p -> agssc_value_bytes += header.ageh_value_length;
 
-			FreeCopiedString (uuid_s);
+			if (*bucket_size_p < data_length)
+				{
+					*bucket_size_p = data_length;
+				}
 		}
 
-	return res;
+	return APR_SUCCESS;
 }
 
 
-unsigned char *MakeKeyFromUUID (const void *data_p, uint32 raw_key_length, uint32 *key_len_p)
+/*
+ * Get a copy of a value from the local cache if it is there and
+ * still up to date. The caller takes ownership of the returned copy.
+ */
+static unsigned char *GetFromLocalCache (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len, const apr_uint32_t generation, unsigned int *value_length_p)
 {
-	unsigned char *res_p = NULL;
-	const uuid_t *id_p = (const uuid_t *) data_p;
-	char *uuid_s = GetUUIDAsString (*id_p);
+	APRGlobalStorageLocalCache *cache_p = storage_p -> ags_local_cache_p;
+	unsigned char *value_p = NULL;
 
-	if (uuid_s)
+	if (apr_thread_mutex_lock (cache_p -> agslc_mutex_p) == APR_SUCCESS)
 		{
-			res_p = (unsigned char *) uuid_s;
-			*key_len_p = UUID_STRING_BUFFER_SIZE - 1;
-		}
+			APRGlobalStorageLocalEntry *entry_p = FindLocalEntry (storage_p, key_p, key_len, generation);
 
-	#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINER
-	PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "uuid \"%s\" len %u res \"%s\"", uuid_s, *key_len_p, res_p);
-	#endif
+			if (entry_p)
+				{
+					value_p = (unsigned char *) AllocMemory (entry_p -> agsle_value_length);
 
+					if (value_p)
+						{
+							memcpy (value_p, entry_p -> agsle_value_p, entry_p -> agsle_value_length);
+							*value_length_p = entry_p -> agsle_value_length;
+						}
+				}
+
+			apr_thread_mutex_unlock (cache_p -> agslc_mutex_p);
+		}
+
+	apr_atomic_inc32 (value_p ? & (storage_p -> ags_local_cache_hits) : & (storage_p -> ags_local_cache_misses));
 
-	return res_p;
+	return value_p;
 }
 
 
-void PrintAPRGlobalStorage (APRGlobalStorage *storage_p)
+/*
+ * Run a reader directly on a value in the local cache if it is there
+ * and still up to date.
+ */
+static bool ReadFromLocalCache (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len, const apr_uint32_t generation, APRGlobalStorageReader reader_fn, void *reader_data_p, bool *reader_result_p)
 {
-	PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Begin iterating storage");
+	APRGlobalStorageLocalCache *cache_p = storage_p -> ags_local_cache_p;
+	bool found_flag = false;
 
-	storage_p -> ags_socache_provider_p -> iterate (storage_p -> ags_socache_instance_p,
-                                                  storage_p -> ags_server_p,
-                                                  NULL,
-                                                  IterateOverSOCache,
-                                                  storage_p -> ags_pool_p);
+	if (apr_thread_mutex_lock (cache_p -> agslc_mutex_p) == APR_SUCCESS)
+		{
+			APRGlobalStorageLocalEntry *entry_p = FindLocalEntry (storage_p, key_p, key_len, generation);
 
-	PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "End iterating storage");
+			if (entry_p)
+				{
+					*reader_result_p = RunReader (storage_p, reader_fn, entry_p -> agsle_value_p, entry_p -> agsle_value_length, reader_data_p);
+					found_flag = true;
+				}
+
+			apr_thread_mutex_unlock (cache_p -> agslc_mutex_p);
+		}
+
+	apr_atomic_inc32 (found_flag ? & (storage_p -> ags_local_cache_hits) : & (storage_p -> ags_local_cache_misses));
+
+	return found_flag;
 }
 
 
-static apr_status_t IterateOverSOCache (ap_socache_instance_t *instance,
-    server_rec *s,
-    void *userctx,
-    const unsigned char *id,
-    unsigned int idlen,
-    const unsigned char *data,
-    unsigned int datalen,
-    apr_pool_t *pool)
+/*
+ * Find an up to date entry in the local cache, discarding it if it is out of
+ * date. This must be called with the local cache's mutex held.
+ */
+static APRGlobalStorageLocalEntry *FindLocalEntry (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len, const apr_uint32_t generation)
 {
-	apr_status_t ret = OK;
+	APRGlobalStorageLocalCache *cache_p = storage_p -> ags_local_cache_p;
+	APRGlobalStorageLocalEntry *entry_p = (APRGlobalStorageLocalEntry *) apr_hash_get (cache_p -> agslc_entries_p, key_p, key_len);
 
-	char *copied_id_s = CopyToNewString ((const char *) id, idlen, false);
-
-	if (copied_id_s)
+	if (entry_p)
 		{
-			char *copied_data_s = CopyToNewString ((const char *) data, datalen, false);
-
-			if (copied_data_s)
+			if ((entry_p -> agsle_generation == generation) && (!IsEntryExpired (entry_p -> agsle_expiry, apr_time_now ())))
 				{
-					PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "id \"%s\" idlen %u data \"%s\" datalen %u  %X", copied_id_s, idlen, copied_data_s, datalen, data);
+					/* Move it to the front as it's now the most recently used */
+					if (cache_p -> agslc_head_p != entry_p)
+						{
+							UnlinkLocalEntry (cache_p, entry_p);
 
-					FreeCopiedString (copied_data_s);
+							entry_p -> agsle_next_p = cache_p -> agslc_head_p;
+							cache_p -> agslc_head_p -> agsle_prev_p = entry_p;
+							cache_p -> agslc_head_p = entry_p;
+						}
 				}
 			else
 				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy data \"%s\"", (char *) data);
-					ret = APR_EGENERAL;
-				}
+					apr_atomic_inc32 (& (storage_p -> ags_local_cache_invalidations));
 
-			FreeCopiedString (copied_id_s);
-		}
-	else
-		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to copy id \"%s\"", (char *) id);
-			ret = APR_EGENERAL;
+					apr_hash_set (cache_p -> agslc_entries_p, entry_p -> agsle_key_p, entry_p -> agsle_key_length, NULL);
+					UnlinkLocalEntry (cache_p, entry_p);
+					cache_p -> agslc_current_bytes -= entry_p -> agsle_value_length;
+					FreeMemory (entry_p);
+
+					entry_p = NULL;
+				}
 		}
 
-	return ret;
+	return entry_p;
 }
 
 
-static bool SetLargestEntrySize (APRGlobalStorage *storage_p, const unsigned int size)
+/*
+ * Run a reader, keeping track of how long it takes.
+ */
+static bool RunReader (APRGlobalStorage *storage_p, APRGlobalStorageReader reader_fn, const unsigned char *value_p, const unsigned int value_length, void *reader_data_p)
 {
-	bool success_flag = false;
-	unsigned int *largest_size_p = (unsigned int *) OpenSharedMemory (storage_p -> ags_mapped_mem_p, 0);
-
-	if (largest_size_p)
-		{
-			if (*largest_size_p < size)
-				{
-					*largest_size_p = size;
-				}
+	const apr_time_t start = apr_time_now ();
+	const bool success_flag = reader_fn (value_p, value_length, reader_data_p);
 
-			CloseSharedMemory (storage_p -> ags_mapped_mem_p, largest_size_p);
-			success_flag = true;
-		}
-	else
-		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to open shared memory for largest size entry");
-		}
+	RecordElapsedTime (start, & (storage_p -> ags_num_reads), & (storage_p -> ags_total_read_time), & (storage_p -> ags_max_read_time));
 
 	return success_flag;
 }
 
 
+/*
+ * Keep track of how long a stripe's lock was held for a single entry. This
+ * is called just before the lock is released.
+ */
+static void RecordLockHold (APRGlobalStorage *storage_p, const apr_time_t locked_at)
+{
+	RecordElapsedTime (locked_at, & (storage_p -> ags_num_lock_holds), & (storage_p -> ags_total_lock_hold_time), & (storage_p -> ags_max_lock_hold_time));
+}
+
 
-static bool GetLargestEntrySize (APRGlobalStorage *storage_p, unsigned int *size_p)
+static void RecordElapsedTime (const apr_time_t start, volatile apr_uint32_t *count_p, volatile apr_uint64_t *total_p, volatile apr_uint32_t *max_p)
 {
-	bool success_flag = false;
-	unsigned int *largest_size_p = (unsigned int *) OpenSharedMemory (storage_p -> ags_mapped_mem_p, 0);
+	apr_interval_time_t elapsed = apr_time_now () - start;
+	apr_uint32_t elapsed_usecs;
+	apr_uint32_t max_usecs;
 
-	if (largest_size_p)
+	if (elapsed < 0)
 		{
-			*size_p =	*largest_size_p;
-			 
-			CloseSharedMemory (storage_p -> ags_mapped_mem_p, largest_size_p);
-			success_flag = true;
+			elapsed = 0;
 		}
-	else
+
+	elapsed_usecs = (elapsed > APR_UINT32_MAX) ? APR_UINT32_MAX : (apr_uint32_t) elapsed;
+
+	apr_atomic_inc32 (count_p);
+	apr_atomic_add64 (total_p, (apr_uint64_t) elapsed);
+
+	max_usecs = apr_atomic_read32 (max_p);
+
+	while (elapsed_usecs > max_usecs)
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to open shared memory for largest size entry");
-		}
+			apr_uint32_t previous_usecs = apr_atomic_cas32 (max_p, elapsed_usecs, max_usecs);
 
-	return success_flag;
+			if (previous_usecs == max_usecs)
+				{
+					break;
+				}
+
+			max_usecs = previous_usecs;
+		}
 }
 
 
-bool AddObjectToAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned char *value_p, unsigned int value_length)
+static void AddToLocalCache (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len, const apr_uint32_t generation, const apr_time_t expiry, const unsigned char *value_p, const unsigned int value_length)
 {
-	bool success_flag = false;
-	unsigned int key_len = 0;
-	unsigned char *key_p = NULL;
+	APRGlobalStorageLocalCache *cache_p = storage_p -> ags_local_cache_p;
+	APRGlobalStorageLocalEntry *entry_p;
 
-	if (storage_p -> ags_make_key_fn)
-		{
-			key_p = storage_p -> ags_make_key_fn (raw_key_p, raw_key_length, &key_len);
-		}
-	else
+	/* Don't let a single value flush out everything else */
+	if (value_length > (cache_p -> agslc_max_bytes / 2))
 		{
-			key_p = (unsigned char *) raw_key_p;
-			key_len = raw_key_length;
+			return;
 		}
 
-	if (key_p)
-		{
-			bool alloc_key_flag = false;
-			char *key_s = GetKeyAsValidString ((char *) key_p, key_len, &alloc_key_flag);
-			apr_status_t status = apr_global_mutex_lock (storage_p -> ags_mutex_p);
+	entry_p = (APRGlobalStorageLocalEntry *) AllocMemory (sizeof (APRGlobalStorageLocalEntry) + key_len + value_length);
 
-			if (status == APR_SUCCESS)
-				{
-					apr_time_t end_of_time = APR_INT64_MAX;
+	if (entry_p)
+		{
+			entry_p -> agsle_prev_p = NULL;
+			entry_p -> agsle_next_p = NULL;
 
-					/* store it */
-					if (storage_p -> ags_compress_fn)
-						{
-							unsigned int compressed_data_length = 0;
-							unsigned char *compressed_data_p = storage_p -> ags_compress_fn (value_p, value_length, &compressed_data_length, key_s);
+			entry_p -> agsle_key_p = ((unsigned char *) entry_p) + sizeof (APRGlobalStorageLocalEntry);
+			entry_p -> agsle_key_length = key_len;
+			memcpy (entry_p -> agsle_key_p, key_p, key_len);
 
-							if (compressed_data_p)
-								{
-									status = storage_p -> ags_socache_provider_p -> store (storage_p -> ags_socache_instance_p,
-																							 storage_p -> ags_server_p,
-																								key_p,
-																								key_len,
-																								end_of_time,
-																								compressed_data_p,
-																								compressed_data_length,
-																								storage_p -> ags_pool_p);
+			entry_p -> agsle_value_p = entry_p -> agsle_key_p + key_len;
+			entry_p -> agsle_value_length = value_length;
+			memcpy (entry_p -> agsle_value_p, value_p, value_length);
 
-									FreeMemory (compressed_data_p);
-								}
-							else
-								{
-									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress data, unable to store");
-									status = APR_ENOMEM;
-								}
-						}
-					else
+			entry_p -> agsle_generation = generation;
+			entry_p -> agsle_expiry = expiry;
+
+			if (apr_thread_mutex_lock (cache_p -> agslc_mutex_p) == APR_SUCCESS)
+				{
+					APRGlobalStorageLocalEntry *old_entry_p = (APRGlobalStorageLocalEntry *) apr_hash_get (cache_p -> agslc_entries_p, key_p, key_len);
+
+					if (old_entry_p)
 						{
-							status = storage_p -> ags_socache_provider_p -> store (storage_p -> ags_socache_instance_p,
-																					 storage_p -> ags_server_p,
-																						key_p,
-																						key_len,
-																						end_of_time,
-																						value_p,
-																						value_length,
-																						storage_p -> ags_pool_p);
+							apr_hash_set (cache_p -> agslc_entries_p, old_entry_p -> agsle_key_p, old_entry_p -> agsle_key_length, NULL);
+							UnlinkLocalEntry (cache_p, old_entry_p);
+							cache_p -> agslc_current_bytes -= old_entry_p -> agsle_value_length;
+							FreeMemory (old_entry_p);
 						}
 
-
-					if (status == APR_SUCCESS)
+					/* Make room by dropping the least recently used entries */
+					while (cache_p -> agslc_tail_p && (cache_p -> agslc_current_bytes + value_length > cache_p -> agslc_max_bytes))
 						{
-							success_flag = true;
+							APRGlobalStorageLocalEntry *lru_entry_p = cache_p -> agslc_tail_p;
 
-							if (!SetLargestEntrySize (storage_p, value_length))
-								{
-									PrintErrors (STM_LEVEL_FINE, __FILE__, __LINE__, "Failed to possibly set largest entry size to %u", value_length);
-								}
+							apr_hash_set (cache_p -> agslc_entries_p, lru_entry_p -> agsle_key_p, lru_entry_p -> agsle_key_length, NULL);
+							UnlinkLocalEntry (cache_p, lru_entry_p);
+							cache_p -> agslc_current_bytes -= lru_entry_p -> agsle_value_length;
+							FreeMemory (lru_entry_p);
+						}
 
-							#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINE
-							PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Added \"%s\" length %u, value %.16X length %u to global store", key_s, key_len, value_p, value_length);
-							#endif
+					entry_p -> agsle_next_p = cache_p -> agslc_head_p;
 
+					if (cache_p -> agslc_head_p)
+						{
+							cache_p -> agslc_head_p -> agsle_prev_p = entry_p;
 						}
 					else
 						{
-							PrintErrors (STM_LEVEL_FINE, __FILE__, __LINE__, "Failed to add \"%s\" length %u, value %.16X length %u to global store", key_s, key_len, value_p, value_length);
+							cache_p -> agslc_tail_p = entry_p;
 						}
 
-					status = apr_global_mutex_unlock (storage_p -> ags_mutex_p);
-
-					if (status != APR_SUCCESS)
-						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to unlock mutex, status %s after adding %s", status, key_s);
-						} /* if (status != APR_SUCCESS) */
+					cache_p -> agslc_head_p = entry_p;
+					cache_p -> agslc_current_bytes += value_length;
 
+					apr_hash_set (cache_p -> agslc_entries_p, entry_p -> agsle_key_p, entry_p -> agsle_key_length, entry_p);
 
-				}		/* if (status == APR_SUCCESS) */
-			else
-				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock mutex, status %s to add %s", status, key_s);
-				}
-
-			if (alloc_key_flag)
-				{
-					FreeCopiedString (key_s);
+					apr_thread_mutex_unlock (cache_p -> agslc_mutex_p);
 				}
-
-			/*
-			 * If the key_p isn't pointing to the same address
-			 * as raw_key_p it must be new, so delete it.
-			 */
-			if (key_p != raw_key_p)
+			else
 				{
-					FreeMemory (key_p);
+					FreeMemory (entry_p);
 				}
-		} /* if (key_p) */
-	else
-		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make key");
 		}
-
-	#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
-	PrintAPRGlobalStorage (storage_p);
-	#endif
-
-	return success_flag;
 }
 
 
-
-void *GetObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length)
+static void RemoveFromLocalCache (APRGlobalStorage *storage_p, const unsigned char *key_p, const unsigned int key_len)
 {
-	return FindObjectFromAPRGlobalStorage (storage_p, raw_key_p, raw_key_length, false);
-}
+	APRGlobalStorageLocalCache *cache_p = storage_p -> ags_local_cache_p;
 
+	if (apr_thread_mutex_lock (cache_p -> agslc_mutex_p) == APR_SUCCESS)
+		{
+			APRGlobalStorageLocalEntry *entry_p = (APRGlobalStorageLocalEntry *) apr_hash_get (cache_p -> agslc_entries_p, key_p, key_len);
 
-void *RemoveObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length)
-{
-	return FindObjectFromAPRGlobalStorage (storage_p, raw_key_p, raw_key_length, true);
-}
+			if (entry_p)
+				{
+					apr_hash_set (cache_p -> agslc_entries_p, entry_p -> agsle_key_p, entry_p -> agsle_key_length, NULL);
+					UnlinkLocalEntry (cache_p, entry_p);
+					cache_p -> agslc_current_bytes -= entry_p -> agsle_value_length;
+					FreeMemory (entry_p);
+				}
 
+			apr_thread_mutex_unlock (cache_p -> agslc_mutex_p);
+		}
+}
 
 
-static char *GetKeyAsValidString (char *raw_key_p, unsigned int key_length, bool *alloc_key_flag_p)
+static void UnlinkLocalEntry (APRGlobalStorageLocalCache *cache_p, APRGlobalStorageLocalEntry *entry_p)
 {
-	char *key_s = NULL;
-
-	if (* (raw_key_p + key_length) == '\0')
+	if (entry_p -> agsle_prev_p)
 		{
-			key_s = (char *) raw_key_p;
+			entry_p -> agsle_prev_p -> agsle_next_p = entry_p -> agsle_next_p;
 		}
 	else
 		{
-			key_s = CopyToNewString ((const char * const) raw_key_p, key_length, false);
-
-			if (key_s)
-				{
-					*alloc_key_flag_p = true;
-				}
-			else
-				{
-					key_s = "DUMMY KEY";
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make key");
-				}
+			cache_p -> agslc_head_p = entry_p -> agsle_next_p;
 		}
 
-	#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINER
-	PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Added \"%s\" from raw key of length %u", key_s, key_length);
-	#endif
+	if (entry_p -> agsle_next_p)
+		{
+			entry_p -> agsle_next_p -> agsle_prev_p = entry_p -> agsle_prev_p;
+		}
+	else
+		{
+			cache_p -> agslc_tail_p = entry_p -> agsle_prev_p;
+		}
 
-	return key_s;
+	entry_p -> agsle_prev_p = NULL;
+	entry_p -> agsle_next_p = NULL;
 }
 
 
-static void *FindObjectFromAPRGlobalStorage (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, const bool remove_flag)
+static void ClearLocalCache (APRGlobalStorageLocalCache *cache_p)
 {
-	void *result_p = NULL;
-	unsigned int key_len = 0;
-	unsigned char *key_p = NULL;
+	APRGlobalStorageLocalEntry *entry_p = cache_p -> agslc_head_p;
 
-	if (storage_p -> ags_make_key_fn)
+	while (entry_p)
 		{
-			key_p = storage_p -> ags_make_key_fn (raw_key_p, raw_key_length, &key_len);
-		}
-	else
-		{
-			key_p = (unsigned char *) raw_key_p;
-			key_len = raw_key_length;
+			APRGlobalStorageLocalEntry *next_p = entry_p -> agsle_next_p;
+
+			FreeMemory (entry_p);
+			entry_p = next_p;
 		}
 
-	if (key_p)
-		{
-			apr_status_t status;
-			bool alloc_key_flag = false;
-			char *key_s = GetKeyAsValidString ((char *) key_p, key_len, &alloc_key_flag);
+	cache_p -> agslc_head_p = NULL;
+	cache_p -> agslc_tail_p = NULL;
+	cache_p -> agslc_current_bytes = 0;
+	apr_hash_clear (cache_p -> agslc_entries_p);
+}
 
-			#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
-			PrintLog (STM_LEVEL_FINEST,  __FILE__, __LINE__,"Made key: %s", key_s);
-			#endif
 
+static APRGlobalStorageBatchItem *PrepareBatchItems (APRGlobalStorage *storage_p, const void * const *raw_keys_pp, const unsigned int *raw_key_lengths_p, const uint32 num_keys)
+{
+	APRGlobalStorageBatchItem *items_p = NULL;
 
-			status = apr_global_mutex_lock (storage_p -> ags_mutex_p);
+	if (num_keys > 0)
+		{
+			items_p = (APRGlobalStorageBatchItem *) AllocMemory (num_keys * sizeof (APRGlobalStorageBatchItem));
 
-			if (status == APR_SUCCESS)
+			if (items_p)
 				{
-					unsigned char *temp_p = NULL;
-					unsigned int array_size = 0;
+					uint32 i;
 
-					#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
-					PrintLog (STM_LEVEL_FINEST,  __FILE__, __LINE__,"Locked mutex");
-					#endif
+					memset (items_p, 0, num_keys * sizeof (APRGlobalStorageBatchItem));
 
-					if (GetLargestEntrySize (storage_p, &array_size))
+					for (i = 0; i < num_keys; ++ i)
 						{
-							/* We don't know how big the value might be so allocate the largest value that we've seen so far */
-							temp_p = (unsigned char *) AllocMemoryArray (array_size, sizeof (unsigned char));
+							APRGlobalStorageBatchItem *item_p = items_p + i;
+							const void *raw_key_p = * (raw_keys_pp + i);
+							const unsigned int raw_key_length = * (raw_key_lengths_p + i);
 
-							if (temp_p)
+							if (storage_p -> ags_make_key_fn)
 								{
-									/* get the value */
-									status = storage_p -> ags_socache_provider_p -> retrieve (storage_p -> ags_socache_instance_p,
-																							 storage_p -> ags_server_p,
-									                              key_p,
-									                              key_len,
-									                              temp_p,
-									                              &array_size,
-									                              storage_p -> ags_pool_p);
-
-
-									#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
-									PrintLog (STM_LEVEL_FINEST,  __FILE__, __LINE__,"status %d key %s length %u result_p %0.16X remove_flag %d", status, key_s, key_len, temp_p, remove_flag);
-									#endif
-
-									if (status == APR_SUCCESS)
-										{
-											if (storage_p -> ags_decompress_fn)
-												{
-													unsigned int uncompressed_length = 0;
-													unsigned char *uncompressed_data_p = storage_p -> ags_decompress_fn (temp_p, array_size, &uncompressed_length, key_s);
-
-													if (uncompressed_data_p)
-														{
-															result_p = uncompressed_data_p;
-														}
-													else
-														{
-															PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__,"Failed to uncompress data for \"%s\"", key_s);
-														}
-
-													FreeMemory (temp_p);
-													temp_p = NULL;
-
-												}
-											else
-												{
-													result_p = temp_p;
-												}
-
-											if (remove_flag == true)
-												{
-													status = storage_p -> ags_socache_provider_p -> remove (storage_p -> ags_socache_instance_p,
-													                                                        storage_p -> ags_server_p,
-													                                                        key_p,
-													                                                        key_len,
-													                                                        storage_p -> ags_pool_p);
-
-
-													#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
-													PrintLog (STM_LEVEL_FINEST,  __FILE__, __LINE__,"status after removal %d", status);
-													#endif
-												}
-										}
-									else
-										{
-											PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__,"Failed to allocate temporary memory when looking up key \"%s\"", key_s);
-											FreeMemory (temp_p);
-										}
-
-								}		/* if (temp_p) */
+									item_p -> agsbi_key_p = storage_p -> ags_make_key_fn (raw_key_p, raw_key_length, & (item_p -> agsbi_key_length));
+								}
 							else
 								{
-									PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__,"status %d key %s result_p %0.16X remove_flag %d", status, key_s, temp_p, remove_flag);
-									FreeMemory (temp_p);
+									item_p -> agsbi_key_p = (unsigned char *) raw_key_p;
+									item_p -> agsbi_key_length = raw_key_length;
 								}
 
-						}		/* if (GetLargestEntrySize (storage_p, &array_size)) */
-					else
-						{
-							PrintErrors (STM_LEVEL_SEVERE,  __FILE__, __LINE__,"Failed to get largest entry size when adding \"%s\"", key_s);
+							if (item_p -> agsbi_key_p)
+								{
+									FormatStorageKey (item_p -> agsbi_key_p, item_p -> agsbi_key_length, item_p -> agsbi_key_s);
+									item_p -> agsbi_hash = GetAPRGlobalStorageKeyHash (storage_p, item_p -> agsbi_key_p, item_p -> agsbi_key_length);
+									item_p -> agsbi_stripe = GetAPRGlobalStorageStripe (storage_p, item_p -> agsbi_hash);
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to make key " UINT32_FMT, i);
+								}
 						}
-
-				}		/* if (status == APR_SUCCESS) */
+				}
 			else
 				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock mutex for %s, status %s", key_s, status);
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " UINT32_FMT " batch items", num_keys);
 				}
+		}
 
+	return items_p;
+}
 
-			status = apr_global_mutex_unlock (storage_p -> ags_mutex_p);
 
-			if (status != APR_SUCCESS)
-				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to unlock mutex for %s, status %s after finding %s", key_s, status);
-				} /* if (status != APR_SUCCESS) */
+static void FreeBatchItems (APRGlobalStorageBatchItem *items_p, const void * const *raw_keys_pp, const uint32 num_keys)
+{
+	uint32 i;
 
-			if (key_p != raw_key_p)
+	for (i = 0; i < num_keys; ++ i)
+		{
+			APRGlobalStorageBatchItem *item_p = items_p + i;
+
+			if ((item_p -> agsbi_key_p) && (item_p -> agsbi_key_p != * (raw_keys_pp + i)))
 				{
-					FreeMemory (key_p);
+					FreeMemory (item_p -> agsbi_key_p);
 				}
 
-			if (alloc_key_flag)
+			if (item_p -> agsbi_alloc_value_flag)
 				{
-					FreeCopiedString (key_s);
+					FreeMemory (item_p -> agsbi_value_p);
 				}
-		} /* if (key_p) */
-
-	#if APR_GLOBAL_STORAGE_DEBUG >= STM_LEVEL_FINEST
-	PrintAPRGlobalStorage (storage_p);
-	#endif
 
+			if (item_p -> agsbi_entry_p)
+				{
+					FreeMemory (item_p -> agsbi_entry_p);
+				}
+		}
 
-	return result_p;
+	FreeMemory (items_p);
 }
 
 
-bool IterateOverAPRGlobalStorage (APRGlobalStorage *storage_p, ap_socache_iterator_t *iterator_p, void *data_p)
+/*
+ * Get the values for a set of batch items, taking each stripe's lock
+ * once for all of the keys that belong to it. Any values that weren't
+ * compressed point into the returned buffer, so the caller must keep
+ * it until it has finished with them.
+ */
+static unsigned char *RetrieveBatchItems (APRGlobalStorage *storage_p, APRGlobalStorageBatchItem *items_p, const uint32 num_keys)
 {
-	bool did_all_elements_flag = true;
-	apr_status_t status = apr_global_mutex_lock (storage_p -> ags_mutex_p);
+	apr_size_t buffer_size = 0;
+	unsigned char *buffer_p = NULL;
+	uint32 i;
 
-	if (status == APR_SUCCESS)
+	/* Use the local cache where we can and work out how much space the rest need */
+	for (i = 0; i < num_keys; ++ i)
 		{
-			status = storage_p -> ags_socache_provider_p -> iterate (storage_p -> ags_socache_instance_p, storage_p -> ags_server_p, data_p, iterator_p, storage_p -> ags_pool_p);
+			APRGlobalStorageBatchItem *item_p = items_p + i;
 
-			if (status != APR_SUCCESS)
+			if (item_p -> agsbi_key_p)
 				{
-					did_all_elements_flag = false;
+					apr_atomic_inc32 (& (storage_p -> ags_num_lookups));
+
+					if (storage_p -> ags_local_cache_p)
+						{
+							item_p -> agsbi_generation = GetEntryGeneration (storage_p, item_p -> agsbi_hash);
+							item_p -> agsbi_value_p = GetFromLocalCache (storage_p, item_p -> agsbi_key_p, item_p -> agsbi_key_length, item_p -> agsbi_generation, & (item_p -> agsbi_value_length));
+
+							if (item_p -> agsbi_value_p)
+								{
+									item_p -> agsbi_alloc_value_flag = true;
+									item_p -> agsbi_success_flag = true;
+									continue;
+								}
+						}
+
+					item_p -> agsbi_entry_length = GetEntrySizeHint (storage_p, item_p -> agsbi_hash);
+					buffer_size += item_p -> agsbi_entry_length;
 				}
+		}
 
-			status = apr_global_mutex_unlock (storage_p -> ags_mutex_p);
-		}		/* if (status == APR_SUCCESS) */
+	if (buffer_size == 0)
+		{
+			return NULL;
+		}
 
+	/* A single buffer holds all of the entries that we need to retrieve */
+	buffer_p = (unsigned char *) AllocMemory (buffer_size);
 
-	return did_all_elements_flag;
-}
+	if (buffer_p)
+		{
+			unsigned char *entry_p = buffer_p;
+			uint32 stripe;
 
+			apr_atomic_add64 (& (storage_p -> ags_lookup_bytes_allocated), buffer_size);
 
+			for (stripe = 0; stripe < storage_p -> ags_num_stripes; ++ stripe)
+				{
+					bool locked_flag = false;
+					bool failed_flag = false;
 
-bool PreConfigureGlobalStorage (APRGlobalStorage *storage_p, apr_pool_t *config_pool_p)
-{
-	bool success_flag = false;
-	apr_status_t status = ap_mutex_register (config_pool_p, storage_p -> ags_cache_id_s, NULL, APR_LOCK_DEFAULT, 0);
+					for (i = 0; (i < num_keys) && (!failed_flag); ++ i)
+						{
+							APRGlobalStorageBatchItem *item_p = items_p + i;
 
-	if (status == APR_SUCCESS)
-		{
-			storage_p -> ags_socache_provider_p = ap_lookup_provider (AP_SOCACHE_PROVIDER_GROUP, AP_SOCACHE_DEFAULT_PROVIDER, AP_SOCACHE_PROVIDER_VERSION);
-			success_flag = true;
-		}
-	else
-		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "failed to register %s mutex", storage_p -> ags_cache_id_s);
-		}
+							if ((item_p -> agsbi_entry_length > 0) && (item_p -> agsbi_stripe == stripe) && (!item_p -> agsbi_success_flag))
+								{
+									unsigned int entry_length = item_p -> agsbi_entry_length;
+									apr_status_t status;
 
-	return success_flag;
-}
+									if ((!locked_flag) && (!storage_p -> ags_lock_free_reads_flag))
+										{
+											status = LockAPRGlobalStorageStripe (storage_p, stripe, false);
 
+											if (status == APR_SUCCESS)
+												{
+													locked_flag = true;
+												}
+											else
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to lock stripe " UINT32_FMT ", status %d", stripe, status);
+													failed_flag = true;
+													continue;
+												}
+										}
 
-bool PostConfigureGlobalStorage  (APRGlobalStorage *storage_p, apr_pool_t *server_pool_p, server_rec *server_p, const char *provider_name_s, struct ap_socache_hints *cache_hints_p)
-{
-	apr_status_t res;
-	bool success_flag = true;
+									status = RetrieveStorageEntry (storage_p, * (storage_p -> ags_socache_instances_pp + stripe), item_p -> agsbi_key_p, item_p -> agsbi_key_length, item_p -> agsbi_hash, entry_p, &entry_length, & (item_p -> agsbi_entry_p));
 
-	/*
-	 * Have we got a valid set of config directives?
-	 */
-	if (storage_p -> ags_socache_provider_p)
-		{
-			/* We have socache_provider, but do not have socache_instance. This should
-			 * happen only when using "default" socache_provider, so create default
-			 * socache_instance in this case. */
-			if (! (storage_p -> ags_socache_instance_p))
-				{
-					const char *err_msg_s = storage_p -> ags_socache_provider_p -> create (& (storage_p -> ags_socache_instance_p), NULL, server_pool_p, server_pool_p);
+									if (status == APR_SUCCESS)
+										{
+											/* We'll decode these outside of the lock */
+											item_p -> agsbi_value_p = (item_p -> agsbi_entry_p) ? item_p -> agsbi_entry_p : entry_p;
+											item_p -> agsbi_value_length = entry_length;
+											item_p -> agsbi_success_flag = true;
+										}
 
-					if (err_msg_s)
+									entry_p += item_p -> agsbi_entry_length;
+								}
+						}
+
+					if (locked_flag)
 						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "failed to create mod_socache_shmcb socache instance: %s", err_msg_s);
-							success_flag = false;
+							apr_status_t status = UnlockAPRGlobalStorageStripe (storage_p, stripe);
+
+							if (status != APR_SUCCESS)
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to unlock stripe " UINT32_FMT ", status %d", stripe, status);
+								}
 						}
 				}
 
-			if (success_flag)
+			/* Now get the values out of the retrieved entries */
+			for (i = 0; i < num_keys; ++ i)
 				{
-					res = ap_global_mutex_create (& (storage_p -> ags_mutex_p), NULL, storage_p -> ags_cache_id_s, NULL, server_p, server_pool_p, 0);
+					APRGlobalStorageBatchItem *item_p = items_p + i;
 
-					if (res == APR_SUCCESS)
+					if ((item_p -> agsbi_success_flag) && (!item_p -> agsbi_alloc_value_flag))
 						{
-							res = storage_p -> ags_socache_provider_p -> init (storage_p -> ags_socache_instance_p, storage_p -> ags_cache_id_s, cache_hints_p, server_p, server_pool_p);
+							unsigned char *retrieved_p = item_p -> agsbi_value_p;
 
-							if (res != APR_SUCCESS)
+							item_p -> agsbi_value_p = NULL;
+							item_p -> agsbi_success_flag = GetStorageEntryValue (storage_p, retrieved_p, item_p -> agsbi_value_length, & (item_p -> agsbi_value_p), & (item_p -> agsbi_value_length), & (item_p -> agsbi_alloc_value_flag), & (item_p -> agsbi_expiry), item_p -> agsbi_key_s);
+
+							if (item_p -> agsbi_success_flag)
 								{
-									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to initialise %s cache", storage_p -> ags_cache_id_s);
-									success_flag = false;
+									TouchEntry (storage_p, item_p -> agsbi_hash);
+								}
+
+							if ((item_p -> agsbi_success_flag) && (storage_p -> ags_local_cache_p))
+								{
+									AddToLocalCache (storage_p, item_p -> agsbi_key_p, item_p -> agsbi_key_length, item_p -> agsbi_generation, item_p -> agsbi_expiry, item_p -> agsbi_value_p, item_p -> agsbi_value_length);
 								}
-						}
-					else
-						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "failed to create %s mutex", storage_p -> ags_cache_id_s);
-							success_flag = false;
 						}
 				}
 		}
 	else
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Please select a socache provider with AuthnCacheSOCache (no default found on this platform). Maybe you need to load mod_socache_shmcb or another socache module first");
-			success_flag = false;
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " bytes for batch lookup", buffer_size);
 		}
 
-
-	return success_flag;
+	return buffer_p;
 }
 
 
-bool InitAPRGlobalStorageForChild (APRGlobalStorage *storage_p, apr_pool_t *pool_p)
+/*
+ * Copy the retrieved values into a single allocation made up of an
+ * array of pointers to the values followed by the values themselves.
+ */
+static void **PackBatchValues (APRGlobalStorage *storage_p, APRGlobalStorageBatchItem *items_p, const uint32 num_keys, unsigned int *value_lengths_p)
 {
-	bool success_flag = false;
+	apr_size_t size = APR_ALIGN_DEFAULT (num_keys * sizeof (void *));
+	void **values_pp = NULL;
+	uint32 i;
 
-	/* Now that we are in a child process, we have to reconnect
-	 * to the global mutex and the shared segment. We also
-	 * have to find out the base address of the segment, in case
-	 * it moved to a new address. */
-	apr_status_t res = apr_global_mutex_child_init (& (storage_p -> ags_mutex_p), storage_p -> ags_mutex_lock_filename_s, pool_p);
+	for (i = 0; i < num_keys; ++ i)
+		{
+			APRGlobalStorageBatchItem *item_p = items_p + i;
+
+			if (item_p -> agsbi_success_flag)
+				{
+					size += APR_ALIGN_DEFAULT (item_p -> agsbi_value_length);
+				}
+		}
+
+	values_pp = (void **) AllocMemory (size);
 
-	if (res != APR_SUCCESS)
+	if (values_pp)
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to attach grassroots child to global mutex file '%s', res %d", storage_p -> ags_mutex_lock_filename_s, res);
+			unsigned char *value_p = ((unsigned char *) values_pp) + APR_ALIGN_DEFAULT (num_keys * sizeof (void *));
+
+			for (i = 0; i < num_keys; ++ i)
+				{
+					APRGlobalStorageBatchItem *item_p = items_p + i;
+
+					if (item_p -> agsbi_success_flag)
+						{
+							memcpy (value_p, item_p -> agsbi_value_p, item_p -> agsbi_value_length);
+							* (values_pp + i) = value_p;
+
+							if (value_lengths_p)
+								{
+									* (value_lengths_p + i) = item_p -> agsbi_value_length;
+								}
+
+							value_p += APR_ALIGN_DEFAULT (item_p -> agsbi_value_length);
+						}
+					else
+						{
+							* (values_pp + i) = NULL;
+
+							if (value_lengths_p)
+								{
+									* (value_lengths_p + i) = 0;
+								}
+						}
+				}
 		}
 	else
 		{
-			success_flag = true;
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " bytes for batch results", size);
 		}
 
-	return success_flag;
+	return values_pp;
 }
@@ -0,0 +1,308 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * apr_job_object_cache.c
+ */
+
+#include <string.h>
+
+#include "apr_atomic.h"
+#include "apr_time.h"
+
+#include "apr_job_object_cache.h"
+#include "streams.h"
+
+
+/*
+ * From version 2.11, jansson changes its reference counts atomically
+ * so a cached job can be shared whilst the threads copy it.
+ */
+#if JANSSON_VERSION_HEX >= 0x020b00
+#define AJOC_SHARE_CACHED_JOBS (1)
+#else
+#define AJOC_SHARE_CACHED_JOBS (0)
+#endif
+
+
+static APRJobObjectCacheEntry *FindEntry (APRJobObjectCache *cache_p, const uuid_t job_key);
+
+static void UnlinkEntry (APRJobObjectCache *cache_p, APRJobObjectCacheEntry *entry_p);
+
+static void FreeEntry (APRJobObjectCache *cache_p, APRJobObjectCacheEntry *entry_p);
+
+static apr_status_t ReleaseCachedJobs (void *data_p);
+
+
+/**************************/
+
+
+APRJobObjectCache *AllocateAPRJobObjectCache (const uint32 max_jobs, apr_pool_t *pool_p)
+{
+	APRJobObjectCache *cache_p = (APRJobObjectCache *) apr_pcalloc (pool_p, sizeof (APRJobObjectCache));
+
+	if (cache_p)
+		{
+			APRJobObjectCacheEntry *entries_p = (APRJobObjectCacheEntry *) apr_pcalloc (pool_p, max_jobs * sizeof (APRJobObjectCacheEntry));
+
+			if (entries_p)
+				{
+					apr_status_t status = apr_thread_mutex_create (& (cache_p -> ajoc_mutex_p), APR_THREAD_MUTEX_UNNESTED, pool_p);
+
+					if (status == APR_SUCCESS)
+						{
+							cache_p -> ajoc_entries_p = apr_hash_make (pool_p);
+
+							if (cache_p -> ajoc_entries_p)
+								{
+									uint32 i;
+
+									for (i = 0; i < max_jobs; ++ i)
+										{
+											(entries_p + i) -> ajoce_next_p = cache_p -> ajoc_free_p;
+											cache_p -> ajoc_free_p = entries_p + i;
+										}
+
+									apr_atomic_set32 (& (cache_p -> ajoc_num_hits), 0);
+									apr_atomic_set32 (& (cache_p -> ajoc_num_misses), 0);
+
+									apr_pool_cleanup_register (pool_p, cache_p, ReleaseCachedJobs, apr_pool_cleanup_null);
+
+									return cache_p;
+								}
+
+							apr_thread_mutex_destroy (cache_p -> ajoc_mutex_p);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create job object cache mutex, status %d", status);
+						}
+				}
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate job object cache for " UINT32_FMT " jobs", max_jobs);
+
+	return NULL;
+}
+
+
+json_t *GetJobFromAPRJobObjectCache (APRJobObjectCache *cache_p, const uuid_t job_key, const apr_uint32_t generation)
+{
+	json_t *job_json_p = NULL;
+	json_t *cached_json_p = NULL;
+
+	if (apr_thread_mutex_lock (cache_p -> ajoc_mutex_p) == APR_SUCCESS)
+		{
+			APRJobObjectCacheEntry *entry_p = FindEntry (cache_p, job_key);
+
+			if (entry_p)
+				{
+					if ((entry_p -> ajoce_generation == generation) && (apr_time_now () - entry_p -> ajoce_time < apr_time_from_sec (APR_JOB_OBJECT_CACHE_MAX_AGE)))
+						{
+							/* Move it to the front as it's now the most recently used */
+							if (cache_p -> ajoc_head_p != entry_p)
+								{
+									UnlinkEntry (cache_p, entry_p);
+
+									entry_p -> ajoce_next_p = cache_p -> ajoc_head_p;
+									cache_p -> ajoc_head_p -> ajoce_prev_p = entry_p;
+									cache_p -> ajoc_head_p = entry_p;
+								}
+
+							/*
+							 * The caller gets its own copy as building a ServiceJob from the JSON
+							 * changes it. The reference keeps the cached copy alive if the entry
+							 * is dropped whilst we are copying it.
+							 */
+							#if AJOC_SHARE_CACHED_JOBS
+							cached_json_p = json_incref (entry_p -> ajoce_job_json_p);
+							#else
+							job_json_p = json_deep_copy (entry_p -> ajoce_job_json_p);
+							#endif
+						}
+					else
+						{
+							FreeEntry (cache_p, entry_p);
+						}
+				}
+
+			apr_thread_mutex_unlock (cache_p -> ajoc_mutex_p);
+		}
+
+	if (cached_json_p)
+		{
+			job_json_p = json_deep_copy (cached_json_p);
+			json_decref (cached_json_p);
+		}
+
+	apr_atomic_inc32 (job_json_p ? & (cache_p -> ajoc_num_hits) : & (cache_p -> ajoc_num_misses));
+
+	return job_json_p;
+}
+
+
+void AddJobToAPRJobObjectCache (APRJobObjectCache *cache_p, const uuid_t job_key, const apr_uint32_t generation, json_t *job_json_p)
+{
+	/* As with the copies that we hand out, the cache keeps its own copy that nobody else can reach */
+	json_t *cached_json_p = json_deep_copy (job_json_p);
+
+	if (!cached_json_p)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to copy job for job object cache");
+			return;
+		}
+
+	if (apr_thread_mutex_lock (cache_p -> ajoc_mutex_p) == APR_SUCCESS)
+		{
+			APRJobObjectCacheEntry *entry_p = FindEntry (cache_p, job_key);
+
+			if (entry_p)
+				{
+					FreeEntry (cache_p, entry_p);
+				}
+
+			/* Make room by dropping the least recently used entry */
+			if ((! (cache_p -> ajoc_free_p)) && (cache_p -> ajoc_tail_p))
+				{
+					FreeEntry (cache_p, cache_p -> ajoc_tail_p);
+				}
+
+			entry_p = cache_p -> ajoc_free_p;
+
+			if (entry_p)
+				{
+					cache_p -> ajoc_free_p = entry_p -> ajoce_next_p;
+
+					uuid_copy (entry_p -> ajoce_key, job_key);
+					entry_p -> ajoce_generation = generation;
+					entry_p -> ajoce_time = apr_time_now ();
+					entry_p -> ajoce_job_json_p = cached_json_p;
+					cached_json_p = NULL;
+
+					entry_p -> ajoce_prev_p = NULL;
+					entry_p -> ajoce_next_p = cache_p -> ajoc_head_p;
+
+					if (cache_p -> ajoc_head_p)
+						{
+							cache_p -> ajoc_head_p -> ajoce_prev_p = entry_p;
+						}
+					else
+						{
+							cache_p -> ajoc_tail_p = entry_p;
+						}
+
+					cache_p -> ajoc_head_p = entry_p;
+
+					apr_hash_set (cache_p -> ajoc_entries_p, entry_p -> ajoce_key, UUID_RAW_SIZE, entry_p);
+				}
+
+			apr_thread_mutex_unlock (cache_p -> ajoc_mutex_p);
+		}
+
+	if (cached_json_p)
+		{
+			json_decref (cached_json_p);
+		}
+}
+
+
+void RemoveJobFromAPRJobObjectCache (APRJobObjectCache *cache_p, const uuid_t job_key)
+{
+	if (apr_thread_mutex_lock (cache_p -> ajoc_mutex_p) == APR_SUCCESS)
+		{
+			APRJobObjectCacheEntry *entry_p = FindEntry (cache_p, job_key);
+
+			if (entry_p)
+				{
+					FreeEntry (cache_p, entry_p);
+				}
+
+			apr_thread_mutex_unlock (cache_p -> ajoc_mutex_p);
+		}
+}
+
+
+void GetAPRJobObjectCacheCounts (APRJobObjectCache *cache_p, uint32 *hits_p, uint32 *misses_p)
+{
+	*hits_p = apr_atomic_read32 (& (cache_p -> ajoc_num_hits));
+	*misses_p = apr_atomic_read32 (& (cache_p -> ajoc_num_misses));
+}
+
+
+/**************************/
+
+
+/*
+ * This must be called with the cache's mutex held.
+ */
+static APRJobObjectCacheEntry *FindEntry (APRJobObjectCache *cache_p, const uuid_t job_key)
+{
+	return (APRJobObjectCacheEntry *) apr_hash_get (cache_p -> ajoc_entries_p, job_key, UUID_RAW_SIZE);
+}
+
+
+static void UnlinkEntry (APRJobObjectCache *cache_p, APRJobObjectCacheEntry *entry_p)
+{
+	if (entry_p -> ajoce_prev_p)
+		{
+			entry_p -> ajoce_prev_p -> ajoce_next_p = entry_p -> ajoce_next_p;
+		}
+	else
+		{
+			cache_p -> ajoc_head_p = entry_p -> ajoce_next_p;
+		}
+
+	if (entry_p -> ajoce_next_p)
+		{
+			entry_p -> ajoce_next_p -> ajoce_prev_p = entry_p -> ajoce_prev_p;
+		}
+	else
+		{
+			cache_p -> ajoc_tail_p = entry_p -> ajoce_prev_p;
+		}
+
+	entry_p -> ajoce_prev_p = NULL;
+	entry_p -> ajoce_next_p = NULL;
+}
+
+
+/*
+ * Remove an entry and put it on the free list. This must be called
+ * with the cache's mutex held.
+ */
+static void FreeEntry (APRJobObjectCache *cache_p, APRJobObjectCacheEntry *entry_p)
+{
+	apr_hash_set (cache_p -> ajoc_entries_p, entry_p -> ajoce_key, UUID_RAW_SIZE, NULL);
+	UnlinkEntry (cache_p, entry_p);
+
+	json_decref (entry_p -> ajoce_job_json_p);
+	entry_p -> ajoce_job_json_p = NULL;
+
+	entry_p -> ajoce_next_p = cache_p -> ajoc_free_p;
+	cache_p -> ajoc_free_p = entry_p;
+}
+
+
+static apr_status_t ReleaseCachedJobs (void *data_p)
+{
+	APRJobObjectCache *cache_p = (APRJobObjectCache *) data_p;
+
+	while (cache_p -> ajoc_head_p)
+		{
+			FreeEntry (cache_p, cache_p -> ajoc_head_p);
+		}
+
+	return APR_SUCCESS;
+}
@@ -0,0 +1,226 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * apr_job_watch.c
+ */
+
+#include <string.h>
+
+#include "apr_strings.h"
+#include "apr_time.h"
+
+#include "apr_job_watch.h"
+#include "streams.h"
+
+
+static void RefreshAPRWatchedJob (APRJobsManager *manager_p, APRWatchedJob *job_p);
+
+static uint32 RefreshAPRJobWatch (APRJobWatch *watch_p);
+
+
+/**************************/
+
+
+APRJobWatch *AllocateAPRJobWatch (APRJobsManager *manager_p, const char *ids_s, const apr_time_t since, apr_pool_t *pool_p)
+{
+	APRJobWatch *watch_p = (APRJobWatch *) apr_palloc (pool_p, sizeof (APRJobWatch));
+
+	if (watch_p)
+		{
+			watch_p -> ajw_jobs_p = (APRWatchedJob *) apr_pcalloc (pool_p, APR_JOB_WATCH_MAX_JOBS * sizeof (APRWatchedJob));
+
+			if (watch_p -> ajw_jobs_p)
+				{
+					char *copied_ids_s = apr_pstrdup (pool_p, ids_s);
+
+					watch_p -> ajw_manager_p = manager_p;
+					watch_p -> ajw_num_jobs = 0;
+
+					if (copied_ids_s)
+						{
+							char *state_s = NULL;
+							char *id_s = apr_strtok (copied_ids_s, ", ", &state_s);
+
+							while (id_s && (watch_p -> ajw_num_jobs < APR_JOB_WATCH_MAX_JOBS))
+								{
+									APRWatchedJob *job_p = (watch_p -> ajw_jobs_p) + (watch_p -> ajw_num_jobs);
+
+									if (ConvertStringToUUID (id_s, job_p -> awj_key))
+										{
+											uint32 i;
+
+											/* Ignore any repeated ids so that each job is only reported once */
+											for (i = 0; i < watch_p -> ajw_num_jobs; ++ i)
+												{
+													if (uuid_compare (watch_p -> ajw_jobs_p [i].awj_key, job_p -> awj_key) == 0)
+														{
+															break;
+														}
+												}
+
+											if (i == watch_p -> ajw_num_jobs)
+												{
+													ConvertUUIDToString (job_p -> awj_key, job_p -> awj_uuid_s);
+													RefreshAPRWatchedJob (manager_p, job_p);
+
+													/* Anything updated after the client last heard, or gone since then, is reported straight away */
+													job_p -> awj_reported_time = since;
+													job_p -> awj_reported_found_flag = true;
+
+													++ (watch_p -> ajw_num_jobs);
+												}
+										}
+									else
+										{
+											PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Ignoring invalid job id \"%s\" in job watch", id_s);
+										}
+
+									id_s = apr_strtok (NULL, ", ", &state_s);
+								}
+
+							if (watch_p -> ajw_num_jobs > 0)
+								{
+									return watch_p;
+								}
+						}
+				}
+		}
+
+	return NULL;
+}
+
+
+uint32 WaitForAPRJobWatchChanges (APRJobWatch *watch_p, const apr_time_t deadline)
+{
+	/* Get the sequence before checking so that any change made after the check ends the wait */
+	apr_uint32_t sequence = GetServiceJobsSequenceFromAPRJobsManager (watch_p -> ajw_manager_p);
+	uint32 num_changed = RefreshAPRJobWatch (watch_p);
+
+	while (num_changed == 0)
+		{
+			const apr_interval_time_t timeout = deadline - apr_time_now ();
+
+			if (timeout <= 0)
+				{
+					break;
+				}
+
+			/*
+			 * A single ServiceJob is only woken by the changes in its own bucket,
+			 * whereas several of them have to be woken by any change at all.
+			 */
+			if (watch_p -> ajw_num_jobs == 1)
+				{
+					const APRWatchedJob *job_p = watch_p -> ajw_jobs_p;
+
+					WaitForServiceJobStatusChange (watch_p -> ajw_manager_p, job_p -> awj_key, job_p -> awj_generation, timeout);
+				}
+			else
+				{
+					WaitForServiceJobsChange (watch_p -> ajw_manager_p, sequence, timeout);
+					sequence = GetServiceJobsSequenceFromAPRJobsManager (watch_p -> ajw_manager_p);
+				}
+
+			num_changed = RefreshAPRJobWatch (watch_p);
+		}
+
+	return num_changed;
+}
+
+
+bool HasAPRWatchedJobChanged (const APRWatchedJob *job_p)
+{
+	if (job_p -> awj_found_flag != job_p -> awj_reported_found_flag)
+		{
+			return true;
+		}
+
+	return (job_p -> awj_found_flag && (job_p -> awj_status.ajs_update_time > job_p -> awj_reported_time));
+}
+
+
+void SetAPRWatchedJobReported (APRWatchedJob *job_p)
+{
+	job_p -> awj_reported_found_flag = job_p -> awj_found_flag;
+
+	if (job_p -> awj_found_flag)
+		{
+			job_p -> awj_reported_time = job_p -> awj_status.ajs_update_time;
+		}
+}
+
+
+bool HaveAPRJobWatchJobsFinished (const APRJobWatch *watch_p)
+{
+	uint32 i;
+
+	for (i = 0; i < watch_p -> ajw_num_jobs; ++ i)
+		{
+			const APRWatchedJob *job_p = (watch_p -> ajw_jobs_p) + i;
+
+			if ((job_p -> awj_found_flag) && (!HasAPRJobStatusFinished (& (job_p -> awj_status))))
+				{
+					return false;
+				}
+		}
+
+	return true;
+}
+
+
+json_t *GetAPRWatchedJobAsJSON (const APRWatchedJob *job_p)
+{
+	return GetAPRJobStatusAsJSON (job_p -> awj_uuid_s, (job_p -> awj_found_flag) ? & (job_p -> awj_status) : NULL);
+}
+
+
+/**************************/
+
+
+static void RefreshAPRWatchedJob (APRJobsManager *manager_p, APRWatchedJob *job_p)
+{
+	/*
+	 * Get the generation before the status so that a change made in between
+	 * leaves a stale generation behind and is picked up on the next refresh.
+	 */
+	job_p -> awj_generation = GetServiceJobStatusGenerationFromAPRJobsManager (manager_p, job_p -> awj_key);
+	job_p -> awj_found_flag = GetServiceJobStatusFromAPRJobsManager (manager_p, job_p -> awj_key, & (job_p -> awj_status));
+}
+
+
+static uint32 RefreshAPRJobWatch (APRJobWatch *watch_p)
+{
+	uint32 num_changed = 0;
+	uint32 i;
+
+	for (i = 0; i < watch_p -> ajw_num_jobs; ++ i)
+		{
+			APRWatchedJob *job_p = (watch_p -> ajw_jobs_p) + i;
+
+			/* Only lock the cache to get the status when something in its bucket has changed */
+			if (GetServiceJobStatusGenerationFromAPRJobsManager (watch_p -> ajw_manager_p, job_p -> awj_key) != job_p -> awj_generation)
+				{
+					RefreshAPRWatchedJob (watch_p -> ajw_manager_p, job_p);
+				}
+
+			if (HasAPRWatchedJobChanged (job_p))
+				{
+					++ num_changed;
+				}
+		}
+
+	return num_changed;
+}
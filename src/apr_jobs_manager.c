@@ -21,25 +21,27 @@
  */
 
 #include <limits.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "apr_hash.h"
+#include "apr_thread_proc.h"
 
 #include "jobs_manager.h"
 
 #define ALLOCATE_APR_JOBS_MANAGER_TAGS (1)
 #include "apr_jobs_manager.h"
+#include "apr_thread_buffers.h"
 
 #include "service_job.h"
 #include "mod_grassroots_config.h"
+#include "stored_job_encoding.h"
 #include "string_utils.h"
 #include "memory_allocations.h"
 #include "util_mutex.h"
 
 #include "uuid_util.h"
 
-#ifdef USE_BZIP2
-#include "bzip2_util.h"
-#endif
 
 #ifdef _DEBUG
 #define APR_JOBS_MANAGER_DEBUG	(STM_LEVEL_FINEST)
@@ -48,22 +50,132 @@
 #endif
 
 
+/*
+ * A status record copied out of the jobs cache along
+ * with the raw uuid of its ServiceJob.
+ */
+typedef struct APRStoredStatus
+{
+	unsigned char ass_key [UUID_RAW_SIZE];
+	APRJobStatus ass_status;
+} APRStoredStatus;
+
+
+/*
+ * A ServiceJob copied out of the jobs cache so that it
+ * can be rebuilt once the cache has been unlocked.
+ */
+typedef struct APRStoredJob
+{
+	unsigned char *asj_value_p;
+	unsigned int asj_value_length;
+	const APRJobStatus *asj_status_p;
+	json_t *asj_job_json_p;
+	ServiceJob *asj_job_p;
+} APRStoredJob;
+
+
 typedef struct APRSOCacheData
 {
-	GrassrootsServer *ascd_grassroots_p;
-	LinkedList *ascd_jobs_p;
+	const APRJobsFilter *ascd_filter_p;
+
+	APRStoredStatus *ascd_statuses_p;
+	uint32 ascd_num_statuses;
+	uint32 ascd_statuses_size;
+
+	APRStoredJob *ascd_jobs_p;
+	uint32 ascd_num_jobs;
+	uint32 ascd_jobs_size;
+
+	/* The status record of the ServiceJob that is about to be copied, if it has one */
+	const APRJobStatus *ascd_current_status_p;
 } APRSOCacheData;
 
+
+/*
+ * The count of the rebuild tasks that are still running, which
+ * the calling thread waits on.
+ */
+typedef struct APRRebuildTasks
+{
+	apr_thread_mutex_t *art_mutex_p;
+	apr_thread_cond_t *art_cond_p;
+	uint32 art_num_remaining;
+} APRRebuildTasks;
+
+
+/* A share of the stored ServiceJobs for one of the rebuild threads to decode. */
+typedef struct APRRebuildTask
+{
+	APRStoredJob *arj_jobs_p;
+	uint32 arj_num_jobs;
+	APRRebuildTasks *arj_tasks_p;
+} APRRebuildTask;
+
+
+/* The changes that UpdateServiceJobStatusInAPRJobsManager makes to a status record. */
+typedef struct APRJobStatusUpdate
+{
+	uint32 ajsu_fields;
+	OperationStatus ajsu_status;
+	uint32 ajsu_progress;
+	const char *ajsu_error_s;
+} APRJobStatusUpdate;
+
 /**
- * The APRJobsManager stores key value pairs. The keys are the uuids for
- * the ServiceJobs that are converted to strings. The values are the ServiceJob
- * pointers.
+ * The APRJobsManager stores key value pairs. The keys are the raw uuids
+ * for the ServiceJobs and the values are the ServiceJobs serialised to
+ * JSON.
  */
 
 /**************************/
 
 static const char s_mutex_filename_s [] = "logs/grassroots_jobs_manager_lock";
 
+/*
+ * The status records are stored under their ServiceJob's raw uuid
+ * followed by this byte, so they never clash with the ServiceJobs'
+ * own keys.
+ */
+static const unsigned char s_status_key_suffix = 's';
+
+#define APR_JOBS_MANAGER_STATUS_KEY_SIZE (UUID_RAW_SIZE + 1)
+
+/*
+ * Likewise, the descriptors for the results that have been written
+ * to the APRResultStore are stored under the uuid followed by this.
+ */
+static const unsigned char s_results_key_suffix = 'r';
+
+#define APR_JOBS_MANAGER_RESULTS_KEY_SIZE (UUID_RAW_SIZE + 1)
+
+static APRJobsManager *s_child_manager_p = NULL;
+
+/*
+ * The APRJobAdmission, if any, that the ServiceJobs added by
+ * each thread are counted against.
+ */
+static apr_threadkey_t *s_admission_key_p = NULL;
+
+/*
+ * The prefixes for the names of the shared counters of active
+ * ServiceJobs for each Service and for each user.
+ */
+#define AJM_SERVICE_COUNTER_PREFIX_S "service:"
+
+#define AJM_USER_COUNTER_PREFIX_S "user:"
+
+/*
+ * The name of the shared counter of all of the active ServiceJobs.
+ */
+static const char s_active_jobs_counter_s [] = "active-jobs";
+
+/*
+ * The size of the buffer for the name of a shared counter, big enough
+ * for either prefix and a Service's or user's name from an APRJobStatus.
+ */
+#define AJM_COUNTER_NAME_SIZE (16 + APR_JOB_STATUS_SERVICE_NAME_SIZE + APR_JOB_STATUS_USER_NAME_SIZE)
+
 /**************************/
 
 
@@ -75,21 +187,102 @@ static void FreeAPRServerJob (unsigned char *key_p, void *value_p);
 static ServiceJob *QueryServiceJobFromAprJobsManager (JobsManager *jobs_manager_p,
 																									const uuid_t job_key,
 																									bool get_job_flag,
-																									void *(*storage_callback_fn) (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length));
+																									void *(*storage_callback_fn) (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned int *value_length_p));
 
 
 static ServiceJob *GetServiceJobFromAprJobsManager (JobsManager *manager_p, const uuid_t job_key);
 
 
+static bool ParseServiceJobJSON (const unsigned char *value_p, const unsigned int value_length, void *reader_data_p);
+
+static json_t *GetServiceJobJSON (APRJobsManager *manager_p, const uuid_t job_key);
+
+
 static ServiceJob *RemoveServiceJobFromAprJobsManager (JobsManager *manager_p, const uuid_t job_key, bool get_job_flag);
 
 
 static LinkedList *GetAllServiceJobsFromAprJobsManager (struct JobsManager *manager_p);
 
-static apr_status_t AddServiceJobFromSOCache (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p);
+static bool IsServiceJobStatusKey (const unsigned char *raw_key_p, const unsigned int raw_key_length, void *data_p);
+
+static bool ShouldCollectServiceJob (const unsigned char *raw_key_p, const unsigned int raw_key_length, void *data_p);
+
+static apr_status_t CollectServiceJobStatus (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p);
+
+static apr_status_t CollectServiceJob (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p);
+
+static int CompareStoredStatuses (const void *v0_p, const void *v1_p);
+
+static bool DoesStatusMatchFilter (const APRJobStatus *status_p, const APRJobsFilter *filter_p);
+
+static bool DoesServiceJobMatchFilter (ServiceJob *job_p, const APRJobsFilter *filter_p);
+
+static void RebuildStoredJobs (APRJobsManager *manager_p, APRStoredJob *jobs_p, const uint32 num_jobs, GrassrootsServer *grassroots_p);
+
+static void * APR_THREAD_FUNC RunRebuildTask (apr_thread_t *thread_p, void *data_p);
+
+static void DecodeStoredJobRange (APRStoredJob *jobs_p, const uint32 num_jobs);
+
+
+static ServiceJob *RebuildServiceJob (const unsigned char *value_p, const unsigned int value_length, GrassrootsServer *grassroots_p);
+
+static unsigned char *SerialiseServiceJob (APRJobsManager *manager_p, ServiceJob *job_p, const char *uuid_s, APRThreadBuffer *buffer_p, unsigned int *value_length_p);
+
+static apr_interval_time_t GetServiceJobTTL (ServiceJob *job_p);
+
+static apr_interval_time_t GetStatusTTL (const OperationStatus status);
 
+static int32 GetJobRetention (const GrassrootsLocationConfig *config_p);
 
-static ServiceJob *RebuildServiceJob (char *value_s, GrassrootsServer *grassroots_p);
+static uint32 GetConfigValue (const uint32 value, const uint32 default_value);
+
+static void SaveDictionarySample (APRJobsManager *manager_p, const char *uuid_s, const unsigned char *value_p, const unsigned int value_length);
+
+static void MakeServiceJobStatusKey (const uuid_t job_key, unsigned char *key_p);
+
+static void FillServiceJobStatus (const APRJobsManager *manager_p, ServiceJob *job_p, const apr_interval_time_t ttl, APRJobStatus *status_p);
+
+static void StoreServiceJobStatus (APRJobsManager *manager_p, const uuid_t job_key, ServiceJob *job_p, const apr_interval_time_t ttl, const char *uuid_s);
+
+static bool RemoveServiceJobStatus (APRJobsManager *manager_p, const uuid_t job_key, APRJobStatus *status_p);
+
+static void ApplyServiceJobStatus (ServiceJob *job_p, const APRJobStatus *status_p);
+
+static bool CopyServiceJobStatus (const unsigned char *value_p, const unsigned int value_length, void *reader_data_p);
+
+static bool ApplyServiceJobStatusUpdate (unsigned char *value_p, const unsigned int value_length, const apr_time_t expiry, void *updater_data_p);
+
+static void MakeServiceJobResultsKey (const uuid_t job_key, unsigned char *key_p);
+
+static void StoreServiceJobResults (APRJobsManager *manager_p, const uuid_t job_key, ServiceJob *job_p, const apr_interval_time_t ttl, const char *uuid_s);
+
+static void RemoveServiceJobResults (APRJobsManager *manager_p, const uuid_t job_key);
+
+static bool CopyResultDescriptor (const unsigned char *value_p, const unsigned int value_length, void *reader_data_p);
+
+static void SweepResultStore (apr_pool_t *pool_p, void *data_p);
+
+static void MakeJobCounterName (char *buffer_s, const char *prefix_s, const char *name_s, const size_t max_name_length);
+
+static void ReleaseAPRJobAdmission (APRJobAdmission *admission_p);
+
+static APRJobAdmissionResult ReserveServiceJob (APRJobsManager *manager_p, const char *counter_name_s, const uint32 limit, const APRJobAdmissionResult limit_result);
+
+static void UpdateServiceJobCounts (APRJobsManager *manager_p, const unsigned char *status_key_p, APRJobStatus *status_p);
+
+static void CountServiceJob (APRJobsManager *manager_p, APRJobStatus *status_p);
+
+static void UncountServiceJob (APRJobsManager *manager_p, const APRJobStatus *status_p);
+
+static bool CountServiceJobOnCounter (APRJobsManager *manager_p, const char *counter_name_s, uint32 *num_reserved_p, bool *reserved_flag_p);
+
+static void UncountServiceJobOnCounter (APRJobsManager *manager_p, const char *counter_name_s, uint32 *num_reserved_p, const bool reserved_flag);
+
+static void UncountRemovedServiceJob (const unsigned char *key_p, const unsigned int key_length, const unsigned char *value_p, const unsigned int value_length, void *data_p);
+
+static apr_status_t EndAPRJobAdmissionOnCleanup (void *data_p);
+
+static apr_status_t DeleteAdmissionKey (void *data_p);
 
 /**************************/
 
@@ -100,30 +293,71 @@ APRJobsManager *InitAPRJobsManager (server_rec *server_p, apr_pool_t *pool_p, co
 
 	if (manager_p)
 		{
-			unsigned char *(*make_key_fn) (const void *data_p, uint32 raw_key_length, uint32 *key_len_p) = MakeKeyFromUUID;
-			unsigned char *(*compress_fn) (unsigned char *src_s, const unsigned int src_length, unsigned int *dest_length_p, const char * const key_s) = NULL;
-			unsigned char *(*decompress_fn) (unsigned char *src_s, const unsigned int src_length, unsigned int *dest_length_p, const char * const key_s) = NULL;
+			GrassrootsLocationConfig *config_p = ap_get_module_config (server_p -> module_config, GetGrassrootsModule ());
 			APRGlobalStorage *storage_p = NULL;
 
-			#ifdef USE_BZIP2
-			compress_fn  = CompressToBZ2;
-			decompress_fn  = UncompressFromBZ2;
-			#endif
-
 			storage_p = AllocateAPRGlobalStorage (pool_p,
 																						HashUUIDForAPR,
-																						make_key_fn,
+																						NULL,
 																						FreeAPRServerJob,
 																						server_p,
 																						s_mutex_filename_s,
 																						APR_JOBS_MANAGER_CACHE_ID_S,
 																						provider_name_s,
-																						compress_fn,
-																						decompress_fn);
+																						config_p -> glc_cache_codec_p,
+																						config_p -> glc_num_cache_stripes);
 
 			if (storage_p)
 				{
 					manager_p -> ajm_store_p = storage_p;
+					manager_p -> ajm_samples_path_s = config_p -> glc_cache_dictionary_samples_path_s;
+					manager_p -> ajm_encoding = (config_p -> glc_job_encoding != GLC_UNSET_INT32) ? (StoredJobEncoding) (config_p -> glc_job_encoding) : SJE_BSON;
+					manager_p -> ajm_rebuild_pool_p = NULL;
+					manager_p -> ajm_scratch_pool_p = NULL;
+					manager_p -> ajm_result_store_p = NULL;
+					manager_p -> ajm_job_cache_p = NULL;
+					manager_p -> ajm_service_job_limit = GetConfigValue (config_p -> glc_service_job_limit, 0);
+					manager_p -> ajm_user_job_limit = GetConfigValue (config_p -> glc_user_job_limit, 0);
+					manager_p -> ajm_active_job_limit = GetConfigValue (config_p -> glc_active_job_limit, 0);
+					apr_atomic_set32 (& (manager_p -> ajm_num_samples), 0);
+
+					SetAPRGlobalStorageLockMode (storage_p, (config_p -> glc_cache_lock_mode != GLC_UNSET_INT32) ? (APRGlobalStorageLockMode) (config_p -> glc_cache_lock_mode) : AGS_LM_EXCLUSIVE);
+					SetAPRGlobalStorageDefaultTTL (storage_p, apr_time_from_sec (GetJobRetention (config_p)));
+					SetAPRGlobalStorageCapacity (storage_p, ((apr_uint64_t) GetConfigValue (config_p -> glc_cache_capacity_kb, 0)) << 10, (config_p -> glc_cache_full_policy != GLC_UNSET_INT32) ? (APRGlobalStorageFullPolicy) (config_p -> glc_cache_full_policy) : AGS_FP_REJECT);
+
+					if ((config_p -> glc_cache_compress_min_length >= 0) || (config_p -> glc_cache_compress_min_saving >= 0))
+						{
+							SetAPRGlobalStorageCompressionThresholds (storage_p,
+																												(config_p -> glc_cache_compress_min_length >= 0) ? (uint32) (config_p -> glc_cache_compress_min_length) : storage_p -> ags_min_compress_length,
+																												(config_p -> glc_cache_compress_min_saving >= 0) ? (uint32) (config_p -> glc_cache_compress_min_saving) : storage_p -> ags_min_compress_saving);
+						}
+
+					if (GetConfigValue (config_p -> glc_local_cache_size_kb, 0) > 0)
+						{
+							EnableAPRGlobalStorageLocalCache (storage_p, ((apr_size_t) (config_p -> glc_local_cache_size_kb)) << 10);
+						}
+
+					/* Status records that are swept or evicted won't be removed through us, so stop counting their ServiceJobs then */
+					if (HasAPRJobsManagerGotJobLimits (manager_p))
+						{
+							SetAPRGlobalStorageRemovalCallback (storage_p, IsServiceJobStatusKey, UncountRemovedServiceJob, manager_p);
+						}
+
+					/* Without a result store, the results are only available from the Services */
+					if (config_p -> glc_result_store_path_s)
+						{
+							manager_p -> ajm_result_store_p = AllocateAPRResultStore (config_p -> glc_result_store_path_s, pool_p);
+
+							if (manager_p -> ajm_result_store_p)
+								{
+									/* The results files expire along with their ServiceJobs */
+									SetAPRGlobalStorageSweepCallback (storage_p, SweepResultStore, manager_p);
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to set up the result store in \"%s\"", config_p -> glc_result_store_path_s);
+								}
+						}
 
 					InitJobsManager (& (manager_p -> ajm_base_manager), AddServiceJobToAPRJobsManager, GetServiceJobFromAprJobsManager, RemoveServiceJobFromAprJobsManager, GetAllServiceJobsFromAprJobsManager, NULL);
 
@@ -151,6 +385,11 @@ bool DestroyAPRJobsManager (APRJobsManager *jobs_manager_p)
 {
 	if (jobs_manager_p)
 		{
+			if (s_child_manager_p == jobs_manager_p)
+				{
+					s_child_manager_p = NULL;
+				}
+
 			FreeMemory (jobs_manager_p);
 		}
 
@@ -169,11 +408,12 @@ bool APRJobsManagerPreConfigure (APRJobsManager *manager_p, apr_pool_t *config_p
 
 bool PostConfigAPRJobsManager (APRJobsManager *manager_p, apr_pool_t *config_pool_p, server_rec *server_p, const char *provider_name_s)
 {
-	/* Set up the maximum expiry time as we never want it to expire */
-	apr_interval_time_t expiry = 0;
+	/* Each job has its own expiry time, so this is only a hint for the provider */
+	GrassrootsLocationConfig *config_p = ap_get_module_config (server_p -> module_config, GetGrassrootsModule ());
+	apr_interval_time_t expiry = apr_time_from_sec (GetJobRetention (config_p));
 	apr_size_t average_obj_size = 16384;
 
-	struct ap_socache_hints job_cache_hints = { UUID_STRING_BUFFER_SIZE, average_obj_size, expiry };
+	struct ap_socache_hints job_cache_hints = { UUID_RAW_SIZE, average_obj_size, expiry };
 
 	return PostConfigureGlobalStorage(manager_p -> ajm_store_p, config_pool_p, server_p, provider_name_s, &job_cache_hints);
 }
@@ -189,6 +429,56 @@ APRJobsManager *APRJobsManagerChildInit (apr_pool_t *pool_p, server_rec *server_
 		{
 			if (InitAPRGlobalStorageForChild (manager_p -> ajm_store_p, pool_p))
 				{
+					/*
+					 * Remove the finished jobs as they expire rather than leaving
+					 * the cache to evict whatever is oldest when it fills up. The
+					 * sweeper also keeps the count of the space used up to date.
+					 */
+					if ((manager_p -> ajm_store_p -> ags_default_ttl > 0) || (manager_p -> ajm_store_p -> ags_capacity > 0))
+						{
+							if (!StartAPRGlobalStorageSweeper (manager_p -> ajm_store_p, apr_time_from_sec (APR_JOBS_MANAGER_SWEEP_INTERVAL), pool_p))
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to start the sweeper for expired jobs");
+								}
+						}
+
+					/* If the threads can't be created, the ServiceJobs are decoded by each caller */
+					manager_p -> ajm_scratch_pool_p = CreateAPRThreadSafePool (pool_p);
+
+					if ((! (manager_p -> ajm_scratch_pool_p)) || (apr_thread_pool_create (& (manager_p -> ajm_rebuild_pool_p), 0, APR_JOBS_MANAGER_REBUILD_THREADS, pool_p) != APR_SUCCESS))
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to create the threads to decode the stored jobs");
+							manager_p -> ajm_rebuild_pool_p = NULL;
+						}
+
+					if (GetConfigValue (config_p -> glc_job_object_cache_size, 0) > 0)
+						{
+							manager_p -> ajm_job_cache_p = AllocateAPRJobObjectCache (config_p -> glc_job_object_cache_size, pool_p);
+
+							if (!manager_p -> ajm_job_cache_p)
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to create the cache of decoded jobs, they will be decoded every time");
+								}
+						}
+
+					/* Without the key, the ServiceJobs are counted but not against the requests' reservations */
+					if (HasAPRJobsManagerGotJobLimits (manager_p))
+						{
+							apr_status_t status = apr_threadkey_private_create (&s_admission_key_p, NULL, pool_p);
+
+							if (status == APR_SUCCESS)
+								{
+									apr_pool_cleanup_register (pool_p, NULL, DeleteAdmissionKey, apr_pool_cleanup_null);
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to create the key for the job admissions, %d", status);
+									s_admission_key_p = NULL;
+								}
+						}
+
+					s_child_manager_p = manager_p;
+
 					return manager_p;
 				}
 
@@ -203,258 +493,2002 @@ static bool AddServiceJobToAPRJobsManager (JobsManager *jobs_manager_p, uuid_t j
 {
 	APRJobsManager *manager_p = (APRJobsManager *) jobs_manager_p;
 	bool success_flag = false;
-	unsigned char *value_p = NULL;
-	unsigned int value_length = 0;
 	char uuid_s [UUID_STRING_BUFFER_SIZE];
+	unsigned int value_length = 0;
+	unsigned char *value_p;
 
-	Service *service_p = GetServiceFromServiceJob (job_p);
+	/* The value is copied when it is stored, so the thread's buffer can be reused for the next job */
+	APRThreadBuffer *buffer_p = GetAPRThreadBuffer (ATB_ENCODED_JOB);
 
-	if (service_p)
-		{
-			json_t *job_json_p = NULL;
-			bool omit_results_flag = true;
+	ConvertUUIDToString (job_key, uuid_s);
 
-			ConvertUUIDToString (job_key, uuid_s);
+	value_p = SerialiseServiceJob (manager_p, job_p, uuid_s, buffer_p, &value_length);
 
-			if (DoesServiceHaveCustomServiceJobSerialisation (service_p))
+	if (value_p)
+		{
+			const apr_interval_time_t ttl = GetServiceJobTTL (job_p);
+
+			#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINEST
 				{
-					job_json_p = CreateSerialisedJSONForServiceJobFromService (service_p, job_p, omit_results_flag);
+					PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Adding \"%s\" as %u bytes", uuid_s, value_length);
+				}
+			#endif
 
-					if (!job_json_p)
-						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create custom serialised job for %s from %s", uuid_s, GetServiceName (service_p));
-						}
+			if (manager_p -> ajm_samples_path_s)
+				{
+					SaveDictionarySample (manager_p, uuid_s, value_p, value_length);
 				}
-			else
+
+			success_flag = AddObjectToAPRGlobalStorageWithTTL (manager_p -> ajm_store_p, (const void *) job_key, UUID_RAW_SIZE, value_p, value_length, ttl);
+
+			if (success_flag)
 				{
-					/* We store the c-style string for the ServiceJob's json */
-					job_json_p = GetServiceJobAsJSON (job_p, omit_results_flag);
+					StoreServiceJobStatus (manager_p, job_key, job_p, ttl, uuid_s);
 
-					if (!job_json_p)
+					if (manager_p -> ajm_result_store_p)
 						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create serialised job for %s from %s", uuid_s, GetServiceName (service_p));
+							StoreServiceJobResults (manager_p, job_key, job_p, ttl, uuid_s);
 						}
 				}
 
+			#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINER
+				{
+					PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Added \"%s\" as %u bytes, success=%d", uuid_s, value_length, success_flag);
+				}
+			#endif
 
-			if (job_json_p)
+			if (!buffer_p)
 				{
-					char *job_s = json_dumps (job_json_p, JSON_INDENT (2));
+					free (value_p);
+				}
+		}		/* if (value_p) */
+
+	if (buffer_p)
+		{
+			ReleaseAPRThreadBuffer (buffer_p);
+		}
+
+	return success_flag;
+}
+
 
-					if (job_s)
+uint32 AddServiceJobsToAPRJobsManager (APRJobsManager *manager_p, ServiceJob **jobs_pp, const uint32 num_jobs)
+{
+	uint32 num_added = 0;
+
+	if (num_jobs > 0)
+		{
+			/*
+			 * A single allocation for the keys, the values, the ServiceJobs, their times to live, the status
+			 * records, the keys' and values' lengths, the results and the status records' keys
+			 */
+			const size_t size = num_jobs * (sizeof (const void *) + sizeof (unsigned char *) + sizeof (ServiceJob *) + sizeof (apr_interval_time_t) + sizeof (APRJobStatus) + sizeof (unsigned int) + sizeof (unsigned int) + sizeof (bool) + APR_JOBS_MANAGER_STATUS_KEY_SIZE);
+			const void **keys_pp = (const void **) AllocMemory (size);
+
+			if (keys_pp)
+				{
+					unsigned char **values_pp = (unsigned char **) (keys_pp + num_jobs);
+					ServiceJob **added_jobs_pp = (ServiceJob **) (values_pp + num_jobs);
+					apr_interval_time_t *ttls_p = (apr_interval_time_t *) (added_jobs_pp + num_jobs);
+					APRJobStatus *statuses_p = (APRJobStatus *) (ttls_p + num_jobs);
+					unsigned int *key_lengths_p = (unsigned int *) (statuses_p + num_jobs);
+					unsigned int *value_lengths_p = key_lengths_p + num_jobs;
+					bool *results_p = (bool *) (value_lengths_p + num_jobs);
+					unsigned char *status_keys_p = (unsigned char *) (results_p + num_jobs);
+					uint32 num_values = 0;
+					uint32 i;
+
+					for (i = 0; i < num_jobs; ++ i)
 						{
-							/*
-							 * include the terminating \0 to make sure
-							 * the value as a valid c-style string
-							 */
-							value_length = strlen (job_s) + 1;
-							value_p = (unsigned char *) job_s;
+							ServiceJob *job_p = * (jobs_pp + i);
+							char uuid_s [UUID_STRING_BUFFER_SIZE];
+							unsigned char *value_p;
+
+							ConvertUUIDToString (job_p -> sj_id, uuid_s);
+
+							/* Each value must stay valid until they are all stored, so they can't share a buffer */
+							value_p = SerialiseServiceJob (manager_p, job_p, uuid_s, NULL, value_lengths_p + num_values);
 
-							#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINEST
+							if (value_p)
 								{
-									PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Adding \"%s\"=\"%s\"", uuid_s, value_p);
+									if (manager_p -> ajm_samples_path_s)
+										{
+											SaveDictionarySample (manager_p, uuid_s, value_p, * (value_lengths_p + num_values));
+										}
+
+									* (keys_pp + num_values) = (const void *) (job_p -> sj_id);
+									* (key_lengths_p + num_values) = UUID_RAW_SIZE;
+									* (values_pp + num_values) = value_p;
+									* (added_jobs_pp + num_values) = job_p;
+									* (ttls_p + num_values) = GetServiceJobTTL (job_p);
+
+									FillServiceJobStatus (manager_p, job_p, * (ttls_p + num_values), statuses_p + num_values);
+									MakeServiceJobStatusKey (job_p -> sj_id, status_keys_p + (num_values * APR_JOBS_MANAGER_STATUS_KEY_SIZE));
+
+									++ num_values;
 								}
-							#endif
+						}
 
-							success_flag = AddObjectToAPRGlobalStorage (manager_p -> ajm_store_p, (const void *) &job_key, UUID_RAW_SIZE, value_p, value_length);
+					if (num_values > 0)
+						{
+							uint32 num_statuses = 0;
+
+							num_added = AddObjectsToAPRGlobalStorage (manager_p -> ajm_store_p, keys_pp, key_lengths_p, values_pp, value_lengths_p, ttls_p, num_values, results_p);
 
-							#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINER
+							for (i = 0; i < num_values; ++ i)
 								{
-									PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Added \"%s\"=\"%s\", success=%d", uuid_s, value_p, success_flag);
+									free (* (values_pp + i));
 								}
-							#endif
 
+							/*
+							 * Now store the status records for the ServiceJobs that were
+							 * added, reusing the arrays for them.
+							 */
+							for (i = 0; i < num_values; ++ i)
+								{
+									if (* (results_p + i))
+										{
+											if (HasAPRJobsManagerGotJobLimits (manager_p))
+												{
+													UpdateServiceJobCounts (manager_p, status_keys_p + (i * APR_JOBS_MANAGER_STATUS_KEY_SIZE), statuses_p + i);
+												}
+
+											* (keys_pp + num_statuses) = (const void *) (status_keys_p + (i * APR_JOBS_MANAGER_STATUS_KEY_SIZE));
+											* (key_lengths_p + num_statuses) = APR_JOBS_MANAGER_STATUS_KEY_SIZE;
+											* (values_pp + num_statuses) = (unsigned char *) (statuses_p + i);
+											* (value_lengths_p + num_statuses) = sizeof (APRJobStatus);
+											* (ttls_p + num_statuses) = * (ttls_p + i);
+											* (added_jobs_pp + num_statuses) = * (added_jobs_pp + i);
+
+											++ num_statuses;
+										}
+								}
 
-							free (job_s);
-						}		/* if (job_s) */
-					else
-						{
-							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "json_dumps failed for \"%s\"", uuid_s);
+							if (num_statuses > 0)
+								{
+									AddObjectsToAPRGlobalStorage (manager_p -> ajm_store_p, keys_pp, key_lengths_p, values_pp, value_lengths_p, ttls_p, num_statuses, NULL);
+
+									if (manager_p -> ajm_result_store_p)
+										{
+											for (i = 0; i < num_statuses; ++ i)
+												{
+													ServiceJob *job_p = * (added_jobs_pp + i);
+													char uuid_s [UUID_STRING_BUFFER_SIZE];
+
+													ConvertUUIDToString (job_p -> sj_id, uuid_s);
+													StoreServiceJobResults (manager_p, job_p -> sj_id, job_p, * (ttls_p + i), uuid_s);
+												}
+										}
+								}
 						}
 
-				}		/* if (job_json_p) */
-
-		}		/* if (service_p) */
+					FreeMemory (keys_pp);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate memory to add " UINT32_FMT " jobs", num_jobs);
+				}
+		}
 
+	return num_added;
+}
 
-	return success_flag;
+APRJobsManager *GetChildAPRJobsManager (void)
+{
+	return s_child_manager_p;
 }
 
 
-static ServiceJob *GetServiceJobFromAprJobsManager (JobsManager *manager_p, const uuid_t job_key)
+bool IsAPRJobsManagerFull (const APRJobsManager *manager_p)
 {
-	return QueryServiceJobFromAprJobsManager (manager_p, job_key, true, GetObjectFromAPRGlobalStorage);
+	return IsAPRGlobalStorageFull (manager_p -> ajm_store_p);
 }
 
 
-
-static ServiceJob *RemoveServiceJobFromAprJobsManager (JobsManager *manager_p, const uuid_t job_key, bool get_job_flag)
+bool HasAPRJobsManagerGotJobLimits (const APRJobsManager *manager_p)
 {
-	return QueryServiceJobFromAprJobsManager (manager_p, job_key, get_job_flag, RemoveObjectFromAPRGlobalStorage);
+	return ((manager_p -> ajm_service_job_limit > 0) || (manager_p -> ajm_user_job_limit > 0) || (manager_p -> ajm_active_job_limit > 0));
 }
 
 
-static ServiceJob *QueryServiceJobFromAprJobsManager (JobsManager *jobs_manager_p, const uuid_t job_key, bool get_job_flag, void *(*storage_callback_fn) (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length))
+APRJobAdmissionResult AdmitServiceJobsToAPRJobsManager (APRJobsManager *manager_p, const char *user_s, const char **service_names_ss, const uint32 num_services, apr_pool_t *pool_p, APRJobAdmission **admission_pp)
 {
-	APRJobsManager *manager_p = (APRJobsManager *) jobs_manager_p;
-	ServiceJob *job_p = NULL;
-	unsigned char *value_p = NULL;
-	const void *key_p = (const void *) &job_key;
+	APRJobAdmission *admission_p;
+	char counter_name_s [AJM_COUNTER_NAME_SIZE];
+	uint32 i;
 
-	char uuid_s [UUID_STRING_BUFFER_SIZE];
-	ConvertUUIDToString (job_key, uuid_s);
+	*admission_pp = NULL;
 
-	#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINEST
-	PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Looking for %s", uuid_s);
-	#endif
+	if ((num_services == 0) || (!HasAPRJobsManagerGotJobLimits (manager_p)))
+		{
+			return AJA_ADMITTED;
+		}
 
-	value_p = storage_callback_fn (manager_p -> ajm_store_p, key_p, UUID_RAW_SIZE);
+	admission_p = (APRJobAdmission *) apr_pcalloc (pool_p, sizeof (APRJobAdmission) + (num_services * sizeof (APRJobReservation)));
 
-	if (value_p)
+	if (!admission_p)
 		{
-			GrassrootsServer *grassroots_p = GetGrassrootsServerFromJobsManager (jobs_manager_p);
-
-			#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINER
-			PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "For job %s, got: \"%s\"", uuid_s, value_p);
-			#endif
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate admission for " UINT32_FMT " jobs", num_services);
+			return AJA_ERROR;
+		}
 
+	admission_p -> aja_reservations_p = (APRJobReservation *) (admission_p + 1);
 
-			job_p = RebuildServiceJob ((char *) value_p, grassroots_p);
+	admission_p -> aja_manager_p = manager_p;
 
-			if (!job_p)
-				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "CreateServiceJobFromJSON failed for \"%s\"", uuid_s);
-				}
+	admission_p -> aja_user_s = user_s;
 
-			FreeMemory (value_p);
-		}		/* if (value_p) */
-	else
+	/*
+	 * Reserve each ServiceJob in turn, giving back everything
+	 * reserved so far as soon as any of the limits is reached.
+	 * Only the counters for the limits that have been set are
+	 * used, so that callers can't fill the shared memory with
+	 * counters that nothing checks.
+	 */
+	for (i = 0; i < num_services; ++ i)
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get stored value for \"%s\"", uuid_s);
-		}
+			const char *service_name_s = * (service_names_ss + i);
+			APRJobAdmissionResult res;
 
-	return job_p;
-}
+			if (manager_p -> ajm_active_job_limit > 0)
+				{
+					if ((res = ReserveServiceJob (manager_p, s_active_jobs_counter_s, manager_p -> ajm_active_job_limit, AJA_ACTIVE_LIMIT)) != AJA_ADMITTED)
+						{
+							ReleaseAPRJobAdmission (admission_p);
+							return res;
+						}
 
+					++ (admission_p -> aja_num_jobs);
+				}
 
+			if (user_s && (manager_p -> ajm_user_job_limit > 0))
+				{
+					MakeJobCounterName (counter_name_s, AJM_USER_COUNTER_PREFIX_S, user_s, APR_JOB_STATUS_USER_NAME_SIZE - 1);
 
-static ServiceJob *RebuildServiceJob (char *value_s, GrassrootsServer *grassroots_p)
-{
-	json_error_t err;
-	ServiceJob *job_p = NULL;
-	json_t *job_json_p = json_loads (value_s, 0, &err);
+					if ((res = ReserveServiceJob (manager_p, counter_name_s, manager_p -> ajm_user_job_limit, AJA_USER_LIMIT)) != AJA_ADMITTED)
+						{
+							ReleaseAPRJobAdmission (admission_p);
+							return res;
+						}
 
-	if (job_json_p)
-		{
-			job_p = CreateServiceJobFromJSON (job_json_p, grassroots_p);
+					++ (admission_p -> aja_num_user_jobs);
+				}
 
-			if (!job_p)
+			if (manager_p -> ajm_service_job_limit > 0)
 				{
-					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create ServiceJob from \"%s\"", value_s);
-				}
+					APRJobReservation *reservation_p = admission_p -> aja_reservations_p;
+					uint32 j;
 
-			json_decref (job_json_p);
-		}		/* if (job_json_p) */
-	else
+					for (j = 0; j < admission_p -> aja_num_reservations; ++ j, ++ reservation_p)
+						{
+							if (strncmp (reservation_p -> ajr_service_name_s, service_name_s, APR_JOB_STATUS_SERVICE_NAME_SIZE - 1) == 0)
+								{
+									break;
+								}
+						}
+
+					if (j == admission_p -> aja_num_reservations)
+						{
+							reservation_p -> ajr_service_name_s = service_name_s;
+							++ (admission_p -> aja_num_reservations);
+						}
+
+					MakeJobCounterName (counter_name_s, AJM_SERVICE_COUNTER_PREFIX_S, service_name_s, APR_JOB_STATUS_SERVICE_NAME_SIZE - 1);
+
+					if ((res = ReserveServiceJob (manager_p, counter_name_s, manager_p -> ajm_service_job_limit, AJA_SERVICE_LIMIT)) != AJA_ADMITTED)
+						{
+							ReleaseAPRJobAdmission (admission_p);
+							return res;
+						}
+
+					++ (reservation_p -> ajr_num_jobs);
+				}
+		}
+
+	if (s_admission_key_p)
+		{
+			apr_threadkey_private_set (admission_p, s_admission_key_p);
+		}
+
+	/* Give the reservations back even if the request ends without calling EndAPRJobAdmission */
+	admission_p -> aja_pool_p = pool_p;
+	apr_pool_cleanup_register (pool_p, admission_p, EndAPRJobAdmissionOnCleanup, apr_pool_cleanup_null);
+
+	*admission_pp = admission_p;
+
+	return AJA_ADMITTED;
+}
+
+
+void EndAPRJobAdmission (APRJobAdmission *admission_p)
+{
+	apr_pool_cleanup_run (admission_p -> aja_pool_p, admission_p, EndAPRJobAdmissionOnCleanup);
+}
+
+
+bool GetServiceJobResultsFromAPRJobsManager (APRJobsManager *manager_p, const uuid_t job_key, APRResultDescriptor *descriptor_p)
+{
+	bool success_flag = false;
+
+	if (manager_p -> ajm_result_store_p)
+		{
+			unsigned char key [APR_JOBS_MANAGER_RESULTS_KEY_SIZE];
+
+			MakeServiceJobResultsKey (job_key, key);
+
+			success_flag = ReadObjectFromAPRGlobalStorage (manager_p -> ajm_store_p, key, APR_JOBS_MANAGER_RESULTS_KEY_SIZE, CopyResultDescriptor, descriptor_p);
+		}
+
+	return success_flag;
+}
+
+
+apr_uint32_t GetServiceJobStatusGenerationFromAPRJobsManager (APRJobsManager *manager_p, const uuid_t job_key)
+{
+	unsigned char key [APR_JOBS_MANAGER_STATUS_KEY_SIZE];
+
+	MakeServiceJobStatusKey (job_key, key);
+
+	return GetAPRGlobalStorageObjectGeneration (manager_p -> ajm_store_p, key, APR_JOBS_MANAGER_STATUS_KEY_SIZE);
+}
+
+
+apr_uint32_t GetServiceJobsSequenceFromAPRJobsManager (APRJobsManager *manager_p)
+{
+	return GetAPRGlobalStorageSequence (manager_p -> ajm_store_p);
+}
+
+
+bool WaitForServiceJobStatusChange (APRJobsManager *manager_p, const uuid_t job_key, const apr_uint32_t generation, const apr_interval_time_t timeout)
+{
+	unsigned char key [APR_JOBS_MANAGER_STATUS_KEY_SIZE];
+
+	MakeServiceJobStatusKey (job_key, key);
+
+	return (WaitForAPRGlobalStorageObjectChange (manager_p -> ajm_store_p, key, APR_JOBS_MANAGER_STATUS_KEY_SIZE, generation, timeout) == APR_SUCCESS);
+}
+
+
+bool WaitForServiceJobsChange (APRJobsManager *manager_p, const apr_uint32_t sequence, const apr_interval_time_t timeout)
+{
+	return (WaitForAPRGlobalStorageChange (manager_p -> ajm_store_p, sequence, timeout) == APR_SUCCESS);
+}
+
+
+bool HasAPRJobStatusFinished (const APRJobStatus *status_p)
+{
+	return (GetStatusTTL (status_p -> ajs_status) != APR_GLOBAL_STORAGE_NO_EXPIRY);
+}
+
+
+bool GetServiceJobStatusFromAPRJobsManager (APRJobsManager *manager_p, const uuid_t job_key, APRJobStatus *status_p)
+{
+	unsigned char key [APR_JOBS_MANAGER_STATUS_KEY_SIZE];
+
+	MakeServiceJobStatusKey (job_key, key);
+
+	return ReadObjectFromAPRGlobalStorage (manager_p -> ajm_store_p, key, APR_JOBS_MANAGER_STATUS_KEY_SIZE, CopyServiceJobStatus, status_p);
+}
+
+
+uint32 GetServiceJobStatusesFromAPRJobsManager (APRJobsManager *manager_p, const uuid_t *job_keys_p, const uint32 num_jobs, APRJobStatus *statuses_p, bool *found_flags_p)
+{
+	uint32 num_found = 0;
+
+	memset (found_flags_p, 0, num_jobs * sizeof (bool));
+
+	if (num_jobs > 0)
+		{
+			/* A single allocation for the keys, their lengths, the values' lengths and the keys themselves */
+			const void **keys_pp = (const void **) AllocMemory (num_jobs * (sizeof (const void *) + sizeof (unsigned int) + sizeof (unsigned int) + APR_JOBS_MANAGER_STATUS_KEY_SIZE));
+
+			if (keys_pp)
+				{
+					unsigned int *key_lengths_p = (unsigned int *) (keys_pp + num_jobs);
+					unsigned int *value_lengths_p = key_lengths_p + num_jobs;
+					unsigned char *status_keys_p = (unsigned char *) (value_lengths_p + num_jobs);
+					void **values_pp;
+					uint32 i;
+
+					for (i = 0; i < num_jobs; ++ i)
+						{
+							MakeServiceJobStatusKey (* (job_keys_p + i), status_keys_p + (i * APR_JOBS_MANAGER_STATUS_KEY_SIZE));
+							* (keys_pp + i) = (const void *) (status_keys_p + (i * APR_JOBS_MANAGER_STATUS_KEY_SIZE));
+							* (key_lengths_p + i) = APR_JOBS_MANAGER_STATUS_KEY_SIZE;
+						}
+
+					/* Only the small status records are got, with each stripe locked once for all of its keys */
+					values_pp = GetObjectsFromAPRGlobalStorage (manager_p -> ajm_store_p, keys_pp, key_lengths_p, num_jobs, value_lengths_p);
+
+					if (values_pp)
+						{
+							for (i = 0; i < num_jobs; ++ i)
+								{
+									const unsigned char *value_p = (const unsigned char *) (* (values_pp + i));
+
+									if (value_p && CopyServiceJobStatus (value_p, * (value_lengths_p + i), statuses_p + i))
+										{
+											* (found_flags_p + i) = true;
+											++ num_found;
+										}
+								}
+
+							FreeMemory (values_pp);
+						}
+
+					FreeMemory (keys_pp);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate memory to get " UINT32_FMT " job statuses", num_jobs);
+				}
+		}
+
+	return num_found;
+}
+
+
+json_t *GetAPRJobStatusAsJSON (const char *uuid_s, const APRJobStatus *status_p)
+{
+	json_t *status_json_p = json_object ();
+
+	if (status_json_p)
+		{
+			bool success_flag = (json_object_set_new (status_json_p, JOB_UUID_S, json_string (uuid_s)) == 0);
+
+			if (success_flag)
+				{
+					success_flag = (json_object_set_new (status_json_p, "found", status_p ? json_true () : json_false ()) == 0);
+				}
+
+			if (success_flag && status_p)
+				{
+					const char *status_s = GetStatusAsString (status_p -> ajs_status);
+
+					success_flag = (status_s != NULL) && (json_object_set_new (status_json_p, JOB_STATUS_S, json_string (status_s)) == 0);
+
+					if (success_flag)
+						{
+							success_flag = (json_object_set_new (status_json_p, "status_code", json_integer (status_p -> ajs_status)) == 0);
+						}
+
+					if (success_flag)
+						{
+							success_flag = (json_object_set_new (status_json_p, "progress", json_integer (status_p -> ajs_progress)) == 0);
+						}
+
+					if (success_flag)
+						{
+							success_flag = (json_object_set_new (status_json_p, "has_results", (status_p -> ajs_results_flag) ? json_true () : json_false ()) == 0);
+						}
+
+					if (success_flag)
+						{
+							success_flag = (json_object_set_new (status_json_p, "update_time", json_integer ((json_int_t) (status_p -> ajs_update_time))) == 0);
+						}
+
+					if (success_flag && (* (status_p -> ajs_service_name_s) != '\0'))
+						{
+							success_flag = (json_object_set_new (status_json_p, JOB_SERVICE_S, json_string (status_p -> ajs_service_name_s)) == 0);
+						}
+
+					if (success_flag && (* (status_p -> ajs_error_s) != '\0'))
+						{
+							success_flag = (json_object_set_new (status_json_p, "error", json_string (status_p -> ajs_error_s)) == 0);
+						}
+				}
+
+			if (success_flag)
+				{
+					return status_json_p;
+				}
+
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to convert status of \"%s\" to json", uuid_s);
+			json_decref (status_json_p);
+		}
+
+	return NULL;
+}
+
+bool UpdateServiceJobStatusInAPRJobsManager (APRJobsManager *manager_p, const uuid_t job_key, const uint32 fields, const OperationStatus status, const uint32 progress, const char *error_s)
+{
+	bool success_flag = false;
+	char uuid_s [UUID_STRING_BUFFER_SIZE];
+
+	ConvertUUIDToString (job_key, uuid_s);
+
+	if ((fields & AJS_UPDATE_STATUS) && (GetStatusTTL (status) != APR_GLOBAL_STORAGE_NO_EXPIRY))
+		{
+			#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINE
+			PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "\"%s\" has finished with status %d so needs storing in full", uuid_s, status);
+			#endif
+		}
+	else
+		{
+			unsigned char key [APR_JOBS_MANAGER_STATUS_KEY_SIZE];
+			APRJobStatusUpdate update;
+
+			MakeServiceJobStatusKey (job_key, key);
+
+			update.ajsu_fields = fields;
+			update.ajsu_status = status;
+			update.ajsu_progress = progress;
+			update.ajsu_error_s = error_s;
+
+			/*
+			 * The record is patched whilst its stripe is locked so that
+			 * it can't be stored as finished, or stop being counted, in
+			 * between us reading it and writing it back.
+			 */
+			success_flag = UpdateObjectInAPRGlobalStorage (manager_p -> ajm_store_p, key, APR_JOBS_MANAGER_STATUS_KEY_SIZE, ApplyServiceJobStatusUpdate, &update);
+
+			#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINE
+			if (!success_flag)
+				{
+					PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "No running status record to update for \"%s\"", uuid_s);
+				}
+			#endif
+		}
+
+	return success_flag;
+}
+
+
+/*
+ * Only running ServiceJobs, which never expire, are updated as
+ * otherwise the record and the ServiceJob could expire at
+ * different times. The record keeps its expiry and whether it
+ * is counted, so only the reported fields change.
+ */
+static bool ApplyServiceJobStatusUpdate (unsigned char *value_p, const unsigned int value_length, const apr_time_t expiry, void *updater_data_p)
+{
+	const APRJobStatusUpdate *update_p = (const APRJobStatusUpdate *) updater_data_p;
+	APRJobStatus job_status;
+
+	if ((expiry == 0) && CopyServiceJobStatus (value_p, value_length, &job_status) && (job_status.ajs_expiry_time == 0))
+		{
+			if (update_p -> ajsu_fields & AJS_UPDATE_STATUS)
+				{
+					job_status.ajs_status = update_p -> ajsu_status;
+				}
+
+			if (update_p -> ajsu_fields & AJS_UPDATE_PROGRESS)
+				{
+					job_status.ajs_progress = (uint8) ((update_p -> ajsu_progress < 100) ? update_p -> ajsu_progress : 100);
+				}
+
+			if (update_p -> ajsu_fields & AJS_UPDATE_ERROR)
+				{
+					memset (job_status.ajs_error_s, 0, APR_JOB_STATUS_ERROR_SIZE);
+
+					if (update_p -> ajsu_error_s)
+						{
+							strncpy (job_status.ajs_error_s, update_p -> ajsu_error_s, APR_JOB_STATUS_ERROR_SIZE - 1);
+						}
+				}
+
+			job_status.ajs_update_time = apr_time_now ();
+			job_status.ajs_updated_flag = 1;
+
+			memcpy (value_p, &job_status, sizeof (APRJobStatus));
+
+			return true;
+		}
+
+	return false;
+}
+
+
+uint32 GetServiceJobsFromAPRJobsManager (APRJobsManager *manager_p, const uuid_t *job_keys_p, const uint32 num_jobs, ServiceJob **jobs_pp)
+{
+	uint32 num_found = 0;
+
+	if (num_jobs > 0)
+		{
+			/*
+			 * The ServiceJobs' status records are got at the same time, after those ServiceJobs that
+			 * aren't already decoded. A single allocation for the keys, the decoded ServiceJobs, the
+			 * keys' and values' lengths, the generations and the status records' keys.
+			 */
+			const uint32 max_keys = num_jobs << 1;
+			const void **keys_pp = (const void **) AllocMemory (max_keys * (sizeof (const void *) + sizeof (unsigned int) + sizeof (unsigned int)) + num_jobs * (sizeof (json_t *) + sizeof (apr_uint32_t) + APR_JOBS_MANAGER_STATUS_KEY_SIZE));
+
+			if (keys_pp)
+				{
+					json_t **jobs_json_pp = (json_t **) (keys_pp + max_keys);
+					unsigned int *key_lengths_p = (unsigned int *) (jobs_json_pp + num_jobs);
+					unsigned int *value_lengths_p = key_lengths_p + max_keys;
+					apr_uint32_t *generations_p = (apr_uint32_t *) (value_lengths_p + max_keys);
+					unsigned char *status_keys_p = (unsigned char *) (generations_p + num_jobs);
+					uint32 num_to_decode = 0;
+					void **values_pp;
+					uint32 i;
+
+					for (i = 0; i < num_jobs; ++ i)
+						{
+							* (jobs_json_pp + i) = NULL;
+
+							if (manager_p -> ajm_job_cache_p)
+								{
+									* (generations_p + i) = GetAPRGlobalStorageObjectGeneration (manager_p -> ajm_store_p, * (job_keys_p + i), UUID_RAW_SIZE);
+									* (jobs_json_pp + i) = GetJobFromAPRJobObjectCache (manager_p -> ajm_job_cache_p, * (job_keys_p + i), * (generations_p + i));
+								}
+
+							if (! (* (jobs_json_pp + i)))
+								{
+									* (keys_pp + num_to_decode) = (const void *) (* (job_keys_p + i));
+									* (key_lengths_p + num_to_decode) = UUID_RAW_SIZE;
+									++ num_to_decode;
+								}
+						}
+
+					for (i = 0; i < num_jobs; ++ i)
+						{
+							MakeServiceJobStatusKey (* (job_keys_p + i), status_keys_p + (i * APR_JOBS_MANAGER_STATUS_KEY_SIZE));
+							* (keys_pp + num_to_decode + i) = (const void *) (status_keys_p + (i * APR_JOBS_MANAGER_STATUS_KEY_SIZE));
+							* (key_lengths_p + num_to_decode + i) = APR_JOBS_MANAGER_STATUS_KEY_SIZE;
+						}
+
+					values_pp = GetObjectsFromAPRGlobalStorage (manager_p -> ajm_store_p, keys_pp, key_lengths_p, num_to_decode + num_jobs, value_lengths_p);
+
+					if (values_pp)
+						{
+							GrassrootsServer *grassroots_p = GetGrassrootsServerFromJobsManager (& (manager_p -> ajm_base_manager));
+							APRJobStatus status;
+							uint32 value_index = 0;
+
+							for (i = 0; i < num_jobs; ++ i)
+								{
+									json_t *job_json_p = * (jobs_json_pp + i);
+									ServiceJob *job_p = NULL;
+
+									if (!job_json_p)
+										{
+											const unsigned char *value_p = (const unsigned char *) (* (values_pp + value_index));
+
+											if (value_p)
+												{
+													job_json_p = DecodeStoredJob (value_p, * (value_lengths_p + value_index));
+
+													if (job_json_p && (manager_p -> ajm_job_cache_p))
+														{
+															AddJobToAPRJobObjectCache (manager_p -> ajm_job_cache_p, * (job_keys_p + i), * (generations_p + i), job_json_p);
+														}
+												}
+
+											++ value_index;
+										}
+
+									if (job_json_p)
+										{
+											job_p = CreateServiceJobFromJSON (job_json_p, grassroots_p);
+
+											if (job_p)
+												{
+													const unsigned char *status_value_p = (const unsigned char *) (* (values_pp + num_to_decode + i));
+
+													if (status_value_p && CopyServiceJobStatus (status_value_p, * (value_lengths_p + num_to_decode + i), &status))
+														{
+															ApplyServiceJobStatus (job_p, &status);
+														}
+
+													++ num_found;
+												}
+											else
+												{
+													PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create ServiceJob from stored job");
+												}
+
+											json_decref (job_json_p);
+										}
+
+									* (jobs_pp + i) = job_p;
+								}
+
+							FreeMemory (values_pp);
+						}
+					else
+						{
+							for (i = 0; i < num_jobs; ++ i)
+								{
+									if (* (jobs_json_pp + i))
+										{
+											json_decref (* (jobs_json_pp + i));
+										}
+								}
+
+							memset (jobs_pp, 0, num_jobs * sizeof (ServiceJob *));
+						}
+
+					FreeMemory (keys_pp);
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate memory to get " UINT32_FMT " jobs", num_jobs);
+				}
+		}
+
+	return num_found;
+}
+
+
+/*
+ * Get the encoded value to store for a ServiceJob. If buffer_p is not NULL,
+ * the value is written into it, otherwise the returned value is newly
+ * allocated and should be freed with free ().
+ */
+static unsigned char *SerialiseServiceJob (APRJobsManager *manager_p, ServiceJob *job_p, const char *uuid_s, APRThreadBuffer *buffer_p, unsigned int *value_length_p)
+{
+	unsigned char *value_p = NULL;
+	Service *service_p = GetServiceFromServiceJob (job_p);
+
+	if (service_p)
+		{
+			json_t *job_json_p = NULL;
+			bool omit_results_flag = true;
+
+			if (DoesServiceHaveCustomServiceJobSerialisation (service_p))
+				{
+					job_json_p = CreateSerialisedJSONForServiceJobFromService (service_p, job_p, omit_results_flag);
+
+					if (!job_json_p)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create custom serialised job for %s from %s", uuid_s, GetServiceName (service_p));
+						}
+				}
+			else
+				{
+					job_json_p = GetServiceJobAsJSON (job_p, omit_results_flag);
+
+					if (!job_json_p)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create serialised job for %s from %s", uuid_s, GetServiceName (service_p));
+						}
+				}
+
+			if (job_json_p)
+				{
+					if (buffer_p)
+						{
+							value_p = EncodeStoredJob (job_json_p, manager_p -> ajm_encoding, & (buffer_p -> atb_data_p), & (buffer_p -> atb_size), value_length_p);
+						}
+					else
+						{
+							unsigned char *new_buffer_p = NULL;
+							size_t buffer_size = 0;
+
+							value_p = EncodeStoredJob (job_json_p, manager_p -> ajm_encoding, &new_buffer_p, &buffer_size, value_length_p);
+
+							if ((!value_p) && new_buffer_p)
+								{
+									free (new_buffer_p);
+								}
+						}
+
+					if (!value_p)
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to encode \"%s\"", uuid_s);
+						}
+
+				}		/* if (job_json_p) */
+
+		}		/* if (service_p) */
+
+	return value_p;
+}
+
+
+/*
+ * Jobs that are still running never expire, so they can't be removed
+ * from underneath their services. Once they have finished, they are
+ * only kept for the retention time.
+ */
+static apr_interval_time_t GetServiceJobTTL (ServiceJob *job_p)
+{
+	return GetStatusTTL (GetServiceJobStatus (job_p));
+}
+
+
+static apr_interval_time_t GetStatusTTL (const OperationStatus status)
+{
+	switch (status)
+		{
+			case OS_IDLE:
+			case OS_PENDING:
+			case OS_STARTED:
+				return APR_GLOBAL_STORAGE_NO_EXPIRY;
+
+			default:
+				return APR_GLOBAL_STORAGE_DEFAULT_TTL;
+		}
+}
+
+
+static int32 GetJobRetention (const GrassrootsLocationConfig *config_p)
+{
+	return (config_p -> glc_job_retention_secs >= 0) ? config_p -> glc_job_retention_secs : APR_JOBS_MANAGER_DEFAULT_JOB_RETENTION;
+}
+
+
+/* Get a setting that may not have been given in any of the contexts */
+static uint32 GetConfigValue (const uint32 value, const uint32 default_value)
+{
+	return (value != GLC_UNSET_UINT32) ? value : default_value;
+}
+
+
+static ServiceJob *GetServiceJobFromAprJobsManager (JobsManager *jobs_manager_p, const uuid_t job_key)
+{
+	APRJobsManager *manager_p = (APRJobsManager *) jobs_manager_p;
+	ServiceJob *job_p = NULL;
+	json_t *job_json_p = NULL;
+	char uuid_s [UUID_STRING_BUFFER_SIZE];
+
+	ConvertUUIDToString (job_key, uuid_s);
+
+	#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINEST
+	PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Looking for %s", uuid_s);
+	#endif
+
+	job_json_p = GetServiceJobJSON (manager_p, job_key);
+
+	if (job_json_p)
+		{
+			GrassrootsServer *grassroots_p = GetGrassrootsServerFromJobsManager (jobs_manager_p);
+
+			job_p = CreateServiceJobFromJSON (job_json_p, grassroots_p);
+
+			if (job_p)
+				{
+					APRJobStatus status;
+
+					if (GetServiceJobStatusFromAPRJobsManager (manager_p, job_key, &status))
+						{
+							ApplyServiceJobStatus (job_p, &status);
+						}
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "CreateServiceJobFromJSON failed for \"%s\"", uuid_s);
+				}
+
+			json_decref (job_json_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get stored value for \"%s\"", uuid_s);
+		}
+
+	return job_p;
+}
+
+
+static bool ParseServiceJobJSON (const unsigned char *value_p, const unsigned int value_length, void *reader_data_p)
+{
+	json_t **job_json_pp = (json_t **) reader_data_p;
+
+	*job_json_pp = DecodeStoredJob (value_p, value_length);
+
+	return (*job_json_pp != NULL);
+}
+
+
+/*
+ * Get the decoded JSON for a stored ServiceJob, from this child's cache
+ * of them if it is there and up to date. The caller owns the JSON and
+ * must json_decref () it.
+ */
+static json_t *GetServiceJobJSON (APRJobsManager *manager_p, const uuid_t job_key)
+{
+	json_t *job_json_p = NULL;
+	apr_uint32_t generation = 0;
+
+	if (manager_p -> ajm_job_cache_p)
+		{
+			/* Get the generation first so that a change made whilst decoding leaves the cached copy out of date */
+			generation = GetAPRGlobalStorageObjectGeneration (manager_p -> ajm_store_p, job_key, UUID_RAW_SIZE);
+			job_json_p = GetJobFromAPRJobObjectCache (manager_p -> ajm_job_cache_p, job_key, generation);
+
+			if (job_json_p)
+				{
+					return job_json_p;
+				}
+		}
+
+	/*
+	 * Only decode the JSON whilst reading the stored value, the ServiceJob
+	 * itself is built afterwards as that can take a lot longer.
+	 */
+	if (ReadObjectFromAPRGlobalStorage (manager_p -> ajm_store_p, (const void *) job_key, UUID_RAW_SIZE, ParseServiceJobJSON, &job_json_p))
+		{
+			if (manager_p -> ajm_job_cache_p)
+				{
+					AddJobToAPRJobObjectCache (manager_p -> ajm_job_cache_p, job_key, generation, job_json_p);
+				}
+		}
+
+	return job_json_p;
+}
+
+
+
+static ServiceJob *RemoveServiceJobFromAprJobsManager (JobsManager *manager_p, const uuid_t job_key, bool get_job_flag)
+{
+	APRJobStatus status;
+	const bool status_flag = RemoveServiceJobStatus ((APRJobsManager *) manager_p, job_key, &status);
+	ServiceJob *job_p = QueryServiceJobFromAprJobsManager (manager_p, job_key, get_job_flag, RemoveObjectFromAPRGlobalStorage);
+
+	if (((APRJobsManager *) manager_p) -> ajm_result_store_p)
+		{
+			RemoveServiceJobResults ((APRJobsManager *) manager_p, job_key);
+		}
+
+	if (((APRJobsManager *) manager_p) -> ajm_job_cache_p)
+		{
+			RemoveJobFromAPRJobObjectCache (((APRJobsManager *) manager_p) -> ajm_job_cache_p, job_key);
+		}
+
+	if (status_flag && (status.ajs_counted_flag) && (!HasAPRJobStatusFinished (&status)))
+		{
+			UncountServiceJob ((APRJobsManager *) manager_p, &status);
+		}
+
+	if (job_p && status_flag)
+		{
+			ApplyServiceJobStatus (job_p, &status);
+		}
+
+	return job_p;
+}
+
+
+static ServiceJob *QueryServiceJobFromAprJobsManager (JobsManager *jobs_manager_p, const uuid_t job_key, bool get_job_flag, void *(*storage_callback_fn) (APRGlobalStorage *storage_p, const void *raw_key_p, unsigned int raw_key_length, unsigned int *value_length_p))
+{
+	APRJobsManager *manager_p = (APRJobsManager *) jobs_manager_p;
+	ServiceJob *job_p = NULL;
+	unsigned char *value_p = NULL;
+	unsigned int value_length = 0;
+	const void *key_p = (const void *) job_key;
+
+	char uuid_s [UUID_STRING_BUFFER_SIZE];
+	ConvertUUIDToString (job_key, uuid_s);
+
+	#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINEST
+	PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Looking for %s", uuid_s);
+	#endif
+
+	value_p = storage_callback_fn (manager_p -> ajm_store_p, key_p, UUID_RAW_SIZE, &value_length);
+
+	if (value_p)
+		{
+			GrassrootsServer *grassroots_p = GetGrassrootsServerFromJobsManager (jobs_manager_p);
+
+			#if APR_JOBS_MANAGER_DEBUG >= STM_LEVEL_FINER
+			PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Found stored value for job %s", uuid_s);
+			#endif
+
+
+			job_p = RebuildServiceJob (value_p, value_length, grassroots_p);
+
+			if (!job_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "CreateServiceJobFromJSON failed for \"%s\"", uuid_s);
+				}
+
+			FreeMemory (value_p);
+		}		/* if (value_p) */
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to get stored value for \"%s\"", uuid_s);
+		}
+
+	return job_p;
+}
+
+
+
+static ServiceJob *RebuildServiceJob (const unsigned char *value_p, const unsigned int value_length, GrassrootsServer *grassroots_p)
+{
+	ServiceJob *job_p = NULL;
+	json_t *job_json_p = DecodeStoredJob (value_p, value_length);
+
+	if (job_json_p)
+		{
+			job_p = CreateServiceJobFromJSON (job_json_p, grassroots_p);
+
+			if (!job_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create ServiceJob from stored job");
+				}
+
+			json_decref (job_json_p);
+		}		/* if (job_json_p) */
+
+	return job_p;
+}
+
+
+static void FreeAPRServerJob (unsigned char *key_p, void *value_p)
+{
+	if (key_p)
+		{
+			FreeMemory (key_p);
+		}
+
+	if (value_p)
+		{
+			char *value_s = value_p;
+
+			free (value_s);
+		}
+}
+
+
+
+void APRServiceJobFinished (JobsManager *jobs_manager_p, uuid_t job_key)
+{
+	ServiceJob *job_p = RemoveServiceJobFromJobsManager (jobs_manager_p, job_key, true);
+
+	if (job_p)
+		{
+		}
+}
+
+
+
+apr_status_t CleanUpAPRJobsManager (void *value_p)
+{
+	APRJobsManager *manager_p = (APRJobsManager *) value_p;
+
+	return (DestroyAPRJobsManager (manager_p) ? APR_SUCCESS : APR_EGENERAL);
+}
+
+
+
+static LinkedList *GetAllServiceJobsFromAprJobsManager (struct JobsManager *jobs_manager_p)
+{
+	return GetFilteredServiceJobsFromAPRJobsManager ((APRJobsManager *) jobs_manager_p, NULL);
+}
+
+
+LinkedList *GetFilteredServiceJobsFromAPRJobsManager (APRJobsManager *manager_p, const APRJobsFilter *filter_p)
+{
+	LinkedList *jobs_p = NULL;
+	APRSOCacheData data;
+
+	memset (&data, 0, sizeof (APRSOCacheData));
+	data.ascd_filter_p = filter_p;
+
+	/*
+	 * Get the small status records first so that the ServiceJobs that
+	 * don't match the filter can be skipped without decompressing them.
+	 */
+	IterateOverFilteredAPRGlobalStorage (manager_p -> ajm_store_p, IsServiceJobStatusKey, CollectServiceJobStatus, &data);
+
+	if (data.ascd_num_statuses > 1)
+		{
+			qsort (data.ascd_statuses_p, data.ascd_num_statuses, sizeof (APRStoredStatus), CompareStoredStatuses);
+		}
+
+	/* This only copies the ServiceJobs so each stripe is locked for as short a time as possible */
+	IterateOverFilteredAPRGlobalStorage (manager_p -> ajm_store_p, ShouldCollectServiceJob, CollectServiceJob, &data);
+
+	if (data.ascd_num_jobs > 0)
+		{
+			GrassrootsServer *grassroots_p = GetGrassrootsServerFromJobsManager (& (manager_p -> ajm_base_manager));
+			uint32 i;
+
+			RebuildStoredJobs (manager_p, data.ascd_jobs_p, data.ascd_num_jobs, grassroots_p);
+
+			jobs_p = AllocateLinkedList (FreeServiceJobNode);
+
+			for (i = 0; i < data.ascd_num_jobs; ++ i)
+				{
+					APRStoredJob *stored_job_p = data.ascd_jobs_p + i;
+					ServiceJob *job_p = stored_job_p -> asj_job_p;
+
+					if (job_p)
+						{
+							ServiceJobNode *node_p = NULL;
+
+							if (stored_job_p -> asj_status_p)
+								{
+									ApplyServiceJobStatus (job_p, stored_job_p -> asj_status_p);
+								}
+
+							if (jobs_p && DoesServiceJobMatchFilter (job_p, filter_p))
+								{
+									node_p = AllocateServiceJobNode (job_p);
+								}
+
+							if (node_p)
+								{
+									LinkedListAddTail (jobs_p, (ListItem *) node_p);
+								}
+							else
+								{
+									FreeServiceJob (job_p);
+								}
+						}
+				}
+
+			if (jobs_p && (jobs_p -> ll_size == 0))
+				{
+					FreeLinkedList (jobs_p);
+					jobs_p = NULL;
+				}
+
+			FreeMemory (data.ascd_jobs_p);
+		}
+
+	if (data.ascd_statuses_p)
+		{
+			FreeMemory (data.ascd_statuses_p);
+		}
+
+	return jobs_p;
+}
+
+
+static apr_status_t CollectServiceJobStatus (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p)
+{
+	APRSOCacheData *apr_data_p = (APRSOCacheData *) user_data_p;
+	APRStoredStatus *stored_status_p;
+
+	if (apr_data_p -> ascd_num_statuses == apr_data_p -> ascd_statuses_size)
+		{
+			const uint32 new_size = (apr_data_p -> ascd_statuses_size > 0) ? (apr_data_p -> ascd_statuses_size << 1) : 64;
+			APRStoredStatus *statuses_p = (APRStoredStatus *) ReallocMemory (apr_data_p -> ascd_statuses_p, new_size * sizeof (APRStoredStatus), apr_data_p -> ascd_statuses_size * sizeof (APRStoredStatus));
+
+			if (!statuses_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate memory for " UINT32_FMT " job statuses", new_size);
+					return APR_ENOMEM;
+				}
+
+			apr_data_p -> ascd_statuses_p = statuses_p;
+			apr_data_p -> ascd_statuses_size = new_size;
+		}
+
+	stored_status_p = apr_data_p -> ascd_statuses_p + apr_data_p -> ascd_num_statuses;
+
+	if (CopyServiceJobStatus (data_p, data_length, & (stored_status_p -> ass_status)))
+		{
+			memcpy (stored_status_p -> ass_key, id_s, UUID_RAW_SIZE);
+			++ (apr_data_p -> ascd_num_statuses);
+		}
+
+	return APR_SUCCESS;
+}
+
+
+static apr_status_t CollectServiceJob (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p)
+{
+	APRSOCacheData *apr_data_p = (APRSOCacheData *) user_data_p;
+	APRStoredJob *stored_job_p;
+
+	if (apr_data_p -> ascd_num_jobs == apr_data_p -> ascd_jobs_size)
+		{
+			const uint32 new_size = (apr_data_p -> ascd_jobs_size > 0) ? (apr_data_p -> ascd_jobs_size << 1) : 64;
+			APRStoredJob *jobs_p = (APRStoredJob *) ReallocMemory (apr_data_p -> ascd_jobs_p, new_size * sizeof (APRStoredJob), apr_data_p -> ascd_jobs_size * sizeof (APRStoredJob));
+
+			if (!jobs_p)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate memory for " UINT32_FMT " stored jobs", new_size);
+					return APR_ENOMEM;
+				}
+
+			apr_data_p -> ascd_jobs_p = jobs_p;
+			apr_data_p -> ascd_jobs_size = new_size;
+		}
+
+	stored_job_p = apr_data_p -> ascd_jobs_p + apr_data_p -> ascd_num_jobs;
+	stored_job_p -> asj_value_p = (unsigned char *) AllocMemory (data_length);
+
+	if (! (stored_job_p -> asj_value_p))
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate %u bytes to copy a stored job", data_length);
+			return APR_ENOMEM;
+		}
+
+	memcpy (stored_job_p -> asj_value_p, data_p, data_length);
+	stored_job_p -> asj_value_length = data_length;
+	stored_job_p -> asj_status_p = apr_data_p -> ascd_current_status_p;
+	stored_job_p -> asj_job_json_p = NULL;
+	stored_job_p -> asj_job_p = NULL;
+
+	++ (apr_data_p -> ascd_num_jobs);
+
+	return APR_SUCCESS;
+}
+
+
+static bool IsServiceJobStatusKey (const unsigned char *raw_key_p, const unsigned int raw_key_length, void *data_p)
+{
+	return ((raw_key_length == APR_JOBS_MANAGER_STATUS_KEY_SIZE) && (* (raw_key_p + UUID_RAW_SIZE) == s_status_key_suffix));
+}
+
+
+/*
+ * Skip the status records and, using the status records that were
+ * collected beforehand, any ServiceJobs that don't match the filter.
+ */
+static bool ShouldCollectServiceJob (const unsigned char *raw_key_p, const unsigned int raw_key_length, void *data_p)
+{
+	APRSOCacheData *apr_data_p = (APRSOCacheData *) data_p;
+	const APRJobsFilter *filter_p = apr_data_p -> ascd_filter_p;
+
+	apr_data_p -> ascd_current_status_p = NULL;
+
+	if (raw_key_length != UUID_RAW_SIZE)
+		{
+			return false;
+		}
+
+	if (filter_p && (filter_p -> ajf_limit > 0) && (apr_data_p -> ascd_num_jobs >= filter_p -> ajf_limit))
+		{
+			return false;
+		}
+
+	if (apr_data_p -> ascd_num_statuses > 0)
+		{
+			const APRStoredStatus *stored_status_p = (const APRStoredStatus *) bsearch (raw_key_p, apr_data_p -> ascd_statuses_p, apr_data_p -> ascd_num_statuses, sizeof (APRStoredStatus), CompareStoredStatuses);
+
+			if (stored_status_p)
+				{
+					if (filter_p && (!DoesStatusMatchFilter (& (stored_status_p -> ass_status), filter_p)))
+						{
+							return false;
+						}
+
+					apr_data_p -> ascd_current_status_p = & (stored_status_p -> ass_status);
+				}
+		}
+
+	return true;
+}
+
+
+/* Both the APRStoredStatuses and the raw uuids start with the uuid */
+static int CompareStoredStatuses (const void *v0_p, const void *v1_p)
+{
+	return memcmp (v0_p, v1_p, UUID_RAW_SIZE);
+}
+
+
+static bool DoesStatusMatchFilter (const APRJobStatus *status_p, const APRJobsFilter *filter_p)
+{
+	if ((filter_p -> ajf_status_flag) && (status_p -> ajs_status != filter_p -> ajf_status))
+		{
+			return false;
+		}
+
+	/* The stored name may have been truncated */
+	if ((filter_p -> ajf_service_name_s) && (strncmp (status_p -> ajs_service_name_s, filter_p -> ajf_service_name_s, APR_JOB_STATUS_SERVICE_NAME_SIZE - 1) != 0))
+		{
+			return false;
+		}
+
+	return true;
+}
+
+
+static bool DoesServiceJobMatchFilter (ServiceJob *job_p, const APRJobsFilter *filter_p)
+{
+	if (filter_p)
+		{
+			if ((filter_p -> ajf_status_flag) && (GetServiceJobStatus (job_p) != filter_p -> ajf_status))
+				{
+					return false;
+				}
+
+			if (filter_p -> ajf_service_name_s)
+				{
+					Service *service_p = GetServiceFromServiceJob (job_p);
+					const char *name_s = service_p ? GetServiceName (service_p) : NULL;
+
+					if ((!name_s) || (strcmp (name_s, filter_p -> ajf_service_name_s) != 0))
+						{
+							return false;
+						}
+				}
+		}
+
+	return true;
+}
+
+
+/*
+ * Rebuild the copied ServiceJobs. Decoding them back into JSON is
+ * shared out between the rebuild threads if there are enough of them,
+ * as it only uses the copies and jansson, which is safe to use from
+ * different threads on different objects. Creating the ServiceJobs
+ * looks up their Services in the GrassrootsServer, which isn't known
+ * to be thread-safe, so that is done afterwards by the calling thread.
+ */
+static void RebuildStoredJobs (APRJobsManager *manager_p, APRStoredJob *jobs_p, const uint32 num_jobs, GrassrootsServer *grassroots_p)
+{
+	const uint32 num_tasks = (num_jobs + APR_JOBS_MANAGER_JOBS_PER_REBUILD_TASK - 1) / APR_JOBS_MANAGER_JOBS_PER_REBUILD_TASK;
+	bool decoded_flag = false;
+	uint32 i;
+
+	if ((manager_p -> ajm_rebuild_pool_p) && (num_tasks > 1))
+		{
+			apr_pool_t *pool_p = NULL;
+
+			/* Unlike a root pool, the scratch pool's subpools can be created by several request threads at once */
+			if (apr_pool_create (&pool_p, manager_p -> ajm_scratch_pool_p) == APR_SUCCESS)
+				{
+					APRRebuildTasks tasks;
+					APRRebuildTask *task_p = (APRRebuildTask *) apr_palloc (pool_p, num_tasks * sizeof (APRRebuildTask));
+
+					if (task_p &&
+							(apr_thread_mutex_create (& (tasks.art_mutex_p), APR_THREAD_MUTEX_DEFAULT, pool_p) == APR_SUCCESS) &&
+							(apr_thread_cond_create (& (tasks.art_cond_p), pool_p) == APR_SUCCESS))
+						{
+							tasks.art_num_remaining = num_tasks;
+
+							for (i = 0; i < num_tasks; ++ i)
+								{
+									const uint32 offset = i * APR_JOBS_MANAGER_JOBS_PER_REBUILD_TASK;
+									APRRebuildTask *current_task_p = task_p + i;
+
+									current_task_p -> arj_jobs_p = jobs_p + offset;
+									current_task_p -> arj_num_jobs = (num_jobs - offset < APR_JOBS_MANAGER_JOBS_PER_REBUILD_TASK) ? num_jobs - offset : APR_JOBS_MANAGER_JOBS_PER_REBUILD_TASK;
+									current_task_p -> arj_tasks_p = &tasks;
+								}
+
+							/* The calling thread does the first share itself rather than just waiting */
+							for (i = 1; i < num_tasks; ++ i)
+								{
+									if (apr_thread_pool_push (manager_p -> ajm_rebuild_pool_p, RunRebuildTask, task_p + i, APR_THREAD_TASK_PRIORITY_NORMAL, manager_p) != APR_SUCCESS)
+										{
+											RunRebuildTask (NULL, task_p + i);
+										}
+								}
+
+							RunRebuildTask (NULL, task_p);
+
+							apr_thread_mutex_lock (tasks.art_mutex_p);
+
+							while (tasks.art_num_remaining > 0)
+								{
+									apr_thread_cond_wait (tasks.art_cond_p, tasks.art_mutex_p);
+								}
+
+							apr_thread_mutex_unlock (tasks.art_mutex_p);
+
+							decoded_flag = true;
+						}
+
+					apr_pool_destroy (pool_p);
+				}
+		}
+
+	if (!decoded_flag)
+		{
+			DecodeStoredJobRange (jobs_p, num_jobs);
+		}
+
+	for (i = 0; i < num_jobs; ++ i)
+		{
+			APRStoredJob *stored_job_p = jobs_p + i;
+
+			if (stored_job_p -> asj_job_json_p)
+				{
+					stored_job_p -> asj_job_p = CreateServiceJobFromJSON (stored_job_p -> asj_job_json_p, grassroots_p);
+
+					if (! (stored_job_p -> asj_job_p))
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create ServiceJob from stored job");
+						}
+
+					json_decref (stored_job_p -> asj_job_json_p);
+					stored_job_p -> asj_job_json_p = NULL;
+				}
+		}
+}
+
+
+static void * APR_THREAD_FUNC RunRebuildTask (apr_thread_t *thread_p, void *data_p)
+{
+	APRRebuildTask *task_p = (APRRebuildTask *) data_p;
+	APRRebuildTasks *tasks_p = task_p -> arj_tasks_p;
+
+	DecodeStoredJobRange (task_p -> arj_jobs_p, task_p -> arj_num_jobs);
+
+	apr_thread_mutex_lock (tasks_p -> art_mutex_p);
+
+	if (-- (tasks_p -> art_num_remaining) == 0)
+		{
+			apr_thread_cond_signal (tasks_p -> art_cond_p);
+		}
+
+	apr_thread_mutex_unlock (tasks_p -> art_mutex_p);
+
+	return NULL;
+}
+
+
+static void DecodeStoredJobRange (APRStoredJob *jobs_p, const uint32 num_jobs)
+{
+	uint32 i;
+
+	for (i = 0; i < num_jobs; ++ i)
+		{
+			APRStoredJob *stored_job_p = jobs_p + i;
+
+			stored_job_p -> asj_job_json_p = DecodeStoredJob (stored_job_p -> asj_value_p, stored_job_p -> asj_value_length);
+
+			/* Free each copy as soon as possible as there may be lots of them */
+			FreeMemory (stored_job_p -> asj_value_p);
+			stored_job_p -> asj_value_p = NULL;
+		}
+}
+
+
+/*
+ * Save an encoded job so that it can be used to train a zstd
+ * dictionary with grassroots_dictionary_trainer.
+ */
+static void SaveDictionarySample (APRJobsManager *manager_p, const char *uuid_s, const unsigned char *value_p, const unsigned int value_length)
+{
+	/* Check first so that the count stops growing once there are enough */
+	if ((apr_atomic_read32 (& (manager_p -> ajm_num_samples)) < APR_JOBS_MANAGER_MAX_DICTIONARY_SAMPLES) &&
+			(apr_atomic_inc32 (& (manager_p -> ajm_num_samples)) < APR_JOBS_MANAGER_MAX_DICTIONARY_SAMPLES))
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to convert \"%s\" to json err \"%s\" at line %d, column %d", value_s, err.text, err.line, err.column);
+			char *filename_s = ConcatenateVarargsStrings (manager_p -> ajm_samples_path_s, "/", uuid_s, (manager_p -> ajm_encoding == SJE_BSON) ? ".bson" : ".json", NULL);
+
+			if (filename_s)
+				{
+					FILE *out_f = fopen (filename_s, "wb");
+
+					if (out_f)
+						{
+							if (fwrite (value_p, 1, value_length, out_f) != value_length)
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to write dictionary sample \"%s\"", filename_s);
+								}
+
+							fclose (out_f);
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to open dictionary sample \"%s\"", filename_s);
+						}
+
+					FreeCopiedString (filename_s);
+				}
 		}
+}
 
-	return job_p;
+
+static void MakeServiceJobStatusKey (const uuid_t job_key, unsigned char *key_p)
+{
+	memcpy (key_p, job_key, UUID_RAW_SIZE);
+	* (key_p + UUID_RAW_SIZE) = s_status_key_suffix;
 }
 
 
-static void FreeAPRServerJob (unsigned char *key_p, void *value_p)
+static void FillServiceJobStatus (const APRJobsManager *manager_p, ServiceJob *job_p, const apr_interval_time_t ttl, APRJobStatus *status_p)
 {
-	if (key_p)
+	const apr_interval_time_t job_ttl = (ttl == APR_GLOBAL_STORAGE_DEFAULT_TTL) ? manager_p -> ajm_store_p -> ags_default_ttl : ttl;
+	Service *service_p = GetServiceFromServiceJob (job_p);
+	const json_t *results_p = job_p -> sj_result_p;
+
+	/* Clear the padding too as the record is stored as it is */
+	memset (status_p, 0, sizeof (APRJobStatus));
+
+	status_p -> ajs_update_time = apr_time_now ();
+	status_p -> ajs_expiry_time = (job_ttl > 0) ? status_p -> ajs_update_time + job_ttl : 0;
+	status_p -> ajs_status = GetServiceJobStatus (job_p);
+	status_p -> ajs_version = APR_JOB_STATUS_VERSION;
+	status_p -> ajs_results_flag = json_is_array (results_p) ? (json_array_size (results_p) > 0) : (results_p != NULL);
+
+	/* The full ServiceJob doesn't record its progress, but we know when it has finished */
+	status_p -> ajs_progress = (GetStatusTTL (status_p -> ajs_status) == APR_GLOBAL_STORAGE_NO_EXPIRY) ? 0 : 100;
+
+	if (service_p)
 		{
-			FreeMemory (key_p);
+			const char *name_s = GetServiceName (service_p);
+
+			if (name_s)
+				{
+					strncpy (status_p -> ajs_service_name_s, name_s, APR_JOB_STATUS_SERVICE_NAME_SIZE - 1);
+				}
+		}
+}
+
+
+static void StoreServiceJobStatus (APRJobsManager *manager_p, const uuid_t job_key, ServiceJob *job_p, const apr_interval_time_t ttl, const char *uuid_s)
+{
+	unsigned char key [APR_JOBS_MANAGER_STATUS_KEY_SIZE];
+	APRJobStatus status;
+
+	MakeServiceJobStatusKey (job_key, key);
+	FillServiceJobStatus (manager_p, job_p, ttl, &status);
+
+	if (HasAPRJobsManagerGotJobLimits (manager_p))
+		{
+			UpdateServiceJobCounts (manager_p, key, &status);
+		}
+
+	if (!AddObjectToAPRGlobalStorageWithTTL (manager_p -> ajm_store_p, key, APR_JOBS_MANAGER_STATUS_KEY_SIZE, (unsigned char *) &status, sizeof (APRJobStatus), ttl))
+		{
+			/* Don't leave an out of date status behind, the callers will fall back to getting the ServiceJob */
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to store status for \"%s\"", uuid_s);
+			RemoveServiceJobStatus (manager_p, job_key, NULL);
+
+			/* Without its record, nothing would stop counting it when it finishes */
+			if (status.ajs_counted_flag)
+				{
+					UncountServiceJob (manager_p, &status);
+				}
 		}
+}
+
+
+/*
+ * Remove a ServiceJob's status record, copying it into status_p
+ * if that is not NULL.
+ */
+static bool RemoveServiceJobStatus (APRJobsManager *manager_p, const uuid_t job_key, APRJobStatus *status_p)
+{
+	bool copied_flag = false;
+	unsigned char key [APR_JOBS_MANAGER_STATUS_KEY_SIZE];
+	void *value_p;
+	unsigned int value_length = 0;
+
+	MakeServiceJobStatusKey (job_key, key);
+
+	value_p = RemoveObjectFromAPRGlobalStorage (manager_p -> ajm_store_p, key, APR_JOBS_MANAGER_STATUS_KEY_SIZE, &value_length);
 
 	if (value_p)
 		{
-			char *value_s = value_p;
+			if (status_p)
+				{
+					copied_flag = CopyServiceJobStatus ((const unsigned char *) value_p, value_length, status_p);
+				}
 
-			free (value_s);
+			FreeMemory (value_p);
 		}
+
+	return copied_flag;
 }
 
 
+/*
+ * A status that has been updated since the ServiceJob was stored
+ * is newer than the one in the ServiceJob.
+ */
+static void ApplyServiceJobStatus (ServiceJob *job_p, const APRJobStatus *status_p)
+{
+	if ((status_p -> ajs_updated_flag) && (GetServiceJobStatus (job_p) != status_p -> ajs_status))
+		{
+			SetServiceJobStatus (job_p, status_p -> ajs_status);
+		}
+}
 
-void APRServiceJobFinished (JobsManager *jobs_manager_p, uuid_t job_key)
+
+static bool CopyServiceJobStatus (const unsigned char *value_p, const unsigned int value_length, void *reader_data_p)
 {
-	ServiceJob *job_p = RemoveServiceJobFromJobsManager (jobs_manager_p, job_key, true);
+	if ((value_length == sizeof (APRJobStatus)) && (((const APRJobStatus *) value_p) -> ajs_version == APR_JOB_STATUS_VERSION))
+		{
+			memcpy (reader_data_p, value_p, sizeof (APRJobStatus));
+			return true;
+		}
 
-	if (job_p)
+	return false;
+}
+
+
+static void MakeServiceJobResultsKey (const uuid_t job_key, unsigned char *key_p)
+{
+	memcpy (key_p, job_key, UUID_RAW_SIZE);
+	* (key_p + UUID_RAW_SIZE) = s_results_key_suffix;
+}
+
+
+/*
+ * Write the results of a finished ServiceJob to the result store, unless
+ * they have already been written, and store the descriptor for them.
+ */
+static void StoreServiceJobResults (APRJobsManager *manager_p, const uuid_t job_key, ServiceJob *job_p, const apr_interval_time_t ttl, const char *uuid_s)
+{
+	const json_t *results_p = job_p -> sj_result_p;
+
+	if ((ttl != APR_GLOBAL_STORAGE_NO_EXPIRY) && (json_is_array (results_p) ? (json_array_size (results_p) > 0) : (results_p != NULL)))
 		{
+			unsigned char key [APR_JOBS_MANAGER_RESULTS_KEY_SIZE];
+			APRResultDescriptor descriptor;
+
+			MakeServiceJobResultsKey (job_key, key);
+
+			if (!ReadObjectFromAPRGlobalStorage (manager_p -> ajm_store_p, key, APR_JOBS_MANAGER_RESULTS_KEY_SIZE, CopyResultDescriptor, &descriptor))
+				{
+					if (WriteResultsToAPRResultStore (manager_p -> ajm_result_store_p, uuid_s, results_p, &descriptor))
+						{
+							if (!AddObjectToAPRGlobalStorageWithTTL (manager_p -> ajm_store_p, key, APR_JOBS_MANAGER_RESULTS_KEY_SIZE, (unsigned char *) &descriptor, sizeof (APRResultDescriptor), ttl))
+								{
+									PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to store the results descriptor for \"%s\"", uuid_s);
+									RemoveResultsFromAPRResultStore (manager_p -> ajm_result_store_p, uuid_s);
+								}
+						}
+				}
 		}
 }
 
 
+static void RemoveServiceJobResults (APRJobsManager *manager_p, const uuid_t job_key)
+{
+	unsigned char key [APR_JOBS_MANAGER_RESULTS_KEY_SIZE];
+	void *value_p;
+
+	MakeServiceJobResultsKey (job_key, key);
 
-apr_status_t CleanUpAPRJobsManager (void *value_p)
+	value_p = RemoveObjectFromAPRGlobalStorage (manager_p -> ajm_store_p, key, APR_JOBS_MANAGER_RESULTS_KEY_SIZE, NULL);
+
+	if (value_p)
+		{
+			char uuid_s [UUID_STRING_BUFFER_SIZE];
+
+			ConvertUUIDToString (job_key, uuid_s);
+
+			if (!RemoveResultsFromAPRResultStore (manager_p -> ajm_result_store_p, uuid_s))
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to remove the stored results for \"%s\"", uuid_s);
+				}
+
+			FreeMemory (value_p);
+		}
+}
+
+
+static bool CopyResultDescriptor (const unsigned char *value_p, const unsigned int value_length, void *reader_data_p)
 {
-	APRJobsManager *manager_p = (APRJobsManager *) value_p;
+	if ((value_length == sizeof (APRResultDescriptor)) && (((const APRResultDescriptor *) value_p) -> ard_version == APR_RESULT_DESCRIPTOR_VERSION))
+		{
+			memcpy (reader_data_p, value_p, sizeof (APRResultDescriptor));
+			return true;
+		}
 
-	return (DestroyAPRJobsManager (manager_p) ? APR_SUCCESS : APR_EGENERAL);
+	return false;
 }
 
 
+/*
+ * The sweeper has just removed the expired descriptors, so remove
+ * their results files too, along with any left by crashed processes.
+ */
+static void SweepResultStore (apr_pool_t *pool_p, void *data_p)
+{
+	APRJobsManager *manager_p = (APRJobsManager *) data_p;
+	const apr_interval_time_t ttl = manager_p -> ajm_store_p -> ags_default_ttl;
 
-static LinkedList *GetAllServiceJobsFromAprJobsManager (struct JobsManager *jobs_manager_p)
+	if (ttl > 0)
+		{
+			const apr_time_t cutoff = apr_time_now () - ttl - manager_p -> ajm_store_p -> ags_expiry_grace_period;
+			const uint32 num_removed = SweepAPRResultStore (manager_p -> ajm_result_store_p, cutoff, pool_p);
+
+			if (num_removed > 0)
+				{
+					PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Removed " UINT32_FMT " expired results files", num_removed);
+				}
+		}
+}
+
+
+static void MakeJobCounterName (char *buffer_s, const char *prefix_s, const char *name_s, const size_t max_name_length)
 {
-	LinkedList *jobs_p = AllocateLinkedList (FreeServiceJobNode);
+	/* The names are truncated in the same way as in the APRJobStatus records so that both use the same counters */
+	const size_t prefix_length = strlen (prefix_s);
 
-	if (jobs_p)
+	memcpy (buffer_s, prefix_s, prefix_length);
+	strncpy (buffer_s + prefix_length, name_s, max_name_length);
+	* (buffer_s + prefix_length + max_name_length) = '\0';
+}
+
+
+static APRJobAdmissionResult ReserveServiceJob (APRJobsManager *manager_p, const char *counter_name_s, const uint32 limit, const APRJobAdmissionResult limit_result)
+{
+	switch (AcquireAPRGlobalStorageCounter (manager_p -> ajm_store_p, counter_name_s, limit))
 		{
-			APRJobsManager *manager_p = (APRJobsManager *) jobs_manager_p;
-			ap_socache_iterator_t *iterator_p = AddServiceJobFromSOCache;
-			GrassrootsServer *grassroots_p = GetGrassrootsServerFromJobsManager (& (manager_p -> ajm_base_manager));
+			case AGS_CR_ACQUIRED:
+				return AJA_ADMITTED;
+
+			case AGS_CR_AT_LIMIT:
+				return limit_result;
 
-			APRSOCacheData data;
+			case AGS_CR_NO_ROOM:
+				return AJA_COUNTERS_FULL;
+
+			default:
+				return AJA_ERROR;
+		}
+}
 
-			data.ascd_jobs_p = jobs_p;
-			data.ascd_grassroots_p = grassroots_p;
 
-			IterateOverAPRGlobalStorage (manager_p -> ajm_store_p, iterator_p, &data);
+static void ReleaseAPRJobAdmission (APRJobAdmission *admission_p)
+{
+	APRJobsManager *manager_p = admission_p -> aja_manager_p;
+	APRJobReservation *reservation_p = admission_p -> aja_reservations_p;
+	char counter_name_s [AJM_COUNTER_NAME_SIZE];
+	uint32 i;
 
-			if (jobs_p -> ll_size == 0)
+	for (i = 0; i < admission_p -> aja_num_reservations; ++ i, ++ reservation_p)
+		{
+			if (reservation_p -> ajr_num_jobs > 0)
 				{
-					FreeLinkedList (jobs_p);
-					jobs_p = NULL;
+					MakeJobCounterName (counter_name_s, AJM_SERVICE_COUNTER_PREFIX_S, reservation_p -> ajr_service_name_s, APR_JOB_STATUS_SERVICE_NAME_SIZE - 1);
+
+					while (reservation_p -> ajr_num_jobs > 0)
+						{
+							ReleaseAPRGlobalStorageCounter (manager_p -> ajm_store_p, counter_name_s);
+							-- (reservation_p -> ajr_num_jobs);
+						}
 				}
+		}
 
-		}		/* if (jobs_p) */
+	if (admission_p -> aja_num_user_jobs > 0)
+		{
+			MakeJobCounterName (counter_name_s, AJM_USER_COUNTER_PREFIX_S, admission_p -> aja_user_s, APR_JOB_STATUS_USER_NAME_SIZE - 1);
 
-	return jobs_p;
+			while (admission_p -> aja_num_user_jobs > 0)
+				{
+					ReleaseAPRGlobalStorageCounter (manager_p -> ajm_store_p, counter_name_s);
+					-- (admission_p -> aja_num_user_jobs);
+				}
+		}
+
+	while (admission_p -> aja_num_jobs > 0)
+		{
+			ReleaseAPRGlobalStorageCounter (manager_p -> ajm_store_p, s_active_jobs_counter_s);
+			-- (admission_p -> aja_num_jobs);
+		}
 }
 
 
-static apr_status_t AddServiceJobFromSOCache (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, const unsigned char *id_s, unsigned int id_length, const unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p)
+/*
+ * A ServiceJob is counted as active from when it is first added until it
+ * is stored as finished or removed, with its status record remembering
+ * whether it was counted and against which user. Two threads storing
+ * the same ServiceJob as finished at once could both stop counting it,
+ * but the counters never drop below 0.
+ */
+static void UpdateServiceJobCounts (APRJobsManager *manager_p, const unsigned char *status_key_p, APRJobStatus *status_p)
 {
-	apr_status_t status = APR_SUCCESS;
-	APRSOCacheData *apr_data_p = (APRSOCacheData *) user_data_p;
-	ServiceJob *job_p = RebuildServiceJob ((char *) data_p, apr_data_p -> ascd_grassroots_p);
+	APRJobStatus previous_status;
 
-	if (job_p)
+	if (ReadObjectFromAPRGlobalStorage (manager_p -> ajm_store_p, status_key_p, APR_JOBS_MANAGER_STATUS_KEY_SIZE, CopyServiceJobStatus, &previous_status))
+		{
+			memcpy (status_p -> ajs_user_s, previous_status.ajs_user_s, APR_JOB_STATUS_USER_NAME_SIZE);
+
+			if (previous_status.ajs_counted_flag)
+				{
+					if (HasAPRJobStatusFinished (status_p))
+						{
+							UncountServiceJob (manager_p, &previous_status);
+						}
+					else
+						{
+							status_p -> ajs_counted_flag = 1;
+						}
+				}
+		}
+	else if (!HasAPRJobStatusFinished (status_p))
+		{
+			CountServiceJob (manager_p, status_p);
+		}
+}
+
+
+/*
+ * Count a newly-added ServiceJob, taking over one of the reservations
+ * made by the calling thread's request if it has any left. Otherwise
+ * the ServiceJob is counted regardless of the limits as it is already
+ * running. As with the admissions, only the counters for the limits
+ * that have been set are used. If any of its counters can't be
+ * incremented, the others are put back and the ServiceJob is left
+ * uncounted so that nothing is released for it later.
+ */
+static void CountServiceJob (APRJobsManager *manager_p, APRJobStatus *status_p)
+{
+	APRJobAdmission *admission_p = NULL;
+	APRJobReservation *reservation_p = NULL;
+	char service_counter_name_s [AJM_COUNTER_NAME_SIZE];
+	char user_counter_name_s [AJM_COUNTER_NAME_SIZE];
+	uint32 *num_user_jobs_p = NULL;
+	uint32 *num_jobs_p = NULL;
+	bool service_reserved_flag = false;
+	bool user_reserved_flag = false;
+	bool active_reserved_flag = false;
+	bool service_flag = false;
+	bool user_flag = false;
+
+	if (s_admission_key_p)
 		{
-			ServiceJobNode *node_p = AllocateServiceJobNode (job_p);
+			void *data_p = NULL;
 
-			if (node_p)
+			if (apr_threadkey_private_get (&data_p, s_admission_key_p) == APR_SUCCESS)
 				{
-					LinkedListAddTail (apr_data_p -> ascd_jobs_p, (ListItem *) node_p);
+					admission_p = (APRJobAdmission *) data_p;
 				}
-			else
+		}
+
+	if (admission_p)
+		{
+			uint32 i;
+
+			for (i = 0; i < admission_p -> aja_num_reservations; ++ i)
+				{
+					if (strncmp ((admission_p -> aja_reservations_p + i) -> ajr_service_name_s, status_p -> ajs_service_name_s, APR_JOB_STATUS_SERVICE_NAME_SIZE - 1) == 0)
+						{
+							reservation_p = admission_p -> aja_reservations_p + i;
+							break;
+						}
+				}
+
+			num_user_jobs_p = & (admission_p -> aja_num_user_jobs);
+			num_jobs_p = & (admission_p -> aja_num_jobs);
+		}
+
+	if (manager_p -> ajm_service_job_limit > 0)
+		{
+			MakeJobCounterName (service_counter_name_s, AJM_SERVICE_COUNTER_PREFIX_S, status_p -> ajs_service_name_s, APR_JOB_STATUS_SERVICE_NAME_SIZE - 1);
+
+			if (!CountServiceJobOnCounter (manager_p, service_counter_name_s, reservation_p ? & (reservation_p -> ajr_num_jobs) : NULL, &service_reserved_flag))
+				{
+					return;
+				}
+
+			service_flag = true;
+		}
+
+	if (admission_p && (admission_p -> aja_user_s))
+		{
+			strncpy (status_p -> ajs_user_s, admission_p -> aja_user_s, APR_JOB_STATUS_USER_NAME_SIZE - 1);
+
+			if (manager_p -> ajm_user_job_limit > 0)
+				{
+					MakeJobCounterName (user_counter_name_s, AJM_USER_COUNTER_PREFIX_S, status_p -> ajs_user_s, APR_JOB_STATUS_USER_NAME_SIZE - 1);
+
+					if (!CountServiceJobOnCounter (manager_p, user_counter_name_s, num_user_jobs_p, &user_reserved_flag))
+						{
+							if (service_flag)
+								{
+									UncountServiceJobOnCounter (manager_p, service_counter_name_s, reservation_p ? & (reservation_p -> ajr_num_jobs) : NULL, service_reserved_flag);
+								}
+
+							return;
+						}
+
+					user_flag = true;
+				}
+		}
+
+	if (manager_p -> ajm_active_job_limit > 0)
+		{
+			if (!CountServiceJobOnCounter (manager_p, s_active_jobs_counter_s, num_jobs_p, &active_reserved_flag))
 				{
-					status = APR_ENOMEM;
+					if (user_flag)
+						{
+							UncountServiceJobOnCounter (manager_p, user_counter_name_s, num_user_jobs_p, user_reserved_flag);
+						}
+
+					if (service_flag)
+						{
+							UncountServiceJobOnCounter (manager_p, service_counter_name_s, reservation_p ? & (reservation_p -> ajr_num_jobs) : NULL, service_reserved_flag);
+						}
+
+					return;
 				}
 		}
+
+	status_p -> ajs_counted_flag = 1;
+}
+
+
+/*
+ * Count a ServiceJob on one of its counters, taking over one of the
+ * request's reservations on it if there are any left.
+ */
+static bool CountServiceJobOnCounter (APRJobsManager *manager_p, const char *counter_name_s, uint32 *num_reserved_p, bool *reserved_flag_p)
+{
+	if (num_reserved_p && (*num_reserved_p > 0))
+		{
+			-- (*num_reserved_p);
+			*reserved_flag_p = true;
+
+			return true;
+		}
+
+	*reserved_flag_p = false;
+
+	if (AcquireAPRGlobalStorageCounter (manager_p -> ajm_store_p, counter_name_s, 0) != AGS_CR_ACQUIRED)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to count ServiceJob against \"%s\"", counter_name_s);
+			return false;
+		}
+
+	return true;
+}
+
+
+/*
+ * Undo CountServiceJobOnCounter, handing any reservation that was taken
+ * back to the request so that it is still given back when that ends.
+ */
+static void UncountServiceJobOnCounter (APRJobsManager *manager_p, const char *counter_name_s, uint32 *num_reserved_p, const bool reserved_flag)
+{
+	if (reserved_flag)
+		{
+			++ (*num_reserved_p);
+		}
 	else
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create external server from \"%s\"", (char *) data_p);
+			ReleaseAPRGlobalStorageCounter (manager_p -> ajm_store_p, counter_name_s);
+		}
+}
+
+
+static void UncountServiceJob (APRJobsManager *manager_p, const APRJobStatus *status_p)
+{
+	char counter_name_s [AJM_COUNTER_NAME_SIZE];
+
+	if (manager_p -> ajm_service_job_limit > 0)
+		{
+			MakeJobCounterName (counter_name_s, AJM_SERVICE_COUNTER_PREFIX_S, status_p -> ajs_service_name_s, APR_JOB_STATUS_SERVICE_NAME_SIZE - 1);
+			ReleaseAPRGlobalStorageCounter (manager_p -> ajm_store_p, counter_name_s);
+		}
+
+	if ((manager_p -> ajm_user_job_limit > 0) && (* (status_p -> ajs_user_s) != '\0'))
+		{
+			MakeJobCounterName (counter_name_s, AJM_USER_COUNTER_PREFIX_S, status_p -> ajs_user_s, APR_JOB_STATUS_USER_NAME_SIZE - 1);
+			ReleaseAPRGlobalStorageCounter (manager_p -> ajm_store_p, counter_name_s);
+		}
+
+	if (manager_p -> ajm_active_job_limit > 0)
+		{
+			ReleaseAPRGlobalStorageCounter (manager_p -> ajm_store_p, s_active_jobs_counter_s);
+		}
+}
+
+
+/*
+ * A status record for a ServiceJob that was still being counted has
+ * expired or been evicted, so nothing else would stop counting it.
+ */
+static void UncountRemovedServiceJob (const unsigned char *key_p, const unsigned int key_length, const unsigned char *value_p, const unsigned int value_length, void *data_p)
+{
+	APRJobStatus status;
+
+	if (CopyServiceJobStatus (value_p, value_length, &status) && (status.ajs_counted_flag) && (!HasAPRJobStatusFinished (&status)))
+		{
+			UncountServiceJob ((APRJobsManager *) data_p, &status);
+		}
+}
+
+
+static apr_status_t EndAPRJobAdmissionOnCleanup (void *data_p)
+{
+	if (s_admission_key_p)
+		{
+			apr_threadkey_private_set (NULL, s_admission_key_p);
 		}
 
-	return status;
+	ReleaseAPRJobAdmission ((APRJobAdmission *) data_p);
+
+	return APR_SUCCESS;
 }
 
 
+static apr_status_t DeleteAdmissionKey (void *data_p)
+{
+	if (s_admission_key_p)
+		{
+			apr_threadkey_private_delete (s_admission_key_p);
+			s_admission_key_p = NULL;
+		}
+
+	return APR_SUCCESS;
+}
@@ -0,0 +1,1108 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * apr_native_cache.c
+ *
+ *  A shared object cache provider that keeps its entries in an
+ *  open-addressing hash table in shared memory.
+ *
+ *  The shared memory is laid out as a NativeCacheHeader followed
+ *  by the table of NativeCacheSlots and then the slab of
+ *  NativeCacheBlocks. Each entry's key, followed by its value, is
+ *  stored in a chain of blocks.
+ *
+ *  Every slot has a sequence counter which is odd whilst the slot
+ *  is being changed. Readers never lock, they note the sequence
+ *  before reading a slot and its blocks and try again if it has
+ *  changed afterwards. Writers lock a slot by moving its sequence
+ *  from the even value that they read to the next odd value, so a
+ *  writer only succeeds if nobody else has changed the slot since.
+ *  The unused blocks are kept on a lock-free stack.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "apr_native_cache.h"
+
+#include "apr_atomic.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+#include "apr_hash.h"
+#include "apr_thread_proc.h"
+#include "http_protocol.h"
+
+#include "memory_allocations.h"
+#include "streams.h"
+
+
+#ifdef _DEBUG
+#define APR_NATIVE_CACHE_DEBUG	(STM_LEVEL_FINEST)
+#else
+#define APR_NATIVE_CACHE_DEBUG	(STM_LEVEL_NONE)
+#endif
+
+
+/*
+ * Used to check that the shared memory has been laid out.
+ */
+#define NC_MAGIC (0x4E434131)
+
+
+/*
+ * The size in bytes of each block in the slab.
+ */
+#define NC_BLOCK_SIZE (256)
+
+
+/*
+ * The number of bytes of key and value data that each block holds.
+ */
+#define NC_BLOCK_PAYLOAD_SIZE (NC_BLOCK_SIZE - sizeof (apr_uint32_t))
+
+
+/*
+ * The table has one slot for this many bytes of shared memory.
+ */
+#define NC_BYTES_PER_SLOT (1024)
+
+
+/*
+ * The smallest amount of shared memory that an instance can use.
+ */
+#define NC_MIN_SIZE (64 * 1024)
+
+
+/*
+ * How many times a reader spins on a slot that is being
+ * changed before giving up its time slice.
+ */
+#define NC_MAX_SPINS (64)
+
+
+/*
+ * The states of a slot.
+ */
+#define NC_SLOT_EMPTY (0)
+#define NC_SLOT_FULL (1)
+#define NC_SLOT_REMOVED (2)
+
+
+/*
+ * The results of reading a slot.
+ */
+#define NC_READ_END (0)
+#define NC_READ_OTHER (1)
+#define NC_READ_MATCH (2)
+
+
+#if defined (__GNUC__)
+	#define NC_MEMORY_BARRIER() __sync_synchronize ()
+#else
+	static volatile apr_uint32_t s_barrier;
+	#define NC_MEMORY_BARRIER() apr_atomic_cas32 (&s_barrier, 0, 0)
+#endif
+
+
+typedef struct NativeCacheHeader
+{
+	apr_uint32_t nch_magic;
+
+	apr_uint32_t nch_num_slots;
+
+	apr_uint32_t nch_num_blocks;
+
+	apr_uint32_t nch_padding;
+
+	/**
+	 * The top of the stack of unused blocks. The lower 32 bits are
+	 * the block's index plus one, or 0 if there are no unused blocks,
+	 * and the upper 32 bits are a tag that changes on every update so
+	 * that a block which is popped and pushed back again in between
+	 * a reader's load and compare-and-swap isn't mistaken for no change.
+	 */
+	volatile apr_uint64_t nch_free_blocks;
+
+	volatile apr_uint32_t nch_num_free_blocks;
+
+	volatile apr_uint32_t nch_num_entries;
+
+	/** The number of stores that failed as the cache was full. */
+	volatile apr_uint32_t nch_num_full_failures;
+} NativeCacheHeader;
+
+
+typedef struct NativeCacheSlot
+{
+	/** This is odd whilst the slot is being changed. */
+	volatile apr_uint32_t ncs_sequence;
+
+	/** One of the NC_SLOT_ values. */
+	volatile apr_uint32_t ncs_state;
+
+	volatile apr_uint32_t ncs_hash;
+
+	volatile apr_uint32_t ncs_key_length;
+
+	volatile apr_uint32_t ncs_value_length;
+
+	/** The index plus one of the first block holding the key and value. */
+	volatile apr_uint32_t ncs_first_block;
+
+	volatile apr_time_t ncs_expiry;
+} NativeCacheSlot;
+
+
+typedef struct NativeCacheBlock
+{
+	/** The index plus one of the next block in the chain, or 0 for the last one. */
+	volatile apr_uint32_t ncb_next;
+
+	unsigned char ncb_data [NC_BLOCK_PAYLOAD_SIZE];
+} NativeCacheBlock;
+
+
+/*
+ * A copy of a slot's details taken by a reader.
+ */
+typedef struct NativeCacheSlotCopy
+{
+	apr_uint32_t nscc_sequence;
+	apr_uint32_t nscc_state;
+	apr_uint32_t nscc_value_length;
+	apr_uint32_t nscc_first_block;
+	apr_time_t nscc_expiry;
+} NativeCacheSlotCopy;
+
+
+/*
+ * The position within a chain of blocks.
+ */
+typedef struct NativeCacheCursor
+{
+	apr_uint32_t ncc_block;
+	unsigned int ncc_offset;
+} NativeCacheCursor;
+
+
+struct ap_socache_instance_t
+{
+	apr_size_t nci_size;
+
+	apr_shm_t *nci_shm_p;
+
+	NativeCacheHeader *nci_header_p;
+
+	NativeCacheSlot *nci_slots_p;
+
+	NativeCacheBlock *nci_blocks_p;
+};
+
+
+static const char *NativeCacheCreate (ap_socache_instance_t **instance_pp, const char *arg_s, apr_pool_t *temp_pool_p, apr_pool_t *pool_p);
+
+static apr_status_t NativeCacheInit (ap_socache_instance_t *instance_p, const char *cache_name_s, const struct ap_socache_hints *hints_p, server_rec *server_p, apr_pool_t *pool_p);
+
+static void NativeCacheDestroy (ap_socache_instance_t *instance_p, server_rec *server_p);
+
+static apr_status_t NativeCacheStore (ap_socache_instance_t *instance_p, server_rec *server_p, const unsigned char *id_p, unsigned int id_length, apr_time_t expiry, unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p);
+
+static apr_status_t NativeCacheRetrieve (ap_socache_instance_t *instance_p, server_rec *server_p, const unsigned char *id_p, unsigned int id_length, unsigned char *data_p, unsigned int *data_length_p, apr_pool_t *pool_p);
+
+static apr_status_t NativeCacheRemove (ap_socache_instance_t *instance_p, server_rec *server_p, const unsigned char *id_p, unsigned int id_length, apr_pool_t *pool_p);
+
+static void NativeCacheStatus (ap_socache_instance_t *instance_p, request_rec *req_p, int flags);
+
+static apr_status_t NativeCacheIterate (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, ap_socache_iterator_t *iterator_fn, apr_pool_t *pool_p);
+
+
+static apr_uint32_t GetNativeCacheHash (const unsigned char *id_p, const unsigned int id_length);
+
+static apr_uint32_t GetFirstSlotIndex (const ap_socache_instance_t *instance_p, apr_uint32_t hash);
+
+static int ReadSlot (ap_socache_instance_t *instance_p, NativeCacheSlot *slot_p, const apr_uint32_t hash, const unsigned char *id_p, const unsigned int id_length, unsigned char *dest_p, const unsigned int dest_size, NativeCacheSlotCopy *copy_p);
+
+static bool LockSlot (NativeCacheSlot *slot_p, const apr_uint32_t sequence);
+
+static void UnlockSlot (NativeCacheSlot *slot_p, const apr_uint32_t sequence);
+
+static void WaitForWriter (uint32 *spins_p);
+
+static apr_uint32_t AllocateBlockChain (ap_socache_instance_t *instance_p, const apr_size_t length);
+
+static void FreeBlockChain (ap_socache_instance_t *instance_p, const apr_uint32_t first_block);
+
+static apr_uint32_t PopFreeBlock (ap_socache_instance_t *instance_p);
+
+static void PushFreeBlocks (ap_socache_instance_t *instance_p, const apr_uint32_t first_block, const apr_uint32_t last_block, const apr_uint32_t num_blocks);
+
+static void WriteToBlockChain (ap_socache_instance_t *instance_p, NativeCacheCursor *cursor_p, const unsigned char *src_p, unsigned int length);
+
+static bool ReadFromBlockChain (ap_socache_instance_t *instance_p, NativeCacheCursor *cursor_p, const unsigned char *compare_p, unsigned char *dest_p, unsigned int length);
+
+
+static const ap_socache_provider_t s_native_cache_provider =
+{
+	APR_NATIVE_CACHE_PROVIDER_NAME_S,
+	0,
+	NativeCacheCreate,
+	NativeCacheInit,
+	NativeCacheDestroy,
+	NativeCacheStore,
+	NativeCacheRetrieve,
+	NativeCacheRemove,
+	NativeCacheStatus,
+	NativeCacheIterate
+};
+
+
+/***************************************************/
+
+
+const ap_socache_provider_t *GetNativeCacheProvider (void)
+{
+	return &s_native_cache_provider;
+}
+
+
+bool IsNativeCacheProvider (const ap_socache_provider_t *provider_p)
+{
+	return (provider_p == &s_native_cache_provider);
+}
+
+
+bool RegisterNativeCacheProvider (apr_pool_t *pool_p)
+{
+	apr_status_t status = ap_register_provider (pool_p, AP_SOCACHE_PROVIDER_GROUP, APR_NATIVE_CACHE_PROVIDER_NAME_S, AP_SOCACHE_PROVIDER_VERSION, &s_native_cache_provider);
+
+	if (status != APR_SUCCESS)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to register \"%s\" cache provider, status %d", APR_NATIVE_CACHE_PROVIDER_NAME_S, status);
+		}
+
+	return (status == APR_SUCCESS);
+}
+
+
+static const char *NativeCacheCreate (ap_socache_instance_t **instance_pp, const char *arg_s, apr_pool_t *temp_pool_p, apr_pool_t *pool_p)
+{
+	ap_socache_instance_t *instance_p = (ap_socache_instance_t *) apr_pcalloc (pool_p, sizeof (ap_socache_instance_t));
+
+	instance_p -> nci_size = APR_NATIVE_CACHE_DEFAULT_SIZE;
+
+	/* The optional argument is the size of the shared memory in bytes */
+	if (arg_s && (*arg_s != '\0'))
+		{
+			char *end_s = NULL;
+			long size = strtol (arg_s, &end_s, 10);
+
+			if ((end_s == arg_s) || (*end_s != '\0') || (size < NC_MIN_SIZE))
+				{
+					return apr_psprintf (temp_pool_p, "Invalid size \"%s\" for the %s cache, it must be at least %d bytes", arg_s, APR_NATIVE_CACHE_PROVIDER_NAME_S, NC_MIN_SIZE);
+				}
+
+			instance_p -> nci_size = (apr_size_t) size;
+		}
+
+	*instance_pp = instance_p;
+
+	return NULL;
+}
+
+
+static apr_status_t NativeCacheInit (ap_socache_instance_t *instance_p, const char *cache_name_s, const struct ap_socache_hints *hints_p, server_rec *server_p, apr_pool_t *pool_p)
+{
+	apr_status_t status = apr_shm_create (& (instance_p -> nci_shm_p), instance_p -> nci_size, NULL, pool_p);
+
+	/*
+	 * As with mod_socache_shmcb, if anonymous shared memory isn't
+	 * available on this platform, fall back to a named segment.
+	 */
+	if (APR_STATUS_IS_ENOTIMPL (status))
+		{
+			const char *filename_s = ap_runtime_dir_relative (pool_p, cache_name_s);
+
+			if (filename_s)
+				{
+					apr_shm_remove (filename_s, pool_p);
+					status = apr_shm_create (& (instance_p -> nci_shm_p), instance_p -> nci_size, filename_s, pool_p);
+				}
+		}
+
+	if (status == APR_SUCCESS)
+		{
+			unsigned char *base_p = (unsigned char *) apr_shm_baseaddr_get (instance_p -> nci_shm_p);
+			apr_size_t size = apr_shm_size_get (instance_p -> nci_shm_p);
+			apr_size_t slots_offset = APR_ALIGN_DEFAULT (sizeof (NativeCacheHeader));
+			apr_uint32_t num_slots = (apr_uint32_t) (size / NC_BYTES_PER_SLOT);
+			apr_size_t blocks_offset = APR_ALIGN_DEFAULT (slots_offset + num_slots * sizeof (NativeCacheSlot));
+
+			if (blocks_offset + NC_BLOCK_SIZE <= size)
+				{
+					NativeCacheHeader *header_p = (NativeCacheHeader *) base_p;
+					apr_uint32_t num_blocks = (apr_uint32_t) ((size - blocks_offset) / NC_BLOCK_SIZE);
+					apr_uint32_t i;
+
+					instance_p -> nci_header_p = header_p;
+					instance_p -> nci_slots_p = (NativeCacheSlot *) (base_p + slots_offset);
+					instance_p -> nci_blocks_p = (NativeCacheBlock *) (base_p + blocks_offset);
+
+					memset (base_p, 0, blocks_offset);
+
+					/* Put all of the blocks onto the stack of unused ones */
+					for (i = 0; i < num_blocks; ++ i)
+						{
+							instance_p -> nci_blocks_p [i].ncb_next = (i + 1 < num_blocks) ? i + 2 : 0;
+						}
+
+					header_p -> nch_num_slots = num_slots;
+					header_p -> nch_num_blocks = num_blocks;
+					header_p -> nch_free_blocks = 1;
+					header_p -> nch_num_free_blocks = num_blocks;
+					header_p -> nch_magic = NC_MAGIC;
+
+					#if APR_NATIVE_CACHE_DEBUG >= STM_LEVEL_FINE
+					PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Native cache \"%s\" has " UINT32_FMT " slots and " UINT32_FMT " blocks", cache_name_s, num_slots, num_blocks);
+					#endif
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Shared memory of " SIZET_FMT " bytes is too small for the native cache \"%s\"", size, cache_name_s);
+
+					apr_shm_destroy (instance_p -> nci_shm_p);
+					instance_p -> nci_shm_p = NULL;
+					status = APR_ENOSPC;
+				}
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create " SIZET_FMT " bytes of shared memory for the native cache \"%s\", status %d", instance_p -> nci_size, cache_name_s, status);
+		}
+
+	return status;
+}
+
+
+static void NativeCacheDestroy (ap_socache_instance_t *instance_p, server_rec *server_p)
+{
+	if (instance_p && instance_p -> nci_shm_p)
+		{
+			apr_shm_destroy (instance_p -> nci_shm_p);
+
+			instance_p -> nci_shm_p = NULL;
+			instance_p -> nci_header_p = NULL;
+			instance_p -> nci_slots_p = NULL;
+			instance_p -> nci_blocks_p = NULL;
+		}
+}
+
+
+static apr_status_t NativeCacheStore (ap_socache_instance_t *instance_p, server_rec *server_p, const unsigned char *id_p, unsigned int id_length, apr_time_t expiry, unsigned char *data_p, unsigned int data_length, apr_pool_t *pool_p)
+{
+	return StoreInNativeCache (instance_p, server_p, id_p, id_length, expiry, data_p, data_length, NULL, 0, NULL, pool_p);
+}
+
+
+apr_status_t StoreInNativeCache (ap_socache_instance_t *instance_p, server_rec *server_p, const unsigned char *id_p, unsigned int id_length, apr_time_t expiry, unsigned char *data_p, unsigned int data_length, unsigned char *replaced_data_p, const unsigned int replaced_data_size, unsigned int *replaced_length_p, apr_pool_t *pool_p)
+{
+	NativeCacheHeader *header_p = instance_p -> nci_header_p;
+	const apr_uint32_t hash = GetNativeCacheHash (id_p, id_length);
+	apr_uint32_t first_block;
+	NativeCacheCursor cursor;
+
+	/*
+	 * Write the new entry into its own blocks first. Nobody else
+	 * can see them until they are attached to a slot.
+	 */
+	first_block = AllocateBlockChain (instance_p, ((apr_size_t) id_length) + data_length);
+
+	if (first_block == 0)
+		{
+			apr_atomic_inc32 (& (header_p -> nch_num_full_failures));
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "No space in native cache for entry of %u bytes", id_length + data_length);
+			return APR_ENOSPC;
+		}
+
+	cursor.ncc_block = first_block;
+	cursor.ncc_offset = 0;
+	WriteToBlockChain (instance_p, &cursor, id_p, id_length);
+	WriteToBlockChain (instance_p, &cursor, data_p, data_length);
+
+	/*
+	 * Find the slot to use, which is either the one that already holds this
+	 * key or the first unused one along the probe sequence. A slot holding
+	 * another key's expired entry is left alone, as that entry is still
+	 * counted by whoever stored it, and it is for them to remove it, e.g.
+	 * APRGlobalStorage's sweeper. If another writer changes the slot that we
+	 * pick before we can lock it, we need to look again.
+	 */
+	for (;;)
+		{
+			const apr_uint32_t num_slots = header_p -> nch_num_slots;
+			apr_uint32_t index = GetFirstSlotIndex (instance_p, hash);
+			NativeCacheSlot *target_p = NULL;
+			NativeCacheSlotCopy target_copy;
+			bool match_flag = false;
+			apr_uint32_t i;
+
+			for (i = 0; i < num_slots; ++ i)
+				{
+					NativeCacheSlot *slot_p = instance_p -> nci_slots_p + index;
+					NativeCacheSlotCopy copy;
+					int res = ReadSlot (instance_p, slot_p, hash, id_p, id_length, NULL, 0, &copy);
+
+					if (res == NC_READ_MATCH)
+						{
+							target_p = slot_p;
+							target_copy = copy;
+							match_flag = true;
+							break;
+						}
+					else if ((copy.nscc_state != NC_SLOT_FULL) && (!target_p))
+						{
+							target_p = slot_p;
+							target_copy = copy;
+						}
+
+					if (res == NC_READ_END)
+						{
+							break;
+						}
+
+					index = (index + 1 < num_slots) ? index + 1 : 0;
+				}
+
+			if (!target_p)
+				{
+					FreeBlockChain (instance_p, first_block);
+					apr_atomic_inc32 (& (header_p -> nch_num_full_failures));
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "No free slots in native cache");
+					return APR_ENOSPC;
+				}
+
+			if (LockSlot (target_p, target_copy.nscc_sequence))
+				{
+					const apr_uint32_t old_first_block = (target_copy.nscc_state == NC_SLOT_FULL) ? target_copy.nscc_first_block : 0;
+
+					/*
+					 * The caller serialises stores of the same key and we have the slot
+					 * locked, so the old blocks can't change whilst we read from them.
+					 */
+					if (replaced_length_p)
+						{
+							*replaced_length_p = 0;
+
+							if (match_flag)
+								{
+									NativeCacheCursor old_cursor;
+
+									old_cursor.ncc_block = old_first_block;
+									old_cursor.ncc_offset = 0;
+
+									if (replaced_data_p && (replaced_data_size > 0))
+										{
+											const unsigned int length = (target_copy.nscc_value_length < replaced_data_size) ? target_copy.nscc_value_length : replaced_data_size;
+
+											if (ReadFromBlockChain (instance_p, &old_cursor, NULL, NULL, id_length) && ReadFromBlockChain (instance_p, &old_cursor, NULL, replaced_data_p, length))
+												{
+													*replaced_length_p = target_copy.nscc_value_length;
+												}
+										}
+									else
+										{
+											*replaced_length_p = target_copy.nscc_value_length;
+										}
+								}
+						}
+
+					target_p -> ncs_hash = hash;
+					target_p -> ncs_key_length = id_length;
+					target_p -> ncs_value_length = data_length;
+					target_p -> ncs_first_block = first_block;
+					target_p -> ncs_expiry = expiry;
+					target_p -> ncs_state = NC_SLOT_FULL;
+
+					UnlockSlot (target_p, target_copy.nscc_sequence);
+
+					/* Replacing this key's entry leaves the number of entries the same */
+					if (old_first_block)
+						{
+							FreeBlockChain (instance_p, old_first_block);
+						}
+					else
+						{
+							apr_atomic_inc32 (& (header_p -> nch_num_entries));
+						}
+
+					return APR_SUCCESS;
+				}
+		}
+}
+
+
+static apr_status_t NativeCacheRetrieve (ap_socache_instance_t *instance_p, server_rec *server_p, const unsigned char *id_p, unsigned int id_length, unsigned char *data_p, unsigned int *data_length_p, apr_pool_t *pool_p)
+{
+	const apr_uint32_t hash = GetNativeCacheHash (id_p, id_length);
+	const apr_uint32_t num_slots = instance_p -> nci_header_p -> nch_num_slots;
+	apr_uint32_t index = GetFirstSlotIndex (instance_p, hash);
+	apr_uint32_t i;
+
+	for (i = 0; i < num_slots; ++ i)
+		{
+			NativeCacheSlotCopy copy;
+			int res = ReadSlot (instance_p, instance_p -> nci_slots_p + index, hash, id_p, id_length, data_p, *data_length_p, &copy);
+
+			if (res == NC_READ_MATCH)
+				{
+					/* As with mod_socache_shmcb, a buffer that is too small counts as not found */
+					if ((copy.nscc_value_length <= *data_length_p) && (copy.nscc_expiry > apr_time_now ()))
+						{
+							*data_length_p = copy.nscc_value_length;
+							return APR_SUCCESS;
+						}
+
+					break;
+				}
+			else if (res == NC_READ_END)
+				{
+					break;
+				}
+
+			index = (index + 1 < num_slots) ? index + 1 : 0;
+		}
+
+	return APR_NOTFOUND;
+}
+
+
+static apr_status_t NativeCacheRemove (ap_socache_instance_t *instance_p, server_rec *server_p, const unsigned char *id_p, unsigned int id_length, apr_pool_t *pool_p)
+{
+	const apr_uint32_t hash = GetNativeCacheHash (id_p, id_length);
+	const apr_uint32_t num_slots = instance_p -> nci_header_p -> nch_num_slots;
+	apr_uint32_t index = GetFirstSlotIndex (instance_p, hash);
+	apr_uint32_t i = 0;
+
+	while (i < num_slots)
+		{
+			NativeCacheSlot *slot_p = instance_p -> nci_slots_p + index;
+			NativeCacheSlotCopy copy;
+			int res = ReadSlot (instance_p, slot_p, hash, id_p, id_length, NULL, 0, &copy);
+
+			if (res == NC_READ_MATCH)
+				{
+					if (LockSlot (slot_p, copy.nscc_sequence))
+						{
+							/*
+							 * The slot becomes a tombstone rather than empty so
+							 * that the probe sequences of other keys stay intact.
+							 */
+							slot_p -> ncs_state = NC_SLOT_REMOVED;
+							slot_p -> ncs_first_block = 0;
+
+							UnlockSlot (slot_p, copy.nscc_sequence);
+
+							FreeBlockChain (instance_p, copy.nscc_first_block);
+							apr_atomic_dec32 (& (instance_p -> nci_header_p -> nch_num_entries));
+
+							return APR_SUCCESS;
+						}
+
+					/* The slot changed under us so check it again */
+					continue;
+				}
+			else if (res == NC_READ_END)
+				{
+					break;
+				}
+
+			index = (index + 1 < num_slots) ? index + 1 : 0;
+			++ i;
+		}
+
+	return APR_NOTFOUND;
+}
+
+
+static void NativeCacheStatus (ap_socache_instance_t *instance_p, request_rec *req_p, int flags)
+{
+	NativeCacheHeader *header_p = instance_p -> nci_header_p;
+
+	if (header_p)
+		{
+			const apr_uint32_t num_entries = apr_atomic_read32 (& (header_p -> nch_num_entries));
+			const apr_uint32_t num_free_blocks = apr_atomic_read32 (& (header_p -> nch_num_free_blocks));
+			const apr_uint32_t num_failures = apr_atomic_read32 (& (header_p -> nch_num_full_failures));
+
+			if (flags & AP_STATUS_SHORT)
+				{
+					ap_rprintf (req_p, "CacheType: %s\n", APR_NATIVE_CACHE_PROVIDER_NAME_S);
+					ap_rprintf (req_p, "CacheEntries: %u\n", num_entries);
+					ap_rprintf (req_p, "CacheSlots: %u\n", header_p -> nch_num_slots);
+					ap_rprintf (req_p, "CacheFreeBlocks: %u\n", num_free_blocks);
+					ap_rprintf (req_p, "CacheBlocks: %u\n", header_p -> nch_num_blocks);
+					ap_rprintf (req_p, "CacheFullFailures: %u\n", num_failures);
+				}
+			else
+				{
+					ap_rprintf (req_p, "cache type: <b>%s</b>, %u entries in %u slots, %u of %u blocks of %d bytes free, %u stores failed as the cache was full<br>",
+											APR_NATIVE_CACHE_PROVIDER_NAME_S, num_entries, header_p -> nch_num_slots, num_free_blocks, header_p -> nch_num_blocks, NC_BLOCK_SIZE, num_failures);
+				}
+		}
+}
+
+
+static apr_status_t NativeCacheIterate (ap_socache_instance_t *instance_p, server_rec *server_p, void *user_data_p, ap_socache_iterator_t *iterator_fn, apr_pool_t *pool_p)
+{
+	apr_status_t status = APR_SUCCESS;
+	const apr_uint32_t num_slots = instance_p -> nci_header_p -> nch_num_slots;
+	const apr_size_t max_length = ((apr_size_t) (instance_p -> nci_header_p -> nch_num_blocks)) * NC_BLOCK_PAYLOAD_SIZE;
+	unsigned char *buffer_p = NULL;
+	apr_size_t buffer_size = 0;
+	apr_uint32_t i;
+
+	for (i = 0; (i < num_slots) && (status == APR_SUCCESS); ++ i)
+		{
+			NativeCacheSlot *slot_p = instance_p -> nci_slots_p + i;
+			uint32 spins = 0;
+			bool read_flag = false;
+
+			while (!read_flag)
+				{
+					const apr_uint32_t sequence = apr_atomic_read32 (& (slot_p -> ncs_sequence));
+
+					if (sequence & 1)
+						{
+							WaitForWriter (&spins);
+						}
+					else
+						{
+							apr_uint32_t key_length = 0;
+							apr_uint32_t value_length = 0;
+							bool full_flag = false;
+
+							NC_MEMORY_BARRIER ();
+
+							/*
+							 * Expired entries are included so that APRGlobalStorage's sweeper
+							 * can still find and remove any that it didn't get to before their
+							 * grace period ran out, rather than leaving them until a store
+							 * happens to reuse their slots.
+							 */
+							if (slot_p -> ncs_state == NC_SLOT_FULL)
+								{
+									apr_size_t length;
+									NativeCacheCursor cursor;
+
+									key_length = slot_p -> ncs_key_length;
+									value_length = slot_p -> ncs_value_length;
+									length = ((apr_size_t) key_length) + value_length;
+
+									cursor.ncc_block = slot_p -> ncs_first_block;
+									cursor.ncc_offset = 0;
+
+									if (length <= max_length)
+										{
+											if (length > buffer_size)
+												{
+													if (buffer_p)
+														{
+															FreeMemory (buffer_p);
+														}
+
+													buffer_p = (unsigned char *) AllocMemory (length);
+
+													if (buffer_p)
+														{
+															buffer_size = length;
+														}
+													else
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate " SIZET_FMT " bytes to iterate over native cache", length);
+															buffer_size = 0;
+															return APR_ENOMEM;
+														}
+												}
+
+											full_flag = ReadFromBlockChain (instance_p, &cursor, NULL, buffer_p, (unsigned int) length);
+										}
+								}
+
+							NC_MEMORY_BARRIER ();
+
+							if (apr_atomic_read32 (& (slot_p -> ncs_sequence)) == sequence)
+								{
+									read_flag = true;
+
+									if (full_flag)
+										{
+											status = iterator_fn (instance_p, server_p, user_data_p, buffer_p, key_length, buffer_p + key_length, value_length, pool_p);
+										}
+								}
+						}
+				}
+		}
+
+	if (buffer_p)
+		{
+			FreeMemory (buffer_p);
+		}
+
+	return status;
+}
+
+
+static apr_uint32_t GetNativeCacheHash (const unsigned char *id_p, const unsigned int id_length)
+{
+	apr_ssize_t len = id_length;
+
+	return apr_hashfunc_default ((const char *) id_p, &len);
+}
+
+
+static apr_uint32_t GetFirstSlotIndex (const ap_socache_instance_t *instance_p, apr_uint32_t hash)
+{
+	/*
+	 * APRGlobalStorage picks the stripe, and so the instance, from
+	 * the same hash, so mix the bits before using it otherwise the
+	 * keys in each instance would only start from a fraction of the slots.
+	 */
+	hash ^= hash >> 16;
+	hash *= 0x85EBCA6B;
+	hash ^= hash >> 13;
+	hash *= 0xC2B2AE35;
+	hash ^= hash >> 16;
+
+	return hash % (instance_p -> nci_header_p -> nch_num_slots);
+}
+
+
+/*
+ * Read a slot without locking it. If the slot holds the given key, its value is
+ * copied into dest_p if dest_p is not NULL and dest_size is large enough.
+ */
+static int ReadSlot (ap_socache_instance_t *instance_p, NativeCacheSlot *slot_p, const apr_uint32_t hash, const unsigned char *id_p, const unsigned int id_length, unsigned char *dest_p, const unsigned int dest_size, NativeCacheSlotCopy *copy_p)
+{
+	const apr_size_t max_length = ((apr_size_t) (instance_p -> nci_header_p -> nch_num_blocks)) * NC_BLOCK_PAYLOAD_SIZE;
+	uint32 spins = 0;
+
+	for (;;)
+		{
+			const apr_uint32_t sequence = apr_atomic_read32 (& (slot_p -> ncs_sequence));
+
+			if (sequence & 1)
+				{
+					WaitForWriter (&spins);
+				}
+			else
+				{
+					int res = NC_READ_OTHER;
+
+					NC_MEMORY_BARRIER ();
+
+					copy_p -> nscc_sequence = sequence;
+					copy_p -> nscc_state = slot_p -> ncs_state;
+					copy_p -> nscc_value_length = slot_p -> ncs_value_length;
+					copy_p -> nscc_first_block = slot_p -> ncs_first_block;
+					copy_p -> nscc_expiry = slot_p -> ncs_expiry;
+
+					if (copy_p -> nscc_state == NC_SLOT_EMPTY)
+						{
+							res = NC_READ_END;
+						}
+					else if ((copy_p -> nscc_state == NC_SLOT_FULL) && (slot_p -> ncs_hash == hash) && (slot_p -> ncs_key_length == id_length) && (((apr_size_t) id_length) + copy_p -> nscc_value_length <= max_length))
+						{
+							NativeCacheCursor cursor;
+
+							cursor.ncc_block = copy_p -> nscc_first_block;
+							cursor.ncc_offset = 0;
+
+							if (ReadFromBlockChain (instance_p, &cursor, id_p, NULL, id_length))
+								{
+									res = NC_READ_MATCH;
+
+									if (dest_p && (copy_p -> nscc_value_length <= dest_size))
+										{
+											if (!ReadFromBlockChain (instance_p, &cursor, NULL, dest_p, copy_p -> nscc_value_length))
+												{
+													res = NC_READ_OTHER;
+												}
+										}
+								}
+						}
+
+					NC_MEMORY_BARRIER ();
+
+					/* If nobody changed the slot whilst we were reading it, we're done */
+					if (apr_atomic_read32 (& (slot_p -> ncs_sequence)) == sequence)
+						{
+							return res;
+						}
+				}
+		}
+}
+
+
+static bool LockSlot (NativeCacheSlot *slot_p, const apr_uint32_t sequence)
+{
+	return (apr_atomic_cas32 (& (slot_p -> ncs_sequence), sequence + 1, sequence) == sequence);
+}
+
+
+static void UnlockSlot (NativeCacheSlot *slot_p, const apr_uint32_t sequence)
+{
+	/* Make sure that the changes are visible before the slot is */
+	NC_MEMORY_BARRIER ();
+
+	apr_atomic_set32 (& (slot_p -> ncs_sequence), sequence + 2);
+}
+
+
+static void WaitForWriter (uint32 *spins_p)
+{
+	if (*spins_p < NC_MAX_SPINS)
+		{
+			++ (*spins_p);
+		}
+	else
+		{
+			apr_thread_yield ();
+		}
+}
+
+
+/*
+ * Get enough unused blocks to hold length bytes, chained together.
+ */
+static apr_uint32_t AllocateBlockChain (ap_socache_instance_t *instance_p, const apr_size_t length)
+{
+	apr_uint32_t num_blocks = (apr_uint32_t) ((length + NC_BLOCK_PAYLOAD_SIZE - 1) / NC_BLOCK_PAYLOAD_SIZE);
+	apr_uint32_t first_block = 0;
+	apr_uint32_t last_block = 0;
+	apr_uint32_t i;
+
+	if (num_blocks == 0)
+		{
+			num_blocks = 1;
+		}
+
+	if (num_blocks > apr_atomic_read32 (& (instance_p -> nci_header_p -> nch_num_free_blocks)))
+		{
+			return 0;
+		}
+
+	for (i = 0; i < num_blocks; ++ i)
+		{
+			apr_uint32_t block = PopFreeBlock (instance_p);
+
+			if (block == 0)
+				{
+					/* Someone else got there first, so give back what we have */
+					if (first_block)
+						{
+							PushFreeBlocks (instance_p, first_block, last_block, i);
+						}
+
+					return 0;
+				}
+
+			instance_p -> nci_blocks_p [block - 1].ncb_next = 0;
+
+			if (last_block)
+				{
+					instance_p -> nci_blocks_p [last_block - 1].ncb_next = block;
+				}
+			else
+				{
+					first_block = block;
+				}
+
+			last_block = block;
+		}
+
+	return first_block;
+}
+
+
+static void FreeBlockChain (ap_socache_instance_t *instance_p, const apr_uint32_t first_block)
+{
+	const apr_uint32_t max_blocks = instance_p -> nci_header_p -> nch_num_blocks;
+	apr_uint32_t last_block = first_block;
+	apr_uint32_t num_blocks = 1;
+	apr_uint32_t next_block;
+
+	if ((first_block == 0) || (first_block > max_blocks))
+		{
+			return;
+		}
+
+	while (((next_block = instance_p -> nci_blocks_p [last_block - 1].ncb_next) != 0) && (next_block <= max_blocks) && (num_blocks < max_blocks))
+		{
+			last_block = next_block;
+			++ num_blocks;
+		}
+
+	PushFreeBlocks (instance_p, first_block, last_block, num_blocks);
+}
+
+
+static apr_uint32_t PopFreeBlock (ap_socache_instance_t *instance_p)
+{
+	NativeCacheHeader *header_p = instance_p -> nci_header_p;
+	apr_uint64_t head = apr_atomic_read64 (& (header_p -> nch_free_blocks));
+
+	for (;;)
+		{
+			const apr_uint32_t block = (apr_uint32_t) (head & 0xFFFFFFFF);
+			apr_uint64_t new_head;
+			apr_uint64_t previous_head;
+
+			if ((block == 0) || (block > header_p -> nch_num_blocks))
+				{
+					return 0;
+				}
+
+			new_head = ((((head >> 32) + 1) & 0xFFFFFFFF) << 32) | instance_p -> nci_blocks_p [block - 1].ncb_next;
+			previous_head = apr_atomic_cas64 (& (header_p -> nch_free_blocks), new_head, head);
+
+			if (previous_head == head)
+				{
+					apr_atomic_dec32 (& (header_p -> nch_num_free_blocks));
+					return block;
+				}
+
+			head = previous_head;
+		}
+}
+
+
+static void PushFreeBlocks (ap_socache_instance_t *instance_p, const apr_uint32_t first_block, const apr_uint32_t last_block, const apr_uint32_t num_blocks)
+{
+	NativeCacheHeader *header_p = instance_p -> nci_header_p;
+	apr_uint64_t head = apr_atomic_read64 (& (header_p -> nch_free_blocks));
+
+	for (;;)
+		{
+			apr_uint64_t new_head = ((((head >> 32) + 1) & 0xFFFFFFFF) << 32) | first_block;
+			apr_uint64_t previous_head;
+
+			instance_p -> nci_blocks_p [last_block - 1].ncb_next = (apr_uint32_t) (head & 0xFFFFFFFF);
+
+			previous_head = apr_atomic_cas64 (& (header_p -> nch_free_blocks), new_head, head);
+
+			if (previous_head == head)
+				{
+					break;
+				}
+
+			head = previous_head;
+		}
+
+	apr_atomic_add32 (& (header_p -> nch_num_free_blocks), num_blocks);
+}
+
+
+/*
+ * Only used on chains that nobody else can see yet, which
+ * AllocateBlockChain has made long enough.
+ */
+static void WriteToBlockChain (ap_socache_instance_t *instance_p, NativeCacheCursor *cursor_p, const unsigned char *src_p, unsigned int length)
+{
+	while (length > 0)
+		{
+			NativeCacheBlock *block_p = instance_p -> nci_blocks_p + (cursor_p -> ncc_block - 1);
+			unsigned int chunk;
+
+			if (cursor_p -> ncc_offset == NC_BLOCK_PAYLOAD_SIZE)
+				{
+					cursor_p -> ncc_block = block_p -> ncb_next;
+					cursor_p -> ncc_offset = 0;
+					continue;
+				}
+
+			chunk = NC_BLOCK_PAYLOAD_SIZE - cursor_p -> ncc_offset;
+
+			if (chunk > length)
+				{
+					chunk = length;
+				}
+
+			memcpy (block_p -> ncb_data + cursor_p -> ncc_offset, src_p, chunk);
+
+			src_p += chunk;
+			length -= chunk;
+			cursor_p -> ncc_offset += chunk;
+		}
+}
+
+
+/*
+ * Read length bytes from a chain of blocks that a writer may be changing
+ * at the same time, comparing them against compare_p and/or copying them
+ * into dest_p. Since what we read may be inconsistent, every block index is
+ * checked before it is used and the caller must check the slot's sequence
+ * afterwards.
+ */
+static bool ReadFromBlockChain (ap_socache_instance_t *instance_p, NativeCacheCursor *cursor_p, const unsigned char *compare_p, unsigned char *dest_p, unsigned int length)
+{
+	const apr_uint32_t max_blocks = instance_p -> nci_header_p -> nch_num_blocks;
+
+	while (length > 0)
+		{
+			NativeCacheBlock *block_p;
+			unsigned int chunk;
+
+			if ((cursor_p -> ncc_block == 0) || (cursor_p -> ncc_block > max_blocks))
+				{
+					return false;
+				}
+
+			if (cursor_p -> ncc_offset == NC_BLOCK_PAYLOAD_SIZE)
+				{
+					cursor_p -> ncc_block = instance_p -> nci_blocks_p [cursor_p -> ncc_block - 1].ncb_next;
+					cursor_p -> ncc_offset = 0;
+					continue;
+				}
+
+			block_p = instance_p -> nci_blocks_p + (cursor_p -> ncc_block - 1);
+			chunk = NC_BLOCK_PAYLOAD_SIZE - cursor_p -> ncc_offset;
+
+			if (chunk > length)
+				{
+					chunk = length;
+				}
+
+			if (compare_p)
+				{
+					if (memcmp (block_p -> ncb_data + cursor_p -> ncc_offset, compare_p, chunk) != 0)
+						{
+							return false;
+						}
+
+					compare_p += chunk;
+				}
+
+			if (dest_p)
+				{
+					memcpy (dest_p, block_p -> ncb_data + cursor_p -> ncc_offset, chunk);
+					dest_p += chunk;
+				}
+
+			length -= chunk;
+			cursor_p -> ncc_offset += chunk;
+		}
+
+	return true;
+}
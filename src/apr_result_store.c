@@ -0,0 +1,247 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * apr_result_store.c
+ */
+
+#include <string.h>
+
+#include "apr_strings.h"
+
+#include "apr_result_store.h"
+#include "apr_thread_buffers.h"
+#include "streams.h"
+
+
+/* The results files are named after their ServiceJobs' uuids with this suffix */
+static const char s_results_suffix_s [] = ".json";
+
+/* The suffix that apr_file_mktemp () replaces to make the temporary files' names unique */
+static const char s_temp_suffix_s [] = ".XXXXXX";
+
+
+static int WriteResultsChunk (const char *buffer_s, size_t size, void *data_p);
+
+static char *GetResultsFilename (const APRResultStore *store_p, const char *uuid_s, apr_pool_t *pool_p);
+
+
+/**************************/
+
+
+APRResultStore *AllocateAPRResultStore (const char *path_s, apr_pool_t *pool_p)
+{
+	apr_status_t status = apr_dir_make_recursive (path_s, APR_FPROT_OS_DEFAULT, pool_p);
+
+	if (status == APR_SUCCESS)
+		{
+			APRResultStore *store_p = (APRResultStore *) apr_palloc (pool_p, sizeof (APRResultStore));
+
+			if (store_p)
+				{
+					store_p -> ars_path_s = apr_pstrdup (pool_p, path_s);
+					store_p -> ars_pool_p = CreateAPRThreadSafePool (pool_p);
+
+					if ((store_p -> ars_path_s) && (store_p -> ars_pool_p))
+						{
+							return store_p;
+						}
+				}
+
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate result store for \"%s\"", path_s);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create result store directory \"%s\", %d", path_s, status);
+		}
+
+	return NULL;
+}
+
+
+bool WriteResultsToAPRResultStore (const APRResultStore *store_p, const char *uuid_s, const json_t *results_p, APRResultDescriptor *descriptor_p)
+{
+	bool success_flag = false;
+	apr_pool_t *pool_p = NULL;
+
+	/* This is called from the request threads so each call needs a pool of its own */
+	if (apr_pool_create (&pool_p, store_p -> ars_pool_p) == APR_SUCCESS)
+		{
+			char *filename_s = GetResultsFilename (store_p, uuid_s, pool_p);
+			char *temp_filename_s = apr_pstrcat (pool_p, filename_s, s_temp_suffix_s, NULL);
+
+			if (filename_s && temp_filename_s)
+				{
+					apr_file_t *file_p = NULL;
+					apr_status_t status = apr_file_mktemp (&file_p, temp_filename_s, APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_EXCL | APR_FOPEN_BUFFERED | APR_FOPEN_BINARY, pool_p);
+
+					if (status == APR_SUCCESS)
+						{
+							apr_finfo_t finfo;
+							bool written_flag = (json_dump_callback (results_p, WriteResultsChunk, file_p, JSON_COMPACT) == 0);
+
+							if (written_flag)
+								{
+									written_flag = ((apr_file_flush (file_p) == APR_SUCCESS) && (apr_file_info_get (&finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, file_p) == APR_SUCCESS));
+								}
+
+							apr_file_close (file_p);
+
+							if (written_flag)
+								{
+									status = apr_file_rename (temp_filename_s, filename_s, pool_p);
+
+									if (status == APR_SUCCESS)
+										{
+											memset (descriptor_p, 0, sizeof (APRResultDescriptor));
+
+											descriptor_p -> ard_creation_time = finfo.mtime;
+											descriptor_p -> ard_size = (apr_uint64_t) finfo.size;
+											descriptor_p -> ard_version = APR_RESULT_DESCRIPTOR_VERSION;
+
+											success_flag = true;
+										}
+									else
+										{
+											PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to rename \"%s\" to \"%s\", %d", temp_filename_s, filename_s, status);
+										}
+								}
+							else
+								{
+									PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to write results to \"%s\"", temp_filename_s);
+								}
+
+							if (!success_flag)
+								{
+									apr_file_remove (temp_filename_s, pool_p);
+								}
+						}
+					else
+						{
+							PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create \"%s\", %d", temp_filename_s, status);
+						}
+				}
+
+			apr_pool_destroy (pool_p);
+		}
+
+	return success_flag;
+}
+
+
+apr_status_t OpenResultsInAPRResultStore (const APRResultStore *store_p, const char *uuid_s, apr_file_t **file_pp, apr_finfo_t *finfo_p, apr_pool_t *pool_p)
+{
+	char *filename_s = GetResultsFilename (store_p, uuid_s, pool_p);
+	apr_status_t status = APR_ENOMEM;
+
+	if (filename_s)
+		{
+			status = apr_file_open (file_pp, filename_s, APR_FOPEN_READ | APR_FOPEN_BINARY | APR_FOPEN_SENDFILE_ENABLED, APR_FPROT_OS_DEFAULT, pool_p);
+
+			if (status == APR_SUCCESS)
+				{
+					status = apr_file_info_get (finfo_p, APR_FINFO_SIZE | APR_FINFO_MTIME | APR_FINFO_INODE, *file_pp);
+
+					/* The inode isn't available on every platform but we don't need it */
+					if (status == APR_INCOMPLETE)
+						{
+							status = APR_SUCCESS;
+						}
+
+					if (status != APR_SUCCESS)
+						{
+							apr_file_close (*file_pp);
+							*file_pp = NULL;
+						}
+				}
+		}
+
+	return status;
+}
+
+
+bool RemoveResultsFromAPRResultStore (const APRResultStore *store_p, const char *uuid_s)
+{
+	bool success_flag = false;
+	apr_pool_t *pool_p = NULL;
+
+	if (apr_pool_create (&pool_p, store_p -> ars_pool_p) == APR_SUCCESS)
+		{
+			char *filename_s = GetResultsFilename (store_p, uuid_s, pool_p);
+
+			if (filename_s)
+				{
+					apr_status_t status = apr_file_remove (filename_s, pool_p);
+
+					success_flag = ((status == APR_SUCCESS) || APR_STATUS_IS_ENOENT (status));
+				}
+
+			apr_pool_destroy (pool_p);
+		}
+
+	return success_flag;
+}
+
+
+uint32 SweepAPRResultStore (const APRResultStore *store_p, const apr_time_t cutoff, apr_pool_t *pool_p)
+{
+	uint32 num_removed = 0;
+	apr_dir_t *dir_p = NULL;
+	apr_status_t status = apr_dir_open (&dir_p, store_p -> ars_path_s, pool_p);
+
+	if (status == APR_SUCCESS)
+		{
+			apr_finfo_t finfo;
+
+			while (((status = apr_dir_read (&finfo, APR_FINFO_NAME | APR_FINFO_TYPE | APR_FINFO_MTIME, dir_p)) == APR_SUCCESS) || (status == APR_INCOMPLETE))
+				{
+					/* Only touch the results files and the temporary ones for them */
+					if ((finfo.filetype == APR_REG) && (finfo.mtime < cutoff) && (strstr (finfo.name, s_results_suffix_s) != NULL))
+						{
+							char *filename_s = apr_pstrcat (pool_p, store_p -> ars_path_s, "/", finfo.name, NULL);
+
+							if (filename_s && (apr_file_remove (filename_s, pool_p) == APR_SUCCESS))
+								{
+									++ num_removed;
+								}
+						}
+				}
+
+			apr_dir_close (dir_p);
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to open result store directory \"%s\", %d", store_p -> ars_path_s, status);
+		}
+
+	return num_removed;
+}
+
+
+/**************************/
+
+
+static int WriteResultsChunk (const char *buffer_s, size_t size, void *data_p)
+{
+	apr_file_t *file_p = (apr_file_t *) data_p;
+
+	return (apr_file_write_full (file_p, buffer_s, size, NULL) == APR_SUCCESS) ? 0 : -1;
+}
+
+
+static char *GetResultsFilename (const APRResultStore *store_p, const char *uuid_s, apr_pool_t *pool_p)
+{
+	return apr_pstrcat (pool_p, store_p -> ars_path_s, "/", uuid_s, s_results_suffix_s, NULL);
+}
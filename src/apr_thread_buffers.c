@@ -0,0 +1,208 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * apr_thread_buffers.c
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "apr_allocator.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_proc.h"
+
+#include "apr_thread_buffers.h"
+#include "streams.h"
+
+
+/*
+ * The key for each thread's array of ATB_NUM_BUFFERS buffers.
+ */
+static apr_threadkey_t *s_buffers_key_p = NULL;
+
+
+static void FreeBuffers (void *data_p);
+
+static apr_status_t DeleteBuffersKey (void *data_p);
+
+
+/**************************/
+
+
+bool InitAPRThreadBuffers (apr_pool_t *pool_p)
+{
+	apr_status_t status = apr_threadkey_private_create (&s_buffers_key_p, FreeBuffers, pool_p);
+
+	if (status == APR_SUCCESS)
+		{
+			apr_pool_cleanup_register (pool_p, NULL, DeleteBuffersKey, apr_pool_cleanup_null);
+			return true;
+		}
+	else
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create the key for the thread buffers, %d", status);
+			s_buffers_key_p = NULL;
+		}
+
+	return false;
+}
+
+
+APRThreadBuffer *GetAPRThreadBuffer (const APRThreadBufferId id)
+{
+	APRThreadBuffer *buffer_p = NULL;
+
+	if (s_buffers_key_p)
+		{
+			void *data_p = NULL;
+
+			if (apr_threadkey_private_get (&data_p, s_buffers_key_p) == APR_SUCCESS)
+				{
+					APRThreadBuffer *buffers_p = (APRThreadBuffer *) data_p;
+
+					if (!buffers_p)
+						{
+							buffers_p = (APRThreadBuffer *) calloc (ATB_NUM_BUFFERS, sizeof (APRThreadBuffer));
+
+							if (buffers_p)
+								{
+									if (apr_threadkey_private_set (buffers_p, s_buffers_key_p) != APR_SUCCESS)
+										{
+											free (buffers_p);
+											buffers_p = NULL;
+										}
+								}
+						}
+
+					/* A buffer that is already in use can't be handed out again */
+					if (buffers_p && (! (buffers_p [id].atb_in_use_flag)))
+						{
+							buffer_p = buffers_p + id;
+							buffer_p -> atb_in_use_flag = true;
+						}
+				}
+		}
+
+	return buffer_p;
+}
+
+
+bool ReserveAPRThreadBuffer (APRThreadBuffer *buffer_p, const size_t size)
+{
+	if (size > buffer_p -> atb_size)
+		{
+			unsigned char *data_p = (unsigned char *) realloc (buffer_p -> atb_data_p, size);
+
+			if (!data_p)
+				{
+					return false;
+				}
+
+			buffer_p -> atb_data_p = data_p;
+			buffer_p -> atb_size = size;
+		}
+
+	return true;
+}
+
+
+void ReleaseAPRThreadBuffer (APRThreadBuffer *buffer_p)
+{
+	if (buffer_p -> atb_size > APR_THREAD_BUFFER_MAX_RETAINED_SIZE)
+		{
+			free (buffer_p -> atb_data_p);
+			buffer_p -> atb_data_p = NULL;
+			buffer_p -> atb_size = 0;
+		}
+
+	buffer_p -> atb_in_use_flag = false;
+}
+
+
+apr_pool_t *CreateAPRThreadSafePool (apr_pool_t *parent_pool_p)
+{
+	apr_allocator_t *allocator_p = NULL;
+	apr_status_t status = apr_allocator_create (&allocator_p);
+
+	if (status == APR_SUCCESS)
+		{
+			apr_pool_t *pool_p = NULL;
+
+			status = apr_pool_create_ex (&pool_p, parent_pool_p, NULL, allocator_p);
+
+			if (status == APR_SUCCESS)
+				{
+					apr_thread_mutex_t *mutex_p = NULL;
+
+					/* The allocator, and its mutex, are now destroyed along with the pool */
+					apr_allocator_owner_set (allocator_p, pool_p);
+
+					status = apr_thread_mutex_create (&mutex_p, APR_THREAD_MUTEX_DEFAULT, pool_p);
+
+					if (status == APR_SUCCESS)
+						{
+							apr_allocator_mutex_set (allocator_p, mutex_p);
+							return pool_p;
+						}
+
+					apr_pool_destroy (pool_p);
+				}
+			else
+				{
+					apr_allocator_destroy (allocator_p);
+				}
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to create a thread-safe pool, %d", status);
+
+	return NULL;
+}
+
+
+/**************************/
+
+
+static void FreeBuffers (void *data_p)
+{
+	APRThreadBuffer *buffers_p = (APRThreadBuffer *) data_p;
+
+	if (buffers_p)
+		{
+			uint32 i;
+
+			for (i = 0; i < ATB_NUM_BUFFERS; ++ i)
+				{
+					if (buffers_p [i].atb_data_p)
+						{
+							free (buffers_p [i].atb_data_p);
+						}
+				}
+
+			free (buffers_p);
+		}
+}
+
+
+static apr_status_t DeleteBuffersKey (void *data_p)
+{
+	if (s_buffers_key_p)
+		{
+			apr_threadkey_private_delete (s_buffers_key_p);
+			s_buffers_key_p = NULL;
+		}
+
+	return APR_SUCCESS;
+}
@@ -26,9 +26,15 @@
 #endif
 
 
+static void InitBZ2Stream (bz_stream *stream_p, BZ2Allocator *allocator_p);
+
+static void *AllocateBZ2Memory (void *opaque_p, int num_items, int item_size);
+
+static void FreeBZ2Memory (void *opaque_p, void *data_p);
+
 static bool SaveBZ2Data (const char *data_p, const unsigned int data_length, const char *key_s);
 
-static void LogDataHead (char *data_p, unsigned int data_length, const char *prefix_s);
+static void LogDataHead (const char *data_p, unsigned int data_length, const char *prefix_s);
 
 static char GetPrintableChar (const char c);
 
@@ -38,198 +44,316 @@ static int s_index = 0;
 /*
  * These routines compress and decompress data to bzip2 format.
  *
- * The actual compressed data begins with a uint64 value which is the length of
- * the uncompressed data followed by the actual data.
+ * The length of the uncompressed data is not stored with the compressed
+ * data, the caller needs to keep track of it.
  */
 
-unsigned char *CompressToBZ2 (unsigned char *src_s, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s)
+BZ2Allocator *AllocateBZ2Allocator (void)
 {
-	unsigned int temp_dest_length = src_length * sizeof (char);
-	char *dest_p = (char *) AllocMemory (temp_dest_length + sizeof (unsigned int));
+	BZ2Allocator *allocator_p = (BZ2Allocator *) AllocMemory (sizeof (BZ2Allocator));
 
-	if (dest_p)
+	if (allocator_p)
 		{
-			const int block_size_100k = 9;
-			const int verbosity = 0;
-			const int work_factor = 0;
-			int res;
+			memset (allocator_p, 0, sizeof (BZ2Allocator));
+		}
 
-			#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINEST
-				{
-					char *filename_s = ConcatenateStrings (key_s, ".json");
+	return allocator_p;
+}
 
-					if (filename_s)
-						{
-							SaveBZ2Data ((char *) src_s, src_length, filename_s);
 
-							FreeCopiedString (filename_s);
-						}
-				}
-			#endif
+void FreeBZ2Allocator (BZ2Allocator *allocator_p)
+{
+	uint32 i;
 
+	for (i = 0; i < BZ2_ALLOCATOR_NUM_BLOCKS; ++ i)
+		{
+			if (allocator_p -> bza_blocks [i].bzb_data_p)
+				{
+					FreeMemory (allocator_p -> bza_blocks [i].bzb_data_p);
+				}
+		}
 
-		#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINER
-		LogDataHead ((char *) src_s, src_length, "uncompressed src: ");
-		#endif
+	FreeMemory (allocator_p);
+}
 
 
-			res = BZ2_bzBuffToBuffCompress (dest_p + sizeof (unsigned int), &temp_dest_length, (char *) src_s, src_length, block_size_100k, verbosity, work_factor);
+bool CompressToBZ2 (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_capacity, unsigned int *dest_length_p, BZ2Allocator *allocator_p, const char * const key_s)
+{
+	/*
+	 * The memory that bzip2 needs grows with the block size, so
+	 * use the smallest that will hold all of the data in one block.
+	 */
+	const int block_size_100k = (src_length >= 900000) ? 9 : (int) (src_length / 100000) + 1;
+	const int verbosity = 0;
+	const int work_factor = 0;
+	bz_stream stream;
+	int res;
+
+	#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINEST
+		{
+			char *filename_s = ConcatenateStrings (key_s, ".json");
 
-			if (res == BZ_OK)
+			if (filename_s)
 				{
-					unsigned int *uncompressed_length_p = (unsigned int *) dest_p;
+					SaveBZ2Data ((const char *) src_p, src_length, filename_s);
 
+					FreeCopiedString (filename_s);
+				}
+		}
+	#endif
 
-					*uncompressed_length_p = src_length;
 
-					/* Add the length of the size chunk */
-					*dest_length_p = temp_dest_length + sizeof (unsigned int);
+	#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINER
+	LogDataHead ((const char *) src_p, src_length, "uncompressed src: ");
+	#endif
 
-					#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINEST
-						{
-							char *filename_s = ConcatenateStrings (key_s, ".bz2");
+	InitBZ2Stream (&stream, allocator_p);
 
-							if (filename_s)
-								{
-									SaveBZ2Data (dest_p + sizeof (unsigned int), temp_dest_length, filename_s);
+	res = BZ2_bzCompressInit (&stream, block_size_100k, verbosity, work_factor);
 
-									FreeCopiedString (filename_s);
-								}
-						}
-					#endif
+	if (res == BZ_OK)
+		{
+			stream.next_in = (char *) src_p;
+			stream.avail_in = src_length;
+			stream.next_out = (char *) dest_p;
+			stream.avail_out = dest_capacity;
 
-					#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINER
-					LogDataHead (dest_p, temp_dest_length, "compressed dest: ");
-					#endif
+			res = BZ2_bzCompress (&stream, BZ_FINISH);
 
-					return ((unsigned char *) dest_p);
-				}
-			else
-				{
-					switch (res)
-						{
-							case BZ_CONFIG_ERROR:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress entry, the library has been mis-compiled");
-								break;
+			BZ2_bzCompressEnd (&stream);
+		}
 
-							case BZ_PARAM_ERROR:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress entry, parameter error, dest_p %8X, temp_dest_length " UINT32_FMT " block_size_100k %d verbosity %d work_factor %d", dest_p, temp_dest_length, block_size_100k, verbosity, work_factor);;
-								break;
+	if (res == BZ_STREAM_END)
+		{
+			*dest_length_p = stream.total_out_lo32;
 
-							case BZ_MEM_ERROR:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress entry, insufficient memory is available");
-								break;
+			#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINEST
+				{
+					char *filename_s = ConcatenateStrings (key_s, ".bz2");
 
-							case BZ_OUTBUFF_FULL:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress entry, the size of the compressed data exceeds " UINT32_FMT, temp_dest_length);
-								break;
+					if (filename_s)
+						{
+							SaveBZ2Data ((const char *) dest_p, *dest_length_p, filename_s);
 
-							default:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress entry, unknown error %d", res);
-								break;
+							FreeCopiedString (filename_s);
 						}
 				}
+			#endif
 
-		}		/* if (dest_p) */
+			#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINER
+			LogDataHead ((const char *) dest_p, *dest_length_p, "compressed dest: ");
+			#endif
+
+			return true;
+		}
+	else if (res == BZ_FINISH_OK)
+		{
+			/* The compressed data didn't fit which isn't an error, the caller will store the value as it is */
+			*dest_length_p = 0;
+			return true;
+		}
 	else
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate memory to compress entry \"%s\"", src_s);
+			switch (res)
+				{
+					case BZ_CONFIG_ERROR:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress entry, the library has been mis-compiled");
+						break;
+
+					case BZ_PARAM_ERROR:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress entry, parameter error, dest_p %8X, dest_capacity " UINT32_FMT " block_size_100k %d verbosity %d work_factor %d", dest_p, dest_capacity, block_size_100k, verbosity, work_factor);;
+						break;
+
+					case BZ_MEM_ERROR:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress entry, insufficient memory is available");
+						break;
+
+					default:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to compress entry, unknown error %d", res);
+						break;
+				}
 		}
 
-	return NULL;
+	return false;
 }
 
 
 
-unsigned char *UncompressFromBZ2 (unsigned char *src_p, unsigned int src_length, unsigned int *dest_length_p, const char * const key_s)
+bool UncompressFromBZ2 (const unsigned char *src_p, const unsigned int src_length, unsigned char *dest_p, const unsigned int dest_length, BZ2Allocator *allocator_p, const char * const key_s)
 {
-	unsigned int *uncompressed_length_p = (unsigned int *) src_p;
-	unsigned int uncompressed_length = *uncompressed_length_p;
-	char *dest_p = (char *) AllocMemory (uncompressed_length * sizeof (char));
+	bz_stream stream;
+	int res;
+	const int small = 0;
+	const int verbosity = 0;
 
 	#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINER
-	PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Uncompressing from " UINT32_FMT " bytes long to " UINT32_FMT, src_length, *uncompressed_length_p);
+	PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Uncompressing from " UINT32_FMT " bytes long to " UINT32_FMT, src_length, dest_length);
 	#endif
 
-
 	#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINER
-	LogDataHead ((char *) src_p, src_length, "compressed src: ");
+	LogDataHead ((const char *) src_p, src_length, "compressed src: ");
 	#endif
 
-	if (dest_p)
+	InitBZ2Stream (&stream, allocator_p);
+
+	res = BZ2_bzDecompressInit (&stream, verbosity, small);
+
+	if (res == BZ_OK)
 		{
-			int res;
-			const int small = 0;
-			const int verbosity = 4;
+			stream.next_in = (char *) src_p;
+			stream.avail_in = src_length;
+			stream.next_out = (char *) dest_p;
+			stream.avail_out = dest_length;
+
+			res = BZ2_bzDecompress (&stream);
 
-			/* move past the uncompressed length value */
-			src_p += sizeof (unsigned int);
-			//src_length -= sizeof (unsigned int);
+			BZ2_bzDecompressEnd (&stream);
+		}
 
+	if (res == BZ_STREAM_END)
+		{
 			#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINER
-			LogDataHead ((char *) src_p, src_length, "shuffled compressed src: ");
+			PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Uncompressed from " UINT32_FMT " bytes long to " UINT32_FMT, src_length, stream.total_out_lo32);
 			#endif
 
+			#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINER
+			LogDataHead ((const char *) dest_p, stream.total_out_lo32, "uncompressed dest: ");
+			#endif
 
-			res = BZ2_bzBuffToBuffDecompress (dest_p, &uncompressed_length, (char *) src_p, src_length, small, verbosity);
+			if (stream.total_out_lo32 == dest_length)
+				{
+					return true;
+				}
 
-			if (res == BZ_OK)
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Decompressed \"%s\" to " UINT32_FMT " bytes rather than " UINT32_FMT, key_s, stream.total_out_lo32, dest_length);
+		}
+	else
+		{
+			switch (res)
 				{
-					*dest_length_p = uncompressed_length;
+					case BZ_CONFIG_ERROR:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, the library has been mis-compiled");
+						break;
 
-					#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINER
-					PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "Uncompressed from " UINT32_FMT " bytes long to " UINT32_FMT, src_length, uncompressed_length);
-					#endif
+					case BZ_PARAM_ERROR:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, parameter error, dest_p %8X, dest_length " UINT32_FMT " small %d verbosity %d", dest_p, dest_length, small, verbosity);
+						break;
 
-					#if BZIP2_UTIL_DEBUG >= STM_LEVEL_FINER
-					LogDataHead (dest_p, uncompressed_length, "uncompressed dest: ");
-					#endif
+					case BZ_MEM_ERROR:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, insufficient memory is available");
+						break;
 
+					case BZ_OK:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, the uncompressed data is longer than " UINT32_FMT " bytes", dest_length);
+						break;
 
+					case BZ_DATA_ERROR_MAGIC:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, the compressed data doesn't begin with the right magic bytes");
+						break;
 
-					return ((unsigned char *) dest_p);
+					case BZ_DATA_ERROR:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, a data integrity error was detected in the compressed data");
+						break;
+
+					default:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, unknown error %d", res);
+						break;
 				}
-			else
-				{
-					switch (res)
-						{
-							case BZ_CONFIG_ERROR:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, the library has been mis-compiled");
-								break;
+		}
+
+	return false;
+}
 
-							case BZ_PARAM_ERROR:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, parameter error, dest_p %8X, temp_dest_length " UINT32_FMT " small %d verbosity %d", dest_p, uncompressed_length, small, verbosity);
-								break;
 
-							case BZ_MEM_ERROR:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, insufficient memory is available");
-								break;
 
-							case BZ_DATA_ERROR_MAGIC:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, the compressed data doesn't begin with the right magic bytes %8X", * ((uint32 *) src_p));
-								break;
+static void InitBZ2Stream (bz_stream *stream_p, BZ2Allocator *allocator_p)
+{
+	memset (stream_p, 0, sizeof (bz_stream));
 
-							case BZ_DATA_ERROR:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, a data integrity error was detected in the compressed datas %8X", * ((uint32 *) src_p));
-								break;
+	if (allocator_p)
+		{
+			stream_p -> bzalloc = AllocateBZ2Memory;
+			stream_p -> bzfree = FreeBZ2Memory;
+			stream_p -> opaque = allocator_p;
+		}
+}
 
-							case BZ_UNEXPECTED_EOF:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, the compressed data ends unexpectedly");
-								break;
 
-							default:
-								PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decompress entry, unknown error %d", res);
-								break;
+/*
+ * The bzalloc callback. This hands out the smallest free block that is big
+ * enough before allocating a new one, so once a thread has compressed or
+ * decompressed something, doing the same again allocates nothing.
+ */
+static void *AllocateBZ2Memory (void *opaque_p, int num_items, int item_size)
+{
+	BZ2Allocator *allocator_p = (BZ2Allocator *) opaque_p;
+	const int size = num_items * item_size;
+	BZ2Block *best_p = NULL;
+	BZ2Block *empty_p = NULL;
+	uint32 i;
+
+	for (i = 0; i < BZ2_ALLOCATOR_NUM_BLOCKS; ++ i)
+		{
+			BZ2Block *block_p = allocator_p -> bza_blocks + i;
+
+			if (block_p -> bzb_data_p)
+				{
+					if ((!block_p -> bzb_in_use_flag) && (block_p -> bzb_size >= size) && ((!best_p) || (block_p -> bzb_size < best_p -> bzb_size)))
+						{
+							best_p = block_p;
 						}
 				}
+			else if (!empty_p)
+				{
+					empty_p = block_p;
+				}
+		}
 
-		}		/* if (dest_p) */
-	else
+	if (best_p)
+		{
+			best_p -> bzb_in_use_flag = true;
+			++ (allocator_p -> bza_num_reuses);
+
+			return best_p -> bzb_data_p;
+		}
+
+	++ (allocator_p -> bza_num_allocations);
+
+	if (empty_p)
+		{
+			empty_p -> bzb_data_p = AllocMemory (size);
+
+			if (empty_p -> bzb_data_p)
+				{
+					empty_p -> bzb_size = size;
+					empty_p -> bzb_in_use_flag = true;
+				}
+
+			return empty_p -> bzb_data_p;
+		}
+
+	/* All of the blocks are in use, so this one won't be kept */
+	return AllocMemory (size);
+}
+
+
+static void FreeBZ2Memory (void *opaque_p, void *data_p)
+{
+	BZ2Allocator *allocator_p = (BZ2Allocator *) opaque_p;
+	uint32 i;
+
+	for (i = 0; i < BZ2_ALLOCATOR_NUM_BLOCKS; ++ i)
 		{
-			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to allocate memory to decompress entry");
+			BZ2Block *block_p = allocator_p -> bza_blocks + i;
+
+			if (block_p -> bzb_data_p == data_p)
+				{
+					block_p -> bzb_in_use_flag = false;
+					return;
+				}
 		}
 
-	return NULL;
+	FreeMemory (data_p);
 }
 
 
@@ -268,7 +392,7 @@ static bool SaveBZ2Data (const char *data_p, const unsigned int data_length, con
 
 
 
-static void LogDataHead (char *data_p, unsigned int data_length, const char *prefix_s)
+static void LogDataHead (const char *data_p, unsigned int data_length, const char *prefix_s)
 {
 	unsigned int limit = data_length; //< 63 ? data_length : 63;
 	unsigned int i;
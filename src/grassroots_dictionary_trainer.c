@@ -0,0 +1,269 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * grassroots_dictionary_trainer.c
+ *
+ *  A command line tool that trains a zstd dictionary from a sample of
+ *  serialised ServiceJobs, such as those saved by the jobs manager when
+ *  the GrassrootsCacheDictionarySamples directive is set. The dictionary
+ *  can then be used with the GrassrootsCacheDictionary directive.
+ *
+ *  This is built separately from the module with "make dictionary_trainer"
+ *  and only needs the zstd library.
+ *
+ *  Usage: grassroots_dictionary_trainer [-s <max size>] -o <dictionary> <sample> ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zdict.h"
+
+
+/**
+ * The default maximum size of the dictionary. The jobs are small and
+ * share most of their structure, so a small dictionary captures nearly
+ * all of it and keeps the memory that each child needs for it low.
+ */
+#define DT_DEFAULT_DICTIONARY_SIZE (32 * 1024)
+
+
+/**
+ * zstd needs a reasonable number of samples to find the
+ * common content in them.
+ */
+#define DT_MIN_NUM_SAMPLES (8)
+
+
+typedef struct Samples
+{
+	/** All of the samples, one after another. */
+	char *sa_data_p;
+
+	/** The length of each of the samples. */
+	size_t *sa_lengths_p;
+
+	/** The total length of the samples. */
+	size_t sa_total_length;
+
+	/** The number of samples. */
+	unsigned int sa_num_samples;
+} Samples;
+
+
+static int AddSample (Samples *samples_p, const char *filename_s);
+
+static int SaveDictionary (const void *dictionary_p, const size_t length, const char *filename_s);
+
+static void PrintUsage (const char *program_s);
+
+
+/**************************/
+
+
+int main (int argc, char *argv [])
+{
+	const char *output_s = NULL;
+	size_t max_size = DT_DEFAULT_DICTIONARY_SIZE;
+	Samples samples;
+	int res = 1;
+	int i;
+
+	memset (&samples, 0, sizeof (Samples));
+
+	samples.sa_lengths_p = (size_t *) malloc (argc * sizeof (size_t));
+
+	if (!samples.sa_lengths_p)
+		{
+			fprintf (stderr, "Failed to allocate memory for %d samples\n", argc);
+			return 1;
+		}
+
+	for (i = 1; i < argc; ++ i)
+		{
+			if ((strcmp (argv [i], "-o") == 0) && (i + 1 < argc))
+				{
+					output_s = argv [++ i];
+				}
+			else if ((strcmp (argv [i], "-s") == 0) && (i + 1 < argc))
+				{
+					char *end_s = NULL;
+					long size = strtol (argv [++ i], &end_s, 10);
+
+					if ((end_s == argv [i]) || (*end_s != '\0') || (size <= 0))
+						{
+							fprintf (stderr, "\"%s\" is not a valid dictionary size\n", argv [i]);
+							PrintUsage (argv [0]);
+							return 1;
+						}
+
+					max_size = (size_t) size;
+				}
+			else if (!AddSample (&samples, argv [i]))
+				{
+					return 1;
+				}
+		}
+
+	if (output_s && (samples.sa_num_samples >= DT_MIN_NUM_SAMPLES))
+		{
+			void *dictionary_p = malloc (max_size);
+
+			if (dictionary_p)
+				{
+					const size_t length = ZDICT_trainFromBuffer (dictionary_p, max_size, samples.sa_data_p, samples.sa_lengths_p, samples.sa_num_samples);
+
+					if (!ZDICT_isError (length))
+						{
+							if (SaveDictionary (dictionary_p, length, output_s))
+								{
+									printf ("Trained dictionary %u of %lu bytes from %u samples totalling %lu bytes\n", ZDICT_getDictID (dictionary_p, length), (unsigned long) length, samples.sa_num_samples, (unsigned long) samples.sa_total_length);
+									res = 0;
+								}
+						}
+					else
+						{
+							fprintf (stderr, "Failed to train dictionary, %s\n", ZDICT_getErrorName (length));
+						}
+
+					free (dictionary_p);
+				}
+			else
+				{
+					fprintf (stderr, "Failed to allocate %lu bytes for the dictionary\n", (unsigned long) max_size);
+				}
+		}
+	else
+		{
+			if (output_s)
+				{
+					fprintf (stderr, "At least %d samples are needed, only %u were given\n", DT_MIN_NUM_SAMPLES, samples.sa_num_samples);
+				}
+
+			PrintUsage (argv [0]);
+		}
+
+	if (samples.sa_data_p)
+		{
+			free (samples.sa_data_p);
+		}
+
+	free (samples.sa_lengths_p);
+
+	return res;
+}
+
+
+static int AddSample (Samples *samples_p, const char *filename_s)
+{
+	int success_flag = 0;
+	FILE *in_f = fopen (filename_s, "rb");
+
+	if (in_f)
+		{
+			long length = -1;
+
+			if (fseek (in_f, 0, SEEK_END) == 0)
+				{
+					length = ftell (in_f);
+					rewind (in_f);
+				}
+
+			if (length > 0)
+				{
+					char *data_p = (char *) realloc (samples_p -> sa_data_p, samples_p -> sa_total_length + length);
+
+					if (data_p)
+						{
+							samples_p -> sa_data_p = data_p;
+
+							if (fread (data_p + samples_p -> sa_total_length, 1, length, in_f) == (size_t) length)
+								{
+									* (samples_p -> sa_lengths_p + samples_p -> sa_num_samples) = (size_t) length;
+									samples_p -> sa_total_length += length;
+									++ (samples_p -> sa_num_samples);
+
+									success_flag = 1;
+								}
+							else
+								{
+									fprintf (stderr, "Failed to read \"%s\"\n", filename_s);
+								}
+						}
+					else
+						{
+							fprintf (stderr, "Failed to allocate memory for \"%s\"\n", filename_s);
+						}
+				}
+			else if (length == 0)
+				{
+					/* Nothing to learn from an empty file */
+					success_flag = 1;
+				}
+			else
+				{
+					fprintf (stderr, "Failed to get the size of \"%s\"\n", filename_s);
+				}
+
+			fclose (in_f);
+		}
+	else
+		{
+			fprintf (stderr, "Failed to open \"%s\"\n", filename_s);
+		}
+
+	return success_flag;
+}
+
+
+static int SaveDictionary (const void *dictionary_p, const size_t length, const char *filename_s)
+{
+	int success_flag = 0;
+	FILE *out_f = fopen (filename_s, "wb");
+
+	if (out_f)
+		{
+			if (fwrite (dictionary_p, 1, length, out_f) == length)
+				{
+					success_flag = 1;
+				}
+			else
+				{
+					fprintf (stderr, "Failed to write the dictionary to \"%s\"\n", filename_s);
+				}
+
+			if (fclose (out_f) != 0)
+				{
+					success_flag = 0;
+				}
+		}
+	else
+		{
+			fprintf (stderr, "Failed to open \"%s\" to write the dictionary to\n", filename_s);
+		}
+
+	return success_flag;
+}
+
+
+static void PrintUsage (const char *program_s)
+{
+	fprintf (stderr, "Usage: %s [-s <max size>] -o <dictionary> <sample> ...\n", program_s);
+	fprintf (stderr, "  -o <dictionary>  The file to write the dictionary to.\n");
+	fprintf (stderr, "  -s <max size>    The maximum size of the dictionary in bytes, the default is %d.\n", DT_DEFAULT_DICTIONARY_SIZE);
+	fprintf (stderr, "  <sample> ...     The serialised jobs to train the dictionary with, at least %d.\n", DT_MIN_NUM_SAMPLES);
+}
@@ -0,0 +1,536 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * grassroots_stripe_benchmark.c
+ *
+ *  A command line tool that measures how much contention there is on the
+ *  jobs cache's cross-process locks with a single lock and with the lock
+ *  split into stripes, as with the GrassrootsCacheStripes directive.
+ *
+ *  It forks a number of processes, like the httpd children, each running
+ *  a number of threads. Every operation picks a random key, locks the
+ *  stripe that the key hashes to, copies an entry of the given size into
+ *  or out of that stripe's part of the shared memory and then unlocks it,
+ *  which is the same pattern as APRGlobalStorage's lookups and stores. The
+ *  copied entry is then checksummed outside of the lock to stand in for
+ *  decoding it. The locks are process-shared pthread mutexes and, as in
+ *  APRGlobalStorage, each one is tried first so that the contended
+ *  acquisitions can be counted.
+ *
+ *  This is built separately from the module with "make stripe_benchmark"
+ *  and only needs pthreads.
+ *
+ *  Usage: grassroots_stripe_benchmark [-p <processes>] [-t <threads>] [-s <stripes>] [-n <operations>] [-l <entry length>] [-w <write percentage>]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+
+/**
+ * The most stripes that can be used, the same as
+ * APR_GLOBAL_STORAGE_MAX_NUM_STRIPES.
+ */
+#define SB_MAX_NUM_STRIPES (64)
+
+
+/**
+ * The number of entries kept in each stripe.
+ */
+#define SB_ENTRIES_PER_STRIPE (64)
+
+
+#define SB_DEFAULT_NUM_PROCESSES (4)
+
+#define SB_DEFAULT_NUM_THREADS (8)
+
+#define SB_DEFAULT_NUM_STRIPES (16)
+
+#define SB_DEFAULT_NUM_OPERATIONS (200000)
+
+#define SB_DEFAULT_ENTRY_LENGTH (2048)
+
+#define SB_DEFAULT_WRITE_PERCENTAGE (20)
+
+
+typedef struct BenchmarkOptions
+{
+	unsigned int bo_num_processes;
+
+	unsigned int bo_num_threads;
+
+	unsigned int bo_num_stripes;
+
+	/** The number of operations run by each thread. */
+	unsigned long bo_num_operations;
+
+	unsigned int bo_entry_length;
+
+	unsigned int bo_write_percentage;
+} BenchmarkOptions;
+
+
+/*
+ * The data shared between all of the processes.
+ */
+typedef struct BenchmarkSharedData
+{
+	pthread_mutex_t bsd_mutexes [SB_MAX_NUM_STRIPES];
+
+	/** Set to 1 to start all of the threads at once. */
+	volatile int bsd_start_flag;
+
+	volatile unsigned int bsd_num_ready;
+
+	volatile unsigned long bsd_num_acquisitions;
+
+	volatile unsigned long bsd_num_contentions;
+
+	/** Stops the checksums from being optimised away. */
+	volatile unsigned long bsd_checksum;
+
+	/** The entries for each stripe, one stripe after another. */
+	unsigned char bsd_entries [];
+} BenchmarkSharedData;
+
+
+typedef struct BenchmarkThread
+{
+	const BenchmarkOptions *bt_options_p;
+
+	BenchmarkSharedData *bt_shared_data_p;
+
+	unsigned int bt_num_stripes;
+
+	unsigned int bt_seed;
+} BenchmarkThread;
+
+
+typedef struct BenchmarkResult
+{
+	double br_seconds;
+
+	unsigned long br_num_acquisitions;
+
+	unsigned long br_num_contentions;
+} BenchmarkResult;
+
+
+static int ParseNumber (const char *value_s, const unsigned long min_value, const unsigned long max_value, unsigned long *value_p);
+
+static int RunBenchmark (const BenchmarkOptions *options_p, const unsigned int num_stripes, BenchmarkResult *result_p);
+
+static int RunProcess (const BenchmarkOptions *options_p, BenchmarkSharedData *shared_data_p, const unsigned int num_stripes, const unsigned int process_index);
+
+static void *RunThread (void *data_p);
+
+static unsigned int GetNextRandomNumber (unsigned int *state_p);
+
+static double GetTime (void);
+
+static void PrintResult (const char *label_s, const BenchmarkOptions *options_p, const unsigned int num_stripes, const BenchmarkResult *result_p);
+
+static void PrintUsage (const char *program_s);
+
+
+/**************************/
+
+
+int main (int argc, char *argv [])
+{
+	BenchmarkOptions options;
+	BenchmarkResult single_result;
+	BenchmarkResult striped_result;
+	int i;
+
+	options.bo_num_processes = SB_DEFAULT_NUM_PROCESSES;
+	options.bo_num_threads = SB_DEFAULT_NUM_THREADS;
+	options.bo_num_stripes = SB_DEFAULT_NUM_STRIPES;
+	options.bo_num_operations = SB_DEFAULT_NUM_OPERATIONS;
+	options.bo_entry_length = SB_DEFAULT_ENTRY_LENGTH;
+	options.bo_write_percentage = SB_DEFAULT_WRITE_PERCENTAGE;
+
+	for (i = 1; i < argc; ++ i)
+		{
+			unsigned long value = 0;
+			int valid_flag = 0;
+
+			if (i + 1 < argc)
+				{
+					const char *value_s = argv [i + 1];
+
+					if (strcmp (argv [i], "-p") == 0)
+						{
+							if ((valid_flag = ParseNumber (value_s, 1, 256, &value)))
+								{
+									options.bo_num_processes = (unsigned int) value;
+								}
+						}
+					else if (strcmp (argv [i], "-t") == 0)
+						{
+							if ((valid_flag = ParseNumber (value_s, 1, 1024, &value)))
+								{
+									options.bo_num_threads = (unsigned int) value;
+								}
+						}
+					else if (strcmp (argv [i], "-s") == 0)
+						{
+							if ((valid_flag = ParseNumber (value_s, 2, SB_MAX_NUM_STRIPES, &value)))
+								{
+									options.bo_num_stripes = (unsigned int) value;
+								}
+						}
+					else if (strcmp (argv [i], "-n") == 0)
+						{
+							if ((valid_flag = ParseNumber (value_s, 1, 1000000000, &value)))
+								{
+									options.bo_num_operations = value;
+								}
+						}
+					else if (strcmp (argv [i], "-l") == 0)
+						{
+							if ((valid_flag = ParseNumber (value_s, 1, 1024 * 1024, &value)))
+								{
+									options.bo_entry_length = (unsigned int) value;
+								}
+						}
+					else if (strcmp (argv [i], "-w") == 0)
+						{
+							if ((valid_flag = ParseNumber (value_s, 0, 100, &value)))
+								{
+									options.bo_write_percentage = (unsigned int) value;
+								}
+						}
+				}
+
+			if (!valid_flag)
+				{
+					PrintUsage (argv [0]);
+					return 1;
+				}
+
+			++ i;
+		}
+
+	/* A single lock is what the jobs cache used before it was striped */
+	if (RunBenchmark (&options, 1, &single_result) && RunBenchmark (&options, options.bo_num_stripes, &striped_result))
+		{
+			PrintResult ("single lock", &options, 1, &single_result);
+			PrintResult ("striped", &options, options.bo_num_stripes, &striped_result);
+
+			if (striped_result.br_seconds > 0.0)
+				{
+					printf ("speed up: %.2fx\n", single_result.br_seconds / striped_result.br_seconds);
+				}
+
+			return 0;
+		}
+
+	return 1;
+}
+
+
+static int ParseNumber (const char *value_s, const unsigned long min_value, const unsigned long max_value, unsigned long *value_p)
+{
+	char *end_s = NULL;
+	unsigned long value = strtoul (value_s, &end_s, 10);
+
+	if ((end_s == value_s) || (*end_s != '\0') || (value < min_value) || (value > max_value))
+		{
+			fprintf (stderr, "\"%s\" must be a number between %lu and %lu\n", value_s, min_value, max_value);
+			return 0;
+		}
+
+	*value_p = value;
+
+	return 1;
+}
+
+
+static int RunBenchmark (const BenchmarkOptions *options_p, const unsigned int num_stripes, BenchmarkResult *result_p)
+{
+	int success_flag = 0;
+	const size_t size = sizeof (BenchmarkSharedData) + ((size_t) num_stripes) * SB_ENTRIES_PER_STRIPE * options_p -> bo_entry_length;
+	BenchmarkSharedData *shared_data_p = (BenchmarkSharedData *) mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if (shared_data_p != MAP_FAILED)
+		{
+			pthread_mutexattr_t attr;
+			unsigned int num_mutexes = 0;
+
+			memset (shared_data_p, 0, size);
+
+			if (pthread_mutexattr_init (&attr) == 0)
+				{
+					if (pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED) == 0)
+						{
+							while ((num_mutexes < num_stripes) && (pthread_mutex_init (shared_data_p -> bsd_mutexes + num_mutexes, &attr) == 0))
+								{
+									++ num_mutexes;
+								}
+						}
+
+					pthread_mutexattr_destroy (&attr);
+				}
+
+			if (num_mutexes == num_stripes)
+				{
+					const unsigned int num_threads = options_p -> bo_num_processes * options_p -> bo_num_threads;
+					unsigned int num_started = 0;
+					unsigned int num_succeeded = 0;
+					double start_time;
+					unsigned int i;
+
+					for (i = 0; i < options_p -> bo_num_processes; ++ i)
+						{
+							pid_t pid = fork ();
+
+							if (pid == 0)
+								{
+									_exit (RunProcess (options_p, shared_data_p, num_stripes, i) ? 0 : 1);
+								}
+							else if (pid > 0)
+								{
+									++ num_started;
+								}
+							else
+								{
+									fprintf (stderr, "Failed to start process %u, %s\n", i, strerror (errno));
+								}
+						}
+
+					/* Wait until every thread is ready so that they all start together */
+					while ((num_started == options_p -> bo_num_processes) && (__sync_fetch_and_add (& (shared_data_p -> bsd_num_ready), 0) < num_threads))
+						{
+							usleep (1000);
+						}
+
+					start_time = GetTime ();
+					__sync_lock_test_and_set (& (shared_data_p -> bsd_start_flag), 1);
+
+					for (i = 0; i < num_started; ++ i)
+						{
+							int process_status = 0;
+
+							if ((wait (&process_status) > 0) && WIFEXITED (process_status) && (WEXITSTATUS (process_status) == 0))
+								{
+									++ num_succeeded;
+								}
+						}
+
+					if ((num_started == options_p -> bo_num_processes) && (num_succeeded == num_started))
+						{
+							result_p -> br_seconds = GetTime () - start_time;
+							result_p -> br_num_acquisitions = shared_data_p -> bsd_num_acquisitions;
+							result_p -> br_num_contentions = shared_data_p -> bsd_num_contentions;
+							success_flag = 1;
+						}
+					else
+						{
+							fprintf (stderr, "Only %u of the %u processes finished\n", num_succeeded, options_p -> bo_num_processes);
+						}
+				}
+			else
+				{
+					fprintf (stderr, "Failed to create the process-shared mutexes\n");
+				}
+
+			for (; num_mutexes > 0; -- num_mutexes)
+				{
+					pthread_mutex_destroy (shared_data_p -> bsd_mutexes + num_mutexes - 1);
+				}
+
+			munmap (shared_data_p, size);
+		}
+	else
+		{
+			fprintf (stderr, "Failed to map %lu bytes of shared memory, %s\n", (unsigned long) size, strerror (errno));
+		}
+
+	return success_flag;
+}
+
+
+static int RunProcess (const BenchmarkOptions *options_p, BenchmarkSharedData *shared_data_p, const unsigned int num_stripes, const unsigned int process_index)
+{
+	int success_flag = 0;
+	pthread_t *threads_p = (pthread_t *) malloc (options_p -> bo_num_threads * (sizeof (pthread_t) + sizeof (BenchmarkThread)));
+
+	if (threads_p)
+		{
+			BenchmarkThread *thread_data_p = (BenchmarkThread *) (threads_p + options_p -> bo_num_threads);
+			unsigned int num_started = 0;
+			unsigned int i;
+
+			for (i = 0; i < options_p -> bo_num_threads; ++ i)
+				{
+					BenchmarkThread *data_p = thread_data_p + i;
+
+					data_p -> bt_options_p = options_p;
+					data_p -> bt_shared_data_p = shared_data_p;
+					data_p -> bt_num_stripes = num_stripes;
+					data_p -> bt_seed = ((process_index + 1) * 7919) + ((i + 1) * 104729);
+
+					if (pthread_create (threads_p + i, NULL, RunThread, data_p) == 0)
+						{
+							++ num_started;
+						}
+					else
+						{
+							fprintf (stderr, "Failed to start thread %u in process %u\n", i, process_index);
+							break;
+						}
+				}
+
+			for (i = 0; i < num_started; ++ i)
+				{
+					pthread_join (* (threads_p + i), NULL);
+				}
+
+			success_flag = (num_started == options_p -> bo_num_threads);
+
+			free (threads_p);
+		}
+	else
+		{
+			fprintf (stderr, "Failed to allocate the threads for process %u\n", process_index);
+		}
+
+	return success_flag;
+}
+
+
+static void *RunThread (void *data_p)
+{
+	BenchmarkThread *thread_p = (BenchmarkThread *) data_p;
+	const BenchmarkOptions *options_p = thread_p -> bt_options_p;
+	BenchmarkSharedData *shared_data_p = thread_p -> bt_shared_data_p;
+	const unsigned int entry_length = options_p -> bo_entry_length;
+	unsigned char *entry_p = (unsigned char *) malloc (entry_length);
+	unsigned long num_contentions = 0;
+	unsigned long checksum = 0;
+	unsigned long i;
+
+	__sync_fetch_and_add (& (shared_data_p -> bsd_num_ready), 1);
+
+	if (!entry_p)
+		{
+			return NULL;
+		}
+
+	memset (entry_p, thread_p -> bt_seed & 0xFF, entry_length);
+
+	while (!shared_data_p -> bsd_start_flag)
+		{
+			sched_yield ();
+		}
+
+	for (i = 0; i < options_p -> bo_num_operations; ++ i)
+		{
+			const unsigned int hash = GetNextRandomNumber (& (thread_p -> bt_seed));
+			const unsigned int stripe = hash % (thread_p -> bt_num_stripes);
+			unsigned char *stored_entry_p = shared_data_p -> bsd_entries + ((((size_t) stripe) * SB_ENTRIES_PER_STRIPE) + ((hash / thread_p -> bt_num_stripes) % SB_ENTRIES_PER_STRIPE)) * entry_length;
+			pthread_mutex_t *mutex_p = shared_data_p -> bsd_mutexes + stripe;
+			const int write_flag = ((GetNextRandomNumber (& (thread_p -> bt_seed)) % 100) < options_p -> bo_write_percentage);
+			unsigned int j;
+
+			if (pthread_mutex_trylock (mutex_p) != 0)
+				{
+					++ num_contentions;
+					pthread_mutex_lock (mutex_p);
+				}
+
+			if (write_flag)
+				{
+					memcpy (stored_entry_p, entry_p, entry_length);
+				}
+			else
+				{
+					memcpy (entry_p, stored_entry_p, entry_length);
+				}
+
+			pthread_mutex_unlock (mutex_p);
+
+			/* Stand in for decoding the entry, which happens without the lock */
+			for (j = 0; j < entry_length; ++ j)
+				{
+					checksum = (checksum * 31) + * (entry_p + j);
+				}
+		}
+
+	__sync_fetch_and_add (& (shared_data_p -> bsd_num_acquisitions), options_p -> bo_num_operations);
+	__sync_fetch_and_add (& (shared_data_p -> bsd_num_contentions), num_contentions);
+	__sync_fetch_and_add (& (shared_data_p -> bsd_checksum), checksum);
+
+	free (entry_p);
+
+	return NULL;
+}
+
+
+static unsigned int GetNextRandomNumber (unsigned int *state_p)
+{
+	unsigned int x = *state_p;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	*state_p = x;
+
+	return x;
+}
+
+
+static double GetTime (void)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + (now.tv_nsec / 1e9);
+}
+
+
+static void PrintResult (const char *label_s, const BenchmarkOptions *options_p, const unsigned int num_stripes, const BenchmarkResult *result_p)
+{
+	const double ops_per_second = (result_p -> br_seconds > 0.0) ? (result_p -> br_num_acquisitions / result_p -> br_seconds) : 0.0;
+	const double contention_percentage = (result_p -> br_num_acquisitions > 0) ? ((100.0 * result_p -> br_num_contentions) / result_p -> br_num_acquisitions) : 0.0;
+
+	printf ("%-12s %2u stripe(s), %u processes x %u threads, %u byte entries, %u%% writes: %.3f s, %.0f operations/s, %.2f%% of lock acquisitions contended\n",
+		label_s, num_stripes, options_p -> bo_num_processes, options_p -> bo_num_threads, options_p -> bo_entry_length, options_p -> bo_write_percentage,
+		result_p -> br_seconds, ops_per_second, contention_percentage);
+}
+
+
+static void PrintUsage (const char *program_s)
+{
+	fprintf (stderr, "Usage: %s [-p <processes>] [-t <threads>] [-s <stripes>] [-n <operations>] [-l <entry length>] [-w <write percentage>]\n", program_s);
+	fprintf (stderr, "  -p <processes>        The number of processes to run, the default is %d.\n", SB_DEFAULT_NUM_PROCESSES);
+	fprintf (stderr, "  -t <threads>          The number of threads in each process, the default is %d.\n", SB_DEFAULT_NUM_THREADS);
+	fprintf (stderr, "  -s <stripes>          The number of stripes to compare with a single lock, between 2 and %d. The default is %d.\n", SB_MAX_NUM_STRIPES, SB_DEFAULT_NUM_STRIPES);
+	fprintf (stderr, "  -n <operations>       The number of operations run by each thread, the default is %d.\n", SB_DEFAULT_NUM_OPERATIONS);
+	fprintf (stderr, "  -l <entry length>     The size in bytes of each entry, the default is %d.\n", SB_DEFAULT_ENTRY_LENGTH);
+	fprintf (stderr, "  -w <write percentage> The percentage of the operations that store entries, the default is %d.\n", SB_DEFAULT_WRITE_PERCENTAGE);
+}
@@ -24,6 +24,10 @@
 #include "key_value_pair.h"
 #include "mod_grassroots_config.h"
 #include "apr_grassroots_servers.h"
+#include "apr_native_cache.h"
+#include "apr_cache_codecs.h"
+#include "apr_thread_buffers.h"
+#include "apr_job_watch.h"
 
 #include "httpd.h"
 #include "http_core.h"
@@ -42,6 +46,7 @@
 #include "apr_file_info.h"
 #include "apr_file_io.h"
 #include "apr_tables.h"
+#include "apr_buckets.h"
 #include "util_script.h"
 
 
@@ -51,6 +56,7 @@
 #include "streams.h"
 #include "util_mutex.h"
 #include "async_task.h"
+#include "uuid_util.h"
 
 #include "unistd.h"
 
@@ -77,6 +83,9 @@ static bool s_using_apr_servers_manager_flag;
 /* Define prototypes of our functions in this module */
 static void RegisterHooks (apr_pool_t *pool_p);
 static int GrassrootsHandler (request_rec *req_p);
+static int GrassrootsResultsHandler (request_rec *req_p);
+static int GrassrootsWatchHandler (request_rec *req_p);
+static int GrassrootsStatusHandler (request_rec *req_p);
 static void GrassrootsChildInit (apr_pool_t *pool_p, server_rec *server_p);
 
 static int GrassrootsPreConfig (apr_pool_t *config_pool_p, apr_pool_t *log_pool_p, apr_pool_t *temp_pool_p);
@@ -84,6 +93,36 @@ static int GrassrootsPostConfig (apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t
 
 static const char *SetGrassrootsRootPath (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
 static const char *SetGrassrootsCacheProvider (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+static const char *SetGrassrootsCacheStripes (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsCacheLocking (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsLocalCacheSize (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+static const char *SetGrassrootsJobObjectCacheSize (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+static const char *SetGrassrootsServiceJobLimit (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+static const char *SetGrassrootsUserJobLimit (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+static const char *SetGrassrootsActiveJobLimit (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+static const char *SetGrassrootsJobLimit (cmd_parms *cmd_p, const char *arg_s, const char *directive_s, uint32 *limit_p);
+static const char *SetGrassrootsJobRetention (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsCacheCapacity (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsCacheFullPolicy (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsCacheCompression (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsCacheCompressionThreshold (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsCacheCompressionMinSaving (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsCacheDictionary (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsCacheDictionarySamples (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsJobEncoding (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
+static const char *SetGrassrootsResultStore (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
+
 static const char *SetGrassrootsServersManager (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
 static const char *SetGrassrootsJobsManager (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
 static const char *SetGrassrootsConfigFilename (cmd_parms *cmd_p, void *cfg_p, const char *arg_s);
@@ -111,6 +150,22 @@ static void *MergeConfigs (apr_pool_t *pool_p, void *base_p, void *new_p);
 
 
 static GrassrootsLocationConfig *CreateConfig (apr_pool_t *pool_p, server_rec *server_p, const char *context_s);
+
+static json_t *GetJobWatchChangesAsJSON (APRJobWatch *watch_p, apr_time_t *latest_time_p);
+
+static int SendJobWatchEvents (request_rec *req_p, APRJobWatch *watch_p);
+
+static bool DoesRequestRunServices (const json_t *json_req_p);
+
+static APRJobAdmissionResult AdmitRequestJobs (request_rec *req_p, APRJobsManager *jobs_manager_p, const json_t *json_req_p, APRJobAdmission **admission_pp);
+
+static void CollectRunServiceNames (const json_t *json_req_p, apr_array_header_t *names_p);
+
+static json_t *ProcessBulkRequest (GrassrootsServer *grassroots_p, json_t *requests_p, User *user_p);
+
+static void CollectJobUUIDs (const json_t *json_p, json_t *job_uuids_p);
+
+static uint32 GetStatusRequestIds (request_rec *req_p, const char ***ids_sss);
 
 static apr_status_t CloseInformationSystem (void *data_p);
 
@@ -161,6 +216,23 @@ static const char *GetClaimHeaderValue (request_rec *req_p, const char * const c
 static const command_rec s_grassroots_directives [] =
 {
 	AP_INIT_TAKE1 ("GrassrootsCache", SetGrassrootsCacheProvider, NULL, ACCESS_CONF, "The provider for the Jobs Cache"),
+	AP_INIT_TAKE1 ("GrassrootsCacheStripes", SetGrassrootsCacheStripes, NULL, ACCESS_CONF, "The number of lock stripes to split the Jobs Cache into"),
+	AP_INIT_TAKE1 ("GrassrootsCacheLocking", SetGrassrootsCacheLocking, NULL, ACCESS_CONF, "How to lock the Jobs Cache: exclusive or shared"),
+	AP_INIT_TAKE1 ("GrassrootsLocalCacheSize", SetGrassrootsLocalCacheSize, NULL, ACCESS_CONF, "The size in kilobytes of the cache of recent jobs kept by each child process"),
+	AP_INIT_TAKE1 ("GrassrootsJobObjectCacheSize", SetGrassrootsJobObjectCacheSize, NULL, ACCESS_CONF, "The number of decoded jobs kept by each child process"),
+	AP_INIT_TAKE1 ("GrassrootsServiceJobLimit", SetGrassrootsServiceJobLimit, NULL, ACCESS_CONF, "The maximum number of running jobs for each service, 0 for no limit"),
+	AP_INIT_TAKE1 ("GrassrootsUserJobLimit", SetGrassrootsUserJobLimit, NULL, ACCESS_CONF, "The maximum number of running jobs for each user, 0 for no limit"),
+	AP_INIT_TAKE1 ("GrassrootsActiveJobLimit", SetGrassrootsActiveJobLimit, NULL, ACCESS_CONF, "The maximum number of running jobs in total, 0 for no limit"),
+	AP_INIT_TAKE1 ("GrassrootsJobRetention", SetGrassrootsJobRetention, NULL, ACCESS_CONF, "The number of seconds to keep finished jobs for, 0 keeps them until they are removed"),
+	AP_INIT_TAKE1 ("GrassrootsCacheCapacity", SetGrassrootsCacheCapacity, NULL, ACCESS_CONF, "The maximum size in kilobytes of the jobs in the Jobs Cache, 0 for no limit"),
+	AP_INIT_TAKE1 ("GrassrootsCacheFullPolicy", SetGrassrootsCacheFullPolicy, NULL, ACCESS_CONF, "What to do when the Jobs Cache is full: reject, evict-completed or evict-lru"),
+	AP_INIT_TAKE1 ("GrassrootsCacheCompression", SetGrassrootsCacheCompression, NULL, ACCESS_CONF, "How to compress the values in the caches: none, lz4, zstd or bzip2"),
+	AP_INIT_TAKE1 ("GrassrootsCacheCompressionThreshold", SetGrassrootsCacheCompressionThreshold, NULL, ACCESS_CONF, "The size in bytes below which values in the caches are not compressed"),
+	AP_INIT_TAKE1 ("GrassrootsCacheCompressionMinSaving", SetGrassrootsCacheCompressionMinSaving, NULL, ACCESS_CONF, "The percentage by which compression must shrink a value for it to be stored compressed"),
+	AP_INIT_TAKE1 ("GrassrootsCacheDictionary", SetGrassrootsCacheDictionary, NULL, ACCESS_CONF, "The path to a zstd dictionary to compress the values in the caches with"),
+	AP_INIT_TAKE1 ("GrassrootsCacheDictionarySamples", SetGrassrootsCacheDictionarySamples, NULL, ACCESS_CONF, "The directory to save samples of the jobs to for training a zstd dictionary"),
+	AP_INIT_TAKE1 ("GrassrootsJobEncoding", SetGrassrootsJobEncoding, NULL, ACCESS_CONF, "How to encode the jobs in the jobs cache: bson or json"),
+	AP_INIT_TAKE1 ("GrassrootsResultStore", SetGrassrootsResultStore, NULL, ACCESS_CONF, "The directory to write the results of the finished jobs to"),
 	AP_INIT_TAKE1 ("GrassrootsConfig", SetGrassrootsConfigFilename, NULL, ACCESS_CONF, "The config file to use for this Grassroots Server"),
 	AP_INIT_TAKE1 ("GrassrootsServicesConfigPath", SetGrassrootsServiceConfigPath, NULL, ACCESS_CONF, "The path to the individual services config files"),
 	AP_INIT_TAKE1 ("GrassrootsServicesPath", SetGrassrootsServicesPath, NULL, ACCESS_CONF, "The path to the service module files"),
@@ -225,6 +297,8 @@ const module *GetGrassrootsModule (void)
 /* register_hooks: Adds a hook to the httpd process */
 static void RegisterHooks (apr_pool_t *pool_p)
 {
+	RegisterNativeCacheProvider (pool_p);
+
 	ap_hook_pre_config (GrassrootsPreConfig, NULL, NULL, APR_HOOK_MIDDLE);
 
 	ap_hook_post_config (GrassrootsPostConfig, NULL, NULL, APR_HOOK_MIDDLE);
@@ -232,6 +306,9 @@ static void RegisterHooks (apr_pool_t *pool_p)
   ap_hook_child_init (GrassrootsChildInit, NULL, NULL, APR_HOOK_MIDDLE);
 
 	ap_hook_handler (GrassrootsHandler, NULL, NULL, APR_HOOK_MIDDLE);
+	ap_hook_handler (GrassrootsResultsHandler, NULL, NULL, APR_HOOK_MIDDLE);
+	ap_hook_handler (GrassrootsWatchHandler, NULL, NULL, APR_HOOK_MIDDLE);
+	ap_hook_handler (GrassrootsStatusHandler, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 
@@ -333,6 +410,23 @@ static GrassrootsLocationConfig *CreateConfig (apr_pool_t *pool_p, server_rec *s
 							config_p -> glc_user_auth_claim_s = NULL;
 							config_p -> glc_servers_p = servers_p;
 							config_p -> glc_server_p = server_p;
+							config_p -> glc_num_cache_stripes = 0;
+							config_p -> glc_cache_lock_mode = GLC_UNSET_INT32;
+							config_p -> glc_local_cache_size_kb = GLC_UNSET_UINT32;
+							config_p -> glc_job_object_cache_size = GLC_UNSET_UINT32;
+							config_p -> glc_service_job_limit = GLC_UNSET_UINT32;
+							config_p -> glc_user_job_limit = GLC_UNSET_UINT32;
+							config_p -> glc_active_job_limit = GLC_UNSET_UINT32;
+							config_p -> glc_job_retention_secs = -1;
+							config_p -> glc_cache_capacity_kb = GLC_UNSET_UINT32;
+							config_p -> glc_cache_full_policy = GLC_UNSET_INT32;
+							config_p -> glc_cache_codec_p = NULL;
+							config_p -> glc_cache_compress_min_length = -1;
+							config_p -> glc_cache_compress_min_saving = -1;
+							config_p -> glc_cache_dictionary_s = NULL;
+							config_p -> glc_cache_dictionary_samples_path_s = NULL;
+							config_p -> glc_job_encoding = GLC_UNSET_INT32;
+							config_p -> glc_result_store_path_s = NULL;
 						}
 				}
 		}
@@ -424,6 +518,23 @@ static void *MergeConfigs (apr_pool_t *pool_p, void *base_p, void *new_p)
 																														{
 																															merged_config_p -> glc_servers_p = merged_servers_p;
 																															merged_config_p -> glc_server_p = new_config_p -> glc_server_p ? new_config_p -> glc_server_p : base_config_p -> glc_server_p;
+																															merged_config_p -> glc_num_cache_stripes = (new_config_p -> glc_num_cache_stripes > 0) ? new_config_p -> glc_num_cache_stripes : base_config_p -> glc_num_cache_stripes;
+																															merged_config_p -> glc_cache_lock_mode = (new_config_p -> glc_cache_lock_mode != GLC_UNSET_INT32) ? new_config_p -> glc_cache_lock_mode : base_config_p -> glc_cache_lock_mode;
+																															merged_config_p -> glc_local_cache_size_kb = (new_config_p -> glc_local_cache_size_kb != GLC_UNSET_UINT32) ? new_config_p -> glc_local_cache_size_kb : base_config_p -> glc_local_cache_size_kb;
+																															merged_config_p -> glc_job_object_cache_size = (new_config_p -> glc_job_object_cache_size != GLC_UNSET_UINT32) ? new_config_p -> glc_job_object_cache_size : base_config_p -> glc_job_object_cache_size;
+																															merged_config_p -> glc_service_job_limit = (new_config_p -> glc_service_job_limit != GLC_UNSET_UINT32) ? new_config_p -> glc_service_job_limit : base_config_p -> glc_service_job_limit;
+																															merged_config_p -> glc_user_job_limit = (new_config_p -> glc_user_job_limit != GLC_UNSET_UINT32) ? new_config_p -> glc_user_job_limit : base_config_p -> glc_user_job_limit;
+																															merged_config_p -> glc_active_job_limit = (new_config_p -> glc_active_job_limit != GLC_UNSET_UINT32) ? new_config_p -> glc_active_job_limit : base_config_p -> glc_active_job_limit;
+																															merged_config_p -> glc_job_retention_secs = (new_config_p -> glc_job_retention_secs >= 0) ? new_config_p -> glc_job_retention_secs : base_config_p -> glc_job_retention_secs;
+																															merged_config_p -> glc_cache_capacity_kb = (new_config_p -> glc_cache_capacity_kb != GLC_UNSET_UINT32) ? new_config_p -> glc_cache_capacity_kb : base_config_p -> glc_cache_capacity_kb;
+																															merged_config_p -> glc_cache_full_policy = (new_config_p -> glc_cache_full_policy != GLC_UNSET_INT32) ? new_config_p -> glc_cache_full_policy : base_config_p -> glc_cache_full_policy;
+																															merged_config_p -> glc_cache_codec_p = new_config_p -> glc_cache_codec_p ? new_config_p -> glc_cache_codec_p : base_config_p -> glc_cache_codec_p;
+																															merged_config_p -> glc_cache_compress_min_length = (new_config_p -> glc_cache_compress_min_length >= 0) ? new_config_p -> glc_cache_compress_min_length : base_config_p -> glc_cache_compress_min_length;
+																															merged_config_p -> glc_cache_compress_min_saving = (new_config_p -> glc_cache_compress_min_saving >= 0) ? new_config_p -> glc_cache_compress_min_saving : base_config_p -> glc_cache_compress_min_saving;
+																															merged_config_p -> glc_cache_dictionary_s = new_config_p -> glc_cache_dictionary_s ? new_config_p -> glc_cache_dictionary_s : base_config_p -> glc_cache_dictionary_s;
+																															merged_config_p -> glc_cache_dictionary_samples_path_s = new_config_p -> glc_cache_dictionary_samples_path_s ? new_config_p -> glc_cache_dictionary_samples_path_s : base_config_p -> glc_cache_dictionary_samples_path_s;
+																															merged_config_p -> glc_job_encoding = (new_config_p -> glc_job_encoding != GLC_UNSET_INT32) ? new_config_p -> glc_job_encoding : base_config_p -> glc_job_encoding;
+																															merged_config_p -> glc_result_store_path_s = new_config_p -> glc_result_store_path_s ? new_config_p -> glc_result_store_path_s : base_config_p -> glc_result_store_path_s;
 
 																															return merged_config_p;
 																														}
@@ -553,6 +664,26 @@ static void GrassrootsChildInit (apr_pool_t *pool_p, server_rec *server_p)
 							/* Do any clean up required by the running of asynchronous tasks */
 							apr_pool_cleanup_register (pool_p, NULL, CleanUpTasks, apr_pool_cleanup_null);
 
+							/* Each worker thread keeps its own compression contexts for the caches */
+							if (!InitAPRCacheCodecs (pool_p))
+								{
+									ap_log_error (APLOG_MARK, APLOG_WARNING, APR_EGENERAL, server_p, "Failed to set up the per-thread compression contexts");
+								}
+
+							/* ... and the buffers that the jobs and cache entries are built in */
+							if (!InitAPRThreadBuffers (pool_p))
+								{
+									ap_log_error (APLOG_MARK, APLOG_WARNING, APR_EGENERAL, server_p, "Failed to set up the per-thread buffers");
+								}
+
+							if (config_p -> glc_cache_dictionary_s)
+								{
+									if (!LoadAPRCacheCodecDictionary (config_p -> glc_cache_dictionary_s, pool_p))
+										{
+											ap_log_error (APLOG_MARK, APLOG_WARNING, APR_EGENERAL, server_p, "Failed to load zstd dictionary \"%s\", compressing without it", config_p -> glc_cache_dictionary_s);
+										}
+								}
+
 		  				/*
 		  				 * We should now have a set of all of the required locations that will each need
 		  				 * an individual GrassrootsServer instance.
@@ -839,9 +970,321 @@ static const char *SetGrassrootsCacheProvider (cmd_parms *cmd_p, void *cfg_p, co
   	}
 
   return err_msg_s;
+}
+
+
+/* Get the number of lock stripes that the jobs manager storage will use */
+static const char *SetGrassrootsCacheStripes (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+	char *end_s = NULL;
+	long num_stripes = strtol (arg_s, &end_s, 10);
+
+	if ((end_s != arg_s) && (*end_s == '\0') && (num_stripes > 0) && (num_stripes <= APR_GLOBAL_STORAGE_MAX_NUM_STRIPES))
+		{
+			config_p -> glc_num_cache_stripes = (uint32) num_stripes;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsCacheStripes: \"%s\" must be a number between 1 and %d", arg_s, APR_GLOBAL_STORAGE_MAX_NUM_STRIPES);
+		}
+
+	return err_msg_s;
+}
+
+
+/* Get how the stripes of the jobs manager storage will be locked */
+static const char *SetGrassrootsCacheLocking (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+
+	if (strcmp (arg_s, "exclusive") == 0)
+		{
+			config_p -> glc_cache_lock_mode = AGS_LM_EXCLUSIVE;
+		}
+	else if (strcmp (arg_s, "shared") == 0)
+		{
+			config_p -> glc_cache_lock_mode = AGS_LM_SHARED_READS;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsCacheLocking: \"%s\" must be either \"exclusive\" or \"shared\"", arg_s);
+		}
+
+	return err_msg_s;
+}
+
+
+/* Get the size of the local jobs cache for each child process */
+static const char *SetGrassrootsLocalCacheSize (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+	char *end_s = NULL;
+	long size = strtol (arg_s, &end_s, 10);
+
+	if ((end_s != arg_s) && (*end_s == '\0') && (size >= 0) && (size <= (APR_UINT32_MAX >> 10)))
+		{
+			config_p -> glc_local_cache_size_kb = (uint32) size;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsLocalCacheSize: \"%s\" must be a non-negative number of kilobytes", arg_s);
+		}
+
+	return err_msg_s;
+}
+
+
+/* Get the number of decoded jobs for each child process to keep */
+static const char *SetGrassrootsJobObjectCacheSize (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+	char *end_s = NULL;
+	long size = strtol (arg_s, &end_s, 10);
+
+	if ((end_s != arg_s) && (*end_s == '\0') && (size >= 0) && (size <= APR_JOBS_MANAGER_MAX_JOB_OBJECT_CACHE_SIZE))
+		{
+			config_p -> glc_job_object_cache_size = (uint32) size;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsJobObjectCacheSize: \"%s\" must be a number of jobs from 0 to %d", arg_s, APR_JOBS_MANAGER_MAX_JOB_OBJECT_CACHE_SIZE);
+		}
+
+	return err_msg_s;
+}
+
+
+/* Get the maximum number of running jobs for each service */
+static const char *SetGrassrootsServiceJobLimit (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	return SetGrassrootsJobLimit (cmd_p, arg_s, "GrassrootsServiceJobLimit", & (((GrassrootsLocationConfig *) cfg_p) -> glc_service_job_limit));
+}
+
+
+/* Get the maximum number of running jobs for each user */
+static const char *SetGrassrootsUserJobLimit (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	return SetGrassrootsJobLimit (cmd_p, arg_s, "GrassrootsUserJobLimit", & (((GrassrootsLocationConfig *) cfg_p) -> glc_user_job_limit));
+}
+
+
+/* Get the maximum number of running jobs in total */
+static const char *SetGrassrootsActiveJobLimit (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	return SetGrassrootsJobLimit (cmd_p, arg_s, "GrassrootsActiveJobLimit", & (((GrassrootsLocationConfig *) cfg_p) -> glc_active_job_limit));
+}
+
+
+static const char *SetGrassrootsJobLimit (cmd_parms *cmd_p, const char *arg_s, const char *directive_s, uint32 *limit_p)
+{
+	const char *err_msg_s = NULL;
+	char *end_s = NULL;
+	long limit = strtol (arg_s, &end_s, 10);
+
+	if ((end_s != arg_s) && (*end_s == '\0') && (limit >= 0) && (limit <= APR_JOBS_MANAGER_MAX_JOB_LIMIT))
+		{
+			*limit_p = (uint32) limit;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "%s: \"%s\" must be a number of jobs from 0 to %d", directive_s, arg_s, APR_JOBS_MANAGER_MAX_JOB_LIMIT);
+		}
+
+	return err_msg_s;
+}
+
+
+static const char *SetGrassrootsJobRetention (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+	char *end_s = NULL;
+	long secs = strtol (arg_s, &end_s, 10);
+
+	if ((end_s != arg_s) && (*end_s == '\0') && (secs >= 0) && (secs <= APR_INT32_MAX))
+		{
+			config_p -> glc_job_retention_secs = (int32) secs;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsJobRetention: \"%s\" must be a non-negative number of seconds", arg_s);
+		}
+
+	return err_msg_s;
 }
 
 
+/* Get the maximum size of the jobs in the jobs manager storage */
+static const char *SetGrassrootsCacheCapacity (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+	char *end_s = NULL;
+	long size = strtol (arg_s, &end_s, 10);
+
+	if ((end_s != arg_s) && (*end_s == '\0') && (size >= 0) && (size < GLC_UNSET_UINT32))
+		{
+			config_p -> glc_cache_capacity_kb = (uint32) size;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsCacheCapacity: \"%s\" must be a non-negative number of kilobytes", arg_s);
+		}
+
+	return err_msg_s;
+}
+
+
+/* Get what the jobs manager storage does when it is full */
+static const char *SetGrassrootsCacheFullPolicy (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+
+	if (strcmp (arg_s, "reject") == 0)
+		{
+			config_p -> glc_cache_full_policy = AGS_FP_REJECT;
+		}
+	else if (strcmp (arg_s, "evict-completed") == 0)
+		{
+			config_p -> glc_cache_full_policy = AGS_FP_EVICT_EXPIRING;
+		}
+	else if (strcmp (arg_s, "evict-lru") == 0)
+		{
+			config_p -> glc_cache_full_policy = AGS_FP_EVICT_LRU;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsCacheFullPolicy: \"%s\" must be one of \"reject\", \"evict-completed\" or \"evict-lru\"", arg_s);
+		}
+
+	return err_msg_s;
+}
+
+
+/* Get the codec used to compress the values in the caches */
+static const char *SetGrassrootsCacheCompression (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+	const APRCacheCodec *codec_p = GetAPRCacheCodecByName (arg_s);
+
+	if (codec_p)
+		{
+			config_p -> glc_cache_codec_p = codec_p;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsCacheCompression: \"%s\" is not available, it must be one of %s", arg_s, GetAvailableAPRCacheCodecNames ());
+		}
+
+	return err_msg_s;
+}
+
+
+/* Get the size below which the values in the caches are not compressed */
+static const char *SetGrassrootsCacheCompressionThreshold (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+	char *end_s = NULL;
+	long size = strtol (arg_s, &end_s, 10);
+
+	if ((end_s != arg_s) && (*end_s == '\0') && (size >= 0) && (size <= APR_INT32_MAX))
+		{
+			config_p -> glc_cache_compress_min_length = (int32) size;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsCacheCompressionThreshold: \"%s\" must be a non-negative number of bytes", arg_s);
+		}
+
+	return err_msg_s;
+}
+
+
+/* Get the path to the zstd dictionary for the caches */
+static const char *SetGrassrootsCacheDictionary (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+
+	config_p -> glc_cache_dictionary_s = ap_server_root_relative (cmd_p -> pool, arg_s);
+
+	return config_p -> glc_cache_dictionary_s ? NULL : apr_psprintf (cmd_p -> pool, "GrassrootsCacheDictionary: \"%s\" is not a valid path", arg_s);
+}
+
+
+/* Get the directory to save samples of the jobs to */
+static const char *SetGrassrootsCacheDictionarySamples (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+
+	config_p -> glc_cache_dictionary_samples_path_s = ap_server_root_relative (cmd_p -> pool, arg_s);
+
+	return config_p -> glc_cache_dictionary_samples_path_s ? NULL : apr_psprintf (cmd_p -> pool, "GrassrootsCacheDictionarySamples: \"%s\" is not a valid path", arg_s);
+}
+
+
+/* Get how the jobs are encoded in the jobs cache */
+static const char *SetGrassrootsJobEncoding (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+
+	if (strcmp (arg_s, "bson") == 0)
+		{
+			config_p -> glc_job_encoding = SJE_BSON;
+		}
+	else if (strcmp (arg_s, "json") == 0)
+		{
+			config_p -> glc_job_encoding = SJE_JSON;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsJobEncoding: \"%s\" must be either \"bson\" or \"json\"", arg_s);
+		}
+
+	return err_msg_s;
+}
+
+
+/* Get the directory to write the results of the finished jobs to */
+static const char *SetGrassrootsResultStore (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+
+	config_p -> glc_result_store_path_s = ap_server_root_relative (cmd_p -> pool, arg_s);
+
+	return config_p -> glc_result_store_path_s ? NULL : apr_psprintf (cmd_p -> pool, "GrassrootsResultStore: \"%s\" is not a valid path", arg_s);
+}
+
+
+/* Get how much compression must shrink a value by for it to be stored compressed */
+static const char *SetGrassrootsCacheCompressionMinSaving (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
+{
+	GrassrootsLocationConfig *config_p = (GrassrootsLocationConfig *) cfg_p;
+	const char *err_msg_s = NULL;
+	char *end_s = NULL;
+	long percentage = strtol (arg_s, &end_s, 10);
+
+	if ((end_s != arg_s) && (*end_s == '\0') && (percentage >= 0) && (percentage < 100))
+		{
+			config_p -> glc_cache_compress_min_saving = (int32) percentage;
+		}
+	else
+		{
+			err_msg_s = apr_psprintf (cmd_p -> pool, "GrassrootsCacheCompressionMinSaving: \"%s\" must be a percentage from 0 to 99", arg_s);
+		}
+
+	return err_msg_s;
+}
+
+
 /* Handler for the "GrassrootsServersManager" directive */
 static const char *SetGrassrootsServersManager (cmd_parms *cmd_p, void *cfg_p, const char *arg_s)
 {
@@ -1104,38 +1547,135 @@ static int GrassrootsHandler (request_rec *req_p)
 
   		if (json_req_p && grassroots_uri_s)
   			{
-					if (grassroots_p)
+					APRJobsManager *jobs_manager_p = GetChildAPRJobsManager ();
+					APRJobAdmission *admission_p = NULL;
+					APRJobAdmissionResult admission_result = AJA_ADMITTED;
+
+					/*
+					 * Running services will add new jobs, so if there is no room
+					 * for them, tell the client to come back later rather than
+					 * starting jobs whose results would be lost.
+					 */
+					if (grassroots_p && jobs_manager_p && DoesRequestRunServices (json_req_p) && IsAPRJobsManagerFull (jobs_manager_p))
 						{
-							const char *error_s = NULL;
-							json_t *res_p = NULL;
+							apr_table_setn (req_p -> err_headers_out, "Retry-After", apr_itoa (req_p -> pool, APR_JOBS_MANAGER_RETRY_AFTER));
+							PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Refusing to run services for \"%s\" as the jobs cache is full", grassroots_uri_s);
 
-							res_p = ProcessServerJSONMessage (grassroots_p, json_req_p, user_p, &error_s);
+							json_decref (json_req_p);
 
-							if (res_p)
+							if (user_p)
 								{
-									char *res_s = json_dumps (res_p, JSON_INDENT (2));
+									FreeUser (user_p);
+								}
 
-									if (res_s)
-										{
-											res = OK;
+							res = HTTP_SERVICE_UNAVAILABLE;
+						}
+					else if (grassroots_p && json_is_array (json_req_p) && (json_array_size (json_req_p) > APR_JOBS_MANAGER_MAX_BULK_JOBS))
+						{
+							ap_rprintf (req_p, "Bulk requests can have at most %d entries", APR_JOBS_MANAGER_MAX_BULK_JOBS);
 
-											ap_rputs (res_s, req_p);
+							json_decref (json_req_p);
 
+							if (user_p)
+								{
+									FreeUser (user_p);
+								}
 
-											#if MOD_GRASSROOTS_DEBUG >= STM_LEVEL_FINE
-											PrintLog  (STM_LEVEL_FINE, __FILE__, __LINE__, "RETURNING: %s", res_s);
-											#endif
+							res = HTTP_REQUEST_ENTITY_TOO_LARGE;
+						}
+					else if (grassroots_p && jobs_manager_p && ((admission_result = AdmitRequestJobs (req_p, jobs_manager_p, json_req_p, &admission_p)) != AJA_ADMITTED))
+						{
+							/*
+							 * A user or service at its limit only has to wait for its own jobs
+							 * to finish, whereas the server being at its limit or having no
+							 * room to count any more users' or services' jobs is the same as
+							 * the jobs cache being full.
+							 */
+							switch (admission_result)
+								{
+									case AJA_SERVICE_LIMIT:
+										ap_rprintf (req_p, "Too many jobs are already running for the requested services");
+										res = HTTP_TOO_MANY_REQUESTS;
+										break;
+
+									case AJA_USER_LIMIT:
+										ap_rprintf (req_p, "Too many of your jobs are already running");
+										res = HTTP_TOO_MANY_REQUESTS;
+										break;
+
+									case AJA_ACTIVE_LIMIT:
+										res = HTTP_SERVICE_UNAVAILABLE;
+										break;
+
+									case AJA_COUNTERS_FULL:
+										ap_rprintf (req_p, "The server is already running jobs for too many users and services");
+										PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Refusing to run services for \"%s\" as there is no room left to count their jobs", grassroots_uri_s);
+										res = HTTP_SERVICE_UNAVAILABLE;
+										break;
+
+									default:
+										res = HTTP_INTERNAL_SERVER_ERROR;
+										break;
+								}
 
-											free (res_s);
-										}		/* if (res_s) */
-									else
+							if (res != HTTP_INTERNAL_SERVER_ERROR)
+								{
+									apr_table_setn (req_p -> err_headers_out, "Retry-After", apr_itoa (req_p -> pool, APR_JOBS_MANAGER_RETRY_AFTER));
+
+									if (admission_result != AJA_COUNTERS_FULL)
 										{
-											res = HTTP_INTERNAL_SERVER_ERROR;
+											PrintLog (STM_LEVEL_FINE, __FILE__, __LINE__, "Refusing to run services for \"%s\" as a job limit has been reached, %d", grassroots_uri_s, admission_result);
 										}
+								}
 
-									#if MOD_GRASSROOTS_DEBUG >= STM_LEVEL_FINER
-									PrintJSONRefCounts (res_p, "pre decref res_p", STM_LEVEL_FINER, __FILE__, __LINE__);
-									#endif
+							json_decref (json_req_p);
+
+							if (user_p)
+								{
+									FreeUser (user_p);
+								}
+						}
+					else if (grassroots_p)
+						{
+							const char *error_s = NULL;
+							json_t *res_p = NULL;
+
+							/* An array is a bulk request, each of whose entries is processed as a separate request */
+							if (json_is_array (json_req_p))
+								{
+									res_p = ProcessBulkRequest (grassroots_p, json_req_p, user_p);
+									error_s = "Failed to process bulk request";
+								}
+							else
+								{
+									res_p = ProcessServerJSONMessage (grassroots_p, json_req_p, user_p, &error_s);
+								}
+
+							if (res_p)
+								{
+									char *res_s = json_dumps (res_p, JSON_INDENT (2));
+
+									if (res_s)
+										{
+											res = OK;
+
+											ap_rputs (res_s, req_p);
+
+
+											#if MOD_GRASSROOTS_DEBUG >= STM_LEVEL_FINE
+											PrintLog  (STM_LEVEL_FINE, __FILE__, __LINE__, "RETURNING: %s", res_s);
+											#endif
+
+											free (res_s);
+										}		/* if (res_s) */
+									else
+										{
+											res = HTTP_INTERNAL_SERVER_ERROR;
+										}
+
+									#if MOD_GRASSROOTS_DEBUG >= STM_LEVEL_FINER
+									PrintJSONRefCounts (res_p, "pre decref res_p", STM_LEVEL_FINER, __FILE__, __LINE__);
+									#endif
 
 									json_decref (res_p);
 
@@ -1146,6 +1686,12 @@ static int GrassrootsHandler (request_rec *req_p)
 									res = HTTP_BAD_REQUEST;
 								}
 
+							/* The reservations refer to the service names in the request so give them back first */
+							if (admission_p)
+								{
+									EndAPRJobAdmission (admission_p);
+								}
+
 							#if MOD_GRASSROOTS_DEBUG >= STM_LEVEL_FINER
 							PrintLog (STM_LEVEL_FINER, __FILE__, __LINE__, "json_req_p -> refcount %ld", json_req_p -> refcount);
 							#endif
@@ -1173,6 +1719,795 @@ static int GrassrootsHandler (request_rec *req_p)
 
 
 
+/*
+ * Send the stored results of a finished job. The uuid of the job is the
+ * last part of the uri. The results file is sent as a file bucket so
+ * that httpd can use sendfile or mmap for it, and httpd's byterange
+ * filter answers any Range requests for part of it.
+ */
+static int GrassrootsResultsHandler (request_rec *req_p)
+{
+	APRJobsManager *jobs_manager_p;
+	const char *id_s;
+	char uuid_s [UUID_STRING_BUFFER_SIZE];
+	uuid_t job_key;
+	APRResultDescriptor descriptor;
+	apr_file_t *file_p = NULL;
+	apr_finfo_t finfo;
+	apr_bucket_brigade *bb_p;
+	apr_status_t status;
+	int res;
+
+	if ((! (req_p -> handler)) || (strcmp (req_p -> handler, "grassroots-results-handler") != 0))
+		{
+			return DECLINED;
+		}
+
+	req_p -> allowed |= (AP_METHOD_BIT << M_GET);
+
+	if (req_p -> method_number != M_GET)
+		{
+			return HTTP_METHOD_NOT_ALLOWED;
+		}
+
+	jobs_manager_p = GetChildAPRJobsManager ();
+	id_s = strrchr (req_p -> uri, '/');
+	id_s = id_s ? id_s + 1 : req_p -> uri;
+
+	if ((!jobs_manager_p) || (!ConvertStringToUUID (id_s, job_key)))
+		{
+			return HTTP_NOT_FOUND;
+		}
+
+	/* Use the uuid's own form of the id so that it always matches the file's name */
+	ConvertUUIDToString (job_key, uuid_s);
+
+	/* The descriptor is only there whilst the job is, so expired files aren't served */
+	if (!GetServiceJobResultsFromAPRJobsManager (jobs_manager_p, job_key, &descriptor))
+		{
+			return HTTP_NOT_FOUND;
+		}
+
+	status = OpenResultsInAPRResultStore (jobs_manager_p -> ajm_result_store_p, uuid_s, &file_p, &finfo, req_p -> pool);
+
+	if (status != APR_SUCCESS)
+		{
+			ap_log_rerror (APLOG_MARK, APLOG_ERR, status, req_p, "Failed to open the stored results for \"%s\"", uuid_s);
+			return APR_STATUS_IS_ENOENT (status) ? HTTP_NOT_FOUND : HTTP_INTERNAL_SERVER_ERROR;
+		}
+
+	req_p -> finfo = finfo;
+
+	ap_set_content_type (req_p, "application/json");
+	ap_set_content_length (req_p, finfo.size);
+	ap_update_mtime (req_p, finfo.mtime);
+	ap_set_last_modified (req_p);
+	ap_set_etag (req_p);
+	apr_table_setn (req_p -> headers_out, "Accept-Ranges", "bytes");
+
+	res = ap_meets_conditions (req_p);
+
+	if (res != OK)
+		{
+			apr_file_close (file_p);
+			return res;
+		}
+
+	if (req_p -> header_only)
+		{
+			apr_file_close (file_p);
+			return OK;
+		}
+
+	/* The byterange filter only handles complete responses, so the whole file and the EOS go in one brigade */
+	bb_p = apr_brigade_create (req_p -> pool, req_p -> connection -> bucket_alloc);
+	apr_brigade_insert_file (bb_p, file_p, 0, finfo.size, req_p -> pool);
+	APR_BRIGADE_INSERT_TAIL (bb_p, apr_bucket_eos_create (bb_p -> bucket_alloc));
+
+	status = ap_pass_brigade (req_p -> output_filters, bb_p);
+
+	if (status != APR_SUCCESS)
+		{
+			/* The client has most likely gone away */
+			ap_log_rerror (APLOG_MARK, APLOG_DEBUG, status, req_p, "Failed to send the stored results for \"%s\"", uuid_s);
+			return AP_FILTER_ERROR;
+		}
+
+	return OK;
+}
+
+
+static int GrassrootsWatchHandler (request_rec *req_p)
+{
+	APRJobsManager *jobs_manager_p;
+	APRJobWatch *watch_p;
+	apr_table_t *args_p = NULL;
+	const char *ids_s = NULL;
+	const char *value_s;
+	const char *accept_s;
+	apr_time_t since = 0;
+	bool stream_flag;
+
+	if ((! (req_p -> handler)) || (strcmp (req_p -> handler, "grassroots-watch-handler") != 0))
+		{
+			return DECLINED;
+		}
+
+	req_p -> allowed |= (AP_METHOD_BIT << M_GET);
+
+	if (req_p -> method_number != M_GET)
+		{
+			return HTTP_METHOD_NOT_ALLOWED;
+		}
+
+	jobs_manager_p = GetChildAPRJobsManager ();
+
+	if (!jobs_manager_p)
+		{
+			return HTTP_SERVICE_UNAVAILABLE;
+		}
+
+	ap_args_to_table (req_p, &args_p);
+
+	if (args_p)
+		{
+			ids_s = apr_table_get (args_p, "ids");
+		}
+
+	if (!ids_s)
+		{
+			ap_log_rerror (APLOG_MARK, APLOG_DEBUG, 0, req_p, "No job ids to watch");
+			return HTTP_BAD_REQUEST;
+		}
+
+	accept_s = apr_table_get (req_p -> headers_in, "Accept");
+	stream_flag = (accept_s && (strstr (accept_s, "text/event-stream") != NULL));
+
+	/* A reconnecting event stream tells us the last event that it got */
+	value_s = stream_flag ? apr_table_get (req_p -> headers_in, "Last-Event-ID") : NULL;
+
+	if (!value_s)
+		{
+			value_s = apr_table_get (args_p, "since");
+		}
+
+	if (value_s)
+		{
+			since = (apr_time_t) apr_atoi64 (value_s);
+		}
+
+	watch_p = AllocateAPRJobWatch (jobs_manager_p, ids_s, since, req_p -> pool);
+
+	if (!watch_p)
+		{
+			ap_log_rerror (APLOG_MARK, APLOG_DEBUG, 0, req_p, "No valid job ids to watch in \"%s\"", ids_s);
+			return HTTP_BAD_REQUEST;
+		}
+
+	apr_table_setn (req_p -> headers_out, "Cache-Control", "no-cache");
+
+	if (stream_flag)
+		{
+			return SendJobWatchEvents (req_p, watch_p);
+		}
+	else
+		{
+			apr_time_t timeout = apr_time_from_sec (APR_JOB_WATCH_DEFAULT_TIMEOUT);
+			apr_time_t latest_time = since;
+			json_t *res_p;
+			json_t *jobs_p;
+
+			value_s = apr_table_get (args_p, "timeout");
+
+			if (value_s)
+				{
+					apr_int64_t secs = apr_atoi64 (value_s);
+
+					if (secs < 0)
+						{
+							secs = 0;
+						}
+					else if (secs > APR_JOB_WATCH_MAX_TIMEOUT)
+						{
+							secs = APR_JOB_WATCH_MAX_TIMEOUT;
+						}
+
+					timeout = apr_time_from_sec (secs);
+				}
+
+			WaitForAPRJobWatchChanges (watch_p, apr_time_now () + timeout);
+
+			res_p = json_object ();
+			jobs_p = GetJobWatchChangesAsJSON (watch_p, &latest_time);
+
+			if (res_p && jobs_p)
+				{
+					/* The client passes "time" back as "since" on its next poll */
+					if ((json_object_set_new (res_p, "time", json_integer ((json_int_t) latest_time)) == 0) && (json_object_set_new (res_p, "jobs", jobs_p) == 0))
+						{
+							char *res_s = json_dumps (res_p, JSON_COMPACT);
+
+							jobs_p = NULL;
+
+							if (res_s)
+								{
+									ap_set_content_type (req_p, "application/json");
+									ap_rputs (res_s, req_p);
+
+									free (res_s);
+									json_decref (res_p);
+
+									return OK;
+								}
+						}
+				}
+
+			if (jobs_p)
+				{
+					json_decref (jobs_p);
+				}
+
+			if (res_p)
+				{
+					json_decref (res_p);
+				}
+
+			return HTTP_INTERNAL_SERVER_ERROR;
+		}
+}
+
+
+static json_t *GetJobWatchChangesAsJSON (APRJobWatch *watch_p, apr_time_t *latest_time_p)
+{
+	json_t *jobs_p = json_array ();
+
+	if (jobs_p)
+		{
+			uint32 i;
+
+			for (i = 0; i < watch_p -> ajw_num_jobs; ++ i)
+				{
+					APRWatchedJob *job_p = (watch_p -> ajw_jobs_p) + i;
+
+					if (HasAPRWatchedJobChanged (job_p))
+						{
+							json_t *job_json_p = GetAPRWatchedJobAsJSON (job_p);
+
+							if (!job_json_p)
+								{
+									json_decref (jobs_p);
+									return NULL;
+								}
+
+							if (json_array_append_new (jobs_p, job_json_p) != 0)
+								{
+									json_decref (jobs_p);
+									return NULL;
+								}
+
+							SetAPRWatchedJobReported (job_p);
+						}
+
+					if (job_p -> awj_reported_time > *latest_time_p)
+						{
+							*latest_time_p = job_p -> awj_reported_time;
+						}
+				}
+		}
+
+	return jobs_p;
+}
+
+
+static int SendJobWatchEvents (request_rec *req_p, APRJobWatch *watch_p)
+{
+	const apr_time_t end_time = apr_time_now () + apr_time_from_sec (APR_JOB_WATCH_MAX_STREAM_TIME);
+	apr_time_t latest_time = 0;
+	bool finished_flag = false;
+
+	ap_set_content_type (req_p, "text/event-stream");
+
+	/* Send the headers straight away so that the client knows the stream is open */
+	ap_rflush (req_p);
+
+	while ((!finished_flag) && (! (req_p -> connection -> aborted)))
+		{
+			apr_time_t deadline = apr_time_now () + apr_time_from_sec (APR_JOB_WATCH_KEEP_ALIVE_INTERVAL);
+			uint32 num_changed;
+
+			if (deadline > end_time)
+				{
+					deadline = end_time;
+				}
+
+			num_changed = WaitForAPRJobWatchChanges (watch_p, deadline);
+
+			if (num_changed > 0)
+				{
+					uint32 i;
+
+					for (i = 0; i < watch_p -> ajw_num_jobs; ++ i)
+						{
+							APRWatchedJob *job_p = (watch_p -> ajw_jobs_p) + i;
+
+							if (HasAPRWatchedJobChanged (job_p))
+								{
+									json_t *job_json_p = GetAPRWatchedJobAsJSON (job_p);
+
+									SetAPRWatchedJobReported (job_p);
+
+									if (job_p -> awj_reported_time > latest_time)
+										{
+											latest_time = job_p -> awj_reported_time;
+										}
+
+									if (job_json_p)
+										{
+											char *job_s = json_dumps (job_json_p, JSON_COMPACT);
+
+											if (job_s)
+												{
+													/* The id is sent back as Last-Event-ID when the client reconnects */
+													ap_rprintf (req_p, "id: %" APR_TIME_T_FMT "\nevent: status\ndata: %s\n\n", latest_time, job_s);
+													free (job_s);
+												}
+
+											json_decref (job_json_p);
+										}
+								}
+						}
+
+				}
+			else if (apr_time_now () >= end_time)
+				{
+					break;
+				}
+
+			finished_flag = HaveAPRJobWatchJobsFinished (watch_p);
+
+			if ((num_changed == 0) && (!finished_flag))
+				{
+					ap_rputs (": keep-alive\n\n", req_p);
+				}
+
+			if (ap_rflush (req_p) < 0)
+				{
+					break;
+				}
+		}
+
+	if (finished_flag)
+		{
+			/* Let the client close the stream rather than reconnecting to it */
+			ap_rputs ("event: end\ndata: {}\n\n", req_p);
+			ap_rflush (req_p);
+		}
+
+	return OK;
+}
+
+
+/*
+ * Check whether a request, or any of the entries in a
+ * bulk request, will run services and so add new jobs.
+ */
+static bool DoesRequestRunServices (const json_t *json_req_p)
+{
+	if (json_is_array (json_req_p))
+		{
+			size_t i;
+			json_t *entry_p;
+
+			json_array_foreach (json_req_p, i, entry_p)
+				{
+					if (json_object_get (entry_p, SERVICES_NAME_S))
+						{
+							return true;
+						}
+				}
+
+			return false;
+		}
+
+	return (json_object_get (json_req_p, SERVICES_NAME_S) != NULL);
+}
+
+
+/*
+ * Reserve the jobs that a request, or all of the entries in a bulk
+ * request, will start against the job limits. Each service that is
+ * being run counts as one job. Anonymous users are told apart by
+ * their addresses.
+ */
+static APRJobAdmissionResult AdmitRequestJobs (request_rec *req_p, APRJobsManager *jobs_manager_p, const json_t *json_req_p, APRJobAdmission **admission_pp)
+{
+	APRJobAdmissionResult res = AJA_ADMITTED;
+
+	*admission_pp = NULL;
+
+	if (HasAPRJobsManagerGotJobLimits (jobs_manager_p) && DoesRequestRunServices (json_req_p))
+		{
+			apr_array_header_t *names_p = apr_array_make (req_p -> pool, 8, sizeof (const char *));
+
+			if (names_p)
+				{
+					const char *user_s = (req_p -> user) ? req_p -> user : req_p -> useragent_ip;
+
+					CollectRunServiceNames (json_req_p, names_p);
+
+					res = AdmitServiceJobsToAPRJobsManager (jobs_manager_p, user_s, (const char **) (names_p -> elts), (uint32) (names_p -> nelts), req_p -> pool, admission_pp);
+				}
+			else
+				{
+					res = AJA_ERROR;
+				}
+		}
+
+	return res;
+}
+
+
+static void CollectRunServiceNames (const json_t *json_req_p, apr_array_header_t *names_p)
+{
+	if (json_is_array (json_req_p))
+		{
+			size_t i;
+			json_t *entry_p;
+
+			json_array_foreach (json_req_p, i, entry_p)
+				{
+					CollectRunServiceNames (entry_p, names_p);
+				}
+		}
+	else
+		{
+			const json_t *services_p = json_object_get (json_req_p, SERVICES_NAME_S);
+
+			if (json_is_array (services_p))
+				{
+					size_t i;
+					json_t *service_p;
+
+					json_array_foreach (services_p, i, service_p)
+						{
+							const char *service_name_s = json_string_value (json_object_get (service_p, SERVICE_NAME_S));
+
+							if (service_name_s && json_is_true (json_object_get (service_p, SERVICE_RUN_S)))
+								{
+									* (const char **) apr_array_push (names_p) = service_name_s;
+								}
+						}
+				}
+		}
+}
+
+
+/*
+ * Process each of the entries in a bulk request in turn. The response has
+ * the entries' responses, in the same order, and the uuids of all of the
+ * jobs that they refer to so that clients don't have to look through them.
+ */
+static json_t *ProcessBulkRequest (GrassrootsServer *grassroots_p, json_t *requests_p, User *user_p)
+{
+	json_t *res_p = json_object ();
+
+	if (res_p)
+		{
+			json_t *responses_p = json_array ();
+
+			if (responses_p)
+				{
+					if (json_object_set_new (res_p, "responses", responses_p) == 0)
+						{
+							json_t *job_uuids_p = json_array ();
+
+							if (job_uuids_p)
+								{
+									if (json_object_set_new (res_p, "job_uuids", job_uuids_p) == 0)
+										{
+											size_t i;
+											json_t *request_p;
+
+											json_array_foreach (requests_p, i, request_p)
+												{
+													const char *error_s = NULL;
+													json_t *response_p = ProcessServerJSONMessage (grassroots_p, request_p, user_p, &error_s);
+
+													if (response_p)
+														{
+															CollectJobUUIDs (response_p, job_uuids_p);
+														}
+													else
+														{
+															/* Keep the responses in step with the requests */
+															response_p = json_object ();
+
+															if (response_p)
+																{
+																	if (json_object_set_new (response_p, "error", json_string (error_s ? error_s : "Failed to process request")) != 0)
+																		{
+																			json_decref (response_p);
+																			response_p = NULL;
+																		}
+																}
+														}
+
+													if ((!response_p) || (json_array_append_new (responses_p, response_p) != 0))
+														{
+															PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to add response " SIZET_FMT " to bulk response", i);
+															json_decref (res_p);
+
+															return NULL;
+														}
+												}
+
+											return res_p;
+										}
+									else
+										{
+											json_decref (job_uuids_p);
+										}
+								}
+						}
+					else
+						{
+							json_decref (responses_p);
+						}
+				}
+
+			json_decref (res_p);
+		}
+
+	return NULL;
+}
+
+
+/*
+ * Add the values of all of the job uuid keys within a response to an array.
+ */
+static void CollectJobUUIDs (const json_t *json_p, json_t *job_uuids_p)
+{
+	if (json_is_object (json_p))
+		{
+			const char *key_s;
+			json_t *value_p;
+
+			json_object_foreach ((json_t *) json_p, key_s, value_p)
+				{
+					if (json_is_string (value_p))
+						{
+							if (strcmp (key_s, JOB_UUID_S) == 0)
+								{
+									json_array_append_new (job_uuids_p, json_string (json_string_value (value_p)));
+								}
+						}
+					else
+						{
+							CollectJobUUIDs (value_p, job_uuids_p);
+						}
+				}
+		}
+	else if (json_is_array (json_p))
+		{
+			size_t i;
+			json_t *value_p;
+
+			json_array_foreach (json_p, i, value_p)
+				{
+					CollectJobUUIDs (value_p, job_uuids_p);
+				}
+		}
+}
+
+
+static int GrassrootsStatusHandler (request_rec *req_p)
+{
+	APRJobsManager *jobs_manager_p;
+	const char **ids_ss = NULL;
+	uint32 num_ids;
+
+	if ((! (req_p -> handler)) || (strcmp (req_p -> handler, "grassroots-status-handler") != 0))
+		{
+			return DECLINED;
+		}
+
+	req_p -> allowed |= (AP_METHOD_BIT << M_GET) | (AP_METHOD_BIT << M_POST);
+
+	if ((req_p -> method_number != M_GET) && (req_p -> method_number != M_POST))
+		{
+			return HTTP_METHOD_NOT_ALLOWED;
+		}
+
+	jobs_manager_p = GetChildAPRJobsManager ();
+
+	if (!jobs_manager_p)
+		{
+			return HTTP_SERVICE_UNAVAILABLE;
+		}
+
+	num_ids = GetStatusRequestIds (req_p, &ids_ss);
+
+	if (num_ids == 0)
+		{
+			ap_log_rerror (APLOG_MARK, APLOG_DEBUG, 0, req_p, "No job ids to get the statuses of");
+			return HTTP_BAD_REQUEST;
+		}
+	else if (num_ids > APR_JOBS_MANAGER_MAX_BULK_JOBS)
+		{
+			ap_log_rerror (APLOG_MARK, APLOG_DEBUG, 0, req_p, "Too many job ids, " UINT32_FMT ", to get the statuses of", num_ids);
+			return HTTP_REQUEST_ENTITY_TOO_LARGE;
+		}
+	else
+		{
+			uuid_t *job_keys_p = (uuid_t *) apr_palloc (req_p -> pool, num_ids * sizeof (uuid_t));
+			APRJobStatus *statuses_p = (APRJobStatus *) apr_palloc (req_p -> pool, num_ids * sizeof (APRJobStatus));
+			bool *found_flags_p = (bool *) apr_palloc (req_p -> pool, num_ids * sizeof (bool));
+			bool *valid_flags_p = (bool *) apr_palloc (req_p -> pool, num_ids * sizeof (bool));
+			json_t *res_p = json_object ();
+			json_t *jobs_p = json_array ();
+			int res = HTTP_INTERNAL_SERVER_ERROR;
+			uint32 num_valid = 0;
+			uint32 i;
+
+			if (job_keys_p && statuses_p && found_flags_p && valid_flags_p && res_p && jobs_p)
+				{
+					/* The invalid ids are reported as not found, so only the valid ones are looked up */
+					for (i = 0; i < num_ids; ++ i)
+						{
+							* (valid_flags_p + i) = ConvertStringToUUID (* (ids_ss + i), * (job_keys_p + num_valid));
+
+							if (* (valid_flags_p + i))
+								{
+									++ num_valid;
+								}
+						}
+
+					GetServiceJobStatusesFromAPRJobsManager (jobs_manager_p, (const uuid_t *) job_keys_p, num_valid, statuses_p, found_flags_p);
+
+					for (i = 0, num_valid = 0; i < num_ids; ++ i)
+						{
+							json_t *status_json_p = NULL;
+
+							if (* (valid_flags_p + i))
+								{
+									char uuid_s [UUID_STRING_BUFFER_SIZE];
+
+									ConvertUUIDToString (* (job_keys_p + num_valid), uuid_s);
+									status_json_p = GetAPRJobStatusAsJSON (uuid_s, (* (found_flags_p + num_valid)) ? statuses_p + num_valid : NULL);
+
+									++ num_valid;
+								}
+							else
+								{
+									status_json_p = GetAPRJobStatusAsJSON (* (ids_ss + i), NULL);
+								}
+
+							if ((!status_json_p) || (json_array_append_new (jobs_p, status_json_p) != 0))
+								{
+									break;
+								}
+						}
+
+					if (i == num_ids)
+						{
+							if (json_object_set_new (res_p, "jobs", jobs_p) == 0)
+								{
+									char *res_s;
+
+									jobs_p = NULL;
+									res_s = json_dumps (res_p, JSON_COMPACT);
+
+									if (res_s)
+										{
+											apr_table_setn (req_p -> headers_out, "Cache-Control", "no-cache");
+											ap_set_content_type (req_p, "application/json");
+											ap_rputs (res_s, req_p);
+
+											free (res_s);
+											res = OK;
+										}
+								}
+						}
+				}
+
+			if (jobs_p)
+				{
+					json_decref (jobs_p);
+				}
+
+			if (res_p)
+				{
+					json_decref (res_p);
+				}
+
+			return res;
+		}
+}
+
+
+/*
+ * Get the job ids for a bulk status request. These are either the comma-separated
+ * "ids" parameter of a GET request or the JSON array of ids posted in the body.
+ */
+static uint32 GetStatusRequestIds (request_rec *req_p, const char ***ids_sss)
+{
+	uint32 num_ids = 0;
+
+	if (req_p -> method_number == M_GET)
+		{
+			apr_table_t *args_p = NULL;
+			const char *value_s;
+
+			ap_args_to_table (req_p, &args_p);
+
+			value_s = args_p ? apr_table_get (args_p, "ids") : NULL;
+
+			if (value_s)
+				{
+					char *copied_ids_s = apr_pstrdup (req_p -> pool, value_s);
+					apr_array_header_t *ids_p = apr_array_make (req_p -> pool, 16, sizeof (const char *));
+
+					if (copied_ids_s && ids_p)
+						{
+							char *state_s = NULL;
+							char *id_s = apr_strtok (copied_ids_s, ", ", &state_s);
+
+							while (id_s)
+								{
+									* (const char **) apr_array_push (ids_p) = id_s;
+									id_s = apr_strtok (NULL, ", ", &state_s);
+								}
+
+							*ids_sss = (const char **) (ids_p -> elts);
+							num_ids = (uint32) (ids_p -> nelts);
+						}
+				}
+		}
+	else
+		{
+			json_t *ids_json_p = GetRequestBodyAsJSON (req_p);
+
+			if (ids_json_p)
+				{
+					if (json_is_array (ids_json_p))
+						{
+							const size_t size = json_array_size (ids_json_p);
+
+							/* Let the caller report that there are too many ids */
+							if (size > APR_JOBS_MANAGER_MAX_BULK_JOBS)
+								{
+									num_ids = (uint32) ((size > APR_UINT32_MAX) ? APR_UINT32_MAX : size);
+								}
+							else if (size > 0)
+								{
+									const char **ids_ss = (const char **) apr_palloc (req_p -> pool, size * sizeof (const char *));
+
+									if (ids_ss)
+										{
+											size_t i;
+											json_t *id_p;
+
+											json_array_foreach (ids_json_p, i, id_p)
+												{
+													const char *id_s = json_string_value (id_p);
+
+													* (ids_ss + i) = apr_pstrdup (req_p -> pool, id_s ? id_s : "");
+												}
+
+											*ids_sss = ids_ss;
+											num_ids = (uint32) size;
+										}
+								}
+						}
+
+					json_decref (ids_json_p);
+				}
+		}
+
+	return num_ids;
+}
+
+
 
 /*
  * Based on code taken from http://marc.info/?l=apache-modules&m=107669698011831
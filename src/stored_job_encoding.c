@@ -0,0 +1,472 @@
+/*
+** Copyright 2014-2016 The Earlham Institute
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+/*
+ * stored_job_encoding.c
+ *
+ *  The JSON is converted straight to and from BSON rather than going
+ *  through JSON text, as parsing the text is what we are trying to avoid.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bson.h"
+
+#include "stored_job_encoding.h"
+#include "streams.h"
+
+
+/*
+ * The growable buffer that json_dump_callback () writes the JSON text into.
+ */
+typedef struct JSONTextBuffer
+{
+	unsigned char **jtb_data_pp;
+
+	size_t *jtb_size_p;
+
+	size_t jtb_length;
+} JSONTextBuffer;
+
+
+static bool AppendJSONObjectToBSON (bson_t *doc_p, const json_t *object_p);
+
+static bool AppendJSONArrayToBSON (bson_t *doc_p, const json_t *array_p);
+
+static bool AppendJSONValueToBSON (bson_t *doc_p, const char *key_s, const json_t *value_p);
+
+static json_t *ConvertBSONToJSON (bson_iter_t *iter_p, const bool array_flag);
+
+static unsigned char *EncodeJobAsBSON (const json_t *job_json_p, unsigned char **buffer_pp, size_t *buffer_size_p, unsigned int *length_p);
+
+static unsigned char *EncodeJobAsJSON (const json_t *job_json_p, unsigned char **buffer_pp, size_t *buffer_size_p, unsigned int *length_p);
+
+static int AppendJSONText (const char *text_s, size_t length, void *data_p);
+
+static void *ReallocBuffer (void *mem_p, size_t num_bytes, void *context_p);
+
+static json_t *DecodeJobFromBSON (const unsigned char *value_p, const unsigned int value_length);
+
+static json_t *DecodeJobFromJSON (const unsigned char *value_p, const unsigned int value_length);
+
+
+/**************************/
+
+
+unsigned char *EncodeStoredJob (const json_t *job_json_p, const StoredJobEncoding encoding, unsigned char **buffer_pp, size_t *buffer_size_p, unsigned int *length_p)
+{
+	unsigned char *value_p = NULL;
+
+	if (encoding == SJE_BSON)
+		{
+			value_p = EncodeJobAsBSON (job_json_p, buffer_pp, buffer_size_p, length_p);
+
+			if (!value_p)
+				{
+					PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to encode job as BSON, storing it as JSON");
+				}
+		}
+
+	if (!value_p)
+		{
+			value_p = EncodeJobAsJSON (job_json_p, buffer_pp, buffer_size_p, length_p);
+		}
+
+	return value_p;
+}
+
+
+json_t *DecodeStoredJob (const unsigned char *value_p, const unsigned int value_length)
+{
+	if (value_length == 0)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Stored job has no length");
+			return NULL;
+		}
+
+	if ((value_length >= sizeof (StoredJobHeader)) && (memcmp (value_p, SJE_MAGIC_S, 3) == 0))
+		{
+			const StoredJobHeader *header_p = (const StoredJobHeader *) value_p;
+
+			if (header_p -> sjh_version != SJE_VERSION)
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Stored job has encoding version %d but only version %d is supported", header_p -> sjh_version, SJE_VERSION);
+				}
+			else if (value_length > sizeof (StoredJobHeader) + sizeof (uint32_t))
+				{
+					return DecodeJobFromBSON (value_p + sizeof (StoredJobHeader), value_length - sizeof (StoredJobHeader));
+				}
+			else
+				{
+					PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Stored job is too short, " UINT32_FMT " bytes", value_length);
+				}
+
+			return NULL;
+		}
+
+	/* The entries stored before the binary encoding was added are JSON text */
+	return DecodeJobFromJSON (value_p, value_length);
+}
+
+
+/**************************/
+
+
+static unsigned char *EncodeJobAsBSON (const json_t *job_json_p, unsigned char **buffer_pp, size_t *buffer_size_p, unsigned int *length_p)
+{
+	unsigned char *value_p = NULL;
+
+	if (json_is_object (job_json_p))
+		{
+			/*
+			 * Write the document straight into the caller's buffer after
+			 * the space for our header so that it doesn't need copying.
+			 */
+			bson_writer_t *writer_p = bson_writer_new (buffer_pp, buffer_size_p, sizeof (StoredJobHeader), ReallocBuffer, NULL);
+
+			if (writer_p)
+				{
+					bson_t *doc_p = NULL;
+
+					if (bson_writer_begin (writer_p, &doc_p))
+						{
+							if (AppendJSONObjectToBSON (doc_p, job_json_p))
+								{
+									StoredJobHeader header;
+
+									bson_writer_end (writer_p);
+
+									memcpy (header.sjh_magic, SJE_MAGIC_S, 3);
+									header.sjh_version = SJE_VERSION;
+
+									value_p = *buffer_pp;
+									memcpy (value_p, &header, sizeof (StoredJobHeader));
+
+									*length_p = (unsigned int) bson_writer_get_length (writer_p);
+								}
+							else
+								{
+									bson_writer_rollback (writer_p);
+								}
+						}
+
+					bson_writer_destroy (writer_p);
+				}
+		}
+
+	return value_p;
+}
+
+
+static unsigned char *EncodeJobAsJSON (const json_t *job_json_p, unsigned char **buffer_pp, size_t *buffer_size_p, unsigned int *length_p)
+{
+	JSONTextBuffer text_buffer;
+
+	text_buffer.jtb_data_pp = buffer_pp;
+	text_buffer.jtb_size_p = buffer_size_p;
+	text_buffer.jtb_length = 0;
+
+	/*
+	 * include the terminating \0 to make sure
+	 * the value as a valid c-style string
+	 */
+	if ((json_dump_callback (job_json_p, AppendJSONText, &text_buffer, JSON_COMPACT) == 0) && (AppendJSONText ("", 1, &text_buffer) == 0))
+		{
+			*length_p = (unsigned int) text_buffer.jtb_length;
+			return *buffer_pp;
+		}
+
+	PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "json_dump_callback failed for job");
+
+	return NULL;
+}
+
+
+static int AppendJSONText (const char *text_s, size_t length, void *data_p)
+{
+	JSONTextBuffer *text_buffer_p = (JSONTextBuffer *) data_p;
+	const size_t required_size = text_buffer_p -> jtb_length + length;
+
+	if (required_size > * (text_buffer_p -> jtb_size_p))
+		{
+			/* Grow geometrically as jansson writes the text in many small pieces */
+			size_t new_size = (* (text_buffer_p -> jtb_size_p)) << 1;
+			unsigned char *new_data_p;
+
+			if (new_size < required_size)
+				{
+					new_size = required_size < 256 ? 256 : required_size;
+				}
+
+			new_data_p = (unsigned char *) realloc (* (text_buffer_p -> jtb_data_pp), new_size);
+
+			if (!new_data_p)
+				{
+					return -1;
+				}
+
+			* (text_buffer_p -> jtb_data_pp) = new_data_p;
+			* (text_buffer_p -> jtb_size_p) = new_size;
+		}
+
+	memcpy (* (text_buffer_p -> jtb_data_pp) + text_buffer_p -> jtb_length, text_s, length);
+	text_buffer_p -> jtb_length = required_size;
+
+	return 0;
+}
+
+
+static void *ReallocBuffer (void *mem_p, size_t num_bytes, void *context_p)
+{
+	return realloc (mem_p, num_bytes);
+}
+
+
+static bool AppendJSONObjectToBSON (bson_t *doc_p, const json_t *object_p)
+{
+	const char *key_s;
+	json_t *value_p;
+
+	json_object_foreach ((json_t *) object_p, key_s, value_p)
+		{
+			if (!AppendJSONValueToBSON (doc_p, key_s, value_p))
+				{
+					return false;
+				}
+		}
+
+	return true;
+}
+
+
+static bool AppendJSONArrayToBSON (bson_t *doc_p, const json_t *array_p)
+{
+	const size_t size = json_array_size (array_p);
+	size_t i;
+
+	for (i = 0; i < size; ++ i)
+		{
+			char buffer_s [16];
+			const char *key_s = NULL;
+
+			bson_uint32_to_string ((uint32_t) i, &key_s, buffer_s, sizeof (buffer_s));
+
+			if (!AppendJSONValueToBSON (doc_p, key_s, json_array_get (array_p, i)))
+				{
+					return false;
+				}
+		}
+
+	return true;
+}
+
+
+static bool AppendJSONValueToBSON (bson_t *doc_p, const char *key_s, const json_t *value_p)
+{
+	bool success_flag = false;
+
+	switch (json_typeof (value_p))
+		{
+			case JSON_OBJECT:
+				{
+					bson_t child;
+
+					if (bson_append_document_begin (doc_p, key_s, -1, &child))
+						{
+							success_flag = AppendJSONObjectToBSON (&child, value_p);
+							success_flag = bson_append_document_end (doc_p, &child) && success_flag;
+						}
+				}
+				break;
+
+			case JSON_ARRAY:
+				{
+					bson_t child;
+
+					if (bson_append_array_begin (doc_p, key_s, -1, &child))
+						{
+							success_flag = AppendJSONArrayToBSON (&child, value_p);
+							success_flag = bson_append_array_end (doc_p, &child) && success_flag;
+						}
+				}
+				break;
+
+			case JSON_STRING:
+				success_flag = bson_append_utf8 (doc_p, key_s, -1, json_string_value (value_p), (int) json_string_length (value_p));
+				break;
+
+			case JSON_INTEGER:
+				success_flag = bson_append_int64 (doc_p, key_s, -1, json_integer_value (value_p));
+				break;
+
+			case JSON_REAL:
+				success_flag = bson_append_double (doc_p, key_s, -1, json_real_value (value_p));
+				break;
+
+			case JSON_TRUE:
+			case JSON_FALSE:
+				success_flag = bson_append_bool (doc_p, key_s, -1, json_is_true (value_p));
+				break;
+
+			case JSON_NULL:
+				success_flag = bson_append_null (doc_p, key_s, -1);
+				break;
+
+			default:
+				break;
+		}
+
+	if (!success_flag)
+		{
+			PrintErrors (STM_LEVEL_WARNING, __FILE__, __LINE__, "Failed to add \"%s\" to BSON", key_s);
+		}
+
+	return success_flag;
+}
+
+
+static json_t *DecodeJobFromBSON (const unsigned char *value_p, const unsigned int value_length)
+{
+	json_t *job_json_p = NULL;
+	uint32_t doc_length;
+	bson_t doc;
+
+	/* The BSON document starts with its own length */
+	memcpy (&doc_length, value_p, sizeof (uint32_t));
+	doc_length = BSON_UINT32_FROM_LE (doc_length);
+
+	if (doc_length <= value_length)
+		{
+			if (bson_init_static (&doc, value_p, doc_length))
+				{
+					bson_iter_t iter;
+
+					if (bson_iter_init (&iter, &doc))
+						{
+							job_json_p = ConvertBSONToJSON (&iter, false);
+						}
+
+					bson_destroy (&doc);
+				}
+		}
+
+	if (!job_json_p)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to decode " UINT32_FMT " byte BSON job", doc_length);
+		}
+
+	return job_json_p;
+}
+
+
+static json_t *ConvertBSONToJSON (bson_iter_t *iter_p, const bool array_flag)
+{
+	json_t *json_p = array_flag ? json_array () : json_object ();
+
+	while (json_p && bson_iter_next (iter_p))
+		{
+			json_t *value_p = NULL;
+
+			switch (bson_iter_type (iter_p))
+				{
+					case BSON_TYPE_DOCUMENT:
+					case BSON_TYPE_ARRAY:
+						{
+							bson_iter_t child;
+
+							if (bson_iter_recurse (iter_p, &child))
+								{
+									value_p = ConvertBSONToJSON (&child, (bson_iter_type (iter_p) == BSON_TYPE_ARRAY));
+								}
+						}
+						break;
+
+					case BSON_TYPE_UTF8:
+						{
+							uint32_t length = 0;
+							const char *value_s = bson_iter_utf8 (iter_p, &length);
+
+							value_p = json_stringn (value_s, length);
+						}
+						break;
+
+					case BSON_TYPE_INT32:
+						value_p = json_integer (bson_iter_int32 (iter_p));
+						break;
+
+					case BSON_TYPE_INT64:
+						value_p = json_integer (bson_iter_int64 (iter_p));
+						break;
+
+					case BSON_TYPE_DOUBLE:
+						value_p = json_real (bson_iter_double (iter_p));
+						break;
+
+					case BSON_TYPE_BOOL:
+						value_p = json_boolean (bson_iter_bool (iter_p));
+						break;
+
+					case BSON_TYPE_NULL:
+						value_p = json_null ();
+						break;
+
+					default:
+						PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Unexpected BSON type %d for \"%s\"", bson_iter_type (iter_p), bson_iter_key (iter_p));
+						break;
+				}
+
+			if (value_p)
+				{
+					const int res = array_flag ? json_array_append_new (json_p, value_p) : json_object_set_new (json_p, bson_iter_key (iter_p), value_p);
+
+					if (res != 0)
+						{
+							json_decref (json_p);
+							json_p = NULL;
+						}
+				}
+			else
+				{
+					json_decref (json_p);
+					json_p = NULL;
+				}
+		}
+
+	return json_p;
+}
+
+
+static json_t *DecodeJobFromJSON (const unsigned char *value_p, const unsigned int value_length)
+{
+	json_t *job_json_p = NULL;
+	json_error_t err;
+	size_t length = value_length;
+
+	/* The stored values include their terminating '\0' */
+	if (* (value_p + length - 1) == '\0')
+		{
+			-- length;
+		}
+
+	job_json_p = json_loadb ((const char *) value_p, length, 0, &err);
+
+	if (!job_json_p)
+		{
+			PrintErrors (STM_LEVEL_SEVERE, __FILE__, __LINE__, "Failed to convert stored job to json err \"%s\" at line %d, column %d", err.text, err.line, err.column);
+		}
+
+	return job_json_p;
+}